@@ -0,0 +1,104 @@
+/*
+ * Copyright 2016, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Transfer benchmark
+ *
+ * Drives usbdev_schedule_xact() on one endpoint of an enumerated device and
+ * reports throughput, CPU cycles per transfer, buffer allocations and latency
+ * percentiles, one record per run in JSON or CSV. The same code runs against
+ * real devices on target and against the software controller of the sim
+ * platform on Linux.
+ *
+ * Times are read from the CPU cycle counter: the TSC on x86, PMCCNTR on ARM,
+ * which needs user access enabled by the kernel. Latency is measured from
+ * submission to callback, IRQ latency from usb_handle_irq() to callback.
+ */
+
+#ifndef _USB_BENCH_H_
+#define _USB_BENCH_H_
+
+#include <stdint.h>
+#include <usb/usb.h>
+
+#define USB_BENCH_MAX_SAMPLES 4096
+#define USB_BENCH_MAX_DEPTH   32
+
+enum usb_bench_mode {
+    USB_BENCH_SYNC,             // Blocking calls, cb == NULL
+    USB_BENCH_ASYNC             // Callbacks, @depth transfers in flight
+};
+
+enum usb_bench_format {
+    USB_BENCH_JSON,             // One object per line
+    USB_BENCH_CSV
+};
+
+struct usb_bench_params {
+    usb_dev_t udev;
+    struct endpoint* ep;        // Endpoint under test, udev->ep_ctrl for EP0
+    int size;                   // Bytes per transfer
+    int depth;                  // Transfers in flight, async only
+    enum usb_bench_mode mode;
+    int count;                  // Transfers to time
+    int alloc;                  // Allocate buffers per transfer
+    uint32_t cpu_mhz;           // Cycle counter rate, for throughput
+    /* Async only: block until the host interrupt fires, return > 0 if it
+     * did. The benchmark then calls usb_handle_irq() itself. */
+    int (*wait_irq)(void* arg);
+    void* arg;
+};
+
+struct usb_bench_result {
+    struct usb_bench_params params;
+    int      done;              // Transfers completed
+    int      errors;            // Transfers that failed
+    uint64_t bytes;             // Payload moved
+    uint64_t cycles;            // Duration of the run
+    uint64_t cpu_cycles;        // Spent in the stack: submission and IRQ
+    uint64_t kb_per_s;          // Throughput, 0 if cpu_mhz is unknown
+    uint32_t allocs;            // Transfer buffer allocations
+    uint64_t lat_p50, lat_p90, lat_p99, lat_max;
+    uint64_t irq_p50, irq_p99;  // Async only
+};
+
+/** Run one benchmark
+ * @param[in]  host   The USB host the device is on
+ * @param[in]  params What to run
+ * @param[out] result Filled with the measurements
+ * @return            0 on success, -1 if the parameters are not supported
+ */
+int usb_bench_run(usb_t* host, const struct usb_bench_params* params,
+                  struct usb_bench_result* result);
+
+/** Print a result
+ * @param[in] result The result to print
+ * @param[in] fmt    Output format
+ * @param[in] header Print the CSV column names first
+ */
+void usb_bench_print(const struct usb_bench_result* result,
+                     enum usb_bench_format fmt, int header);
+
+/** Sweep transfer size, queue depth and sync vs async on one endpoint and
+ * print a record per run. Interrupt endpoints only run async.
+ * @param[in] host    The USB host the device is on
+ * @param[in] base    Device, endpoint, count and IRQ hook for all runs
+ * @param[in] sizes   Transfer sizes to run
+ * @param[in] nsizes  Number of transfer sizes
+ * @param[in] depths  Queue depths for the async runs
+ * @param[in] ndepths Number of queue depths
+ * @param[in] fmt     Output format
+ * @return            The number of runs that failed
+ */
+int usb_bench_sweep(usb_t* host, const struct usb_bench_params* base,
+                    const int* sizes, int nsizes, const int* depths,
+                    int ndepths, enum usb_bench_format fmt);
+
+#endif /* _USB_BENCH_H_ */
@@ -16,8 +16,38 @@
 int usb_storage_bind(usb_dev_t usb_dev);
 
 int usb_storage_init_disk(usb_dev_t usb_dev);
-uint32_t usb_storage_get_capacity(usb_dev_t usb_dev);
-int usb_storage_write(usb_dev_t usb_dev, void *buf, int size);
-int usb_storage_read(usb_dev_t usb_dev, void *buf, int size);
+
+/*
+ * Each logical unit, such as a slot of a card reader, is a block device of
+ * its own, numbered from 0. A LUN without a medium has no capacity.
+ */
+int usb_storage_get_lun_count(usb_dev_t usb_dev);
+/* Disk geometry, valid after usb_storage_init_disk */
+uint64_t usb_storage_get_capacity(usb_dev_t usb_dev, int lun);
+uint32_t usb_storage_get_block_size(usb_dev_t usb_dev, int lun);
+
+/*
+ * Read or write @count blocks starting at @lba. The data goes straight
+ * between the disk and @buf, which must be memory the DMA manager of the
+ * device can pin, cache line aligned. Queued requests are let through
+ * first. Returns 0 on success.
+ */
+int usb_storage_read_blocks(usb_dev_t usb_dev, int lun, uint64_t lba,
+                            uint32_t count, void *buf);
+int usb_storage_write_blocks(usb_dev_t usb_dev, int lun, uint64_t lba,
+                             uint32_t count, const void *buf);
+
+/*
+ * Queue a read or write of @count blocks starting at @lba without waiting for
+ * it. @cb is called with @token once the request has finished, with @err 0 on
+ * success. Requests on a LUN complete in the order they were submitted, @buf
+ * must stay valid until then. A transport error fails the requests of the
+ * command, the queue resumes once the device has been through reset
+ * recovery. Returns 0 if the request was queued.
+ */
+typedef void (*usb_storage_cb_t)(void *token, int err);
+int usb_storage_submit(usb_dev_t usb_dev, int lun, int write, uint64_t lba,
+                       uint32_t count, void *buf, usb_storage_cb_t cb,
+                       void *token);
 #endif /* _USB_STORAGE_H_ */
 
@@ -51,8 +51,24 @@ enum port_feature {
     PORT_INDICATOR        = 22
 };
 
+/* Port enumeration states, see usbhub.c */
+enum usb_hub_port_state {
+    HUB_PORT_IDLE = 0,     // Nothing attached, or we gave up on it
+    HUB_PORT_POWER,        // Waiting for power to become good
+    HUB_PORT_DEBOUNCE,     // Connected, waiting for the connection to settle
+    HUB_PORT_RESET_WAIT,   // Waiting for the default address to be free
+    HUB_PORT_RESET,        // Reset issued, the port owns the default address
+    HUB_PORT_ADDRESS,      // Addressed, waiting for the device to settle
+    HUB_PORT_RUNNING       // Device enumerated
+};
+
 struct usb_hub_port {
     struct usb_dev* udev;
+    enum usb_hub_port_state state;
+    uint32_t deadline;     // Enumeration clock in ms, 0 when not armed
+    uint32_t started;      // When the current reset was issued
+    int changed;           // Change reported by the status change pipe
+    int retries;
 };
 
 struct usb_hub {
@@ -72,6 +88,16 @@ struct usb_hub {
 typedef struct usb_hub* usb_hub_t;
 int usb_hub_driver_bind(usb_dev_t usb_dev, usb_hub_t* hub);
 
+/** Timer event for port enumeration
+ * Ports move on when their hub reports a change, and when their timers have
+ * expired, which is checked here. Runs with every call of usb_handle_irq()
+ * and usb_process_completions(), calling it every few milliseconds as well
+ * speeds up hot plug. It never waits for a timer.
+ * @param[in] host The USB host
+ * @return         Non-zero while a port is still being enumerated
+ */
+int usb_hub_poll(usb_t* host);
+
 struct usb_hubem;
 typedef struct usb_hubem* usb_hubem_t;
 int usb_hubem_driver_init(void* token, int nports, int pwr_delay_ms,
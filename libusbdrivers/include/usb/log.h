@@ -0,0 +1,57 @@
+/*
+ * Copyright 2016, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Logging
+ *
+ * Messages carry a level and a module. Both are filtered at compile time by
+ * CONFIG_LIB_USB_LOG_LEVEL and CONFIG_LIB_USB_LOG_MODULES, so a message that
+ * is not enabled costs nothing.
+ *
+ * With CONFIG_LIB_USB_LOG_DEFERRED, info, debug and trace messages only store
+ * their format string and arguments in a ring, and usb_log_flush() formats
+ * them later, from a context where a slow console does no harm. Deferred
+ * messages take at most six word sized arguments, so 64-bit values have to be
+ * logged as two 32-bit halves on 32-bit targets.
+ */
+
+#ifndef _USB_LOG_H_
+#define _USB_LOG_H_
+
+#include <stdint.h>
+
+/* Levels */
+#define USB_LOG_NONE     0
+#define USB_LOG_ERR      1
+#define USB_LOG_WARN     2
+#define USB_LOG_INFO     3
+#define USB_LOG_DEBUG    4
+#define USB_LOG_TRACE    5          // Every transfer and interrupt
+
+/* Modules */
+#define USB_LOG_CORE     0x0001     // Device management, usb.c
+#define USB_LOG_EHCI     0x0002
+#define USB_LOG_HUB      0x0004
+#define USB_LOG_OTG      0x0008
+#define USB_LOG_STORAGE  0x0010
+#define USB_LOG_KBD      0x0020
+#define USB_LOG_ETH      0x0040
+#define USB_LOG_CDC      0x0080
+#define USB_LOG_SERIAL   0x0100     // USB to serial converters
+#define USB_LOG_ALL      0xffff
+
+/** Print the deferred messages, oldest first
+ * Only one thread may flush at a time. Does nothing unless deferred logging
+ * is configured.
+ * @return The number of messages lost to ring overflow since the last flush
+ */
+uint32_t usb_log_flush(void);
+
+#endif /* _USB_LOG_H_ */
@@ -14,9 +14,11 @@
 
 #include <platsupport/io.h>
 #include <usb/usb_host.h>
+#include <usb/usb_dma.h>
 
-// Maximum number of devices a host can manage
-#define USB_NDEVICES 32
+// Maximum number of devices a host can manage, addresses are 7 bits wide
+// and address 0 is the default address
+#define USB_NDEVICES 127
 
 // Maximum number of endpoints per device
 #define USB_MAX_EPS 16
@@ -26,15 +28,25 @@
 
 struct usb_dev;
 typedef struct usb_dev* usb_dev_t;
+struct usb_string;
+struct hub_enum;
 
 struct usb {
     usb_host_t hdev;
     /// Bitmap representation of used addresses
-    uint32_t addrbm;
+    uint32_t addrbm[(USB_NDEVICES + 1) / 32];
     /// Next address: delays address recycling
     int next_addr;
-    /// List of devices connected to this host
-    usb_dev_t devlist;
+    /// Devices connected to this host, indexed by address
+    usb_dev_t devices[USB_NDEVICES + 1];
+    /// Transfer buffer pool, shared by all devices
+    struct usb_dma_pool dma_pool;
+    /// Callbacks are left to usb_process_completions
+    int defer_completions;
+    /// Set while the hub driver is enumerating ports on this host
+    int enumerating;
+    /// Port enumeration state of the hub driver
+    struct hub_enum* hub_enum;
 };
 typedef struct usb usb_t;
 
@@ -80,6 +92,13 @@ struct usb_dev {
     uint16_t vend_id;
     uint8_t  class;
     uint8_t  addr;
+    /* Descriptors, read once during enumeration */
+    struct device_desc *ddesc;
+    struct config_desc *cdesc;        // The whole first configuration
+    int cdesc_len;
+    /* Strings, read on first use, see usbdev_get_string() */
+    uint16_t langid;                  // First supported language, 0 if unread
+    struct usb_string *strings;
     /* Filled by driver */
     int (*connect)(struct usb_dev* udev);
     int (*disconnect)(struct usb_dev* udev);
@@ -90,9 +109,6 @@ struct usb_dev {
      */
     struct endpoint *ep_ctrl;         // Control endpoint of the device
     struct endpoint *ep[USB_MAX_EPS]; // The endpoints of the device
-
-    /* For device lists */
-    struct usb_dev      *next;
 };
 
 /*
@@ -283,6 +299,12 @@ __set_interface_req(int index) {
 /****************************************/
 
 /** Initialise usb
+ * Hosts share no state once initialised, each one may be driven by its own
+ * thread, calling usb_handle_irq and usb_process_completions for that host
+ * only. Calls to usb_init itself must be serialised, the platform bus scan
+ * is not thread safe. The library creates no threads of its own, binding
+ * them and routing the IRQ lines returned by usb_host_irqs to a CPU is up to
+ * the component.
  * @param[in] id            the ID of the USB host to
  *                          initialise
  * @param[in] ioops         a structure defining operations for
@@ -314,6 +336,26 @@ int usb_init(enum usb_host_id id, ps_io_ops_t* ioops, mutex_ops_t *mops, usb_t*
 int usb_new_device(usb_dev_t hub, int port,
                    enum usb_speed speed, usb_dev_t* d);
 
+/** Enumeration split in two for hubs that bring up several ports at
+ * once. usb_new_device_address() takes the device on the given port
+ * off the default address, usb_new_device_setup() then reads and
+ * caches its descriptors. The device must be given 2ms to settle on
+ * its new address between the two calls, the hub may reset another
+ * port in the mean time. usb_new_device_setup() frees the device on
+ * failure.
+ * @param[in] hub   The USB hub that the new device is connected
+ *                  to.
+ * @param[in] port  The port on the provided hub that the new
+ *                  device is connected to.
+ * @param[in] speed The connection speed of the new device.
+ * @param[out] d    On success, d will contain a reference to
+ *                  the new device.
+ * @return          0 on success.
+ */
+int usb_new_device_address(usb_dev_t hub, int port,
+                           enum usb_speed speed, usb_dev_t* d);
+int usb_new_device_setup(usb_dev_t udev);
+
 /** A call back for the configuration parser. This function is
  * called for each descriptor.
  * @param[in] token An unmodified token as passed to the
@@ -334,6 +376,8 @@ typedef int (*usb_config_cb)(void* token, int cfg, int iface,
  * all descriptors come as a giant blob, but they may not
  * be aligned correctly and must be copied to aligned memory
  * before use.
+ * The descriptors are read once when the device is enumerated, parsing
+ * them does not cause any bus traffic.
  */
 int usbdev_parse_config(usb_dev_t udev, usb_config_cb cb,
                         void* token);
@@ -345,6 +389,17 @@ int usbdev_parse_config(usb_dev_t udev, usb_config_cb cb,
  */
 void usbdev_disconnect(usb_dev_t dev);
 
+/** Return a string of a USB device, such as the one referred to by
+ * iProduct. Strings are read from the device on first use, in its
+ * first language, and cached until it is disconnected. Characters
+ * outside of ASCII are replaced by '?'.
+ * @param[in] udev  The USB device in question
+ * @param[in] index The string descriptor index
+ * @return          The string, or NULL for index 0 or if the device
+ *                  failed to return it.
+ */
+const char* usbdev_get_string(usb_dev_t udev, int index);
+
 /** Return the class reported by a USB device
  * @param[in] The USB device in question
  * @return    The class ID
@@ -380,6 +435,47 @@ const char* usb_class_get_description(enum usb_class usb_class);
 int usbdev_schedule_xact(usb_dev_t udev, struct endpoint *ep, struct xact* xact,
                          int nxact, usb_cb_t cb, void* token);
 
+/** Schedule several asynchronous transactions with one call, see
+ * usb_hcd_schedule_batch(). Drivers that post many buffers at once,
+ * such as receive rings, save the per call cost of the host.
+ * @param[in] udev    The device to transfer with.
+ * @param[in] reqs    The transfers. Only ep, xact, nxact, cb and
+ *                    token need filling in, the rest is filled from
+ *                    udev. Every transfer needs a call back.
+ * @param[in] n       The number of transfers.
+ * @return            The number of transfers scheduled, negative
+ *                    if none were.
+ */
+int usbdev_schedule_batch(usb_dev_t udev, struct usb_hcd_req* reqs, int n);
+
+/** Schedule isochronous packets on the provided USB device
+ * @param[in] udev        The USB device which is to receive the
+ *                        packets.
+ * @param[in] ep          The isochronous endpoint to use.
+ * @param[in] pkt         An array of packets, one per service
+ *                        interval of the endpoint. The status of
+ *                        each packet is reported back in place.
+ * @param[in] npkt        The number of packets in the array.
+ * @param[in] start_frame The frame in which to send the first
+ *                        packet, or -1 to queue behind the
+ *                        packets already scheduled.
+ * @param[in] cb          A call back function to call once all
+ *                        packets have been processed.
+ * @param[in] token       Passed unmodified to the call back
+ *                        function.
+ * @return                0 on success.
+ */
+int usbdev_schedule_iso(usb_dev_t udev, struct endpoint *ep, struct iso_pkt* pkt,
+                        int npkt, int start_frame, usb_cb_t cb, void* token);
+
+/** Read the current frame number of the bus that a device is on.
+ * This allows isochronous packets to be scheduled a number of
+ * frames ahead.
+ * @param[in] udev    The USB device in question.
+ * @return            The current frame number, see USB_FRAME_MASK.
+ */
+int usbdev_get_frame_number(usb_dev_t udev);
+
 
 /** Print a list of registered devices
  * @param[in] host  the USB host device in question
@@ -400,12 +496,70 @@ usb_dev_t usb_get_device(usb_t* host, int addr);
  */
 void usb_probe_device(usb_dev_t dev);
 
+/** Read the transfer counters of an endpoint
+ * Transfers to the root hub and isochronous transfers are not counted.
+ * @param[in]  ep    The endpoint in question
+ * @param[out] stats Filled with a snapshot of the counters
+ * @param[in]  reset Clear the counters once they are read. Counts made by
+ *                   a completion running at the same time may be lost.
+ */
+void usb_get_ep_stats(struct endpoint* ep, struct usb_ep_stats* stats,
+                      int reset);
+
+/** Print the transfer counters of every endpoint of every device
+ * @param[in] host  The USB host in question
+ */
+void usb_dump_ep_stats(usb_t* host);
+
+/** Start recording transfer events
+ * @param[in] host    The USB host in question
+ * @param[in] nevents Size of the ring, rounded up to a power of 2
+ * @return            0 on success, -1 if already enabled or out of memory
+ */
+int usb_trace_enable(usb_t* host, int nevents);
+
+/** Stop recording and free the trace. No transfer may be submitted or
+ * completed while the trace is being freed.
+ * @param[in] host  The USB host in question
+ */
+void usb_trace_disable(usb_t* host);
+
+/** Copy the recorded events, oldest first
+ * @param[in]  host  The USB host in question
+ * @param[out] ev    Buffer for the events
+ * @param[in]  n     Size of the buffer in events
+ * @return           The number of events copied
+ */
+int usb_trace_read(usb_t* host, struct usb_trace_ev* ev, int n);
+
+/** Print the recorded events, oldest first
+ * @param[in] host  The USB host in question
+ */
+void usb_trace_dump(usb_t* host);
+
 /** Pass control to the devices IRQ handler
  * @param[in] host    The USB host that triggered
  *                    the interrupt event.
  */
 void usb_handle_irq(usb_t* host);
 
+/** Run the callbacks of completed transfers
+ * The interrupt handler only collects finished transfers. By default
+ * usb_handle_irq calls this straight after, once deferred completions are
+ * enabled it must be called from a worker thread instead. Callbacks may block
+ * and submit further transfers. Only one thread should process completions
+ * at a time, so that callbacks run in completion order.
+ * @param[in] host    The USB host
+ */
+void usb_process_completions(usb_t* host);
+
+/** Choose where transfer callbacks run
+ * @param[in] host    The USB host
+ * @param[in] defer   0 to run callbacks from usb_handle_irq, otherwise they
+ *                    only run from usb_process_completions.
+ */
+void usb_defer_completions(usb_t* host, int defer);
+
 /** Allocate transaction buffers for requests
  * @param[in]     dman   A dma allocator instance
  * @param[in/out] xact   A array structure which provides the sizes of buffers
@@ -416,6 +570,18 @@ void usb_handle_irq(usb_t* host);
  */
 int usb_alloc_xact(ps_dma_man_t* dman, struct xact* xact, int nxact);
 
+/** Allocate cached transaction buffers
+ * Same as usb_alloc_xact, but the CPU accesses the buffers through the cache.
+ * The host controller driver takes care of the cache maintenance when the
+ * buffers are submitted and completed, so this suits buffers that the driver
+ * parses or copies, such as bulk data.
+ * @param[in]     dman   A dma allocator instance
+ * @param[in/out] xact   See usb_alloc_xact
+ * @param[in]    nxact   The size, in array indexes, of xact.
+ * @return               0 on success
+ */
+int usb_alloc_xact_cached(ps_dma_man_t* dman, struct xact* xact, int nxact);
+
 /** Frees transaction buffers
  * @param[in]    dman  The dma allocator instance that was used for the allocation
  * @param[in]    xact  The description of the transaction
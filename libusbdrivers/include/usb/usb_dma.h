@@ -0,0 +1,108 @@
+/*
+ * Copyright 2016, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Transfer buffer pool
+ *
+ * Every USB host keeps a slab allocator in front of the platform DMA manager.
+ * Buffers are rounded up to a size class and carved from pinned slabs, which
+ * are cached until usb_dma_trim() is called. Devices see the pool as a plain
+ * ps_dma_man_t(udev->dman), so usb_alloc_xact() and the class drivers use it
+ * without any change. Requests that don't fit a class go straight to the
+ * platform DMA manager, but still count towards the memory cap.
+ *
+ * Uncached and cached buffers live in separate slabs. Cache maintenance on
+ * an uncached slab is skipped, so the host controller driver may simply
+ * clean and invalidate every transfer buffer through the pool.
+ *
+ * Every page the pool hands out is entered in a small hash table, so pinning
+ * and cache maintenance find a buffer's slab without taking the pool lock.
+ */
+
+#ifndef _USB_USB_DMA_H_
+#define _USB_USB_DMA_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <platsupport/io.h>
+#include <usb/usb_host.h>
+
+/* Size classes: 64B, 512B, 4KB and 16KB */
+#define USB_DMA_NCLASSES 4
+/* Entries of the page table, it is filled to at most three quarters */
+#define USB_DMA_NPAGES   1024
+
+struct usb_dma_slab {
+    void* vaddr;
+    uintptr_t paddr;
+    uint64_t used;              // One bit per buffer
+    int class;
+    int cached;
+    struct usb_dma_slab* next;
+};
+
+struct usb_dma_page {
+    uintptr_t vaddr;            // Page address, 0 for empty, 1 for removed
+    struct usb_dma_slab* slab;  // NULL for a fallback buffer
+};
+
+struct usb_dma_stats {
+    size_t   reserved;          // Memory pinned by the pool, incl. fallback
+    size_t   in_use;            // Memory handed out to the drivers
+    size_t   peak;              // High water mark of reserved
+    size_t   cap;               // Hard limit of reserved, 0 for none
+    uint32_t nalloc;            // Buffers allocated from the slabs
+    uint32_t nfree;             // Buffers returned to the slabs
+    uint32_t nslabs;            // Slabs currently held
+    uint32_t nfallback;         // Requests passed to the platform
+    uint32_t nfail;             // Requests refused, mostly due to the cap
+};
+
+struct usb_dma_pool {
+    ps_dma_man_t dman;          // The allocator handed out to devices
+    ps_dma_man_t* parent;       // Platform DMA manager
+    mutex_ops_t* mops;
+    void* lock;
+    struct usb_dma_slab* slabs[2][USB_DMA_NCLASSES]; // [cached][class]
+    struct usb_dma_page pages[USB_DMA_NPAGES];
+    uint32_t npages;            // Pages in the table
+    struct usb_dma_stats stats;
+};
+
+struct usb;
+
+/** Initialise the transfer buffer pool of a host
+ * @param[in] pool   The pool to initialise
+ * @param[in] parent The platform DMA manager to draw slabs from
+ * @param[in] mops   Mutex operations, the pool is shared by all devices
+ * @return           0 on success
+ */
+int usb_dma_pool_init(struct usb_dma_pool* pool, ps_dma_man_t* parent,
+                      mutex_ops_t* mops);
+
+/** Read the allocation statistics of a host's buffer pool
+ * @param[in]  host  The USB host
+ * @param[out] stats Filled with a snapshot of the statistics
+ */
+void usb_dma_get_stats(struct usb* host, struct usb_dma_stats* stats);
+
+/** Limit the DMA memory a host may pin for transfer buffers
+ * @param[in] host The USB host
+ * @param[in] cap  Maximum bytes, 0 removes the limit. Memory already
+ *                 reserved is not reclaimed, see usb_dma_trim().
+ */
+void usb_dma_set_cap(struct usb* host, size_t cap);
+
+/** Release all slabs that have no buffer in use
+ * @param[in] host The USB host
+ */
+void usb_dma_trim(struct usb* host);
+
+#endif /* _USB_USB_DMA_H_ */
@@ -45,17 +45,64 @@ enum usb_endpoint_dir {
     EP_DIR_IN
 };
 
+/*
+ * Submission to completion latency histogram. Bucket 0 counts transfers that
+ * completed in the micro frame they were submitted in, bucket n those that
+ * took 2^(n-1) to 2^n - 1 micro frames. The last bucket takes the rest.
+ */
+#define USB_EP_LAT_BUCKETS 16
+
+/* Transfer counters, maintained by the host controller driver */
+struct usb_ep_stats {
+    uint32_t xfers;      // Transfers completed successfully
+    uint32_t short_xfers;// Completed with bytes left, i.e. a short packet
+    uint32_t halts;      // Transfers that halted the endpoint
+    uint32_t cancels;    // Transfers cancelled while in flight
+    uint32_t timeouts;   // Transfers aborted by the endpoint timeout
+    uint32_t retries;    // Transaction errors retried by the host
+    uint32_t naks;       // NAKs, sampled from the NAK counter, a lower bound
+    uint64_t bytes;      // Payload moved, excluding SETUP packets
+    uint32_t lat[USB_EP_LAT_BUCKETS];
+};
+
 struct endpoint {
     enum usb_endpoint_type type;
     uint8_t   num;               // Endpoint number
     enum usb_endpoint_dir  dir;  // Endpoint direction
     uint16_t  max_pkt;   // Maximum packet size
     uint8_t   interval;  // Interval for polling or NAK rate for Bulk/Control
+    uint8_t   nsubmitters; // Threads submitting to this endpoint, see below
+    uint8_t   nak_rl;    // NAK count reload for Bulk/Control(1-15), 0 for default
+    uint16_t  timeout_ms; // Transfer timeout, 0 for none, see below
+    struct usb_ep_stats stats; // See usb_get_ep_stats()
 
     /* For host controller driver only, actually holds queue head. */
     void      *hcpriv;
 };
 
+/*
+ * A transfer that is still in flight timeout_ms after it was submitted
+ * completes with XACTSTAT_TIMEOUT, and the transfers queued behind it on the
+ * endpoint are cancelled. Deadlines are kept on the host frame counter and
+ * checked whenever the host interrupts, which it does at least once every
+ * frame list period(1024 frames). Synchronous
+ * transfers use the same timeout, or a default when it is 0.
+ *
+ * Endpoints are assumed to be fed by a single thread, which allows the host
+ * controller driver to hand transfers over to its IRQ path without locking.
+ * Every thread that submits to a shared endpoint must register itself.
+ * Control endpoints are always treated as shared.
+ */
+static inline void usb_ep_add_submitter(struct endpoint *ep)
+{
+    __atomic_add_fetch(&ep->nsubmitters, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void usb_ep_del_submitter(struct endpoint *ep)
+{
+    __atomic_sub_fetch(&ep->nsubmitters, 1, __ATOMIC_SEQ_CST);
+}
+
 enum usb_xact_type {
 /// Input PID
     PID_IN,
@@ -75,7 +122,9 @@ enum usb_xact_status {
 /// There was an error in processing the transaction
     XACTSTAT_ERROR,
 /// The host exhibited a failure during the transaction.
-    XACTSTAT_HOSTERROR
+    XACTSTAT_HOSTERROR,
+/// The transaction did not complete within the endpoint timeout
+    XACTSTAT_TIMEOUT
 };
 
 /* TODO: The xact size has to meet the QTD limitation at the moment */
@@ -90,6 +139,52 @@ struct xact {
     int len;
 };
 
+/**
+ * Isochronous packet. One packet is transferred per service interval of the
+ * endpoint. @ref{status} and @ref{actual_len} are filled in by the host once
+ * the (micro)frame carrying the packet has passed.
+ */
+struct iso_pkt {
+/// Buffer to transfer, its type must match the endpoint direction
+    struct xact xact;
+/// Completion status of this packet
+    enum usb_xact_status status;
+/// The number of bytes actually transferred
+    int actual_len;
+};
+
+/// Frame numbers are 11 bits wide, as in the SOF token
+#define USB_FRAME_MASK 0x7ff
+
+/*
+ * Transfer trace
+ *
+ * An optional ring of submit, complete and cancel events, which overwrites
+ * the oldest events when full. Recording is lock free, any thread that
+ * submits or completes transfers may add an event.
+ */
+enum usb_trace_type {
+    USB_TRACE_SUBMIT,
+    USB_TRACE_COMPLETE,
+    USB_TRACE_CANCEL
+};
+
+struct usb_trace_ev {
+    uint32_t time;       // Host micro frame index, wraps, see the host driver
+    uint8_t  type;       // enum usb_trace_type
+    uint8_t  addr;       // Device address
+    uint8_t  ep;         // Endpoint number, bit 7 set for IN endpoints
+    uint8_t  stat;       // enum usb_xact_status, on completion
+    int32_t  len;        // Submit: bytes, complete: bytes left,
+                         // cancel: transfers cancelled
+};
+
+struct usb_trace {
+    struct usb_trace_ev* ev;
+    uint32_t size;       // Number of events, a power of 2
+    uint32_t head;       // Events recorded so far
+};
+
 static inline void* xact_get_vaddr(struct xact* xact)
 {
     return xact->vaddr;
@@ -112,6 +207,19 @@ static inline uintptr_t xact_get_paddr(struct xact* xact)
  */
 typedef int (*usb_cb_t)(void* token, enum usb_xact_status stat, int rbytes);
 
+/// One transfer of a batch, see usb_hcd_schedule_batch()
+struct usb_hcd_req {
+    uint8_t addr;
+    int8_t hub_addr;
+    uint8_t hub_port;
+    enum usb_speed speed;
+    struct endpoint *ep;
+    struct xact* xact;
+    int nxact;
+    usb_cb_t cb;
+    void* token;
+};
+
 
 typedef struct mutex_ops {
 	void *(*mutex_init)(void);
@@ -139,10 +247,26 @@ struct usb_host {
     int (*schedule_xact)(usb_host_t* hdev, uint8_t addr, int8_t hub_addr, uint8_t hub_port,
                          enum usb_speed speed, struct endpoint *ep,
                          struct xact* xact, int nxact, usb_cb_t cb, void* t);
+    /// Submit several transactions at once, optional.
+    int (*schedule_batch)(usb_host_t* hdev, struct usb_hcd_req* reqs, int n);
+    /// Submit isochronous packets for transfer.
+    int (*schedule_iso)(usb_host_t* hdev, uint8_t addr, int8_t hub_addr, uint8_t hub_port,
+                        enum usb_speed speed, struct endpoint *ep,
+                        struct iso_pkt* pkt, int npkt, int start_frame,
+                        usb_cb_t cb, void* t);
+    /// Read the current frame number
+    int (*get_frame)(usb_host_t* hdev);
+    /// Set the asynchronous schedule park mode count
+    int (*set_async_park)(usb_host_t* hdev, int count);
     /// Cancel all transactions for a given device endpoint
     int (*cancel_xact)(usb_host_t* hdev, struct endpoint *ep);
-    /// Handle an IRQ
+    /// Handle an IRQ, only acknowledges and collects finished transfers
     void (*handle_irq)(usb_host_t* hdev);
+    /// Run the callbacks of the transfers collected by handle_irq
+    void (*process_completions)(usb_host_t* hdev);
+
+    /// Transfer trace, NULL unless enabled
+    struct usb_trace* trace;
 
     /// IRQ numbers tied to this device
     const int* irqs;
@@ -182,12 +306,151 @@ usb_hcd_schedule(usb_host_t* hdev, uint8_t addr, uint8_t hub_addr, uint8_t hub_p
                                xact, nxact, cb, t);
 }
 
+/**
+ * Schedules several transactions with one call, so that the host driver can
+ * hand them to the hardware together. The requests are processed in order,
+ * as if usb_hcd_schedule() had been called for each of them. Only
+ * asynchronous transfers can be batched, every request needs a callback.
+ * @param[in] hdev     The host controller that should be used for the transfers
+ * @param[in] reqs     The transfers, see usb_hcd_schedule() for the fields.
+ *                     The array may be reused once the call returns.
+ * @param[in] n        The number of requests in the array.
+ * @return             The number of requests that were scheduled. If it is
+ *                     less than n, the next request failed and it and the
+ *                     ones after it were not scheduled. Negative values
+ *                     represent failure of the first request.
+ */
+static inline int
+usb_hcd_schedule_batch(usb_host_t* hdev, struct usb_hcd_req* reqs, int n)
+{
+    int i;
+
+    if (hdev->schedule_batch) {
+        return hdev->schedule_batch(hdev, reqs, n);
+    }
+    for (i = 0; i < n; i++) {
+        if (reqs[i].cb == NULL ||
+                hdev->schedule_xact(hdev, reqs[i].addr, reqs[i].hub_addr,
+                                    reqs[i].hub_port, reqs[i].speed,
+                                    reqs[i].ep, reqs[i].xact, reqs[i].nxact,
+                                    reqs[i].cb, reqs[i].token) < 0) {
+            break;
+        }
+    }
+    return (i == 0 && n > 0) ? -1 : i;
+}
+
+/**
+ * Schedules isochronous packets
+ * @param[in] hdev        The host controller that should be used for the transfer
+ * @param[in] addr        The destination USB device address
+ * @param[in] hub_addr    The USB device address of the parent hub.
+ * @param[in] hub_port    The port at which the destination device is connected to
+ *                        its parent hub.
+ * @param[in] speed       The USB speed of the device.
+ * @param[in] ep          The isochronous endpoint of the destination device.
+ * @param[in] pkt         An array of packets, one per service interval. The
+ *                        array must stay valid until the callback is called.
+ * @param[in] npkt        The number of packets in the array.
+ * @param[in] start_frame The frame number of the first packet, or -1 to
+ *                        queue right behind the packets already scheduled.
+ * @param[in] cb          A callback function to call once all packets have
+ *                        been processed. Must not be NULL.
+ * @param[in] t           A token to pass, unmodified, to the callback.
+ * @return                0 on success, negative values represent failure.
+ */
+static inline int
+usb_hcd_schedule_iso(usb_host_t* hdev, uint8_t addr, uint8_t hub_addr, uint8_t hub_port,
+                     enum usb_speed speed, struct endpoint *ep,
+                     struct iso_pkt* pkt, int npkt, int start_frame,
+                     usb_cb_t cb, void* t)
+{
+    if (hdev->schedule_iso == NULL) {
+        return -1;
+    }
+    return hdev->schedule_iso(hdev, addr, hub_addr, hub_port, speed, ep,
+                              pkt, npkt, start_frame, cb, t);
+}
+
+/**
+ * Read the frame number that the host controller is currently processing.
+ * @param[in] hdev  The host controller in question
+ * @return          The current frame number, see USB_FRAME_MASK, or
+ *                  negative values on failure.
+ */
+static inline int
+usb_hcd_get_frame_number(usb_host_t* hdev)
+{
+    if (hdev->get_frame == NULL) {
+        return -1;
+    }
+    return hdev->get_frame(hdev);
+}
+
+/**
+ * Tune the asynchronous schedule park mode. When a single high speed bulk
+ * endpoint is streaming, the host may execute up to @count transactions
+ * from it in a row before moving on to the next queue head.
+ * @param[in] hdev  The host controller in question
+ * @param[in] count 1 to 3 transactions, or 0 to disable park mode.
+ * @return          0 on success, negative if park mode is unsupported.
+ */
+static inline int
+usb_hcd_set_async_park(usb_host_t* hdev, int count)
+{
+    if (hdev->set_async_park == NULL) {
+        return -1;
+    }
+    return hdev->set_async_park(hdev, count);
+}
+
 static inline void
 usb_hcd_handle_irq(usb_host_t* hdev)
 {
     hdev->handle_irq(hdev);
 }
 
+static inline void
+usb_hcd_process_completions(usb_host_t* hdev)
+{
+    if (hdev->process_completions) {
+        hdev->process_completions(hdev);
+    }
+}
+
+/**
+ * Record a transfer event, if tracing is enabled on the host.
+ * @param[in] hdev The host controller in question
+ * @param[in] type The event
+ * @param[in] addr The device address
+ * @param[in] ep   The endpoint
+ * @param[in] stat The transfer status, completions only
+ * @param[in] len  The event length, see struct usb_trace_ev
+ * @param[in] time The current time in host units
+ */
+static inline void
+usb_hcd_trace(usb_host_t* hdev, enum usb_trace_type type, uint8_t addr,
+              struct endpoint *ep, enum usb_xact_status stat, int len,
+              uint32_t time)
+{
+    struct usb_trace* trace;
+    struct usb_trace_ev* ev;
+    uint32_t i;
+
+    trace = __atomic_load_n(&hdev->trace, __ATOMIC_ACQUIRE);
+    if (trace == NULL) {
+        return;
+    }
+    i = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+    ev = &trace->ev[i & (trace->size - 1)];
+    ev->time = time;
+    ev->type = type;
+    ev->addr = addr;
+    ev->ep = ep->num | (ep->dir == EP_DIR_IN ? 0x80 : 0);
+    ev->stat = stat;
+    ev->len = len;
+}
+
 static inline int
 usb_hcd_count_ports(usb_host_t* hdev)
 {
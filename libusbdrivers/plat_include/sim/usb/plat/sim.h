@@ -0,0 +1,166 @@
+/*
+ * Copyright 2016, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+/*
+ * Software EHCI controller
+ *
+ * The sim platform runs the unmodified EHCI driver on a Linux host. Each host
+ * controller is a model of the EHCI register file and schedule walker, which
+ * executes qTDs, iTDs and siTDs against virtual devices attached to its root
+ * ports or to virtual hubs.
+ *
+ * The driver accesses the registers directly, so they live in a page that is
+ * read-only to the driver. Every store traps and is replayed through the
+ * model, which gives write-1-to-clear and other side effects exact hardware
+ * semantics. Register writes must therefore be serialised, i.e. one thread
+ * per host, as on real hardware. This is x86_64 Linux only.
+ *
+ * DMA memory must be allocated with ehci_sim_dma_init(), physical addresses
+ * equal virtual addresses and sit in the first 4GB.
+ *
+ * A test binary looks like:
+ *
+ *   ehci_sim_dma_init(&io_ops.dma_manager);
+ *   ehci_sim_attach(ehci_sim_get(USB_HOST1), NULL, 1, sim_bulk_new(512));
+ *   usb_init(USB_HOST1, &io_ops, mops, &host);
+ *   while (ehci_sim_wait_irq(ehci_sim_get(USB_HOST1), 100) >= 0) {
+ *       usb_handle_irq(&host);
+ *   }
+ */
+
+#ifndef _USB_PLAT_SIM_H_
+#define _USB_PLAT_SIM_H_
+
+#include <stdint.h>
+#include <platsupport/io.h>
+#include <usb/usb_host.h>
+#include <usb/usb.h>
+
+/* Handshakes returned by the device operations */
+#define SIM_NAK   (-1)
+#define SIM_STALL (-2)
+
+struct ehci_sim;
+typedef struct ehci_sim ehci_sim_t;
+
+struct sim_dev;
+typedef struct sim_dev sim_dev_t;
+
+struct sim_dev_ops {
+    /* Class and vendor requests on EP0, standard device requests are handled
+     * by the model. IN requests fill @data, OUT requests find their data
+     * stage there. Returns the data stage length or SIM_STALL. Optional. */
+    int (*control)(sim_dev_t* dev, const struct usbreq* req, void* data);
+    /* IN token on @ep, returns bytes written to @buf(<= @len), or a
+     * handshake */
+    int (*in)(sim_dev_t* dev, int ep, void* buf, int len);
+    /* OUT token on @ep, returns bytes accepted, or a handshake */
+    int (*out)(sim_dev_t* dev, int ep, const void* buf, int len);
+    /* Bus reset. Optional. */
+    void (*reset)(sim_dev_t* dev);
+};
+
+struct sim_dev {
+    const struct sim_dev_ops* ops;
+    const struct device_desc* ddesc;
+    const void* cdesc;          // Configuration, interfaces and endpoints
+    const char* name;           // Returned for every string descriptor
+    void* priv;
+    /* Maintained by the model */
+    uint8_t  addr;
+    uint8_t  config;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint32_t naks;
+    uint32_t stalls;
+    /* Control pipe */
+    struct usbreq req;
+    uint8_t  ctl_buf[4096];
+    int      ctl_len;
+    int      ctl_pos;
+    int      ctl_stall;
+    int      new_addr;
+};
+
+struct ehci_sim_stats {
+    uint64_t frames;            // Frames run
+    uint64_t qtds;              // qTDs retired
+    uint64_t isoc;              // iTD and siTD transactions
+    uint64_t naks;              // Transactions NAKed
+    uint64_t bytes;             // Payload moved in either direction
+    uint64_t traps;             // Register writes
+    uint64_t irqs;              // Interrupts asserted
+};
+
+/** Set up a DMA manager with identity mapped memory below 4GB
+ * @param[out] dman The DMA manager to fill in
+ * @return          0 on success
+ */
+int ehci_sim_dma_init(ps_dma_man_t* dman);
+
+/** Get the model of a host controller, it is created on first use
+ * @param[in] id The host
+ * @return       The model, or NULL on failure
+ */
+ehci_sim_t* ehci_sim_get(enum usb_host_id id);
+
+/** Set the duration of a frame
+ * @param[in] sim The model
+ * @param[in] ns  Nanoseconds per frame, 0 runs frames back to back
+ */
+void ehci_sim_set_frame_ns(ehci_sim_t* sim, uint32_t ns);
+
+/** Wait for the interrupt line of the host
+ * @param[in] sim        The model
+ * @param[in] timeout_ms Give up after this long, -1 waits forever
+ * @return               1 if the interrupt is asserted, 0 on timeout
+ */
+int ehci_sim_wait_irq(ehci_sim_t* sim, int timeout_ms);
+
+/** Read the model counters
+ * @param[in]  sim   The model
+ * @param[out] stats Filled with a snapshot of the counters
+ */
+void ehci_sim_get_stats(ehci_sim_t* sim, struct ehci_sim_stats* stats);
+
+/** Plug a device in
+ * @param[in] sim  The model
+ * @param[in] hub  A virtual hub, or NULL for a root port
+ * @param[in] port Port number, starting from 1
+ * @param[in] dev  The device
+ * @return         0 on success, -1 if the port is taken or out of range
+ */
+int ehci_sim_attach(ehci_sim_t* sim, sim_dev_t* hub, int port, sim_dev_t* dev);
+
+/** Unplug a device
+ * @return The device that was attached, or NULL
+ */
+sim_dev_t* ehci_sim_detach(ehci_sim_t* sim, sim_dev_t* hub, int port);
+
+/*
+ * Stock devices, all high speed. Free with sim_dev_free() once detached.
+ */
+
+/** A hub with @nports(1 to 15) downstream ports */
+sim_dev_t* sim_hub_new(int nports);
+
+/** Bulk sink on EP1 OUT and source on EP2 IN. The source returns an
+ * incrementing byte pattern. */
+sim_dev_t* sim_bulk_new(int max_pkt);
+
+/** Interrupt source on EP1 IN, which NAKs until a report is posted */
+sim_dev_t* sim_intr_new(int max_pkt, int interval);
+
+/** Queue a report on an interrupt source, replacing any pending one */
+int sim_intr_post(ehci_sim_t* sim, sim_dev_t* dev, const void* data, int len);
+
+void sim_dev_free(sim_dev_t* dev);
+
+#endif /* _USB_PLAT_SIM_H_ */
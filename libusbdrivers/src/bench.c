@@ -0,0 +1,451 @@
+/*
+ * Copyright 2016, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <usb/usb.h>
+#include <usb/bench.h>
+#include "services.h"
+
+struct bench;
+
+struct bench_slot {
+    struct bench* b;
+    struct xact xact[2];
+    int nxact;
+    uint64_t t_submit;
+};
+
+struct bench {
+    usb_t* host;
+    const struct usb_bench_params* p;
+    struct bench_slot slot[USB_BENCH_MAX_DEPTH];
+    uint64_t* lat;
+    uint64_t* irq;
+    int count;
+    int submitted;
+    int done;
+    int errors;
+    int nirq;
+    uint64_t bytes;
+    uint64_t t_irq;
+    uint64_t cpu;
+};
+
+static inline uint64_t
+_bench_cycles(void)
+{
+#ifdef ARCH_ARM
+    uint32_t v;
+    asm volatile("mrc p15, 0, %0, c9, c13, 0" : "=r"(v));
+    return v;
+#else
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+#endif
+}
+
+static int
+_bench_cmp(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+/* @v must be sorted */
+static uint64_t
+_bench_pct(const uint64_t* v, int n, int pct)
+{
+    if (n == 0) {
+        return 0;
+    }
+    return v[MIN(n - 1, (n * pct) / 100)];
+}
+
+static uint32_t
+_bench_allocs(usb_t* host)
+{
+    struct usb_dma_stats s;
+    usb_dma_get_stats(host, &s);
+    return s.nalloc + s.nfallback;
+}
+
+static int
+_bench_alloc(struct bench* b, struct bench_slot* slot)
+{
+    const struct usb_bench_params* p = b->p;
+    struct usbreq* req;
+    struct xact* data;
+    int i;
+
+    if (p->ep->type == EP_CONTROL) {
+        /* GET_DESCRIPTOR, the device may return less than asked for */
+        slot->xact[0].type = PID_SETUP;
+        slot->xact[0].len = sizeof(struct usbreq);
+        data = &slot->xact[1];
+        data->type = PID_IN;
+        slot->nxact = p->size ? 2 : 1;
+    } else {
+        data = &slot->xact[0];
+        data->type = (p->ep->dir == EP_DIR_IN) ? PID_IN : PID_OUT;
+        slot->nxact = 1;
+    }
+    data->len = p->size;
+
+    if (usb_alloc_xact_cached(p->udev->dman, slot->xact, slot->nxact)) {
+        return -1;
+    }
+
+    if (p->ep->type == EP_CONTROL) {
+        req = xact_get_vaddr(&slot->xact[0]);
+        *req = __get_descriptor_req(CONFIGURATION, 0, 0, p->size);
+    } else if (data->type == PID_OUT) {
+        for (i = 0; i < data->len; i++) {
+            ((uint8_t*)data->vaddr)[i] = i;
+        }
+    }
+    return 0;
+}
+
+static void
+_bench_free(struct bench* b, struct bench_slot* slot)
+{
+    usb_destroy_xact(b->p->udev->dman, slot->xact, slot->nxact);
+}
+
+/* Bytes asked for, only the data stage counts for control transfers */
+static int
+_bench_data_len(struct bench_slot* slot)
+{
+    if (slot->xact[0].type == PID_SETUP) {
+        return (slot->nxact > 1) ? slot->xact[1].len : 0;
+    }
+    return slot->xact[0].len;
+}
+
+static int _bench_cb(void* token, enum usb_xact_status stat, int rbytes);
+
+static int
+_bench_submit(struct bench* b, struct bench_slot* slot)
+{
+    int err;
+
+    if (b->p->alloc && _bench_alloc(b, slot)) {
+        return -1;
+    }
+    b->submitted++;
+    slot->t_submit = _bench_cycles();
+    err = usbdev_schedule_xact(b->p->udev, b->p->ep, slot->xact, slot->nxact,
+                               _bench_cb, slot);
+    if (err < 0) {
+        b->submitted--;
+        if (b->p->alloc) {
+            _bench_free(b, slot);
+        }
+    }
+    return err;
+}
+
+static int
+_bench_cb(void* token, enum usb_xact_status stat, int rbytes)
+{
+    struct bench_slot* slot = token;
+    struct bench* b = slot->b;
+    uint64_t now = _bench_cycles();
+
+    if (b->done < b->count) {
+        b->lat[b->done] = now - slot->t_submit;
+        if (b->t_irq) {
+            b->irq[b->nirq++] = now - b->t_irq;
+        }
+    }
+    b->done++;
+    if (stat == XACTSTAT_SUCCESS) {
+        b->bytes += _bench_data_len(slot) - rbytes;
+    } else {
+        b->errors++;
+    }
+
+    if (b->p->alloc) {
+        _bench_free(b, slot);
+    }
+    if (b->submitted < b->count && _bench_submit(b, slot) < 0) {
+        /* Account for it, or the run never finishes */
+        b->errors++;
+        b->count--;
+    }
+    return 0;
+}
+
+static void
+_bench_sync(struct bench* b)
+{
+    struct bench_slot* slot = &b->slot[0];
+    uint64_t t;
+    int i, r;
+
+    for (i = 0; i < b->count; i++) {
+        if (b->p->alloc && _bench_alloc(b, slot)) {
+            b->errors++;
+            continue;
+        }
+        t = _bench_cycles();
+        r = usbdev_schedule_xact(b->p->udev, b->p->ep, slot->xact,
+                                 slot->nxact, NULL, NULL);
+        t = _bench_cycles() - t;
+        b->lat[b->done++] = t;
+        b->cpu += t;
+        if (r < 0) {
+            b->errors++;
+        } else {
+            b->bytes += _bench_data_len(slot) - r;
+        }
+        if (b->p->alloc) {
+            _bench_free(b, slot);
+        }
+    }
+}
+
+static void
+_bench_async(struct bench* b)
+{
+    uint64_t t;
+    int i;
+
+    for (i = 0; i < b->p->depth && b->submitted < b->count; i++) {
+        t = _bench_cycles();
+        if (_bench_submit(b, &b->slot[i]) < 0) {
+            b->errors++;
+            b->count--;
+        }
+        b->cpu += _bench_cycles() - t;
+    }
+
+    while (b->done < b->count) {
+        if (b->p->wait_irq(b->p->arg) <= 0) {
+            continue;
+        }
+        /* Resubmission from the callbacks counts as IRQ time */
+        b->t_irq = _bench_cycles();
+        usb_handle_irq(b->host);
+        if (b->host->defer_completions) {
+            usb_process_completions(b->host);
+        }
+        b->cpu += _bench_cycles() - b->t_irq;
+        b->t_irq = 0;
+    }
+}
+
+int
+usb_bench_run(usb_t* host, const struct usb_bench_params* p,
+              struct usb_bench_result* r)
+{
+    struct bench b;
+    uint64_t start;
+    uint32_t allocs;
+    int i, err = 0;
+
+    assert(host);
+    assert(p && p->udev && p->ep);
+    assert(r);
+
+    if (p->count <= 0 || p->size < 0 || p->ep->type == EP_ISOCHRONOUS) {
+        return -1;
+    }
+    if (p->mode == USB_BENCH_ASYNC &&
+            (!p->wait_irq || p->depth < 1 || p->depth > USB_BENCH_MAX_DEPTH)) {
+        return -1;
+    }
+    /* The host controller driver only blocks on async endpoints */
+    if (p->mode == USB_BENCH_SYNC && p->ep->type == EP_INTERRUPT) {
+        return -1;
+    }
+
+    memset(&b, 0, sizeof(b));
+    b.host = host;
+    b.p = p;
+    b.count = MIN(p->count, USB_BENCH_MAX_SAMPLES);
+    b.lat = usb_malloc(b.count * sizeof(uint64_t));
+    b.irq = usb_malloc(b.count * sizeof(uint64_t));
+    if (!b.lat || !b.irq) {
+        err = -1;
+        goto out;
+    }
+
+    for (i = 0; i < USB_BENCH_MAX_DEPTH; i++) {
+        b.slot[i].b = &b;
+    }
+    if (!p->alloc) {
+        for (i = 0; i < (p->mode == USB_BENCH_SYNC ? 1 : p->depth); i++) {
+            if (_bench_alloc(&b, &b.slot[i])) {
+                while (i--) {
+                    _bench_free(&b, &b.slot[i]);
+                }
+                err = -1;
+                goto out;
+            }
+        }
+    }
+
+    allocs = _bench_allocs(host);
+    start = _bench_cycles();
+    if (p->mode == USB_BENCH_SYNC) {
+        _bench_sync(&b);
+    } else {
+        _bench_async(&b);
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->params = *p;
+    r->params.count = b.count;
+    r->cycles = _bench_cycles() - start;
+    r->allocs = _bench_allocs(host) - allocs;
+    r->done = b.done;
+    r->errors = b.errors;
+    r->bytes = b.bytes;
+    r->cpu_cycles = b.cpu;
+    if (p->cpu_mhz && r->cycles) {
+        r->kb_per_s = b.bytes * p->cpu_mhz * 1000 / r->cycles;
+    }
+
+    qsort(b.lat, MIN(b.done, b.count), sizeof(uint64_t), _bench_cmp);
+    qsort(b.irq, b.nirq, sizeof(uint64_t), _bench_cmp);
+    r->lat_p50 = _bench_pct(b.lat, MIN(b.done, b.count), 50);
+    r->lat_p90 = _bench_pct(b.lat, MIN(b.done, b.count), 90);
+    r->lat_p99 = _bench_pct(b.lat, MIN(b.done, b.count), 99);
+    r->lat_max = _bench_pct(b.lat, MIN(b.done, b.count), 100);
+    r->irq_p50 = _bench_pct(b.irq, b.nirq, 50);
+    r->irq_p99 = _bench_pct(b.irq, b.nirq, 99);
+
+    if (!p->alloc) {
+        for (i = 0; i < (p->mode == USB_BENCH_SYNC ? 1 : p->depth); i++) {
+            _bench_free(&b, &b.slot[i]);
+        }
+    }
+out:
+    usb_free(b.lat);
+    usb_free(b.irq);
+    return err;
+}
+
+static const char*
+_bench_ep_name(enum usb_endpoint_type type)
+{
+    switch (type) {
+    case EP_CONTROL:
+        return "control";
+    case EP_BULK:
+        return "bulk";
+    case EP_INTERRUPT:
+        return "interrupt";
+    default:
+        return "isochronous";
+    }
+}
+
+void
+usb_bench_print(const struct usb_bench_result* r, enum usb_bench_format fmt,
+                int header)
+{
+    const struct usb_bench_params* p = &r->params;
+    /* Control runs read descriptors */
+    const char* dir = (p->ep->dir == EP_DIR_IN || p->ep->type == EP_CONTROL) ?
+                      "in" : "out";
+    const char* mode = (p->mode == USB_BENCH_SYNC) ? "sync" : "async";
+    uint64_t cpu = r->done ? r->cpu_cycles / r->done : 0;
+    uint32_t apx = r->done ? r->allocs * 100 / r->done : 0;
+
+    if (fmt == USB_BENCH_JSON) {
+        printf("{\"addr\":%d,\"ep\":%d,\"type\":\"%s\",\"dir\":\"%s\","
+               "\"mode\":\"%s\",\"size\":%d,\"depth\":%d,\"alloc\":%d,"
+               "\"count\":%d,\"done\":%d,\"errors\":%d,\"bytes\":%llu,"
+               "\"cycles\":%llu,\"kb_per_s\":%llu,\"cpu_per_xfer\":%llu,"
+               "\"allocs_per_xfer\":%u.%02u,\"lat_p50\":%llu,"
+               "\"lat_p90\":%llu,\"lat_p99\":%llu,\"lat_max\":%llu,"
+               "\"irq_p50\":%llu,\"irq_p99\":%llu}\n",
+               p->udev->addr, p->ep->num, _bench_ep_name(p->ep->type), dir,
+               mode, p->size, p->depth, p->alloc, p->count, r->done,
+               r->errors, (unsigned long long)r->bytes,
+               (unsigned long long)r->cycles,
+               (unsigned long long)r->kb_per_s, (unsigned long long)cpu,
+               apx / 100, apx % 100,
+               (unsigned long long)r->lat_p50,
+               (unsigned long long)r->lat_p90,
+               (unsigned long long)r->lat_p99,
+               (unsigned long long)r->lat_max,
+               (unsigned long long)r->irq_p50,
+               (unsigned long long)r->irq_p99);
+        return;
+    }
+
+    if (header) {
+        printf("addr,ep,type,dir,mode,size,depth,alloc,count,done,errors,"
+               "bytes,cycles,kb_per_s,cpu_per_xfer,allocs_per_xfer,"
+               "lat_p50,lat_p90,lat_p99,lat_max,irq_p50,irq_p99\n");
+    }
+    printf("%d,%d,%s,%s,%s,%d,%d,%d,%d,%d,%d,%llu,%llu,%llu,%llu,%u.%02u,"
+           "%llu,%llu,%llu,%llu,%llu,%llu\n",
+           p->udev->addr, p->ep->num, _bench_ep_name(p->ep->type), dir, mode,
+           p->size, p->depth, p->alloc, p->count, r->done, r->errors,
+           (unsigned long long)r->bytes, (unsigned long long)r->cycles,
+           (unsigned long long)r->kb_per_s, (unsigned long long)cpu,
+           apx / 100, apx % 100,
+           (unsigned long long)r->lat_p50, (unsigned long long)r->lat_p90,
+           (unsigned long long)r->lat_p99, (unsigned long long)r->lat_max,
+           (unsigned long long)r->irq_p50, (unsigned long long)r->irq_p99);
+}
+
+int
+usb_bench_sweep(usb_t* host, const struct usb_bench_params* base,
+                const int* sizes, int nsizes, const int* depths, int ndepths,
+                enum usb_bench_format fmt)
+{
+    struct usb_bench_params p;
+    struct usb_bench_result r;
+    int header = 1;
+    int i, j, failed = 0;
+
+    for (i = 0; i < nsizes; i++) {
+        p = *base;
+        p.size = sizes[i];
+
+        /* Sync first, as the baseline */
+        if (p.ep->type != EP_INTERRUPT) {
+            p.mode = USB_BENCH_SYNC;
+            p.depth = 1;
+            if (usb_bench_run(host, &p, &r) == 0) {
+                usb_bench_print(&r, fmt, header);
+                header = 0;
+            } else {
+                failed++;
+            }
+        }
+
+        if (!p.wait_irq) {
+            continue;
+        }
+        for (j = 0; j < ndepths; j++) {
+            p.mode = USB_BENCH_ASYNC;
+            p.depth = depths[j];
+            if (usb_bench_run(host, &p, &r) == 0) {
+                usb_bench_print(&r, fmt, header);
+                header = 0;
+            } else {
+                failed++;
+            }
+        }
+    }
+
+    return failed;
+}
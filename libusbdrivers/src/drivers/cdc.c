@@ -17,17 +17,8 @@
 #include "../services.h"
 #include "cdc.h"
 
-#define USB_CDC_DEBUG
-
-#ifdef USB_CDC_DEBUG
-#define CDC_DBG(...)            \
-        do {                     \
-            printf("CDC: ");    \
-            printf(__VA_ARGS__); \
-        }while(0)
-#else
-#define CDC_DBG(...) do{}while(0)
-#endif
+#define CDC_DBG(fmt, ...) \
+        usb_log(USB_LOG_CDC, USB_LOG_DEBUG, "CDC: " fmt, ##__VA_ARGS__)
 
 /*
  * XXX: In theory the maximum xact size can be up to 20K, however, our DMA
@@ -246,7 +237,7 @@ int usb_cdc_bind(usb_dev_t udev)
 	/* Allocate read request */
 	cdc->read_xact.type = PID_IN;
 	cdc->read_xact.len = CDC_READ_XACT_SIZE;
-	err = usb_alloc_xact(udev->dman, &cdc->read_xact, 1);
+	err = usb_alloc_xact_cached(udev->dman, &cdc->read_xact, 1);
 	assert(!err);
 	cdc->read_in_progress = 0;
 
@@ -319,7 +310,7 @@ int usb_cdc_write(usb_dev_t udev, void *buf, int len)
 	}
 
 	/* DMA allocation */
-	err = usb_alloc_xact(udev->dman, xact, cnt);
+	err = usb_alloc_xact_cached(udev->dman, xact, cnt);
 	assert(!err);
 
 	/* Copy in */
@@ -29,24 +29,12 @@
 
 #define ETH_ENABLE_IRQS
 
-#define ETH_TRAFFIC_DEBUG
-#define ETH_DEBUG
+#define ETH_DBG(eth, fmt, ...)                                          \
+        usb_log(USB_LOG_ETH, USB_LOG_DEBUG, "ETH %2d: " fmt,            \
+                (eth) ? (eth)->udev->addr : 0, ##__VA_ARGS__)
 
-#ifdef ETH_DEBUG
-#define dprintf(...) printf(__VA_ARGS__)
-#else
-#define dprintf(...) do{}while(0)
-#endif
-
-#define ETH_DBG(eth, ...)                               \
-        do {                                            \
-            if(eth){                                    \
-                dprintf("ETH %2d: ", eth->udev->addr);  \
-            }else{                                      \
-                dprintf("ETH  ?: ");                    \
-            }                                           \
-            dprintf(__VA_ARGS__);                       \
-        }while(0)
+/* Packet dumps, every packet in either direction */
+#define ETH_TRAFFIC_DEBUG USB_LOG_ON(USB_LOG_ETH, USB_LOG_TRACE)
 
 
 #define EP_CTRL         0
@@ -663,7 +651,7 @@ do_lan9730_input(struct netif *netif, struct xact *xact)
         payload += q->len;
     }
 
-#ifdef ETH_TRAFFIC_DEBUG
+#if ETH_TRAFFIC_DEBUG
     printf("\n" COL_RX "RX packet (%d bytes)\n", p->tot_len);
     payload = (char*)&hdr[1];
     dump_pbuf(p);
@@ -782,7 +770,7 @@ static err_t tx_packet(struct usb_eth* eth, struct pbuf* p)
     char* payload;
     int err;
 
-#ifdef ETH_TRAFFIC_DEBUG
+#if ETH_TRAFFIC_DEBUG
     printf("\n" COL_TX "TX packet (%d bytes)\n", p->tot_len);
     dump_pbuf(p);
     printf(COL_DEF);
@@ -794,7 +782,7 @@ static err_t tx_packet(struct usb_eth* eth, struct pbuf* p)
      * the DATAx that the packet should be sent to. */
     xact[1].type = PID_OUT;
     xact[1].len = 0;
-    err = usb_alloc_xact(eth->udev->dman, xact, 2);
+    err = usb_alloc_xact_cached(eth->udev->dman, xact, 2);
     if (err) {
         return ENOMEM;
     }
@@ -829,7 +817,7 @@ lan9730_input(struct netif *netif)
     /* Allocate a buffer */
     xact.type = PID_IN;
     xact.len = EP_IN_SIZE;
-    err = usb_alloc_xact(eth->udev->dman, &xact, 1);
+    err = usb_alloc_xact_cached(eth->udev->dman, &xact, 1);
     if (err) {
         return -1;
     }
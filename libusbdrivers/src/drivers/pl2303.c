@@ -15,17 +15,8 @@
 #include <usb/drivers/pl2303.h>
 #include "../services.h"
 
-#define USB_PL2303_DEBUG
-
-#ifdef USB_PL2303_DEBUG
-#define PL2303_DBG(...)            \
-        do {                     \
-            printf("pl2303: ");    \
-            printf(__VA_ARGS__); \
-        }while(0)
-#else
-#define PL2303_DBG(...) do{}while(0)
-#endif
+#define PL2303_DBG(fmt, ...) \
+        usb_log(USB_LOG_SERIAL, USB_LOG_DEBUG, "pl2303: " fmt, ##__VA_ARGS__)
 
 #define PL2303_VENDOR_REQ  0x01
 #define PL2303_READ_TYPE   (USB_DIR_IN | USB_TYPE_VEN | USB_RCPT_DEVICE)
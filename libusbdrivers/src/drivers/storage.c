@@ -16,21 +16,28 @@
 #include "storage.h"
 #include "ufi.h"
 
-//#define MASS_STORAGE_DEBUG
-
-#ifdef MASS_STORAGE_DEBUG
-#define UBMS_DBG(...)            \
-        do {                     \
-            printf("UBMS: ");    \
-            printf(__VA_ARGS__); \
-        }while(0)
-#else
-#define UBMS_DBG(...) do{}while(0)
-#endif
+#define UBMS_DBG(fmt, ...) \
+        usb_log(USB_LOG_STORAGE, USB_LOG_DEBUG, "UBMS: " fmt, ##__VA_ARGS__)
 
 #define UBMS_CBW_SIGN 0x43425355 //Command block wrapper signature
 #define UBMS_CSW_SIGN 0x53425355 //Command status wrapper signature
 
+/*
+ * Data moved by one READ or WRITE command, the same default as Linux. Each
+ * xact of the data phase covers at most 16KB, so that it fits in the five
+ * pages of a qTD wherever the buffer starts, and there are enough of them
+ * for a command merged from page sized requests.
+ */
+#define UBMS_MAX_XFER   (120 * 1024)
+#define UBMS_XACT_SIZE  (16 * 1024)
+#define UBMS_MAX_XACTS  (UBMS_MAX_XFER / 4096)
+
+/* Bulk transfer timeout, flash can take seconds to finish a write */
+#define UBMS_TIMEOUT_MS 10000
+
+/* GET MAX LUN reports at most 15 */
+#define UBMS_MAX_LUN    16
+
 #define CSW_STS_PASS 0x0
 #define CSW_STS_FAIL 0x1
 #define CSW_STS_ERR  0x2
@@ -54,16 +61,78 @@ struct csw {
     uint8_t status;
 } __attribute__((packed));
 
+/* Asynchronous block request, see usb_storage_submit */
+struct ubms_req {
+    int            write;
+    uint64_t       lba;
+    uint32_t       count;
+    char*          buf;
+    uintptr_t      paddr;     //The buffer is pinned while queued
+    uint32_t       issued;    //Blocks handed to commands
+    uint32_t       left;      //Blocks not completed yet
+    int            err;
+    usb_storage_cb_t cb;
+    void*          token;
+    struct ubms_req* next;
+};
+
+/* The part of a request covered by a command */
+struct ubms_seg {
+    struct ubms_req* req;
+    uint32_t       blocks;
+};
+
+/* A bulk endpoint as seen by the command in flight */
+struct ubms_pipe {
+    usb_dev_t      udev;
+    int            in;        //Bulk IN, else bulk OUT
+    int            cleared;   //A halt was cleared during this command
+    struct xact    setup;     //CLEAR_FEATURE(ENDPOINT_HALT)
+};
+
+/* The command in flight for the request queues */
+struct ubms_cmd {
+    struct xact    cmd;       //CBW followed by the CSW
+    unsigned int   lun;
+    struct xact    xact[UBMS_MAX_XACTS + 1];
+    int            nxact;     //Data xacts, the CSW may follow them
+    struct ubms_seg seg[UBMS_MAX_XACTS];
+    int            nseg;
+    int            write;
+    uint32_t       len;
+    int            pending;   //Transfers still in flight
+    int            err;       //A transfer failed
+    struct ubms_pipe pipe[2]; //Bulk OUT and bulk IN
+    int            recover;   //Reset recovery step, see usb_storage_recover
+};
+
+/* Logical unit, with its own medium and request queue */
+struct ubms_lun {
+    uint64_t       nblocks;   //Capacity in blocks, 0 without a medium
+    uint32_t       block_size;//Bytes per block
+    /* Request queue, in submission order */
+    struct ubms_req* rq_head;
+    struct ubms_req* rq_tail;
+};
+
 /* USB mass storage device */
 struct usb_storage_device {
     usb_dev_t      udev;      //The handle to the underlying USB device
-    unsigned int   max_lun;   //Maximum logical unit number
+    int            max_lun;   //Maximum logical unit number
     unsigned int   subclass;  //Industry standard
     unsigned int   protocol;  //Protocol code
     unsigned int   config;    //Selected configuration
     unsigned int   ep_in;     //BULK in endpoint
     unsigned int   ep_out;    //BULK out endpoint
     unsigned int   ep_int;    //Interrupt endpoint(for CBI devices)
+    uint32_t       tag;       //Tag of the last CBW
+    uint32_t       residue;   //Data residue of the last CSW
+    /* One block device per LUN, they share the bulk endpoints */
+    struct ubms_lun lun[UBMS_MAX_LUN];
+    int            next_lun;  //First LUN to serve, for round robin
+    void*          lock;
+    struct ubms_cmd acmd;
+    int            abusy;     //The bulk endpoints are taken
 };
 
 static inline struct usbreq
@@ -92,6 +161,19 @@ __get_max_lun_req(int interface)
     return r;
 }
 
+static inline struct usbreq
+__clear_halt_req(int ep)
+{
+    struct usbreq r = {
+        .bmRequestType = (USB_DIR_OUT | USB_TYPE_STD | USB_RCPT_ENDPOINT),
+        .bRequest      = CLR_FEATURE,
+        .wValue        = 0, //ENDPOINT_HALT
+        .wIndex        = ep,
+        .wLength       = 0
+    };
+    return r;
+}
+
 static void
 usb_storage_print_cbw(struct cbw *cbw)
 {
@@ -239,16 +321,18 @@ usb_storage_get_max_lun(usb_dev_t udev)
     max_lun = *((uint8_t*)xact[1].vaddr);
     usb_destroy_xact(udev->dman, xact, 2);
     if (err < 0) {
+       /* Devices with a single LUN may stall the request */
        UBMS_DBG("USB mass storage get LUN failed.\n");
+       return 0;
     }
 
-    return max_lun;
+    return MIN(max_lun, UBMS_MAX_LUN - 1);
 }
 
 int
 usb_storage_bind(usb_dev_t udev)
 {
-    int err;
+    int err, i;
     struct usb_storage_device *ubms;
     int class;
 
@@ -288,6 +372,7 @@ usb_storage_bind(usb_dev_t udev)
     class = usbdev_get_class(udev);
     if (class != USB_CLASS_STORAGE) {
         UBMS_DBG("Not a USB mass storage(%d)\n", class);
+        udev->dev_data = NULL;
 	usb_free(ubms);
         return -1;
     }
@@ -296,126 +381,833 @@ usb_storage_bind(usb_dev_t udev)
 
     usb_storage_set_configuration(udev);
 //    usb_storage_reset(udev);
-    ubms->max_lun = usb_storage_get_max_lun(udev);
+    err = usb_storage_get_max_lun(udev);
+    ubms->max_lun = err < 0 ? 0 : err;
+
+    /* Request queue, the CBW and CSW of its command live together */
+    ubms->lock = usb_mutex_init(udev->host->hdev.mops);
+    if (!ubms->lock) {
+        UBMS_DBG("Not enough memory!\n");
+        goto err_lock;
+    }
+    ubms->acmd.cmd.type = PID_OUT;
+    ubms->acmd.cmd.len = sizeof(struct cbw) + sizeof(struct csw);
+    err = usb_alloc_xact(udev->dman, &ubms->acmd.cmd, 1);
+    if (err) {
+        UBMS_DBG("Not enough DMA memory!\n");
+        goto err_cmd;
+    }
+    for (i = 0; i < 2; i++) {
+        ubms->acmd.pipe[i].udev = udev;
+        ubms->acmd.pipe[i].in = i;
+        ubms->acmd.pipe[i].setup.type = PID_SETUP;
+        ubms->acmd.pipe[i].setup.len = sizeof(struct usbreq);
+        err = usb_alloc_xact(udev->dman, &ubms->acmd.pipe[i].setup, 1);
+        if (err) {
+            UBMS_DBG("Not enough DMA memory!\n");
+            goto err_setup;
+        }
+    }
+    udev->ep[ubms->ep_in]->timeout_ms = UBMS_TIMEOUT_MS;
+    udev->ep[ubms->ep_out]->timeout_ms = UBMS_TIMEOUT_MS;
 
     return 0;
+
+err_setup:
+    while (i-- > 0) {
+        usb_destroy_xact(udev->dman, &ubms->acmd.pipe[i].setup, 1);
+    }
+    usb_destroy_xact(udev->dman, &ubms->acmd.cmd, 1);
+err_cmd:
+    usb_mutex_destroy(udev->host->hdev.mops, ubms->lock);
+err_lock:
+    udev->dev_data = NULL;
+    usb_free(ubms);
+    return -1;
+}
+
+static void
+usb_storage_fill_cbw(struct usb_storage_device *ubms, struct cbw *cbw, int lun,
+        void *cb, size_t cb_len, uint32_t len, int direction)
+{
+    cbw->signature = UBMS_CBW_SIGN;
+    cbw->tag = ++ubms->tag;
+    cbw->data_transfer_length = len;
+    cbw->flags = (direction & 0x1) << 7;
+    cbw->lun = lun;
+    cbw->cb_length = cb_len;
+    memcpy(cbw->cb, cb, cb_len);
+#if USB_LOG_ON(USB_LOG_STORAGE, USB_LOG_TRACE)
+    usb_storage_print_cbw(cbw);
+#endif
+}
+
+/* A CSW is only meaningful if it is complete and matches the CBW */
+static int
+usb_storage_check_csw(struct usb_storage_device *ubms, struct csw *csw,
+        uint32_t len)
+{
+    if (csw->signature != UBMS_CSW_SIGN || csw->tag != ubms->tag ||
+            csw->residue > len || csw->status > CSW_STS_ERR) {
+        UBMS_DBG("Invalid CSW(%x, %x, %u)\n", csw->signature, csw->tag,
+                 csw->residue);
+        return -1;
+    }
+
+    UBMS_DBG("CSW status(%u)\n", csw->status);
+    ubms->residue = csw->residue;
+    switch (csw->status) {
+        case CSW_STS_PASS:
+            return 0;
+        case CSW_STS_FAIL:
+            return CSW_STS_FAIL;
+        default:
+            /* Phase error */
+            return -1;
+    }
+}
+
+/* Clear a halt condition on one of the bulk endpoints */
+static int
+usb_storage_clear_halt(usb_dev_t udev, struct endpoint *ep)
+{
+    int err;
+    struct xact xact;
+    struct usbreq *req;
+
+    xact.type = PID_SETUP;
+    xact.len = sizeof(struct usbreq);
+    err = usb_alloc_xact(udev->dman, &xact, 1);
+    if (err) {
+        return -1;
+    }
+
+    req = xact_get_vaddr(&xact);
+    *req = __clear_halt_req(ep->num | (ep->dir == EP_DIR_IN ? 0x80 : 0));
+    err = usbdev_schedule_xact(udev, udev->ep_ctrl, &xact, 1, NULL, NULL);
+    usb_destroy_xact(udev->dman, &xact, 1);
+
+    return err < 0 ? -1 : 0;
+}
+
+/* Reset recovery(BOT 5.3.4), after a phase error or an invalid CSW */
+static void
+usb_storage_reset_recovery(usb_dev_t udev)
+{
+    struct usb_storage_device *ubms;
+
+    ubms = (struct usb_storage_device*)udev->dev_data;
+    usb_storage_reset(udev);
+    usb_storage_clear_halt(udev, udev->ep[ubms->ep_in]);
+    usb_storage_clear_halt(udev, udev->ep[ubms->ep_out]);
+}
+
+static void usb_storage_release(usb_dev_t udev);
+
+/*
+ * Take the bulk endpoints for a synchronous command, once the queued
+ * commands are done with them. Gives up if the queue makes no progress.
+ */
+static int
+usb_storage_take(usb_dev_t udev)
+{
+    struct usb_storage_device *ubms;
+    uint32_t tag;
+    int busy, ms = 0;
+
+    ubms = (struct usb_storage_device*)udev->dev_data;
+    tag = ubms->tag;
+    while (1) {
+        usb_mutex_lock(udev->host->hdev.mops, ubms->lock);
+        busy = ubms->abusy;
+        ubms->abusy = 1;
+        if (busy && ubms->tag != tag) {
+            /* Another command went out */
+            tag = ubms->tag;
+            ms = 0;
+        }
+        usb_mutex_unlock(udev->host->hdev.mops, ubms->lock);
+        if (!busy) {
+            return 0;
+        }
+        if (ms++ >= UBMS_TIMEOUT_MS) {
+            UBMS_DBG("Request queue stuck\n");
+            return -1;
+        }
+        msdelay(1);
+    }
 }
 
+/*
+ * One Bulk-Only command. Each phase starts as soon as the previous one has
+ * completed, and for IN commands the CSW is queued behind the data phase in
+ * the same transfer. A stalled data phase is cleared before the CSW is read,
+ * and a stalled CSW is read once more after clearing the halt.
+ *
+ * Returns 0 if the command passed, CSW_STS_FAIL if the device failed it, or
+ * -1 on a transport error or if the queued commands hold on to the bulk
+ * endpoints. The data residue is left in ubms->residue. The command waits
+ * for the queued ones to finish, and those queued later wait for it.
+ */
 int
-usb_storage_xfer(usb_dev_t udev, void *cb, size_t cb_len,
+usb_storage_xfer(usb_dev_t udev, int lun, void *cb, size_t cb_len,
          struct xact *data, int ndata, int direction)
 {
     int err, i, ret;
     struct cbw *cbw;
     struct csw *csw;
-    struct xact xact;
-    uint32_t tag;
+    struct xact xact[UBMS_MAX_XACTS + 1];
+    struct xact cmd;
+    uint32_t len = 0;
     struct usb_storage_device *ubms;
-    struct endpoint *ep;
+    struct endpoint *ep_in, *ep_out;
 
     ubms = (struct usb_storage_device*)udev->dev_data;
+    ep_in = udev->ep[ubms->ep_in];
+    ep_out = udev->ep[ubms->ep_out];
+    assert(ndata <= UBMS_MAX_XACTS);
 
-    /* Prepare command block */
-    xact.type = PID_OUT;
-    xact.len = sizeof(struct cbw);
-    err = usb_alloc_xact(udev->dman, &xact, 1);
-    assert(!err);
+    if (usb_storage_take(udev)) {
+        return -1;
+    }
+
+    /* The CBW and the CSW share one allocation */
+    cmd.type = PID_OUT;
+    cmd.len = sizeof(struct cbw) + sizeof(struct csw);
+    err = usb_alloc_xact(udev->dman, &cmd, 1);
+    if (err) {
+        usb_storage_release(udev);
+        return -1;
+    }
+    cbw = xact_get_vaddr(&cmd);
+    csw = (struct csw*)(cbw + 1);
 
-    cbw = xact_get_vaddr(&xact);
-    cbw->signature = UBMS_CBW_SIGN;
-    cbw->tag = 0;
-    cbw->data_transfer_length = 0;
     for (i = 0; i < ndata; i++) {
-        cbw->data_transfer_length += data[i].len;
+        len += data[i].len;
     }
-    cbw->flags = (direction & 0x1) << 7;
-    cbw->lun = 0; //TODO: multiple LUN
-    cbw->cb_length = cb_len;
-    memcpy(cbw->cb, cb, cb_len);
+    usb_storage_fill_cbw(ubms, cbw, lun, cb, cb_len, len, direction);
+    memset(csw, 0, sizeof(struct csw));
 
     /* Send CBW */
-    ep = udev->ep[ubms->ep_out];
-#ifdef MASS_STORAGE_DEBUG
-    usb_storage_print_cbw(cbw);
-#endif
-    err = usbdev_schedule_xact(udev, ep, &xact, 1, NULL, NULL);
+    xact[0] = cmd;
+    xact[0].len = sizeof(struct cbw);
+    err = usbdev_schedule_xact(udev, ep_out, xact, 1, NULL, NULL);
     if (err < 0) {
-        assert(0);
+        usb_storage_reset_recovery(udev);
+        ret = -1;
+        goto out;
     }
-    tag = cbw->tag;
-    usb_destroy_xact(udev->dman, &xact, 1);
 
-    msdelay(200);
-    /* Send/Receive data */
-    if (data != NULL) {
-        if (direction) {
-            ep = udev->ep[ubms->ep_in];
+    /* The CSW xact follows the data */
+    xact[ndata].type = PID_IN;
+    xact[ndata].vaddr = csw;
+    xact[ndata].paddr = cmd.paddr + sizeof(struct cbw);
+    xact[ndata].len = sizeof(struct csw);
+
+    if (ndata && direction) {
+        memcpy(xact, data, ndata * sizeof(struct xact));
+        err = usbdev_schedule_xact(udev, ep_in, xact, ndata + 1, NULL, NULL);
+    } else {
+        if (ndata) {
+            err = usbdev_schedule_xact(udev, ep_out, data, ndata, NULL, NULL);
+            if (err < 0) {
+                usb_storage_clear_halt(udev, ep_out);
+            }
         }
-        err = usbdev_schedule_xact(udev, ep, data, ndata, NULL, NULL);
+        err = usbdev_schedule_xact(udev, ep_in, &xact[ndata], 1, NULL, NULL);
+    }
+
+    if (err < 0) {
+        /* Stalled data or CSW, clear it and try for the CSW once more */
+        usb_storage_clear_halt(udev, ep_in);
+        err = usbdev_schedule_xact(udev, ep_in, &xact[ndata], 1, NULL, NULL);
         if (err < 0) {
-            assert(0);
+            usb_storage_clear_halt(udev, ep_in);
         }
     }
-    msdelay(200);
 
-    /* Check CSW from IN endpoint */
-    xact.len = sizeof(struct csw);
-    xact.type = PID_IN;
-    err = usb_alloc_xact(udev->dman, &xact, 1);
-    assert(!err);
+    ret = err < 0 ? -1 : usb_storage_check_csw(ubms, csw, len);
+    if (ret < 0) {
+        usb_storage_reset_recovery(udev);
+    }
 
-    csw = xact_get_vaddr(&xact);
-    csw->signature = UBMS_CSW_SIGN;
-    csw->tag = tag;
+out:
+    usb_destroy_xact(udev->dman, &cmd, 1);
+    usb_storage_release(udev);
 
-    ep = udev->ep[ubms->ep_in];
-    err = usbdev_schedule_xact(udev, ep, &xact, 1, NULL, NULL);
-    UBMS_DBG("CSW status(%u)\n", csw->status);
-    if (err < 0) {
-        assert(0);
+    return ret;
+}
+
+/*
+ * Run READ or WRITE commands over the caller's buffer, which is pinned
+ * through the device DMA manager and used for the data phase directly.
+ */
+static int
+usb_storage_rw(usb_dev_t udev, int lun, int write, uint64_t lba,
+        uint32_t count, void *buf)
+{
+    struct usb_storage_device *ubms;
+    struct ubms_lun *l;
+    struct xact data[UBMS_MAX_XACTS];
+    uint32_t max_blocks, blocks;
+    uintptr_t paddr;
+    size_t len, off;
+    int ndata, err = 0;
+    char *p = buf;
+
+    assert(udev);
+    ubms = (struct usb_storage_device*)udev->dev_data;
+    if (!ubms || lun < 0 || lun > ubms->max_lun) {
+        return -1;
+    }
+    l = &ubms->lun[lun];
+    if (!l->block_size || lba + count > l->nblocks) {
+        return -1;
     }
 
-    switch (csw->status) {
-        case CSW_STS_PASS:
-            ret = 0;
-            break;
-        case CSW_STS_FAIL:
-//            assert(0);
-            ret = 0;
-            break;
-        case CSW_STS_ERR:
-            assert(0);
-            ret = -2;
+    max_blocks = UBMS_MAX_XFER / l->block_size;
+    while (count && !err) {
+        blocks = MIN(count, max_blocks);
+        len = (size_t)blocks * l->block_size;
+        paddr = ps_dma_pin(udev->dman, p, len);
+        if (!paddr) {
+            return -1;
+        }
+
+        for (ndata = 0, off = 0; off < len; ndata++, off += UBMS_XACT_SIZE) {
+            data[ndata].type = write ? PID_OUT : PID_IN;
+            data[ndata].vaddr = p + off;
+            data[ndata].paddr = paddr + off;
+            data[ndata].len = MIN(len - off, UBMS_XACT_SIZE);
+        }
+        err = ufi_read_write(udev, lun, write, lba, blocks, data, ndata);
+        if (!err && ubms->residue) {
+            /* Passed, but not all of the blocks were moved */
+            err = -1;
+        }
+
+        ps_dma_unpin(udev->dman, p, len);
+        lba += blocks;
+        count -= blocks;
+        p += len;
+    }
+
+    return err ? -1 : 0;
+}
+
+/*
+ * Asynchronous request queue
+ *
+ * Requests are served in submission order, each command covering as much of
+ * the queue as fits in UBMS_MAX_XFER, merging the requests that continue one
+ * another. Each LUN has a queue of its own, and the LUNs with work take turns
+ * on the bulk endpoints one command at a time. The CBW, the data and the CSW of a command are handed to the host
+ * together, so the bus never waits for a phase to be set up. BOT does not
+ * allow a CBW before the previous CSW, the next command is issued straight
+ * from the CSW completion instead. A stalled phase is recovered from the
+ * completion too: the halt is cleared and the CSW read once more, without
+ * waiting for either. So is a transport error, with reset recovery.
+ */
+static int usb_storage_cmd_cb(void *token, enum usb_xact_status stat,
+        int rbytes);
+static void usb_storage_cmd_put(struct ubms_pipe *p, int err);
+
+/* Gather the next command from the queues, called with the lock held */
+static int
+usb_storage_build(struct usb_storage_device *ubms)
+{
+    struct ubms_cmd *c = &ubms->acmd;
+    struct ubms_lun *l = NULL;
+    struct ubms_req *req = NULL;
+    uint32_t max_blocks, total = 0, blocks;
+    uint64_t lba;
+    size_t len, off;
+    char cdb[16];
+    int cdb_len;
+    int i, lun = 0;
+
+    /* Round robin over the LUNs with requests not yet issued */
+    for (i = 0; i <= ubms->max_lun && !req; i++) {
+        lun = (ubms->next_lun + i) % (ubms->max_lun + 1);
+        l = &ubms->lun[lun];
+        for (req = l->rq_head; req && req->issued == req->count;
+                req = req->next);
+    }
+    if (!req) {
+        return 0;
+    }
+    ubms->next_lun = (lun + 1) % (ubms->max_lun + 1);
+
+    c->lun = lun;
+    c->write = req->write;
+    c->nseg = 0;
+    c->nxact = 0;
+    lba = req->lba + req->issued;
+    max_blocks = UBMS_MAX_XFER / l->block_size;
+    for (; req && total < max_blocks; req = req->next) {
+        if (req->write != c->write || req->lba + req->issued != lba + total) {
             break;
-        default:
-            UBMS_DBG("Unknown CSW status(%u)\n", csw->status);
-            ret = -3;
+        }
+        blocks = MIN(req->count - req->issued, max_blocks - total);
+        len = (size_t)blocks * l->block_size;
+        if (c->nxact + (len + UBMS_XACT_SIZE - 1) / UBMS_XACT_SIZE >
+                UBMS_MAX_XACTS) {
             break;
+        }
+        off = (size_t)req->issued * l->block_size;
+        for (len += off; off < len; off += UBMS_XACT_SIZE) {
+            c->xact[c->nxact].type = c->write ? PID_OUT : PID_IN;
+            c->xact[c->nxact].vaddr = req->buf + off;
+            c->xact[c->nxact].paddr = req->paddr + off;
+            c->xact[c->nxact].len = MIN(len - off, UBMS_XACT_SIZE);
+            c->nxact++;
+        }
+        c->seg[c->nseg].req = req;
+        c->seg[c->nseg].blocks = blocks;
+        c->nseg++;
+        req->issued += blocks;
+        total += blocks;
     }
+    c->len = total * l->block_size;
+
+    cdb_len = ufi_rw_cdb(cdb, c->write, lba, total);
+    usb_storage_fill_cbw(ubms, xact_get_vaddr(&c->cmd), lun, cdb, cdb_len,
+                         c->len, !c->write);
+    memset((struct cbw*)xact_get_vaddr(&c->cmd) + 1, 0, sizeof(struct csw));
+    c->pending = 2;
+    c->err = 0;
+    c->pipe[0].cleared = 0;
+    c->pipe[1].cleared = 0;
+
+    return 1;
+}
 
-    usb_destroy_xact(udev->dman, &xact, 1);
+/*
+ * Hand the command over to the host, a read as the CBW and then the data
+ * followed by the CSW, a write as the CBW followed by the data and then the
+ * CSW.
+ */
+static void
+usb_storage_issue(usb_dev_t udev)
+{
+    struct usb_storage_device *ubms;
+    struct ubms_cmd *c;
+    struct xact out[UBMS_MAX_XACTS + 1], *in;
+    int nout, nin, err;
 
-    return ret;
+    ubms = (struct usb_storage_device*)udev->dev_data;
+    c = &ubms->acmd;
+
+    out[0] = c->cmd;
+    out[0].type = PID_OUT;
+    out[0].len = sizeof(struct cbw);
+    c->xact[c->nxact].type = PID_IN;
+    c->xact[c->nxact].vaddr = (struct cbw*)xact_get_vaddr(&c->cmd) + 1;
+    c->xact[c->nxact].paddr = c->cmd.paddr + sizeof(struct cbw);
+    c->xact[c->nxact].len = sizeof(struct csw);
+    if (c->write) {
+        memcpy(&out[1], c->xact, c->nxact * sizeof(struct xact));
+        nout = c->nxact + 1;
+        in = &c->xact[c->nxact];
+        nin = 1;
+    } else {
+        nout = 1;
+        in = c->xact;
+        nin = c->nxact + 1;
+    }
+
+    err = usbdev_schedule_xact(udev, udev->ep[ubms->ep_out], out, nout,
+                               usb_storage_cmd_cb, &c->pipe[0]);
+    if (err < 0) {
+        usb_storage_cmd_put(&c->pipe[0], 1);
+    }
+    err = usbdev_schedule_xact(udev, udev->ep[ubms->ep_in], in, nin,
+                               usb_storage_cmd_cb, &c->pipe[1]);
+    if (err < 0) {
+        usb_storage_cmd_put(&c->pipe[1], 1);
+    }
+}
+
+/* Hand the bulk endpoints back, to the next queued command if there is one */
+static void
+usb_storage_release(usb_dev_t udev)
+{
+    struct usb_storage_device *ubms;
+    int next;
+
+    ubms = (struct usb_storage_device*)udev->dev_data;
+    usb_mutex_lock(udev->host->hdev.mops, ubms->lock);
+    next = usb_storage_build(ubms);
+    ubms->abusy = next;
+    usb_mutex_unlock(udev->host->hdev.mops, ubms->lock);
+
+    if (next) {
+        usb_storage_issue(udev);
+    }
+}
+
+static int usb_storage_recover_cb(void *token, enum usb_xact_status stat,
+        int rbytes);
+
+/*
+ * Reset recovery after a queued command failed without a valid CSW: the
+ * Bulk-Only Mass Storage Reset, then the halts of bulk IN and bulk OUT are
+ * cleared. Each request is issued from the completion of the one before, and
+ * the queue resumes at the end. The command has no transfers left on the bulk
+ * endpoints, and the SETUP buffers of its pipes are free to carry the
+ * requests. As in usb_storage_reset_recovery(), a failed request does not
+ * stop the others.
+ */
+static void
+usb_storage_recover(usb_dev_t udev)
+{
+    struct usb_storage_device *ubms;
+    struct ubms_cmd *c;
+    struct ubms_pipe *p;
+    struct endpoint *ep;
+    struct usbreq *req;
+    int err;
+
+    ubms = (struct usb_storage_device*)udev->dev_data;
+    c = &ubms->acmd;
+    while (c->recover < 3) {
+        if (c->recover == 0) {
+            p = &c->pipe[0];
+            req = xact_get_vaddr(&p->setup);
+            *req = __get_reset_req(0);
+        } else {
+            p = &c->pipe[c->recover == 1];
+            ep = udev->ep[p->in ? ubms->ep_in : ubms->ep_out];
+            req = xact_get_vaddr(&p->setup);
+            *req = __clear_halt_req(ep->num |
+                                    (ep->dir == EP_DIR_IN ? 0x80 : 0));
+        }
+        c->recover++;
+        err = usbdev_schedule_xact(udev, udev->ep_ctrl, &p->setup, 1,
+                                   usb_storage_recover_cb, udev);
+        if (err >= 0) {
+            return;
+        }
+    }
+
+    usb_storage_release(udev);
+}
+
+static int
+usb_storage_recover_cb(void *token, enum usb_xact_status stat, int rbytes)
+{
+    (void)rbytes;
+    if (stat != XACTSTAT_SUCCESS) {
+        UBMS_DBG("Reset recovery request failed(%d)\n", stat);
+    }
+    usb_storage_recover(token);
+
+    return 0;
+}
+
+/* The command has completed, retire the requests it finished */
+static void
+usb_storage_complete(usb_dev_t udev)
+{
+    struct usb_storage_device *ubms;
+    struct ubms_cmd *c;
+    struct ubms_lun *l;
+    struct ubms_req *done = NULL, *req;
+    int err, i, next, reset;
+
+    ubms = (struct usb_storage_device*)udev->dev_data;
+    c = &ubms->acmd;
+    l = &ubms->lun[c->lun];
+
+    err = c->err ? -1 : usb_storage_check_csw(ubms,
+            (struct csw*)((struct cbw*)xact_get_vaddr(&c->cmd) + 1), c->len);
+    /* Without a valid CSW the device needs reset recovery(BOT 5.3.4) */
+    reset = err < 0;
+    if (!err && ubms->residue) {
+        err = -1;
+    }
+
+    usb_mutex_lock(udev->host->hdev.mops, ubms->lock);
+    for (i = 0; i < c->nseg; i++) {
+        req = c->seg[i].req;
+        req->left -= c->seg[i].blocks;
+        if (err) {
+            req->err = err;
+        }
+    }
+    /* Requests finish in order */
+    while (l->rq_head && !l->rq_head->left) {
+        req = l->rq_head;
+        l->rq_head = req->next;
+        req->next = done;
+        done = req;
+    }
+    if (!l->rq_head) {
+        l->rq_tail = NULL;
+    }
+    if (reset) {
+        /* The bulk endpoints stay taken until the recovery is over */
+        c->recover = 0;
+        next = 0;
+    } else {
+        next = usb_storage_build(ubms);
+        ubms->abusy = next;
+    }
+    usb_mutex_unlock(udev->host->hdev.mops, ubms->lock);
+
+    if (reset) {
+        usb_storage_recover(udev);
+    } else if (next) {
+        usb_storage_issue(udev);
+    }
+
+    /* Newest first on the list, report them oldest first */
+    for (req = NULL; done; ) {
+        struct ubms_req *tmp = done->next;
+        done->next = req;
+        req = done;
+        done = tmp;
+    }
+    while (req) {
+        done = req;
+        req = req->next;
+        ps_dma_unpin(udev->dman, done->buf,
+                     (size_t)done->count * l->block_size);
+        done->cb(done->token, done->err);
+        usb_free(done);
+    }
+}
+
+/* One of the transfers of the command is over, the last one completes it */
+static void
+usb_storage_cmd_put(struct ubms_pipe *p, int err)
+{
+    struct usb_storage_device *ubms;
+    struct ubms_cmd *c;
+
+    ubms = (struct usb_storage_device*)p->udev->dev_data;
+    c = &ubms->acmd;
+    if (err) {
+        c->err = 1;
+    }
+    if (__atomic_sub_fetch(&c->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+        usb_storage_complete(p->udev);
+    }
+}
+
+/* The halt is gone, a stalled IN phase is followed by the CSW once more */
+static int
+usb_storage_halt_cb(void *token, enum usb_xact_status stat, int rbytes)
+{
+    struct ubms_pipe *p = token;
+    struct usb_storage_device *ubms;
+    struct ubms_cmd *c;
+    int err;
+
+    (void)rbytes;
+    ubms = (struct usb_storage_device*)p->udev->dev_data;
+    c = &ubms->acmd;
+    if (stat == XACTSTAT_SUCCESS && p->in) {
+        err = usbdev_schedule_xact(p->udev, p->udev->ep[ubms->ep_in],
+                                   &c->xact[c->nxact], 1,
+                                   usb_storage_cmd_cb, p);
+        if (err >= 0) {
+            return 0;
+        }
+    }
+    usb_storage_cmd_put(p, stat != XACTSTAT_SUCCESS);
+
+    return 0;
+}
+
+/*
+ * A phase stalled(BOT 6.7.2, 6.7.3). Clear the halt without waiting, the
+ * transfer is only over once the CSW has been read.
+ */
+static int
+usb_storage_clear_halt_async(struct ubms_pipe *p)
+{
+    struct usb_storage_device *ubms;
+    struct endpoint *ep;
+    struct usbreq *req;
+    int err;
+
+    ubms = (struct usb_storage_device*)p->udev->dev_data;
+    ep = p->udev->ep[p->in ? ubms->ep_in : ubms->ep_out];
+    req = xact_get_vaddr(&p->setup);
+    *req = __clear_halt_req(ep->num | (ep->dir == EP_DIR_IN ? 0x80 : 0));
+    err = usbdev_schedule_xact(p->udev, p->udev->ep_ctrl, &p->setup, 1,
+                               usb_storage_halt_cb, p);
+
+    return err < 0 ? -1 : 0;
+}
+
+static int
+usb_storage_cmd_cb(void *token, enum usb_xact_status stat, int rbytes)
+{
+    struct ubms_pipe *p = token;
+
+    (void)rbytes;
+    if (stat == XACTSTAT_ERROR && !p->cleared) {
+        p->cleared = 1;
+        if (!usb_storage_clear_halt_async(p)) {
+            return 0;
+        }
+    }
+    usb_storage_cmd_put(p, stat != XACTSTAT_SUCCESS);
 
+    return 0;
 }
 
 /* Exported Interface */
+int usb_storage_submit(usb_dev_t usb_dev, int lun, int write, uint64_t lba,
+		uint32_t count, void *buf, usb_storage_cb_t cb, void *token)
+{
+	struct usb_storage_device *ubms;
+	struct ubms_lun *l;
+	struct ubms_req *req;
+	int issue;
+
+	assert(usb_dev);
+	assert(cb);
+	ubms = (struct usb_storage_device*)usb_dev->dev_data;
+	if (!ubms || lun < 0 || lun > ubms->max_lun) {
+		return -1;
+	}
+	l = &ubms->lun[lun];
+	if (!l->block_size || !count || lba + count > l->nblocks) {
+		return -1;
+	}
+
+	req = usb_malloc(sizeof(struct ubms_req));
+	if (!req) {
+		return -1;
+	}
+	req->write = write;
+	req->lba = lba;
+	req->count = count;
+	req->left = count;
+	req->buf = buf;
+	req->cb = cb;
+	req->token = token;
+	req->paddr = ps_dma_pin(usb_dev->dman, buf,
+				(size_t)count * l->block_size);
+	if (!req->paddr) {
+		usb_free(req);
+		return -1;
+	}
+
+	usb_mutex_lock(usb_dev->host->hdev.mops, ubms->lock);
+	if (l->rq_tail) {
+		l->rq_tail->next = req;
+	} else {
+		l->rq_head = req;
+	}
+	l->rq_tail = req;
+	issue = !ubms->abusy && usb_storage_build(ubms);
+	ubms->abusy |= issue;
+	usb_mutex_unlock(usb_dev->host->hdev.mops, ubms->lock);
+
+	if (issue) {
+		usb_storage_issue(usb_dev);
+	}
+
+	return 0;
+}
+
+
+/*
+ * Every command moves whole blocks, at least one and at most UBMS_MAX_XFER
+ * bytes of them, and the requests are split on block boundaries.
+ */
+static int
+usb_storage_block_size_ok(uint32_t block_size)
+{
+	return block_size && block_size <= UBMS_MAX_XFER &&
+	       !(block_size & (block_size - 1));
+}
+
+/*
+ * Set up every LUN. A LUN without a medium, such as an empty slot of a card
+ * reader, is left with no capacity, the disk is usable as long as one LUN
+ * is.
+ */
 int usb_storage_init_disk(usb_dev_t usb_dev)
 {
-	return ufi_init_disk(usb_dev);
+	struct usb_storage_device *ubms;
+	struct ubms_lun *l;
+	int err, ret = -1;
+
+	ubms = (struct usb_storage_device*)usb_dev->dev_data;
+	for (int lun = 0; lun <= ubms->max_lun; lun++) {
+		l = &ubms->lun[lun];
+		err = ufi_init_disk(usb_dev, lun);
+		if (!err) {
+			err = ufi_read_capacity(usb_dev, lun, &l->nblocks,
+					&l->block_size);
+		}
+		if (!err && !usb_storage_block_size_ok(l->block_size)) {
+			UBMS_DBG("LUN %d: unsupported block size %u\n", lun,
+				 l->block_size);
+			err = -1;
+		}
+		if (err) {
+			UBMS_DBG("LUN %d not ready\n", lun);
+			l->nblocks = 0;
+			l->block_size = 0;
+			continue;
+		}
+		/* Split, the deferred log takes word sized arguments only */
+		UBMS_DBG("LUN %d: 0x%x%08x blocks of %u bytes\n", lun,
+			 (uint32_t)(l->nblocks >> 32), (uint32_t)l->nblocks,
+			 l->block_size);
+		ret = 0;
+	}
+
+	return ret;
 }
-uint32_t usb_storage_get_capacity(usb_dev_t usb_dev)
+
+int usb_storage_get_lun_count(usb_dev_t usb_dev)
 {
-	return ufi_read_capacity(usb_dev);
+	struct usb_storage_device *ubms;
+
+	ubms = (struct usb_storage_device*)usb_dev->dev_data;
+
+	return ubms->max_lun + 1;
 }
 
-int usb_storage_write(usb_dev_t usb_dev, void *buf, int size)
+uint64_t usb_storage_get_capacity(usb_dev_t usb_dev, int lun)
 {
-	return 0;
+	struct usb_storage_device *ubms;
+
+	ubms = (struct usb_storage_device*)usb_dev->dev_data;
+	if (lun < 0 || lun > ubms->max_lun) {
+		return 0;
+	}
+
+	return ubms->lun[lun].nblocks;
 }
 
-int usb_storage_read(usb_dev_t usb_dev, void *buf, int size)
+uint32_t usb_storage_get_block_size(usb_dev_t usb_dev, int lun)
 {
-	return 0;
+	struct usb_storage_device *ubms;
+
+	ubms = (struct usb_storage_device*)usb_dev->dev_data;
+	if (lun < 0 || lun > ubms->max_lun) {
+		return 0;
+	}
+
+	return ubms->lun[lun].block_size;
 }
 
+int usb_storage_read_blocks(usb_dev_t usb_dev, int lun, uint64_t lba,
+		uint32_t count, void *buf)
+{
+	return usb_storage_rw(usb_dev, lun, 0, lba, count, buf);
+}
+
+int usb_storage_write_blocks(usb_dev_t usb_dev, int lun, uint64_t lba,
+		uint32_t count, const void *buf)
+{
+	return usb_storage_rw(usb_dev, lun, 1, lba, count, (void*)buf);
+}
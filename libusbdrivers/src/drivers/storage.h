@@ -13,7 +13,7 @@
 
 #include <usb/drivers/storage.h>
 
-int usb_storage_xfer(usb_dev_t udev, void *cb, size_t cb_len,
+int usb_storage_xfer(usb_dev_t udev, int lun, void *cb, size_t cb_len,
 		 struct xact *data, int ndata, int direction);
 #endif /* _DRIVERS_STORAGE_H_ */
 
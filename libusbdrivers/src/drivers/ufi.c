@@ -25,6 +25,25 @@ struct ufi_cdb {
 	uint16_t reserved;
 } __attribute__((packed));
 
+/*
+ * The CBW carries the length of the command itself, which follows from the
+ * group code in the top bits of its opcode.
+ */
+static size_t ufi_cdb_len(uint8_t opcode)
+{
+	switch (opcode >> 5) {
+	case 0:
+		return 6;
+	case 1:
+	case 2:
+		return 10;
+	case 4:
+		return 16;
+	default:
+		return 12;
+	}
+}
+
 static void ufi_print_info(char *info)
 {
 	int i = 0;
@@ -43,23 +62,20 @@ static void ufi_format_unit()
 	assert(0);
 }
 
-static void ufi_test_unit_ready(usb_dev_t udev)
+static int ufi_test_unit_ready(usb_dev_t udev, int lun)
 {
-	int err;
 	struct ufi_cdb cdb;
-	struct xact data;
 
 	memset(&cdb, 0, sizeof(struct ufi_cdb));
 
 	/* Fill in the command */
 	cdb.opcode = TEST_UNIT_READY;
 
-	err = usb_storage_xfer(udev, &cdb, sizeof(struct ufi_cdb),
+	return usb_storage_xfer(udev, lun, &cdb, ufi_cdb_len(cdb.opcode),
 			NULL, 0, UFI_OUTPUT);
-	assert(!err);
 }
 
-static void ufi_request_sense(usb_dev_t udev)
+static int ufi_request_sense(usb_dev_t udev, int lun)
 {
 	int err;
 	struct ufi_cdb cdb;
@@ -74,14 +90,17 @@ static void ufi_request_sense(usb_dev_t udev)
 	data.type = PID_IN;
 	data.len = 18;
 	err = usb_alloc_xact(udev->dman, &data, 1);
-	assert(!err);
-	err = usb_storage_xfer(udev, &cdb, sizeof(struct ufi_cdb),
+	if (err) {
+		return -1;
+	}
+	err = usb_storage_xfer(udev, lun, &cdb, ufi_cdb_len(cdb.opcode),
 			&data, 1, UFI_INPUT);
-	assert(!err);
 	usb_destroy_xact(udev->dman, &data, 1);
+
+	return err;
 }
 
-static void ufi_inquiry(usb_dev_t udev)
+static int ufi_inquiry(usb_dev_t udev, int lun)
 {
 	int err;
 	struct ufi_cdb cdb;
@@ -96,18 +115,21 @@ static void ufi_inquiry(usb_dev_t udev)
 	data.type = PID_IN;
 	data.len = 36;
 	err = usb_alloc_xact(udev->dman, &data, 1);
-	assert(!err);
+	if (err) {
+		return -1;
+	}
 
-	err = usb_storage_xfer(udev, &cdb, sizeof(struct ufi_cdb),
+	err = usb_storage_xfer(udev, lun, &cdb, ufi_cdb_len(cdb.opcode),
 			&data, 1, UFI_INPUT);
-	assert(!err);
 
 	usb_destroy_xact(udev->dman, &data, 1);
+
+	return err;
 }
 
-static void ufi_prevent_allow_medium_removal(usb_dev_t udev, int enable)
+static int ufi_prevent_allow_medium_removal(usb_dev_t udev, int lun,
+		int enable)
 {
-	int err;
 	struct ufi_cdb cdb;
 
 	memset(&cdb, 0, sizeof(struct ufi_cdb));
@@ -115,38 +137,74 @@ static void ufi_prevent_allow_medium_removal(usb_dev_t udev, int enable)
 	cdb.opcode = ALLOW_REMOVAL;
 	cdb.lba = enable << 8;
 
-	err = usb_storage_xfer(udev, &cdb, sizeof(struct ufi_cdb),
+	return usb_storage_xfer(udev, lun, &cdb, ufi_cdb_len(cdb.opcode),
 			NULL, 0, UFI_OUTPUT);
-	assert(!err);
 }
 
-uint32_t ufi_read_capacity(usb_dev_t udev)
+/* 16 byte commands, for disks beyond 2^32 blocks */
+struct ufi_cdb16 {
+	uint8_t opcode;
+	uint8_t flags;
+	uint64_t lba;
+	uint32_t length;
+	uint8_t group;
+	uint8_t control;
+} __attribute__((packed));
+
+/*
+ * READ CAPACITY returns the last block address and the block size, both big
+ * endian. Disks too large for it report 0xFFFFFFFF, READ CAPACITY(16) has
+ * the full address.
+ */
+int ufi_read_capacity(usb_dev_t udev, int lun, uint64_t *nblocks,
+		uint32_t *block_size)
 {
 	int err;
-	uint32_t ret;
 	struct ufi_cdb cdb;
+	struct ufi_cdb16 cdb16;
 	struct xact data;
+	uint32_t *cap;
 
 	memset(&cdb, 0, sizeof(struct ufi_cdb));
 
 	cdb.opcode = READ_CAPACITY;
 
 	data.type = PID_IN;
-	data.len = 8;
+	data.len = 32;
 	err = usb_alloc_xact(udev->dman, &data, 1);
-	assert(!err);
+	if (err) {
+		return -1;
+	}
+	cap = data.vaddr;
 
-	err = usb_storage_xfer(udev, &cdb, sizeof(struct ufi_cdb),
+	data.len = 8;
+	err = usb_storage_xfer(udev, lun, &cdb, ufi_cdb_len(cdb.opcode),
 				&data, 1, UFI_INPUT);
-	assert(!err);
+	if (!err && cap[0] == 0xFFFFFFFF) {
+		memset(&cdb16, 0, sizeof(struct ufi_cdb16));
+		cdb16.opcode = SERVICE_ACTION_IN;
+		cdb16.flags = READ_CAPACITY_16;
+		cdb16.length = __builtin_bswap32(32);
+
+		data.len = 32;
+		err = usb_storage_xfer(udev, lun, &cdb16,
+				ufi_cdb_len(cdb16.opcode), &data, 1, UFI_INPUT);
+		if (!err) {
+			*nblocks = __builtin_bswap64(*(uint64_t*)cap) + 1;
+			*block_size = __builtin_bswap32(cap[2]);
+		}
+	} else if (!err) {
+		*nblocks = (uint64_t)__builtin_bswap32(cap[0]) + 1;
+		*block_size = __builtin_bswap32(cap[1]);
+	}
 
-	ret = *(uint32_t*)data.vaddr;
+	data.len = 32;
 	usb_destroy_xact(udev->dman, &data, 1);
 
-	return ret;
+	return err;
 }
 
-static void ufi_mode_sense(usb_dev_t udev)
+static int ufi_mode_sense(usb_dev_t udev, int lun)
 {
 	int err;
 	struct ufi_cdb cdb;
@@ -161,81 +219,76 @@ static void ufi_mode_sense(usb_dev_t udev)
 	data.type = PID_IN;
 	data.len = 192;
 	err = usb_alloc_xact(udev->dman, &data, 1);
-	assert(!err);
+	if (err) {
+		return -1;
+	}
 
-	err = usb_storage_xfer(udev, &cdb, sizeof(struct ufi_cdb),
+	err = usb_storage_xfer(udev, lun, &cdb, ufi_cdb_len(cdb.opcode),
 				&data, 1, UFI_INPUT);
-	assert(!err);
 
 	usb_destroy_xact(udev->dman, &data, 1);
+
+	return err;
 }
 
-static void ufi_read10(usb_dev_t udev, uint32_t lba, uint16_t count)
+/*
+ * Fill @cdb with a READ or WRITE of @count blocks starting at @lba and return
+ * its length. READ(10) and WRITE(10) are used whenever they can address the
+ * request, @cdb must have room for 16 bytes.
+ */
+int ufi_rw_cdb(void *cdb, int write, uint64_t lba, uint32_t count)
 {
-	int err;
-	struct ufi_cdb cdb;
-	struct xact data;
-
-	memset(&cdb, 0, sizeof(struct ufi_cdb));
+	struct ufi_cdb *cdb10 = cdb;
+	struct ufi_cdb16 *cdb16 = cdb;
 
-	cdb.opcode = READ_10;
-	cdb.lba = __builtin_bswap32(lba);
-	cdb.length = __builtin_bswap16(count) << 8;
+	if (lba + count <= 0x100000000ULL && count <= 0xFFFF) {
+		memset(cdb10, 0, sizeof(struct ufi_cdb));
+		cdb10->opcode = write ? WRITE_10 : READ_10;
+		cdb10->lba = __builtin_bswap32(lba);
+		cdb10->length = __builtin_bswap16(count) << 8;
 
-	data.type = PID_IN;
-	data.len = 512 * count;
-
-	err = usb_alloc_xact(udev->dman, &data, 1);
-	assert(!err);
+		return ufi_cdb_len(cdb10->opcode);
+	}
 
-	err = usb_storage_xfer(udev, &cdb, sizeof(struct ufi_cdb),
-				&data, 1, UFI_INPUT);
-	assert(!err);
+	memset(cdb16, 0, sizeof(struct ufi_cdb16));
+	cdb16->opcode = write ? WRITE_16 : READ_16;
+	cdb16->lba = __builtin_bswap64(lba);
+	cdb16->length = __builtin_bswap32(count);
 
-	usb_destroy_xact(udev->dman, &data, 1);
+	return ufi_cdb_len(cdb16->opcode);
 }
 
-static void ufi_read12(usb_dev_t udev, uint32_t lba, uint32_t count)
+/* Move @count blocks starting at @lba through the @data phase */
+int ufi_read_write(usb_dev_t udev, int lun, int write, uint64_t lba,
+		uint32_t count, struct xact *data, int ndata)
 {
-	int err;
-	struct ufi_cdb cdb;
-	struct xact data;
-
-	memset(&cdb, 0, sizeof(struct ufi_cdb));
-
-	cdb.opcode = READ_12;
-	cdb.lba = __builtin_bswap32(lba);
-	cdb.length = __builtin_bswap16(count);
-
-	data.type = PID_IN;
-	data.len = 512 * count;
+	char cdb[sizeof(struct ufi_cdb16)];
+	int len;
 
-	err = usb_alloc_xact(udev->dman, &data, 1);
-	assert(!err);
-
-	err = usb_storage_xfer(udev, &cdb, sizeof(struct ufi_cdb),
-				&data, 1, UFI_INPUT);
-	assert(!err);
+	len = ufi_rw_cdb(cdb, write, lba, count);
 
-	usb_destroy_xact(udev->dman, &data, 1);
+	return usb_storage_xfer(udev, lun, cdb, len, data, ndata,
+			write ? UFI_OUTPUT : UFI_INPUT);
 }
 
+/*
+ * The set up commands may fail on a device that is not ready yet, only a
+ * transport error is fatal for them.
+ */
 int
-ufi_init_disk(usb_dev_t udev)
+ufi_init_disk(usb_dev_t udev, int lun)
 {
-	ufi_inquiry(udev);
-	ufi_test_unit_ready(udev);
-
-	ufi_request_sense(udev);
-	ufi_test_unit_ready(udev);
-
-	ufi_read_capacity(udev);
-	ufi_mode_sense(udev);
-	ufi_test_unit_ready(udev);
-
-	ufi_prevent_allow_medium_removal(udev, 0);
-	ufi_request_sense(udev);
-	ufi_test_unit_ready(udev);
+	if (ufi_inquiry(udev, lun) < 0 ||
+	    ufi_test_unit_ready(udev, lun) < 0 ||
+	    ufi_request_sense(udev, lun) < 0 ||
+	    ufi_test_unit_ready(udev, lun) < 0 ||
+	    ufi_mode_sense(udev, lun) < 0 ||
+	    ufi_test_unit_ready(udev, lun) < 0 ||
+	    ufi_prevent_allow_medium_removal(udev, lun, 0) < 0 ||
+	    ufi_request_sense(udev, lun) < 0 ||
+	    ufi_test_unit_ready(udev, lun) < 0) {
+		return -1;
+	}
 
 	return 0;
 }
@@ -32,5 +32,14 @@
 #define READ_12            0xA8
 #define WRITE_12           0xAA
 
-int ufi_init_disk(usb_dev_t udev);
-uint32_t ufi_read_capacity(usb_dev_t udev);
+#define READ_16            0x88
+#define WRITE_16           0x8A
+#define SERVICE_ACTION_IN  0x9E
+#define READ_CAPACITY_16   0x10 /* SERVICE ACTION IN(16) action */
+
+int ufi_init_disk(usb_dev_t udev, int lun);
+int ufi_read_capacity(usb_dev_t udev, int lun, uint64_t *nblocks,
+		uint32_t *block_size);
+int ufi_rw_cdb(void *cdb, int write, uint64_t lba, uint32_t count);
+int ufi_read_write(usb_dev_t udev, int lun, int write, uint64_t lba,
+		uint32_t count, struct xact *data, int ndata);
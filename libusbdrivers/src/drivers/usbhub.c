@@ -23,31 +23,16 @@
 
 #define HUB_ENABLE_IRQS
 
-#define HUB_DEBUG
-//#define HUBEM_DEBUG
+#define HUB_DBG(h, fmt, ...)                                            \
+        do {                                                            \
+            usb_hub_t _hub = h;                                         \
+            usb_log(USB_LOG_HUB, USB_LOG_DEBUG, "HUB %2d: " fmt,        \
+                    _hub ? _hub->udev->addr : 0, ##__VA_ARGS__);        \
+        } while (0)
 
-#ifdef HUB_DEBUG
-#define dprintf(...) printf(__VA_ARGS__)
-#else
-#define dprintf(...) do{}while(0)
-#endif
-
-#define HUB_DBG(h, ...)                                 \
-        do {                                            \
-            usb_hub_t hub = h;                          \
-            if(hub){                                    \
-                dprintf("HUB %2d: ", hub->udev->addr);  \
-            }else{                                      \
-                dprintf("HUB  ?: ");                    \
-            }                                           \
-            dprintf(__VA_ARGS__);                       \
-        }while(0)
-
-#ifdef HUBEM_DEBUG
-#define DHUBEM(...) printf("HUBEM   :" __VA_ARGS__)
-#else
-#define DHUBEM(...) do{}while(0)
-#endif
+/* The root hub emulation runs on every root hub transfer */
+#define DHUBEM(fmt, ...) \
+        usb_log(USB_LOG_HUB, USB_LOG_TRACE, "HUBEM   :" fmt, ##__VA_ARGS__)
 
 
 
@@ -195,170 +180,433 @@ struct usb_hubem {
 };
 
 
+/*
+ * Port enumeration
+ *
+ * Every port runs its own little state machine, timers are deadlines on a
+ * millisecond clock derived from the host frame counter, so debouncing and
+ * resets of all ports of all hubs overlap. The only thing that must be
+ * serialised across the bus is the window between a port reset and
+ * SET_ADDRESS, when the new device answers on address 0. The descriptor
+ * reads of one device run while the next port is being reset.
+ *
+ * Nothing here waits. A status change reported by a hub, or a timer event
+ * from usb_hub_poll(), runs one pass in which each port moves at most one
+ * step, and returns.
+ */
+
+/* USB 2.0 9.1.2, 7.1.7.3 */
+#define HUB_DEBOUNCE_MS      100
+/* USB 2.0 7.1.7.5, the hub ends the reset, we poll for it */
+#define HUB_RESET_MS         10
+#define HUB_RESET_TIMEOUT_MS 500
+/* USB 2.0 9.2.6.3 */
+#define HUB_ADDRESS_MS       2
+#define HUB_PORT_RETRIES     3
+
+struct hub_enum {
+    usb_t* host;
+    int frame;             // Last frame number seen, -1 if the host has none
+    uint32_t now;          // Milliseconds, starts at 1 as 0 means not armed
+    int addr0_hub;         // Address of the hub that owns address 0, or -1
+    int addr0_port;
+    int restart;           // The device list changed under us
+    int again;             // An event arrived, another pass is due
+    int busy;              // A port was still settling after the last pass
+};
+
+static void
+hub_clock_update(struct hub_enum* e)
+{
+    int frame;
+
+    if (e->frame < 0) {
+        /* No frame counter, every pass counts as a millisecond */
+        e->now++;
+        return;
+    }
+    frame = usb_hcd_get_frame_number(&e->host->hdev);
+    e->now += (frame - e->frame) & USB_FRAME_MASK;
+    e->frame = frame;
+}
+
 static void
-_handle_port_change(usb_hub_t h, int port)
+hub_port_arm(struct hub_enum* e, struct usb_hub_port* p, int ms)
+{
+    p->deadline = e->now + ms;
+}
+
+static int
+hub_port_due(struct hub_enum* e, struct usb_hub_port* p)
+{
+    return (int32_t)(e->now - p->deadline) >= 0;
+}
+
+static void
+hub_addr0_release(usb_hub_t h, int port, struct hub_enum* e)
+{
+    if (e->addr0_hub == h->udev->addr && e->addr0_port == port) {
+        e->addr0_hub = -1;
+    }
+}
+
+/* Issue a hub class request, with an optional IN data stage */
+static int
+hub_request(usb_hub_t h, struct usbreq* r, void* buf, int len)
 {
     struct xact xact[2];
-    struct usbreq *req;
-    struct port_status* sts;
-    uint16_t status, change;
-    int ret;
-    assert(sizeof(unsigned short) == 2);
+    int nxact = len ? 2 : 1;
+    int err;
 
-    HUB_DBG(h, "Handle status change port %d\n", port);
-    /* Setup packet */
     xact[0].type = PID_SETUP;
-    xact[0].len = sizeof(*req);
+    xact[0].len = sizeof(*r);
     xact[1].type = PID_IN;
-    xact[1].len = sizeof(*sts);
+    xact[1].len = len;
+    err = usb_alloc_xact(h->udev->dman, xact, nxact);
+    if (err) {
+        return -1;
+    }
+    memcpy(xact_get_vaddr(&xact[0]), r, sizeof(*r));
+    err = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl, xact, nxact,
+                               NULL, NULL);
+    if (err >= 0 && len) {
+        memcpy(buf, xact_get_vaddr(&xact[1]), len);
+    }
+    usb_destroy_xact(h->udev->dman, xact, nxact);
+    return (err < 0) ? -1 : 0;
+}
 
-    /* FIXME: Memory leak, no usb_destroy_xact in this function */
-    ret = usb_alloc_xact(h->udev->dman, xact, 2);
-    assert(!ret);
-    req = xact_get_vaddr(&xact[0]);
-    sts = xact_get_vaddr(&xact[1]);
+/* Read the port status and acknowledge every change it reports */
+static int
+hub_port_status(usb_hub_t h, int port, uint16_t* status, uint16_t* change)
+{
+    struct port_status sts;
+    struct usbreq r;
+    int f;
 
+    r = __get_port_status_req(port);
+    if (hub_request(h, &r, &sts, sizeof(sts))) {
+        HUB_DBG(h, "Failed to read the status of port %d\n", port);
+        return -1;
+    }
+    *status = sts.wPortStatus;
+    *change = sts.wPortChange;
+    /* C_PORT_x is PORT_x + 16 for the features with a change bit */
+    for (f = PORT_CONNECTION; f <= PORT_RESET; f++) {
+        if (*change & BIT(f)) {
+            r = __clear_port_feature_req(port, C_PORT_CONNECTION + f);
+            if (hub_request(h, &r, NULL, 0)) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
 
-    /* get the associated ports status change */
-    if (port == 0) {
-        *req = __get_hub_status_req();
+/* The connection changed, drop what we had and start over */
+static void
+hub_port_connect(usb_hub_t h, int port, struct hub_enum* e, uint16_t status)
+{
+    struct usb_hub_port* p = &h->port[port - 1];
+
+    hub_addr0_release(h, port, e);
+    if (p->udev) {
+        HUB_DBG(h, "port %d disconnected\n", port);
+        usbdev_disconnect(p->udev);
+        p->udev = NULL;
+        e->restart = 1;
+    }
+    p->retries = 0;
+    if (status & BIT(PORT_CONNECTION)) {
+        HUB_DBG(h, "port %d connected\n", port);
+        p->state = HUB_PORT_DEBOUNCE;
+        hub_port_arm(e, p, HUB_DEBOUNCE_MS);
     } else {
-        *req = __get_port_status_req(port);
+        p->state = HUB_PORT_IDLE;
+        p->deadline = 0;
     }
-    HUB_DBG(h, "Getting status for port %d\n", port);
-    ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl, xact, 2, NULL, NULL);
-    assert(ret >= 0);
-    change = sts->wPortChange;
-    status = sts->wPortStatus;
+}
 
-    if (port == 0) {
-        /* HUB */
-        assert(0);
+static void
+hub_port_failed(usb_hub_t h, int port, struct hub_enum* e)
+{
+    struct usb_hub_port* p = &h->port[port - 1];
+
+    hub_addr0_release(h, port, e);
+    p->udev = NULL;
+    if (++p->retries < HUB_PORT_RETRIES) {
+        HUB_DBG(h, "Failed to initialise new device on port %d, retrying\n",
+                port);
+        p->state = HUB_PORT_RESET_WAIT;
+        hub_port_arm(e, p, HUB_RESET_MS);
     } else {
-        HUB_DBG(h, "Status change (0x%x) on port %d:\n",
-                change, port);
-        if (change & BIT(PORT_CONNECTION)) {
-            change &= ~BIT(PORT_CONNECTION);
-            /* Clear the change flag */
-            *req = __clear_port_feature_req(port,
-                                            C_PORT_CONNECTION);
-            ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-                                       xact, 1, NULL, NULL);
-            assert(ret >= 0);
-            if (status & BIT(PORT_CONNECTION)) {
-                HUB_DBG(h, "port %d connected\n", port);
-                /* USB spec 9.1.2 */
-                msdelay(100);
-                assert(ret >= 0);
-                /* reset the port to enable it */
-                HUB_DBG(h, "Resetting port %d\n", port);
-                *req = __set_port_feature_req(port, PORT_RESET);
-                ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-                                           xact, 1, NULL, NULL);
-                assert(ret >= 0);
-                if (!ret) {
-                    /* Reset changes the status so call again */
-                    return _handle_port_change(h, port);
-                }
-            } else {
-                /* Disconnect */
-                HUB_DBG(h, "port %d disconnected\n", port);
-                *req = __set_port_feature_req(port, PORT_SUSPEND);
-                ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-                                           xact, 1, NULL, NULL);
-                assert(ret >= 0);
-                if (h->port[port - 1].udev) {
-                    usbdev_disconnect(h->port[port - 1].udev);
-                    h->port[port - 1].udev = NULL;
-                }
-                return;
-            }
-        }
-        if (change & BIT(PORT_ENABLE)) {
-            HUB_DBG(h, "%sabled\n", (status & BIT(PORT_ENABLE)) ?
-                    "en" : "dis");
-            change &= ~PORT_ENABLE;
-            *req = __clear_port_feature_req(port,
-                                            C_PORT_ENABLE);
-            ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-                                       xact, 1, NULL, NULL);
-            assert(ret >= 0);
+        usb_log(USB_LOG_HUB, USB_LOG_WARN,
+                "HUB %2d: Giving up on the device on port %d\n",
+                h->udev->addr, port);
+        p->state = HUB_PORT_IDLE;
+        p->deadline = 0;
+    }
+}
+
+/* Reset finished, the device answers on address 0 */
+static void
+hub_port_reset_done(usb_hub_t h, int port, struct hub_enum* e,
+                    uint16_t status)
+{
+    struct usb_hub_port* p = &h->port[port - 1];
+    enum usb_speed speed;
+    int err;
+
+    if (!(status & BIT(PORT_ENABLE))) {
+        hub_port_failed(h, port, e);
+        return;
+    }
+    if (status & BIT(PORT_HIGH_SPEED)) {
+        speed = USBSPEED_HIGH;
+    } else if (status & BIT(PORT_LOW_SPEED)) {
+        speed = USBSPEED_LOW;
+    } else {
+        speed = USBSPEED_FULL;
+    }
+    err = usb_new_device_address(h->udev, port, speed, &p->udev);
+    if (err) {
+        hub_port_failed(h, port, e);
+        return;
+    }
+    /* Someone else may use address 0 while this device settles */
+    hub_addr0_release(h, port, e);
+    p->state = HUB_PORT_ADDRESS;
+    hub_port_arm(e, p, HUB_ADDRESS_MS);
+}
+
+/* Act on a fresh status sample */
+static void
+hub_port_update(usb_hub_t h, int port, struct hub_enum* e,
+                uint16_t status, uint16_t change)
+{
+    struct usb_hub_port* p = &h->port[port - 1];
+
+    if (change & BIT(PORT_ENABLE)) {
+        HUB_DBG(h, "port %d %sabled\n", port,
+                (status & BIT(PORT_ENABLE)) ? "en" : "dis");
+    }
+    if (change & BIT(PORT_SUSPEND)) {
+        HUB_DBG(h, "port %d %s\n", port,
+                (status & BIT(PORT_SUSPEND)) ? "suspended" : "resumed");
+    }
+    if (change & BIT(PORT_OVER_CURRENT)) {
+        HUB_DBG(h, "port %d over current %s\n", port,
+                (status & BIT(PORT_OVER_CURRENT)) ? "detected" : "removed");
+    }
+    if (change & BIT(PORT_CONNECTION)) {
+        hub_port_connect(h, port, e, status);
+        return;
+    }
+
+    switch (p->state) {
+    case HUB_PORT_POWER:
+        if (hub_port_due(e, p)) {
+            hub_port_connect(h, port, e, status);
         }
-        if (change & BIT(PORT_SUSPEND)) {
-            HUB_DBG(h, "%s\n", (status & BIT(PORT_SUSPEND)) ?
-                    "suspended" : "resumed");
-            change &= ~BIT(PORT_SUSPEND);
-            *req = __clear_port_feature_req(port,
-                                            C_PORT_SUSPEND);
-            ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-                                       xact, 1, NULL, NULL);
-            assert(ret >= 0);
+        break;
+    case HUB_PORT_DEBOUNCE:
+        if (!hub_port_due(e, p)) {
+            break;
         }
-        if (change & BIT(PORT_OVER_CURRENT)) {
-            HUB_DBG(h, "over current %s\n",
-                    (status & BIT(PORT_OVER_CURRENT)) ?
-                    "detected" : "removed");
-            change &= ~BIT(PORT_OVER_CURRENT);
-            *req = __clear_port_feature_req(port,
-                                            C_PORT_OVER_CURRENT);
-            ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-                                       xact, 1, NULL, NULL);
-            assert(ret >= 0);
+        if (status & BIT(PORT_CONNECTION)) {
+            p->state = HUB_PORT_RESET_WAIT;
+            p->deadline = 0;
+        } else {
+            hub_port_connect(h, port, e, status);
         }
+        break;
+    case HUB_PORT_RESET:
         if (change & BIT(PORT_RESET)) {
-            HUB_DBG(h, "reset %s\n", (status & BIT(PORT_RESET)) ?
-                    "" : "released");
-            change &= ~BIT(PORT_RESET);
-            *req = __clear_port_feature_req(port, C_PORT_RESET);
-            ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-                                       xact, 1, NULL, NULL);
-            assert(ret >= 0);
-            /* Was the reset part of the init process? */
-            if (status & BIT(PORT_CONNECTION)) {
-                enum usb_speed speed;
-                usb_dev_t new_dev;
-                usb_hub_t new_hub;
-                assert(status & BIT(PORT_ENABLE));
-
-                /* Create the new device */
-                if (status & BIT(PORT_HIGH_SPEED)) {
-                    speed = USBSPEED_HIGH;
-                } else if (status & BIT(PORT_LOW_SPEED)) {
-                    speed = USBSPEED_LOW;
-                } else {
-                    speed = USBSPEED_FULL;
+            hub_port_reset_done(h, port, e, status);
+        } else if (e->now - p->started > HUB_RESET_TIMEOUT_MS) {
+            HUB_DBG(h, "port %d reset timed out\n", port);
+            hub_port_failed(h, port, e);
+        } else if (hub_port_due(e, p)) {
+            hub_port_arm(e, p, 1);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+/* Advance one port by a step, if it has an event */
+static void
+hub_port_step(usb_hub_t h, int port, struct hub_enum* e)
+{
+    struct usb_hub_port* p = &h->port[port - 1];
+    struct usbreq r;
+    uint16_t status, change;
+    int err;
+
+    if (p->changed) {
+        p->changed = 0;
+        if (hub_port_status(h, port, &status, &change) == 0) {
+            hub_port_update(h, port, e, status, change);
+        }
+        return;
+    }
+    if (p->state == HUB_PORT_IDLE || p->state == HUB_PORT_RUNNING) {
+        return;
+    }
+    if (p->state == HUB_PORT_POWER && p->deadline == 0) {
+        hub_port_arm(e, p, h->power_good_delay_ms);
+        return;
+    }
+    if (!hub_port_due(e, p)) {
+        return;
+    }
+
+    switch (p->state) {
+    case HUB_PORT_POWER:
+    case HUB_PORT_DEBOUNCE:
+    case HUB_PORT_RESET:
+        if (hub_port_status(h, port, &status, &change) == 0) {
+            hub_port_update(h, port, e, status, change);
+        }
+        return;
+    case HUB_PORT_RESET_WAIT:
+        if (e->addr0_hub >= 0) {
+            return;
+        }
+        e->addr0_hub = h->udev->addr;
+        e->addr0_port = port;
+        HUB_DBG(h, "Resetting port %d\n", port);
+        r = __set_port_feature_req(port, PORT_RESET);
+        if (hub_request(h, &r, NULL, 0)) {
+            hub_port_failed(h, port, e);
+            return;
+        }
+        p->state = HUB_PORT_RESET;
+        p->started = e->now;
+        hub_port_arm(e, p, HUB_RESET_MS);
+        return;
+    case HUB_PORT_ADDRESS:
+        err = usb_new_device_setup(p->udev);
+        if (err) {
+            /* The device has been released */
+            hub_port_failed(h, port, e);
+        } else {
+            usb_hub_t new_hub;
+            p->state = HUB_PORT_RUNNING;
+            p->deadline = 0;
+            /* See if we can bind a hub, its ports join the next walk */
+            usb_hub_driver_bind(p->udev, &new_hub);
+            e->restart = 1;
+        }
+        return;
+    default:
+        return;
+    }
+}
+
+static int
+hub_port_busy(struct usb_hub_port* p)
+{
+    return p->changed ||
+           (p->state != HUB_PORT_IDLE && p->state != HUB_PORT_RUNNING);
+}
+
+/* A hub that has been bound, as opposed to one being bound right now */
+static usb_hub_t
+hub_of(usb_dev_t udev)
+{
+    usb_hub_t h;
+
+    if (udev->class != USB_CLASS_HUB || udev->dev_data == NULL) {
+        return NULL;
+    }
+    h = (usb_hub_t)udev->dev_data;
+    return h->port ? h : NULL;
+}
+
+/* Drop the claim on address 0 if its hub has gone */
+static void
+hub_addr0_check(struct hub_enum* e)
+{
+    usb_dev_t d;
+    usb_hub_t h;
+
+    if (e->addr0_hub < 0) {
+        return;
+    }
+    d = usb_get_device(e->host, e->addr0_hub);
+    h = d ? hub_of(d) : NULL;
+    if (h == NULL || e->addr0_port > h->nports ||
+            h->port[e->addr0_port - 1].state != HUB_PORT_RESET) {
+        e->addr0_hub = -1;
+    }
+}
+
+/*
+ * Step every port of every hub on the host once. A port that finished a
+ * step without waiting, or a changed device list, gets another pass right
+ * away, anything waiting for a timer or a status change is left for the
+ * next event. Returns non-zero while a port is still settling.
+ */
+static int
+hub_enumerate(usb_t* host)
+{
+    struct hub_enum* e = host->hub_enum;
+    enum usb_hub_port_state old;
+    struct usb_hub_port* p;
+    usb_dev_t d;
+    usb_hub_t h;
+    int busy, work;
+    int addr, i;
+
+    __atomic_store_n(&e->again, 1, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&e->again, __ATOMIC_ACQUIRE)) {
+        if (__atomic_exchange_n(&host->enumerating, 1, __ATOMIC_ACQUIRE)) {
+            /* The running pass picks up the new work */
+            return 1;
+        }
+        while (__atomic_exchange_n(&e->again, 0, __ATOMIC_ACQ_REL)) {
+            do {
+                busy = 0;
+                work = 0;
+                e->restart = 0;
+                hub_clock_update(e);
+                for (addr = 1; addr <= USB_NDEVICES && !e->restart; addr++) {
+                    d = usb_get_device(host, addr);
+                    h = d ? hub_of(d) : NULL;
+                    if (h == NULL) {
+                        continue;
+                    }
+                    for (i = 1; i <= h->nports && !e->restart; i++) {
+                        p = &h->port[i - 1];
+                        old = p->state;
+                        hub_port_step(h, i, e);
+                        work |= p->state != old;
+                        busy |= hub_port_busy(p);
+                    }
                 }
-                ret = usb_new_device(h->udev, port, speed, &new_dev);
-                if (ret) {
-                    HUB_DBG(h, "Failed to initialise new device"
-                            " on port %d\n", port);
-                    HUB_DBG(h, "Resetting port %d\n", port);
-                    msdelay(10);
-                    *req = __set_port_feature_req(port, PORT_RESET);
-                    ret = usbdev_schedule_xact(h->udev, h->udev->ep_ctrl,
-                                               xact, 1, NULL, NULL);
-                    assert(ret >= 0);
-                    printf("Scheduled!\n");
-                    return _handle_port_change(h, port);
-                } else {
-                    h->port[port - 1].udev = new_dev;
-                    /* See if we can bind a hub */
-                    usb_hub_driver_bind(new_dev, &new_hub);
+                if (e->restart) {
+                    /* A hub may have gone, don't let it hold address 0 */
+                    hub_addr0_check(e);
+                    busy = 1;
                 }
-		return;
-            }
+            } while (e->restart || (busy && work));
+            e->busy = busy;
         }
-        if (change) {
-            HUB_DBG(h, "Unhandled port change 0x%x\n", change);
-        }
-        assert(ret >= 0);
+        __atomic_store_n(&host->enumerating, 0, __ATOMIC_RELEASE);
+    }
+    return e->busy;
+}
 
-	/*
-	 * FIXME: A hack to force serializing device enumeration, this function
-	 * needs rewrite.
-	 */
-	_handle_port_change(h, port);
+int
+usb_hub_poll(usb_t* host)
+{
+    assert(host);
+    if (host->hub_enum == NULL || !host->hub_enum->busy) {
+        return 0;
     }
+    return hub_enumerate(host);
 }
 
 static int
@@ -389,7 +637,11 @@ hub_irq_handler(void* token, enum usb_xact_status stat, int bytes_remaining)
         for (j = 0; j < 8; j++) {
             if ((1 << j) & intbm[i]) {
                 int port = i * 8 + j;
-                _handle_port_change(h, port);
+                if (port == 0) {
+                    HUB_DBG(h, "Hub status change ignored\n");
+                } else if (port <= h->nports) {
+                    h->port[port - 1].changed = 1;
+                }
                 handled++;
             }
         }
@@ -401,6 +653,9 @@ hub_irq_handler(void* token, enum usb_xact_status stat, int bytes_remaining)
 
     usbdev_schedule_xact(h->udev, h->udev->ep[0],
                          &h->int_xact, 1, &hub_irq_handler, h);
+    if (handled) {
+        hub_enumerate(h->udev->host);
+    }
     return 0;
 }
 
@@ -457,6 +712,22 @@ usb_hub_driver_bind(usb_dev_t udev, usb_hub_t* hub)
     h->udev = udev;
     udev->dev_data = (struct udev_priv*)h;
 
+    /* The root hub sets up enumeration for the whole host */
+    if (udev->host->hub_enum == NULL) {
+        struct hub_enum* e = usb_malloc(sizeof(*e));
+        if (e == NULL) {
+            usb_free(h);
+            udev->dev_data = NULL;
+            return -2;
+        }
+        e->host = udev->host;
+        e->frame = usb_hcd_get_frame_number(&udev->host->hdev);
+        e->now = 1;
+        e->addr0_hub = -1;
+        e->addr0_port = 0;
+        udev->host->hub_enum = e;
+    }
+
     /* Get hub descriptor for nports and power delay */
     HUB_DBG(h, "Get hub descriptor\n");
     xact[0].type = PID_SETUP;
@@ -518,14 +789,11 @@ usb_hub_driver_bind(usb_dev_t udev, usb_hub_t* hub)
 			xact, 1, NULL, NULL);
         assert(err >= 0);
     }
-    msdelay(h->power_good_delay_ms);
     usb_destroy_xact(udev->dman, xact, 1);
-#if !defined(HUB_ENABLE_IRQS)
-    /* Setup ports */
-    for (i = 1; i <= h->nports; i++) {
-        _handle_port_change(h, i);
+    /* The ports are probed once power is good */
+    for (i = 0; i < h->nports; i++) {
+        h->port[i].state = HUB_PORT_POWER;
     }
-#endif
 #if defined(HUB_ENABLE_IRQS)
     h->int_xact.type = PID_IN;
     /*
@@ -549,6 +817,8 @@ usb_hub_driver_bind(usb_dev_t udev, usb_hub_t* hub)
     (void)hub_irq_handler;
 #endif
     *hub = h;
+    /* Power good timers start now, or in the pass that found this hub */
+    hub_enumerate(udev->host);
 
     return 0;
 }
@@ -558,7 +828,13 @@ usb_hub_driver_bind(usb_dev_t udev, usb_hub_t* hub)
  *** Hub emulation ***
  *********************/
 
-static struct device_desc _hub_device_desc = {
+/*
+ * The descriptor templates are shared by all root hubs and must stay
+ * read-only, hosts may be driven by different threads. Per hub fields are
+ * patched in the copy handed back to the caller.
+ */
+
+static const struct device_desc _hub_device_desc = {
     .bLength = sizeof(struct device_desc),
     .bDescriptorType = DEVICE,
     .bcdUSB = 0x200,
@@ -575,7 +851,7 @@ static struct device_desc _hub_device_desc = {
     .bNumConfigurations = 1
 };
 
-static struct iface_desc _hub_iface_desc = {
+static const struct iface_desc _hub_iface_desc = {
     .bLength = sizeof(_hub_iface_desc),
     .bDescriptorType = INTERFACE,
     .bInterfaceNumber = 0,
@@ -587,7 +863,7 @@ static struct iface_desc _hub_iface_desc = {
     .iInterface = 0
 };
 
-static struct endpoint_desc _hub_endpoint_desc = {
+static const struct endpoint_desc _hub_endpoint_desc = {
     .bLength = sizeof(_hub_endpoint_desc),
     .bDescriptorType = ENDPOINT,
     .bEndpointAddress = 0x81,
@@ -596,7 +872,7 @@ static struct endpoint_desc _hub_endpoint_desc = {
     .bInterval = 0xc
 };
 
-static struct config_desc _hub_config_desc = {
+static const struct config_desc _hub_config_desc = {
     .bLength = sizeof(_hub_config_desc),
     .bDescriptorType = CONFIGURATION,
     .wTotalLength = sizeof(_hub_config_desc) +
@@ -609,7 +885,7 @@ static struct config_desc _hub_config_desc = {
     .bMaxPower = 100/*mA*/ / 2
 };
 
-static struct hub_desc _hub_hub_desc = {
+static const struct hub_desc _hub_hub_desc = {
     .bDescLength = 0x8,
     .bDescriptorType = DESCRIPTOR_TYPE_HUB,
     .bNbrPorts = 2,
@@ -634,21 +910,23 @@ hubem_get_descriptor(usb_hubem_t dev, struct usbreq* req, void* buf, int len)
     }
     case DESCRIPTOR_TYPE_HUB: {
         struct hub_desc* ret = (struct hub_desc*)buf;
+        struct hub_desc desc = _hub_hub_desc;
         int nregs = (dev->hubem_nports + 7) / 8;
         int i;
         DHUBEM("Get hub type descriptor\n");
-        _hub_hub_desc.bNbrPorts = dev->hubem_nports;
-        _hub_hub_desc.bPwrOn2PwrGood = dev->pwr_delay_ms / 2;
-        _hub_hub_desc.bDescLength = 7 + nregs * 2;
+        desc.bNbrPorts = dev->hubem_nports;
+        desc.bPwrOn2PwrGood = dev->pwr_delay_ms / 2;
+        desc.bDescLength = 7 + nregs * 2;
         for (i = 0; i < nregs; i++) {
-            _hub_hub_desc.portcfg[i] = 0;
-            _hub_hub_desc.portcfg[i + nregs] = 0;
+            desc.portcfg[i] = 0;
+            desc.portcfg[i + nregs] = 0;
         }
-        act_len = MIN(_hub_hub_desc.bDescLength, len);
-        memcpy(ret, &_hub_hub_desc, act_len);
+        act_len = MIN(desc.bDescLength, len);
+        memcpy(ret, &desc, act_len);
         return act_len;
     }
     case CONFIGURATION: {
+        struct endpoint_desc ep_desc = _hub_endpoint_desc;
         int cp_len;
         int pos = 0;
         int act_len;
@@ -663,9 +941,9 @@ hubem_get_descriptor(usb_hubem_t dev, struct usbreq* req, void* buf, int len)
         memcpy(buf + pos, &_hub_iface_desc, cp_len);
         pos += cp_len;
         /* copy the endpoint */
-        _hub_endpoint_desc.wMaxPacketSize = (dev->hubem_nports + 7) / 8;
-        cp_len = MIN(act_len - pos, _hub_endpoint_desc.bLength);
-        memcpy(buf + pos, &_hub_endpoint_desc, cp_len);
+        ep_desc.wMaxPacketSize = (dev->hubem_nports + 7) / 8;
+        cp_len = MIN(act_len - pos, ep_desc.bLength);
+        memcpy(buf + pos, &ep_desc, cp_len);
         pos += cp_len;
         assert(pos = act_len);
         return act_len;
@@ -679,9 +957,11 @@ hubem_get_descriptor(usb_hubem_t dev, struct usbreq* req, void* buf, int len)
     }
     case ENDPOINT: {
         int act_len;
+        struct endpoint_desc ep_desc = _hub_endpoint_desc;
         DHUBEM("Get endpoint descriptor\n");
-        act_len = MIN(_hub_endpoint_desc.bLength, len);
-        memcpy(buf, &_hub_endpoint_desc, act_len);
+        ep_desc.wMaxPacketSize = (dev->hubem_nports + 7) / 8;
+        act_len = MIN(ep_desc.bLength, len);
+        memcpy(buf, &ep_desc, act_len);
         return act_len;
     }
     case STRING                    :
@@ -772,11 +1052,14 @@ hubem_process_xact(usb_hubem_t dev, struct xact* xact, int nxact,
             buf = NULL;
             buf_len = 0;
         }
+        /* Like a real host, return the bytes that were not transferred */
         switch (req->bRequest) {
         case GET_STATUS:
-            return hubem_get_status(dev, req, buf, buf_len);
+            err = hubem_get_status(dev, req, buf, buf_len);
+            return (err < 0) ? err : buf_len - err;
         case GET_DESCRIPTOR:
-            return hubem_get_descriptor(dev, req, buf, buf_len);
+            err = hubem_get_descriptor(dev, req, buf, buf_len);
+            return (err < 0) ? err : buf_len - err;
         case SET_CONFIGURATION:
             DHUBEM("Unhandled transaction: SET_CONFIGURATION\n");
             break;
@@ -19,36 +19,21 @@
 
 #include "../services.h"
 
-#define KBD_DEBUG
-//#define KBDIRQ_DEBUG
-
 #define KBD_ENABLE_IRQS
 
 #define KBD_REPEAT_RATE_MS   200
 #define KBD_REPEAT_DELAY_MS 1000
 
-#ifdef KBD_DEBUG
-#define KBD_DBG(...) _KBD_DBG(__VA_ARGS__)
-#else
-#define KBD_DBG(...) do{}while(0)
-#endif
-
-#ifdef KBDIRQ_DEBUG
-#define KBDIRQ_DBG(...) _KBD_DBG(__VA_ARGS__)
-#else
-#define KBDIRQ_DBG(...) do{}while(0)
-#endif
+#define KBD_DBG(...)    _KBD_LOG(USB_LOG_DEBUG, __VA_ARGS__)
+#define KBDIRQ_DBG(...) _KBD_LOG(USB_LOG_TRACE, __VA_ARGS__)
 
-#define _KBD_DBG(k, ...)                                \
-        do {                                            \
-            usb_kbd_t _k = k;                           \
-            if(_k && _k->udev){                         \
-                printf("KBD %2d: ", _k->udev->addr);    \
-            }else{                                      \
-                printf("KBD  ?: ");                     \
-            }                                           \
-            printf(__VA_ARGS__);                        \
-        }while(0)
+#define _KBD_LOG(lvl, k, fmt, ...)                                      \
+        do {                                                            \
+            usb_kbd_t _k = k;                                           \
+            usb_log(USB_LOG_KBD, lvl, "KBD %2d: " fmt,                  \
+                    (_k && _k->udev) ? _k->udev->addr : 0,              \
+                    ##__VA_ARGS__);                                     \
+        } while (0)
 
 enum kbd_protocol {
     BOOT = 0,
@@ -298,7 +283,7 @@ kbd_irq_handler(void* token, enum usb_xact_status stat, int bytes_remaining)
         KBD_DBG(kbd, "Short read on INT packet (%d)\n", len);
         return 1;
     }
-#if defined(KBDIRQ_DEBUG)
+#if USB_LOG_ON(USB_LOG_KBD, USB_LOG_TRACE)
     {
         int i;
         for (i = 0; i < len; i++) {
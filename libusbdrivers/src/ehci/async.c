@@ -25,14 +25,18 @@ _is_enabled_async(struct ehci_host* edev)
 static inline void
 _enable_async(struct ehci_host* edev)
 {
+    ehci_cmd_lock(edev);
     edev->op_regs->usbcmd |= EHCICMD_ASYNC_EN;
+    ehci_cmd_unlock(edev);
     while (!_is_enabled_async(edev));
 }
 
 static inline void
 _disable_async(struct ehci_host* edev)
 {
+    ehci_cmd_lock(edev);
     edev->op_regs->usbcmd &= ~EHCICMD_ASYNC_EN;
+    ehci_cmd_unlock(edev);
     while (_is_enabled_async(edev));
 }
 
@@ -52,7 +56,8 @@ qtd_get_status(volatile struct TD* qtd)
         } else if (t & TDTOK_ERROR) {
             return XACTSTAT_HOSTERROR;
         }
-        printf("EHCI: Unknown QTD error code 0x%x\n", t);
+        usb_log(USB_LOG_EHCI, USB_LOG_ERR,
+                "EHCI: Unknown QTD error code 0x%x\n", t);
         return XACTSTAT_HOSTERROR;
 
     } else {
@@ -78,25 +83,6 @@ qhn_get_status(struct QHn * qhn)
     return qtd_get_status(&qhn->qh->td_overlay);
 }
 
-static inline int
-qhn_get_bytes_remaining(struct QHn *qhn)
-{
-    int sum = 0;
-    int i;
-
-    for (i = 0; i < qhn->ntdns; i++) {
-       sum += TDTOK_GET_BYTES(qhn->tdns->td->token);
-    }
-
-    return sum;
-}
-
-int
-qhn_cb(struct QHn *qhn, enum usb_xact_status stat)
-{
-    return qhn->cb(qhn->token, stat, qhn_get_bytes_remaining(qhn));
-}
-
 /****************************
  **** Queue manipulation ****
  ****************************/
@@ -110,22 +96,30 @@ qtd_alloc(struct ehci_host *edev, enum usb_speed speed, struct endpoint *ep,
 		struct xact *xact, int nxact, usb_cb_t cb, void *token)
 {
 	struct TDn *head_tdn = NULL, *prev_tdn, *tdn = NULL;
-	int buf_filled, cnt, total_bytes = 0;
+	int buf_filled, cnt, total_bytes = 0, payload = 0;
+	uintptr_t page;
 	int xact_stage = 0;
 
 	assert(xact);
 	assert(nxact > 0);
 
+	/* Refuse the whole transfer before anything is allocated */
+	for (int i = 0; i < nxact; i++) {
+		if (!EHCI_ADDR_OK(edev, xact[i].paddr, xact[i].len)) {
+			EHCI_ERR(edev, "Buffer %p is out of reach\n",
+					(void*)xact[i].paddr);
+			return NULL;
+		}
+	}
+
 	prev_tdn = NULL;
 	for (int i = 0; i < nxact; i++) {
 		tdn = calloc(1, sizeof(struct TDn));
 		assert(tdn);
 
 		/* Allocate TD overlay */
-		tdn->td = ps_dma_alloc_pinned(edev->dman, sizeof(*tdn->td), 32, 0,
-				PS_MEM_NORMAL, &tdn->ptd);
+		tdn->td = ehci_desc_alloc(edev, sizeof(*tdn->td), &tdn->ptd);
 		assert(tdn->td);
-		memset((void*)tdn->td, 0, sizeof(*tdn->td));
 
 		/* Fill in the TD */
 		if (prev_tdn) {
@@ -169,20 +163,37 @@ qtd_alloc(struct ehci_host *edev, enum usb_speed speed, struct endpoint *ep,
 			tdn->td->token |= TDTOK_PINGSTATE;
 		}
 
-		/* Fill in the buffer */
+		/*
+		 * Fill in the buffer, the upper address bits are only used by
+		 * hosts with the 64-bit capability.
+		 */
 		cnt = 0;
 		tdn->td->buf[cnt] = xact[i].paddr; //First buffer has offset
+		tdn->td->buf_hi[cnt] = EHCI_ADDR_HI(xact[i].paddr);
 		buf_filled = 0x1000 - (xact[i].paddr & 0xFFF);
 		/* All following buffers are page aligned */
 		while (buf_filled < xact[i].len) {
 			cnt++;
-			tdn->td->buf[cnt] = (xact[i].paddr + 0x1000 * cnt) & ~0xFFF;
+			page = (xact[i].paddr & ~(uintptr_t)0xFFF) + 0x1000 * cnt;
+			tdn->td->buf[cnt] = EHCI_ADDR_LO(page);
+			tdn->td->buf_hi[cnt] = EHCI_ADDR_HI(page);
 			buf_filled += 0x1000;
 		}
 		assert(cnt <= 4); //We only have 5 page-sized buffers
 
+		/* Write back OUT data, IN buffers are invalidated on completion */
+		ehci_buf_to_dev(edev, xact[i].vaddr, xact[i].len,
+				xact[i].type == PID_IN);
+		if (xact[i].type == PID_IN) {
+			tdn->inbuf = xact[i].vaddr;
+			tdn->inlen = xact[i].len;
+		}
+
 		/* Total data transferred */
 		total_bytes += xact[i].len;
+		if (xact[i].type != PID_SETUP) {
+			payload += xact[i].len;
+		}
 
 		if (prev_tdn) {
 			prev_tdn->next = tdn;
@@ -204,10 +215,8 @@ qtd_alloc(struct ehci_host *edev, enum usb_speed speed, struct endpoint *ep,
 		tdn = calloc(1, sizeof(struct TDn));
 
 		/* Allocate TD overlay */
-		tdn->td = ps_dma_alloc_pinned(edev->dman, sizeof(*tdn->td),
-				32, 0, PS_MEM_NORMAL, &tdn->ptd);
+		tdn->td = ehci_desc_alloc(edev, sizeof(*tdn->td), &tdn->ptd);
 		assert(tdn->td);
-		memset((void*)tdn->td, 0, sizeof(*tdn->td));
 
 		/* Fill in the TD */
 		tdn->td->alt = TDLP_INVALID;
@@ -238,10 +247,26 @@ qtd_alloc(struct ehci_host *edev, enum usb_speed speed, struct endpoint *ep,
 		prev_tdn->next = tdn;
 	}
 
+	/*
+	 * A short packet ends the data stage, the host then skips to the last
+	 * TD, which is the status stage of a control transfer or the CSW of a
+	 * mass storage command(EHCI spec 4.10.2).
+	 */
+	for (prev_tdn = head_tdn; prev_tdn != tdn; prev_tdn = prev_tdn->next) {
+		if ((prev_tdn->td->token & TDTOK_PID_MASK) == TDTOK_PID_IN) {
+			prev_tdn->td->alt = tdn->ptd;
+		}
+	}
+
 	/* Send IRQ when finished processing the last TD */
+	tdn->xfer_len = payload;
 	tdn->td->token |= TDTOK_IOC;   //TODO: Maybe disable IRQ when cb == NULL
-	tdn->cb = cb;
-	tdn->token = token;
+	if (cb) {
+		tdn->done = usb_malloc(sizeof(struct ehci_done));
+		assert(tdn->done);
+		tdn->done->cb = cb;
+		tdn->done->token = token;
+	}
 
 	/* Mark the last TD as terminate TD */
 	tdn->td->next |= TDLP_INVALID;
@@ -269,13 +294,12 @@ qhn_alloc(struct ehci_host *edev, uint8_t address, uint8_t hub_addr,
 	assert(qhn);
 
 	/* Allocate queue head */
-	qhn->qh = ps_dma_alloc_pinned(edev->dman, sizeof(*qh), 32, 0,
-			PS_MEM_NORMAL, &qhn->pqh);
+	qhn->qh = ehci_desc_alloc(edev, sizeof(*qh), &qhn->pqh);
 	assert(qhn->qh);
-	memset((void*)qhn->qh, 0, sizeof(*qh));
 
 	/* Fill in the queue head */
 	qh = qhn->qh;
+	qhn->ep = ep;
 
 	qh->qhlptr = QHLP_INVALID;
 	/* epc0 */
@@ -302,8 +326,10 @@ qhn_alloc(struct ehci_host *edev, uint8_t address, uint8_t hub_addr,
 	 */
 	if (ep->type == EP_INTERRUPT) {
 		qh->epc[0] |= QHEPC0_NAKCNT_RL(0);
+	} else if (ep->nak_rl) {
+		qh->epc[0] |= QHEPC0_NAKCNT_RL(ep->nak_rl);
 	} else {
-		qh->epc[0] |= QHEPC0_NAKCNT_RL(0x8);
+		qh->epc[0] |= QHEPC0_NAKCNT_RL(EHCI_NAKCNT_RL_DEFAULT);
 	}
 
 	/* Control endpoint manages its own data toggle */
@@ -327,16 +353,8 @@ qhn_alloc(struct ehci_host *edev, uint8_t address, uint8_t hub_addr,
 		qh->epc[1] |= QHEPC1_HUB_ADDR(hub_addr) | QHEPC1_PORT(hub_port);
 	}
 
-	/* TODO: Check CMASK and SMASK */
-	if ((ep->type == EP_INTERRUPT || ep->type == EP_ISOCHRONOUS) &&
-			speed != USBSPEED_HIGH) {
-		qh->epc[1] |= QHEPC1_UFRAME_CMASK(0x1C);
-	}
+	/* The micro frame masks are assigned by the periodic scheduler */
 
-	if (ep->type == EP_INTERRUPT) {
-		qh->epc[1] |= QHEPC1_UFRAME_SMASK(1);
-	}
-	
 	qh->td_overlay.next = TDLP_INVALID;
 	qh->td_overlay.alt= TDLP_INVALID;
 
@@ -377,48 +395,378 @@ qhn_update(struct QHn *qhn, uint8_t address, struct endpoint *ep)
 	qhn->qh->epc[0] = epc0;
 }
 
+/*
+ * Submitter/completer handoff
+ *
+ * The submitter owns the tail of a queue head's TD list and the completer owns
+ * the head, so they never write the same pointer. New TDs are activated and
+ * linked into the hardware queue before they are published to the completer
+ * with a release store. The completer never frees the last TD on the list,
+ * since the submitter may be linking to it; the TD is retired in place and
+ * freed once a successor shows up.
+ *
+ * Only shared endpoints need the mutex, to serialise their submitters.
+ */
+static inline int
+_qhn_is_shared(struct QHn *qhn)
+{
+	return qhn->ep->type == EP_CONTROL || qhn->ep->nsubmitters > 1;
+}
+
+/*
+ * The host fetched @tdn into the overlay before its successor was linked,
+ * and would stop at the terminate bit. Point the overlay at the successor
+ * (EHCI spec 4.10.2).
+ */
+static inline void
+_qhn_fix_overlay(struct QHn *qhn, struct TDn *tdn, struct TDn *next)
+{
+	if (qhn->qh->td_cur == tdn->ptd &&
+			qhn->qh->td_overlay.next == TDLP_INVALID) {
+		qhn->qh->td_overlay.next = next->ptd;
+	}
+}
+
+static inline void
+_qtd_free(struct ehci_host *edev, struct TDn *tdn)
+{
+	ehci_desc_free(edev, (void*)tdn->td, sizeof(struct TD));
+	usb_free(tdn->done);
+	free(tdn);
+}
+
+/* Free the TDs of a transfer that was never enqueued */
 void
-qtd_enqueue(struct ehci_host *edev, struct QHn *qhn, struct TDn *tdn)
+qtd_free(struct ehci_host *edev, struct TDn *tdn)
+{
+	struct TDn *next;
+
+	while (tdn) {
+		next = tdn->next;
+		_qtd_free(edev, tdn);
+		tdn = next;
+	}
+}
+
+/*
+ * Enable all TDs of a new transfer, nobody can see them yet. Synchronous
+ * transfers are timed by their submitter.
+ */
+static struct TDn*
+_qtd_activate(struct ehci_host *edev, struct QHn *qhn, struct TDn *tdn)
+{
+	struct TDn *tail;
+
+	tail = tdn;
+	while (1) {
+		tail->td->token &= ~TDTOK_SHALTED;
+		tail->td->token |= TDTOK_SACTIVE;
+		if (!tail->next) {
+			break;
+		}
+		tail = tail->next;
+	}
+	tail->stamp = ehci_uframe(edev);
+	if (qhn->ep->timeout_ms && tail->done) {
+		tail->deadline = ehci_clock(edev) + qhn->ep->timeout_ms * 8;
+		tail->timed = 1;
+	}
+
+	return tail;
+}
+
+/* Hand the activated TDs from @tdn to @tail to the host and the completer */
+static void
+_qtd_link(struct ehci_host *edev, struct QHn *qhn, struct TDn *tdn,
+		struct TDn *tail)
 {
 	struct TDn *last_tdn;
+	int shared;
 
-	assert(qhn);
-	assert(tdn);
+	shared = _qhn_is_shared(qhn);
+	if (shared) {
+		usb_mutex_lock(edev->mops, qhn->mutex);
+	}
 
-	/* If the queue is empty, point the TD overlay to the first TD */
-	if (!qhn->tdns) {
+	last_tdn = qhn->tdns_tail;
+	if (!last_tdn) {
+		/* First transfer, point the TD overlay to the first TD */
 		qhn->qh->td_overlay.next = tdn->ptd;
-		qhn->tdns = tdn;
+		__atomic_store_n(&qhn->tdns, tdn, __ATOMIC_RELEASE);
 	} else {
-		usb_mutex_lock(edev->mops, qhn->mutex);
+		/* Add new TD to the hardware queue, then hand it over */
+		last_tdn->td->next = tdn->ptd & ~TDLP_INVALID;
+		dsb();
+		_qhn_fix_overlay(qhn, last_tdn, tdn);
+		__atomic_store_n(&last_tdn->next, tdn, __ATOMIC_RELEASE);
+	}
+	qhn->tdns_tail = tail;
+
+	if (shared) {
+		usb_mutex_unlock(edev->mops, qhn->mutex);
+	}
+}
+
+void
+qtd_enqueue(struct ehci_host *edev, struct QHn *qhn, struct TDn *tdn)
+{
+	struct TDn *tail;
+
+	assert(qhn);
+	assert(tdn);
+
+	tail = _qtd_activate(edev, qhn, tdn);
+	dsb();
+	_qtd_link(edev, qhn, tdn, tail);
+}
+
+/*
+ * Enqueue the transfers of a batch, @qhns[i] is the queue head of @tdns[i],
+ * or NULL to skip the entry. Consecutive transfers to the same queue head are
+ * chained up front, so that each run is linked into the hardware queue in one
+ * go, and all of the TDs are activated behind a single barrier.
+ */
+void
+qtd_enqueue_batch(struct ehci_host *edev, struct QHn **qhns,
+		struct TDn **tdns, int n)
+{
+	struct TDn *tail;
+	int i, first;
 
-		/* Find the last TD */
-		last_tdn = qhn->tdns;
-		while (last_tdn->next) {
-			last_tdn = last_tdn->next;
+	for (i = 0; i < n; i++) {
+		if (!qhns[i]) {
+			continue;
+		}
+		tail = _qtd_activate(edev, qhns[i], tdns[i]);
+		if (i + 1 < n && qhns[i + 1] == qhns[i]) {
+			tail->td->next = tdns[i + 1]->ptd;
+			tail->next = tdns[i + 1];
 		}
+	}
+	dsb();
 
-		if (qhn->qh->td_cur == last_tdn->ptd &&
-			qhn->qh->td_overlay.next == TDLP_INVALID) {
-			qhn->qh->td_overlay.next = tdn->ptd;
+	for (first = 0; first < n; first = i) {
+		for (i = first + 1; i < n && qhns[i] == qhns[first]; i++);
+		if (!qhns[first]) {
+			continue;
 		}
+		for (tail = tdns[i - 1]; tail->next; tail = tail->next);
+		_qtd_link(edev, qhns[first], tdns[first], tail);
+	}
+}
 
-		/* Add new TD to the queue and update the termination bit */
-		last_tdn->next = tdn;
-		last_tdn->td->next = tdn->ptd & ~TDLP_INVALID;
+/*
+ * Statistics of a finished transfer, @tdn is its last TD. The NAK counter
+ * counts down from the reload value and is reloaded by the host on every new
+ * TD, so the difference only covers the last TD of the transfer.
+ */
+static void
+_qhn_account(struct ehci_host *edev, struct QHn *qhn, struct TDn *tdn,
+		int rbytes, int retries)
+{
+	struct usb_ep_stats *stats = &qhn->ep->stats;
+	uint32_t rl, nakcnt, lat;
+	int bucket;
+
+	stats->xfers++;
+	stats->retries += retries;
+	stats->bytes += tdn->xfer_len - MIN(rbytes, tdn->xfer_len);
+	if (rbytes) {
+		stats->short_xfers++;
+	}
 
-		usb_mutex_unlock(edev->mops, qhn->mutex);
+	rl = QHEPC0_GET_NAKCNT_RL(qhn->qh->epc[0]);
+	nakcnt = TDALTTDPTR_NAKCNT(qhn->qh->td_overlay.alt);
+	if (nakcnt < rl) {
+		stats->naks += rl - nakcnt;
 	}
 
-	/* Enable all TDs */
-	while (tdn) {
-		tdn->td->token &= ~TDTOK_SHALTED;
-		tdn->td->token |= TDTOK_SACTIVE;
+	lat = (ehci_uframe(edev) - tdn->stamp) & FRINDEX_MASK;
+	bucket = lat ? 32 - __builtin_clz(lat) : 0;
+	stats->lat[MIN(bucket, USB_EP_LAT_BUCKETS - 1)]++;
+
+	ehci_trace(edev, USB_TRACE_COMPLETE, qhn, XACTSTAT_SUCCESS, rbytes);
+}
+
+/*
+ * The TD the host went on to after the completed @tdn. It takes the
+ * alternate pointer after a short packet, the TDs it skipped are left
+ * untouched and their bytes are added to @sum.
+ */
+static struct TDn*
+_qtd_advance(struct TDn *tdn, int *sum)
+{
+	uint32_t alt = tdn->td->alt;
+
+	if (!TDTOK_GET_BYTES(tdn->td->token) || (alt & TDLP_INVALID)) {
+		return tdn->next;
+	}
+	for (tdn = tdn->next; tdn->ptd != alt; tdn = tdn->next) {
+		*sum += TDTOK_GET_BYTES(tdn->td->token);
+	}
+
+	return tdn;
+}
+
+/*
+ * The host does not go past a halted TD. Its transfer fails straight away,
+ * with the bytes it left, and the last TD is marked so that the bottom half
+ * takes the endpoint off the schedule. Runs once per halt.
+ */
+static void
+_qhn_halt(struct ehci_host *edev, struct QHn *qhn, struct TDn *tdn,
+		int retries)
+{
+	struct TDn *last;
+	int left = 0;
+
+	if (tdn->halted) {
+		return;
+	}
+	tdn->halted = 1;
+	qhn->ep->stats.halts++;
+	qhn->ep->stats.retries += retries + 3 - TDTOK_GET_C_ERR(tdn->td->token);
+	ehci_trace(edev, USB_TRACE_COMPLETE, qhn, qtd_get_status(tdn->td),
+			TDTOK_GET_BYTES(tdn->td->token));
+
+	for (last = tdn; ; last = last->next) {
+		left += TDTOK_GET_BYTES(last->td->token);
+		if (last->td->token & TDTOK_IOC) {
+			break;
+		}
+	}
+	last->halted = 1;
+	if (last->done) {
+		ehci_done_push(edev, last->done, XACTSTAT_ERROR, left);
+		last->done = NULL;
+	}
+}
+
+/*
+ * Retire the completed transfers of a queue head and queue their callbacks
+ * on the done queue. Only one completer may run on a queue head at any time.
+ */
+void
+qhn_reap(struct ehci_host *edev, struct QHn *qhn)
+{
+	struct TDn *tdn, *head, *next, *tmp;
+	int sum = 0, retries = 0;
+
+	head = __atomic_load_n(&qhn->tdns, __ATOMIC_ACQUIRE);
+	if (!head) {
+		return;
+	}
+
+	/* Drop the placeholder once a successor has been published */
+	if (head->retired) {
+		next = __atomic_load_n(&head->next, __ATOMIC_ACQUIRE);
+		if (!next) {
+			return;
+		}
+		_qhn_fix_overlay(qhn, head, next);
+		qhn->tdns = next;
+		_qtd_free(edev, head);
+		head = next;
+	}
+
+	tdn = head;
+	while (tdn != NULL && qtd_get_status(tdn->td) == XACTSTAT_SUCCESS) {
+		sum += TDTOK_GET_BYTES(tdn->td->token);
+		retries += 3 - TDTOK_GET_C_ERR(tdn->td->token);
+		ehci_buf_to_cpu(edev, tdn->inbuf, tdn->inlen);
+		if (!(tdn->td->token & TDTOK_IOC)) {
+			tdn = _qtd_advance(tdn, &sum);
+			continue;
+		}
+
+		_qhn_account(edev, qhn, tdn, sum, retries);
+		if (tdn->done) {
+			ehci_done_push(edev, tdn->done, XACTSTAT_SUCCESS, sum);
+			tdn->done = NULL;
+		}
+		sum = 0;
+		retries = 0;
+
+		/* Free the finished transfer */
+		while (head != tdn) {
+			tmp = head;
+			head = head->next;
+			_qtd_free(edev, tmp);
+		}
+
+		next = __atomic_load_n(&tdn->next, __ATOMIC_ACQUIRE);
+		if (!next) {
+			/* Keep the tail for the submitter */
+			tdn->retired = 1;
+			qhn->tdns = tdn;
+			break;
+		}
+
+		_qhn_fix_overlay(qhn, tdn, next);
+		qhn->tdns = next;
+		_qtd_free(edev, tdn);
+		head = tdn = next;
+	}
+
+	if (tdn != NULL && !tdn->retired && (tdn->td->token & TDTOK_SHALTED)) {
+		_qhn_halt(edev, qhn, tdn, retries);
+	}
+}
+
+/*
+ * The in-flight transfer of a queue head that has run out of time or halted,
+ * which can only be the oldest one since the endpoint completes them in
+ * order.
+ */
+struct TDn*
+qhn_expired(struct QHn *qhn, uint32_t now)
+{
+	struct TDn *tdn;
+
+	tdn = __atomic_load_n(&qhn->tdns, __ATOMIC_ACQUIRE);
+	if (tdn && tdn->retired) {
+		tdn = __atomic_load_n(&tdn->next, __ATOMIC_ACQUIRE);
+	}
+	if (!tdn) {
+		return NULL;
+	}
+	while (!(tdn->td->token & TDTOK_IOC)) {
 		tdn = tdn->next;
 	}
+
+	return tdn->halted || qtd_expired(tdn, now) ? tdn : NULL;
 }
 
-void qhn_destroy(ps_dma_man_t* dman, struct QHn* qhn)
+/*
+ * Abort the endpoint of a transfer that ran out of time or halted, like a
+ * cancel. A transfer ending with @tdn that ran out of time completes with
+ * XACTSTAT_TIMEOUT once the host has let go of the queue head, a halted one
+ * has already failed. The next submission starts on a fresh queue head, with
+ * the data toggle reset as it is on the device by a CLEAR_FEATURE(HALT).
+ */
+void
+qhn_timeout(struct ehci_host *edev, struct QHn *qhn, struct TDn *tdn)
+{
+	struct endpoint *ep = qhn->ep;
+
+	if (!tdn->halted) {
+		usb_log(USB_LOG_EHCI, USB_LOG_WARN, "EHCI: Timeout on EP%d\n",
+			ep->num);
+		tdn->expired = 1;
+		ep->stats.timeouts++;
+		ehci_trace(edev, USB_TRACE_CANCEL, qhn, XACTSTAT_TIMEOUT,
+				tdn->xfer_len);
+	}
+
+	ep->hcpriv = NULL;
+	if (ep->type == EP_BULK || ep->type == EP_CONTROL) {
+		ehci_del_qhn_async(edev, qhn);
+	} else {
+		ehci_del_qhn_periodic(edev, qhn);
+	}
+}
+
+void qhn_destroy(struct ehci_host *edev, struct QHn* qhn)
 {
 	struct TDn *tdn, *tmp;
 
@@ -426,54 +774,88 @@ void qhn_destroy(ps_dma_man_t* dman, struct QHn* qhn)
 	while (tdn) {
 		tmp = tdn;
 		tdn = tdn->next;
-		if (tmp->cb) {
-			tmp->cb(tmp->token, XACTSTAT_CANCELLED, 0);
+		if (tmp->done) {
+			ehci_done_push(edev, tmp->done, tmp->expired ?
+					XACTSTAT_TIMEOUT : XACTSTAT_CANCELLED, 0);
+			tmp->done = NULL;
 		}
-		ps_dma_free_pinned(dman, (void*)tmp->td, sizeof(struct TD));
-		free(tmp);
+		_qtd_free(edev, tmp);
 	}
 
-	ps_dma_free_pinned(dman, (void*)qhn->qh, sizeof(struct QH));
+	ehci_desc_free(edev, (void*)qhn->qh, sizeof(struct QH));
 	free(qhn);
 }
 
+/*
+ * Park mode lets the host run several transactions back to back on one high
+ * speed queue head(EHCI spec 4.10.3.2). That only pays off while a single
+ * bulk endpoint is streaming, otherwise it starves the other queue heads.
+ * The completion picks the mode, the bottom half switches it.
+ */
+static void
+_async_want_park(struct ehci_host *edev, int nbusy, struct QHn *busy)
+{
+	int park;
+
+	park = edev->park_count && nbusy == 1 &&
+		busy->ep->type == EP_BULK &&
+		(busy->qh->epc[0] & QHEPC0_HSPEED) == QHEPC0_HSPEED;
+	__atomic_store_n(&edev->park_want, park, __ATOMIC_RELAXED);
+	if (park != __atomic_load_n(&edev->parked, __ATOMIC_RELAXED)) {
+		__atomic_or_fetch(&edev->work, EHCI_WORK_PARK,
+				__ATOMIC_RELEASE);
+	}
+}
+
+/* Bottom half only */
 void
-_async_complete(struct ehci_host* edev)
+ehci_async_park(struct ehci_host *edev)
 {
-	return;
-    if (edev->alist_tail) {
-        struct QHn *cur, *prev, *tail;
-        /* We cache the tail because edev->alist_tail may change during node removal */
-        prev = tail = edev->alist_tail;
-        do {
-            enum usb_xact_status stat;
-            cur = prev->next;
-            stat = qhn_get_status(cur);
-            if (stat != XACTSTAT_PENDING) {
-                if(stat == XACTSTAT_ERROR){
-                    printf("--- <Transfer error> ---\n");
-                    dump_qhn(cur);
-                    printf("------------------------\n");
-                }
-
-                /* Call the completion handler and remove cur. prev is updated to point to a new cur */
-                if (cur->cb) {
-                    qhn_cb(cur, stat);
-                    _async_remove_next(edev, prev);
-                }
-            } else {
-                /* Step over */
-                prev = cur;
-            }
-        } while (cur != tail);
-    }
+	int park;
+	uint32_t v;
+
+	ehci_cmd_lock(edev);
+	park = __atomic_load_n(&edev->park_want, __ATOMIC_RELAXED);
+	if (park != edev->parked) {
+		v = edev->op_regs->usbcmd;
+		v &= ~(EHCICMD_ASYNC_PARK | EHCICMD_ASYNC_PARKM_MASK);
+		if (park) {
+			v |= EHCICMD_ASYNC_PARK |
+				EHCICMD_ASYNC_PARKM(edev->park_count);
+		}
+		edev->op_regs->usbcmd = v;
+		__atomic_store_n(&edev->parked, park, __ATOMIC_RELAXED);
+	}
+	ehci_cmd_unlock(edev);
 }
 
-void ehci_async_complete(struct ehci_host *edev)
+/*
+ * Abort the expired transfers, rare enough to restart the walk after each.
+ * Bottom half only, with the schedule interrupts masked.
+ */
+void
+ehci_async_expire(struct ehci_host *edev, uint32_t now)
 {
 	struct QHn *qhn;
-	struct TDn *tdn, *head, *tmp;
-	int sum;
+	struct TDn *tdn;
+
+	qhn = edev->alist_tail;
+	while (qhn) {
+		tdn = qhn_expired(qhn, now);
+		if (tdn) {
+			qhn_timeout(edev, qhn, tdn);
+			qhn = edev->alist_tail;
+		} else {
+			qhn = qhn->next == edev->alist_tail ? NULL : qhn->next;
+		}
+	}
+}
+
+void ehci_async_complete(struct ehci_host *edev)
+{
+	struct QHn *qhn, *busy = NULL;
+	int nbusy = 0, expired = 0;
+	uint32_t now;
 
 	qhn = edev->alist_tail;
 
@@ -482,51 +864,23 @@ void ehci_async_complete(struct ehci_host *edev)
 		return;
 	}
 
+	now = ehci_clock(edev);
 	do {
-		usb_mutex_lock(edev->mops, qhn->mutex);
-
-		tdn = qhn->tdns;
-		sum = 0;
-		head = tdn;
-		while (tdn != NULL &&
-			qtd_get_status(tdn->td) == XACTSTAT_SUCCESS) {
-			sum += TDTOK_GET_BYTES(tdn->td->token);
-			if (tdn->td->token & TDTOK_IOC) {
-				if (tdn->cb) {
-					tdn->cb(tdn->token, XACTSTAT_SUCCESS, sum);
-					sum = 0;
-				}
-
-				qhn->tdns = tdn->next;
-
-				/*
-				 * Update the QH if we are about to dequeue the
-				 * "previous" last TD in the queue. This happens
-				 * when the last TD gets partially processed
-				 * while we enqueue new TDs.
-				 */
-				if (qhn->tdns &&
-					qhn->qh->td_cur == tdn->ptd &&
-					qhn->qh->td_overlay.next == TDLP_INVALID) {
-					qhn->qh->td_overlay.next = tdn->next->ptd;
-				}
-
-				/* Free */
-				while (head != tdn->next) {
-					tmp = head;
-					head = head->next;
-					ps_dma_free_pinned(edev->dman,
-							(void*)tmp->td,
-							sizeof(struct TD));
-					free(tmp);
-				}
-			}
-			tdn = tdn->next;
+		qhn_reap(edev, qhn);
+		if (!qhn_is_idle(qhn)) {
+			busy = qhn;
+			nbusy++;
+			expired |= qhn_expired(qhn, now) != NULL;
 		}
-
-		usb_mutex_unlock(edev->mops, qhn->mutex);
 		qhn = qhn->next;
 	} while (qhn != edev->alist_tail);
+
+	if (expired) {
+		/* Unlinking is left to the bottom half */
+		__atomic_or_fetch(&edev->work, EHCI_WORK_EXPIRE,
+				__ATOMIC_RELEASE);
+	}
+	_async_want_park(edev, nbusy, busy);
 }
 
 void ehci_add_qhn_async(struct ehci_host *edev, struct QHn *qhn)
@@ -535,24 +889,58 @@ void ehci_add_qhn_async(struct ehci_host *edev, struct QHn *qhn)
     if (edev->alist_tail) {
 	    /* Update the hardware queue */
 	    qhn->qh->qhlptr = edev->alist_tail->qh->qhlptr;
+	    dsb();
 	    edev->alist_tail->qh->qhlptr = qhn->pqh | QHLP_TYPE_QH;
 
 	    /* Update the Software queue */
 	    qhn->next = edev->alist_tail->next;
+	    qhn->prev = edev->alist_tail;
+	    qhn->next->prev = qhn;
 	    edev->alist_tail->next = qhn;
 	    edev->alist_tail = qhn;
     } else {
 	    edev->alist_tail = qhn;
-	    edev->alist_tail->next = qhn;
+	    qhn->next = qhn;
+	    qhn->prev = qhn;
 
 	    qhn->qh->qhlptr = qhn->pqh | QHLP_TYPE_QH;
     }
 }
 
+/*
+ * Start a double IAA cycle for the pending queue heads, unless one is already
+ * running. In that case check_doorbell() picks them up when the current
+ * cycle advances, so any number of removals share the same doorbells.
+ */
+static void
+_async_ring_doorbell(struct ehci_host *edev)
+{
+	if (edev->db_active || edev->db_retire || !edev->db_pending) {
+		return;
+	}
+
+	edev->db_active = edev->db_pending;
+	edev->db_pending = NULL;
+	ehci_cmd_lock(edev);
+	edev->op_regs->usbcmd |= EHCICMD_ASYNC_DB;
+	ehci_cmd_unlock(edev);
+}
+
+static void
+_async_destroy_list(struct ehci_host *edev, struct QHn *qhn)
+{
+	struct QHn *tmp;
+
+	while (qhn) {
+		tmp = qhn;
+		qhn = qhn->next;
+		qhn_destroy(edev, tmp);
+	}
+}
+
 void ehci_del_qhn_async(struct ehci_host *edev, struct QHn *qhn)
 {
 	struct TDn *tdn;
-	struct QHn *prev;
 
 	/*
 	 * The EHCI spec(section 4.8.2) gives the instructions of removing a QH
@@ -584,62 +972,83 @@ void ehci_del_qhn_async(struct ehci_host *edev, struct QHn *qhn)
 		tdn = tdn->next;
 	}
 
+	if (qhn->next == qhn) {
+		/*
+		 * Removing the last queue head, stop the schedule instead. The
+		 * host no longer walks the list, so nothing waits for an IAA.
+		 */
+		_disable_async(edev);
+		edev->alist_tail = NULL;
+		edev->op_regs->asynclistaddr = 0;
+
+		_async_destroy_list(edev, edev->db_retire);
+		_async_destroy_list(edev, edev->db_active);
+		_async_destroy_list(edev, edev->db_pending);
+		edev->db_retire = NULL;
+		edev->db_active = NULL;
+		edev->db_pending = NULL;
+		qhn_destroy(edev, qhn);
+		return;
+	}
+
 	/* Select another queue head to set its H-bit */
-	if ((qhn->qh->epc[0] & QHEPC0_H) && qhn->next) {
+	if (qhn->qh->epc[0] & QHEPC0_H) {
 		qhn->next->qh->epc[0] |= QHEPC0_H;
 	}
 
 	/* Remove the queue head from async list */
-	prev = edev->alist_tail;
-	while (prev->next != qhn) {
-		prev = prev->next;
-	}
-
-	prev->qh->qhlptr = qhn->qh->qhlptr;
-	prev->next = qhn->next;
+	qhn->prev->qh->qhlptr = qhn->qh->qhlptr;
+	qhn->prev->next = qhn->next;
+	qhn->next->prev = qhn->prev;
 
 	if (edev->alist_tail == qhn) {
-		edev->alist_tail = qhn->next;
+		edev->alist_tail = qhn->prev;
 	}
 
 	/* Put the queue head to the recycle queue */
-	if (edev->db_pending) {
-		prev = edev->db_pending;
-		while (prev->next != NULL) {
-			prev = prev->next;
-		}
-		prev->next = qhn;
-	} else {
-		edev->db_pending = qhn;
-	}
-	qhn->next = NULL;
-	qhn->was_cancelled = 1;
+	qhn->prev = NULL;
+	qhn->next = edev->db_pending;
+	edev->db_pending = qhn;
 
-	/* Ring the doorbell */
-	edev->op_regs->usbcmd |= EHCICMD_ASYNC_DB;
+	_async_ring_doorbell(edev);
 }
 
-int ehci_wait_for_completion(struct TDn *tdn)
+/*
+ * Poll a synchronous transfer until the host is done with it, bounded by the
+ * frame clock, which stops with the host. Returns the number of bytes left,
+ * or -1 if the transfer halted or timed out, or the host halted, in which
+ * case the endpoint has to be cancelled.
+ */
+int
+ehci_wait_for_completion(struct ehci_host *edev, struct TDn *tdn,
+		int timeout_ms)
 {
-	int status;
-	int cnt, sum = 0;
+	uint32_t deadline;
+	uint64_t us, limit;
+	int sum = 0;
 
+	deadline = ehci_clock(edev) + timeout_ms * 8;
+	limit = timeout_ms * 1000ULL * EHCI_SYNC_MARGIN;
+	us = 0;
 	while (tdn) {
-		cnt = 3000;
-		do {
-			status = tdn->td->token & 0xFF;
-			if (status == 0 || status == 1) {
-				sum += TDTOK_GET_BYTES(tdn->td->token);
-				break;
+		while (tdn->td->token & TDTOK_SACTIVE) {
+			if ((int32_t)(ehci_clock(edev) - deadline) >= 0 ||
+					us >= limit ||
+					(edev->op_regs->usbsts & EHCISTS_HCHALTED)) {
+				usb_log(USB_LOG_EHCI, USB_LOG_ERR,
+					"EHCI: Timeout(%p, %p)\n",
+					tdn->td, (void*)tdn->ptd);
+				return -1;
 			}
-			if (cnt <= 0) {
-				printf("Timeout(%p, %p)\n", tdn->td, tdn->ptd);
-				break;
-			}
-			msdelay(1);
-			cnt--;
-		} while (status);
-		tdn = tdn->next;
+			udelay(EHCI_SYNC_POLL_US);
+			us += EHCI_SYNC_POLL_US;
+		}
+		if (tdn->td->token & TDTOK_SHALTED) {
+			return -1;
+		}
+		sum += TDTOK_GET_BYTES(tdn->td->token);
+		tdn = (tdn->td->token & TDTOK_IOC) ? NULL :
+			_qtd_advance(tdn, &sum);
 	}
 
 	return sum;
@@ -648,6 +1057,13 @@ int ehci_wait_for_completion(struct TDn *tdn)
 /* TODO: Is it okay to use alist_tail and remove qhn */
 void ehci_schedule_async(struct ehci_host* edev, struct QHn* qhn)
 {
+	/* Already running, the common case */
+	if ((edev->op_regs->usbsts & EHCISTS_ASYNC_EN) &&
+			(edev->op_regs->usbcmd & EHCICMD_ASYNC_EN)) {
+		return;
+	}
+
+	ehci_cmd_lock(edev);
 	/* Make sure we are safe to write to the register */
 	while (((edev->op_regs->usbsts & EHCISTS_ASYNC_EN) >> 15)
 		^ ((edev->op_regs->usbcmd & EHCICMD_ASYNC_EN) >> 5));
@@ -657,88 +1073,23 @@ void ehci_schedule_async(struct ehci_host* edev, struct QHn* qhn)
 		qhn->qh->epc[0] |= QHEPC0_H;
 		edev->op_regs->asynclistaddr = qhn->pqh;
 		edev->op_regs->usbcmd |= EHCICMD_ASYNC_EN;
-		while (edev->op_regs->usbsts & EHCISTS_ASYNC_EN) break;
 	}
+	ehci_cmd_unlock(edev);
 }
 
-void
-_async_doorbell(struct ehci_host* edev)
-{
-    while (edev->db_active) {
-        struct QHn* qhn;
-        qhn = edev->db_active;
-        edev->db_active = qhn->next;
-        if (qhn->was_cancelled) {
-            enum usb_xact_status stat;
-            assert(qhn->cb);
-            stat = qhn_get_status(qhn);
-            if (stat != XACTSTAT_PENDING) {
-                /* The transfer must have completed while it was being cancelled */
-                qhn_cb(qhn, stat);
-            } else {
-                qhn_cb(qhn, XACTSTAT_CANCELLED);
-            }
-        }
-        qhn_destroy(edev->dman, qhn);
-    }
-}
-
-/* Remove from async schedule; turn the schedule off if it is empty */
-void
-_async_remove_next(struct ehci_host* edev, struct QHn* prev)
-{
-    struct QHn* q = prev->next;
-    if (prev == q) {
-        _disable_async(edev);
-        edev->alist_tail = NULL;
-        edev->op_regs->asynclistaddr = 0;
-    } else {
-        /* Remove single node from async schedule */
-        /* If we are removing the "Head", reassign it */
-        if (q->qh->epc[0] & QHEPC0_H) {
-            q->next->qh->epc[0] |= QHEPC0_H;
-        }
-        /* If we removed the tail, reassign it */
-        if (q == edev->alist_tail) {
-            edev->alist_tail = prev;
-        }
-
-        prev->qh->qhlptr = q->qh->qhlptr;
-        prev->next = q->next;
-    }
-    /* Add to doorbell list for cleanup */
-    q->next = edev->db_pending;
-    edev->db_pending = q;
-}
+/*
+ * Called on every IAA interrupt. Queue heads unlinked before the doorbell
+ * was rung move one stage ahead, and the ones that have now seen two IAA
+ * cycles are released.
+ */
 void check_doorbell(struct ehci_host* edev)
 {
-	int again = 0;
-	struct QHn *qhn, *tmp, *tail;
-
-	qhn = edev->db_pending;
+	_async_destroy_list(edev, edev->db_retire);
+	edev->db_retire = edev->db_active;
+	edev->db_active = edev->db_pending;
 	edev->db_pending = NULL;
-	while (qhn) {
-		tmp = qhn;
-		qhn = qhn->next;
 
-		/* Two IAA cycles have passed, safe to remove */
-		if (tmp->was_cancelled > 1) {
-			qhn_destroy(edev->dman, tmp);
-		} else {
-			tmp->was_cancelled++;
-			if (!edev->db_pending) {
-				edev->db_pending = tmp;
-			} else {
-				tail->next = tmp;
-			}
-			tail = tmp;
-
-			again = 1;
-		}
-	}
-
-	if (again) {
+	if (edev->db_retire || edev->db_active) {
 		edev->op_regs->usbcmd |= EHCICMD_ASYNC_DB;
 	}
 }
-
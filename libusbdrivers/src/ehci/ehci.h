@@ -18,33 +18,18 @@
 
 #include <usb/usb_host.h>
 #include <usb/drivers/usbhub.h>
+#include "../log.h"
 
-//#define EHCI_DEBUG_IRQ
-#define EHCI_DEBUG
-//#define EHCI_TRAFFIC_DEBUG
-
-#ifdef EHCI_DEBUG
-#define dprintf(...) printf(__VA_ARGS__)
-#else
-#define dprintf(...) do{}while(0)
-#endif
-
-#ifdef EHCI_DEBUG_IRQ
-#define EHCI_IRQDBG(...) EHCI_DBG(__VA_ARGS__)
-#else
-#define EHCI_IRQDBG(...) do{}while(0)
-#endif
-
-#define EHCI_DBG(host, ...)                     \
-        do {                                    \
-            struct ehci_host* h = host;         \
-            if(h){                              \
-                dprintf("EHCI %1d: ", h->devid);\
-            }else{                              \
-                dprintf("EHCI  ?: ");           \
-            }                                   \
-            dprintf(__VA_ARGS__);               \
-        }while(0)
+#define EHCI_LOG(host, lvl, fmt, ...)                                   \
+        do {                                                            \
+            struct ehci_host* _h = host;                                \
+            usb_log(USB_LOG_EHCI, lvl, "EHCI %1d: " fmt,                \
+                    _h ? _h->devid : -1, ##__VA_ARGS__);                \
+        } while (0)
+
+#define EHCI_ERR(host, ...)    EHCI_LOG(host, USB_LOG_ERR, __VA_ARGS__)
+#define EHCI_DBG(host, ...)    EHCI_LOG(host, USB_LOG_DEBUG, __VA_ARGS__)
+#define EHCI_IRQDBG(host, ...) EHCI_LOG(host, USB_LOG_TRACE, __VA_ARGS__)
 
 
 /*******************
@@ -74,7 +59,8 @@ struct ehci_host_op {
 #define EHCICMD_IRQTHRES(x)   (((x) & 0xff) * BIT(16))
 #define EHCICMD_IRQTHRES_MASK EHCICMD_IRQTHRES(0xff)
 #define EHCICMD_ASYNC_PARK    BIT(11)
-#define EHCICMD_ASYNC_PARKM   (((x) &  0x3) * BIT( 8))
+#define EHCICMD_ASYNC_PARKM(x) (((x) &  0x3) * BIT( 8))
+#define EHCICMD_ASYNC_PARKM_MASK EHCICMD_ASYNC_PARKM(0x3)
 #define EHCICMD_LIGHT_RST     BIT(7)
 #define EHCICMD_ASYNC_DB      BIT(6)
 #define EHCICMD_ASYNC_EN      BIT(5)
@@ -109,6 +95,8 @@ struct ehci_host_op {
 /// Translate a micro frame index into a frame index
 #define UFRAME2FRAME(x)       ((x) >> 3)
 #define FRINDEX_UF(x)         ((x) & 0x7)
+/// Micro frame index as seen by software, wraps every 2.048 seconds
+#define FRINDEX_MASK          0x3fff
     uint32_t frindex;          /* +0x0C */
     uint32_t ctrldssegment;    /* +0x10 */
     uint32_t periodiclistbase; /* +0x14 */
@@ -147,7 +135,7 @@ struct ehci_host_op {
 struct TD {
 #define TDLP_INVALID           BIT(0)
     uint32_t next;
-#define TDALTTDPTR_NAKCNT(x)   (((x) >> 1) & 0x7)
+#define TDALTTDPTR_NAKCNT(x)   (((x) >> 1) & 0xf)
     uint32_t alt;
 #define TDTOK_DT               BIT(31)
 #define TDTOK_BYTES(x)         (((x) & 0x7fff) << 16)
@@ -158,9 +146,11 @@ struct TD {
 #define TDTOK_C_PAGE_MASK      TDTOK_C_PAGE(0x7)
 #define TDTOK_C_ERR(x)         (((x) & 0x3) * BIT(10))
 #define TDTOK_C_ERR_MASK       TDTOK_C_ERR(0x3)
+#define TDTOK_GET_C_ERR(x)     (((x) & TDTOK_C_ERR_MASK) >> 10)
 #define TDTOK_PID_OUT          (0 * BIT(8))
 #define TDTOK_PID_IN           (1 * BIT(8))
 #define TDTOK_PID_SETUP        (2 * BIT(8))
+#define TDTOK_PID_MASK         (3 * BIT(8))
 #define TDTOK_SACTIVE          BIT(7)
 #define TDTOK_SHALTED          BIT(6)
 #define TDTOK_SBUFERR          BIT(5)
@@ -193,6 +183,7 @@ struct QH {
     uint32_t qhlptr;
 #define QHEPC0_NAKCNT_RL(x)    (((x) &  0xf) * BIT(28))
 #define QHEPC0_NAKCNT_RL_MASK  QHEPC0_NAKCNT_RL(0xf)
+#define QHEPC0_GET_NAKCNT_RL(x) (((x) & QHEPC0_NAKCNT_RL_MASK) >> 28)
 #define QHEPC0_C               BIT(27)
 #define QHEPC0_MAXPKTLEN(x)    (((x) & 0x7ff) * BIT(16))
 #define QHEPC0_MAXPKT_MASK     QHEPC0_MAXPKTLEN(0x7ff)
@@ -213,23 +204,208 @@ struct QH {
 #define QHEPC1_UFRAME_CMASK(x) (((x) & 0xff) * BIT( 8))
 #define QHEPC1_UFRAME_SMASK(x) (((x) & 0xff) * BIT( 0))
 #define QHEPC1_UFRAME_MASK     (QHEPC1_UFRAME_CMASK(0xff) | \
-                                QHEPC1_UFRAME_CMASK(0xff))
+                                QHEPC1_UFRAME_SMASK(0xff))
     uint32_t epc[2];
     uint32_t td_cur;
     struct TD td_overlay;
 };
 
 
+/* High speed isochronous transfer descriptor */
+struct ITD {
+    uint32_t next;
+#define ITDTX_ACTIVE           BIT(31)
+#define ITDTX_BUFERR           BIT(30)
+#define ITDTX_BABBLE           BIT(29)
+#define ITDTX_XACTERR          BIT(28)
+#define ITDTX_ERROR            (ITDTX_BUFERR | ITDTX_BABBLE | ITDTX_XACTERR)
+#define ITDTX_LEN(x)           (((x) & 0xfff) * BIT(16))
+#define ITDTX_GET_LEN(x)       (((x) >> 16) & 0xfff)
+#define ITDTX_IOC              BIT(15)
+#define ITDTX_PG(x)            (((x) & 0x7) * BIT(12))
+#define ITDTX_OFFSET(x)        (((x) & 0xfff) * BIT(0))
+    uint32_t transaction[8];
+#define ITDBUF0_EP(x)          (((x) &  0xf) * BIT(8))
+#define ITDBUF0_ADDR(x)        (((x) & 0x7f) * BIT(0))
+#define ITDBUF1_DIR_IN         BIT(11)
+#define ITDBUF1_MAXPKT(x)      (((x) & 0x7ff) * BIT(0))
+#define ITDBUF2_MULT(x)        (((x) &  0x3) * BIT(0))
+#define ITDBUF_PAGE_MASK       (~(uintptr_t)0xfff)
+    uint32_t buf[7];
+    uint32_t buf_hi[7];        /* 64-bit capability(Appendix B) */
+};
+
+/* Split transaction isochronous transfer descriptor */
+struct SITD {
+    uint32_t next;
+#define SITDEPC_DIR_IN         BIT(31)
+#define SITDEPC_PORT(x)        (((x) & 0x7f) * BIT(24))
+#define SITDEPC_HUB_ADDR(x)    (((x) & 0x7f) * BIT(16))
+#define SITDEPC_EP(x)          (((x) &  0xf) * BIT( 8))
+#define SITDEPC_ADDR(x)        (((x) & 0x7f) * BIT( 0))
+    uint32_t epc;
+#define SITDUF_CMASK(x)        (((x) & 0xff) * BIT(8))
+#define SITDUF_SMASK(x)        (((x) & 0xff) * BIT(0))
+    uint32_t uframe;
+#define SITDST_IOC             BIT(31)
+#define SITDST_PAGE            BIT(30)
+#define SITDST_BYTES(x)        (((x) & 0x3ff) * BIT(16))
+#define SITDST_GET_BYTES(x)    (((x) >> 16) & 0x3ff)
+#define SITDST_ACTIVE          BIT(7)
+#define SITDST_ERR             BIT(6)
+#define SITDST_BUFERR          BIT(5)
+#define SITDST_BABBLE          BIT(4)
+#define SITDST_XACTERR         BIT(3)
+#define SITDST_MISSED          BIT(2)
+#define SITDST_ERROR           (SITDST_ERR     | \
+                                SITDST_BUFERR  | \
+                                SITDST_BABBLE  | \
+                                SITDST_XACTERR | \
+                                SITDST_MISSED)
+    uint32_t state;
+#define SITDBUF1_TP_ALL        (0 * BIT(3))
+#define SITDBUF1_TP_BEGIN      (1 * BIT(3))
+#define SITDBUF1_TCOUNT(x)     (((x) & 0x7) * BIT(0))
+    uint32_t buf[2];
+    uint32_t back;
+    uint32_t buf_hi[2];        /* 64-bit capability(Appendix B) */
+};
+
+/* NAK count reload of bulk and control queue heads */
+#define EHCI_NAKCNT_RL_DEFAULT 8
+/* Default async park mode count, if the host supports it */
+#define EHCI_PARK_DEFAULT      3
+/*
+ * Synchronous transfers poll at this interval. The frame clock times them
+ * out, the time spent polling is only a backstop for a host that stopped,
+ * with a wide margin since udelay() is a rough busy loop on some platforms.
+ */
+#define EHCI_SYNC_POLL_US      10
+#define EHCI_SYNC_MARGIN       10
+
+/*************************
+ **** Descriptor pool ****
+ *************************/
+
+/*
+ * The link pointers of all EHCI data structures are 32-bit, the upper 32 bits
+ * come from the CTRLDSSEGMENT register(Appendix B). Descriptors are therefore
+ * carved out of pages that all sit in the same 4GB segment. Data buffers are
+ * not restricted, their upper address bits go to the buf_hi fields.
+ */
+#define EHCI_DPOOL_PAGE        0x1000
+#define EHCI_DPOOL_BLOCK       64
+#define EHCI_DPOOL_NBLOCKS     (EHCI_DPOOL_PAGE / EHCI_DPOOL_BLOCK)
+/* Pages from another segment tolerated before giving up */
+#define EHCI_DPOOL_RETRY       4
+/* Descriptors of up to half a page come from the free lists */
+#define EHCI_DPOOL_NCLASS      (EHCI_DPOOL_NBLOCKS / 2)
+#define EHCI_DPOOL_MAXPAGES    256
+
+#define EHCI_ADDR_LO(x)        ((uint32_t)(x))
+#define EHCI_ADDR_HI(x)        ((uint32_t)((uint64_t)(x) >> 32))
+/* Only hosts with the 64-bit capability reach buffers above 4GB */
+#define EHCI_ADDR_OK(edev, paddr, len) \
+	(((edev)->cap_regs->hccparams & EHCI_HCC_64BIT) || \
+	 !EHCI_ADDR_HI((uint64_t)(paddr) + (len)))
+
+/* Header in the first block of every pool page */
+struct ehci_dpage {
+    uintptr_t paddr;
+    uint32_t index;            /* Position in ehci_host.dpages */
+};
+
+/***************************
+ **** Periodic schedule ****
+ ***************************/
+
+/*
+ * The periodic schedule is a binary tree of dummy queue heads, one level per
+ * polling interval(1, 2, 4, ... EHCI_PERIODIC_MAX frames). Every frame list
+ * entry points to a leaf of the tree, and each node links to its parent at
+ * the next shorter interval. An endpoint is hooked onto the node matching its
+ * period and phase, so it is visited exactly once every period.
+ */
+#define EHCI_PERIODIC_LEVELS   6
+#define EHCI_PERIODIC_MAX      (1 << (EHCI_PERIODIC_LEVELS - 1))
+#define EHCI_PERIODIC_NSKEL    (2 * EHCI_PERIODIC_MAX - 1)
+/* Index of the tree node for a given period and phase */
+#define EHCI_SKEL_IDX(p, ph)   ((p) - 1 + (ph))
+
+/* USB 2.0 spec 5.5.4: at most 80% of a micro frame for periodic transfers */
+#define EHCI_UFRAME_USECS_MAX  100
+
+/*
+ * Worst case bus time of a high speed periodic transaction in nanoseconds.
+ * USB 2.0 spec 5.11.3, including bit stuffing and the host delay.
+ */
+#define BIT_TIME(bytes)        (7 * 8 * (bytes) / 6)
+#define HS_NSECS(bytes)        (((55 * 8 * 2083) + \
+                                 (2083 * (3 + BIT_TIME(bytes)))) / 1000 + 5)
+#define HS_NSECS_ISO(bytes)    (((38 * 8 * 2083) + \
+                                 (2083 * (3 + BIT_TIME(bytes)))) / 1000 + 5)
+#define NS_TO_US(ns)           (((ns) + 999) / 1000)
+
+/*
+ * Transaction translator budget, USB 2.0 spec 11.18. The full speed bus moves
+ * at most 188 bytes per micro frame, and no more than 90% of a frame may be
+ * used for periodic transfers. Costs are counted in full speed byte times.
+ */
+#define EHCI_TT_UFRAME_BYTES   188
+#define EHCI_TT_FRAME_BYTES    1157
+/* Latest start split micro frame that leaves room for 3 complete splits */
+#define EHCI_TT_SSPLIT_MAX     3
+
+/* Budget of the transaction translator in a high speed hub */
+struct ehci_tt {
+    uint8_t hub_addr;
+    int users;
+    uint16_t bytes[EHCI_PERIODIC_MAX][8];
+    struct ehci_tt* next;
+};
+
 /****************************
  **** Private structures ****
  ****************************/
 
+/*
+ * Completion of a transfer, waiting on the done queue for its callback.
+ * Allocated on submission, so the interrupt handler never allocates memory.
+ */
+struct ehci_done {
+    usb_cb_t cb;
+    void* token;
+    enum usb_xact_status stat;
+    int rbytes;
+    struct ehci_done* next;
+};
+
+/* Deferred interrupt work, see ehci_process_completions */
+#define EHCI_WORK_ROOT         BIT(0)
+#define EHCI_WORK_EXPIRE       BIT(1)  /* A timed transfer ran out of time */
+#define EHCI_WORK_PARK         BIT(2)  /* Park mode should be switched */
+
+/*
+ * Interrupts whose handlers walk the schedules, or the async unlink lists
+ * that ehci_del_qhn_async() also edits
+ */
+#define EHCI_SCHED_IRQS        (EHCIINTR_USBINT | EHCIINTR_USBERRINT | \
+                                EHCIINTR_FLIST_ROLL | EHCIINTR_ASYNC_ADV)
+
 struct TDn {
     volatile struct TD* td;
     uintptr_t ptd;
 //    struct xact xact;
-    usb_cb_t cb;
-    void* token;
+    void* inbuf;      /* IN data buffer, invalidated on completion */
+    int inlen;
+    struct ehci_done* done;  /* Only on the last TD of a transfer */
+    int retired;      /* Completed, kept as a placeholder for the submitter */
+    int halted;       /* Halt already accounted for */
+    int xfer_len;     /* Payload of the transfer, only on the last TD */
+    uint32_t stamp;   /* Micro frame index at submission, last TD only */
+    uint32_t deadline;/* ehci_clock() expiry, last TD only, if timed */
+    int timed;        /* The endpoint has a timeout */
+    int expired;      /* Cancelled by the timeout */
     struct TDn* next;
 };
 
@@ -237,21 +413,82 @@ struct QHn {
     /* Transaction data */
     volatile struct QH* qh;
     uintptr_t pqh;
-    int ntdns;        //TODO: To be removed
-    struct TDn* tdns;
+    struct TDn* tdns; /* Head, owned by the completer */
+    struct TDn* tdns_tail; /* Tail, owned by the submitter */
+    struct endpoint* ep;
     /* Interrupts */
-    int rate;
-    usb_cb_t cb;      //TODO: In TDn now, to be removed.
-    void* token;      //TODO: In TDn now, to be removed.
-    int irq_pending;
-    int was_cancelled;
+    int rate;         /* Polling period in frames */
+    int phase;        /* Frame offset within the period */
+    uint8_t smask;    /* Micro frames that start a transaction */
+    uint8_t cmask;    /* Micro frames that complete a split transaction */
+    int usecs;        /* Bus time claimed in each scheduled micro frame */
+    struct QHn* pnext;/* Next queue head on the same periodic tree node */
+    /* Split transactions */
+    struct ehci_tt* tt;
+    int tt_bytes;     /* Full speed bus time claimed on the TT */
     /* Links */
     uint8_t owner_addr;
     struct QHn* next;
+    struct QHn* prev; /* Async ring only */
     /* mutex */
     void* mutex;
 };
 
+/* One frame worth of isochronous packets */
+struct ISOslot {
+    /* Either an iTD or a siTD, depending on the stream speed */
+    volatile void* desc;
+    uintptr_t pdesc;
+    int frame;
+    /* The request and packets carried in this frame */
+    struct ISOreq* req;
+    struct iso_pkt* pkt;
+    int npkt;
+    /* Next descriptor hooked on the same frame list entry */
+    struct ISOslot* fnext;
+};
+
+/* One call to ehci_schedule_iso */
+struct ISOreq {
+    int pending;
+    enum usb_xact_status stat;
+    int rbytes;
+    struct ehci_done* done;
+};
+
+/* Isochronous stream, one per endpoint */
+struct ISOn {
+    struct endpoint* ep;
+    enum usb_speed speed;
+    uint8_t addr;
+    uint8_t hub_addr;
+    uint8_t hub_port;
+    int maxpkt;
+    int mult;
+    /* Schedule */
+    int rate;         /* Frames between two descriptors */
+    int uframes;      /* Micro frames between two packets */
+    int phase;        /* Frame offset within the period, -1 if unreserved */
+    uint8_t smask;
+    uint8_t cmask;
+    int usecs;
+    struct ehci_tt* tt;
+    int tt_bytes;
+    int next_frame;   /* Frame after the last queued slot, -1 if idle */
+    /* Ring of pre-allocated descriptors, see isoc.c */
+    struct ISOslot* slots;
+    int nslots;
+    unsigned int head;  /* Next slot to retire, completer only */
+    unsigned int tail;  /* Next slot to fill, submitters only */
+    void* mutex;        /* Serialises the submitters of a shared endpoint */
+    struct ISOn* next;
+};
+
+/* The number of frames that can be queued on a single stream */
+#define EHCI_ISO_RING          64
+/* Minimum distance to the current frame for a new iTD/siTD */
+#define EHCI_ISO_SLACK         2
+
 struct ehci_host {
     int devid;
     /* Hub emulation */
@@ -262,24 +499,150 @@ struct ehci_host {
     usb_cb_t irq_cb;
     void* irq_token;
     uint32_t bmreset_c;
+    /* Completions for the bottom half, newest first */
+    struct ehci_done* done;
+    uint32_t work;
+    /* Schedule interrupt masking, see ehci_sched_disable_irq() */
+    int sched_mask;
+    int sched_lock;
+    int in_irq;
+    /* usbcmd writers, see ehci_cmd_lock() */
+    int cmd_lock;
     /* Async schedule */
     struct QHn* alist_tail;
+    /* Unlinked queue heads, waiting for two IAA cycles */
     struct QHn* db_pending;
     struct QHn* db_active;
+    struct QHn* db_retire;
+    uint32_t clk;     /* Micro frame clock, see ehci_clock */
+    int park_count;   /* Park mode count, 0 if disabled */
+    int parked;       /* Park mode currently enabled */
+    int park_want;    /* Park mode wanted by the last async completion */
     /* Periodic frame list */
     uint32_t* flist;
     uintptr_t pflist;
     int flist_size;
     struct QHn* intn_list;
+    struct ISOslot** iso_frame;
+    struct ISOn* iso_list;
+    struct ehci_tt* tt_list;
+    struct QHn skel[EHCI_PERIODIC_NSKEL];
+    uint8_t uframe_usecs[EHCI_PERIODIC_MAX][8];
     /* Standard registers */
     volatile struct ehci_host_cap * cap_regs;
     volatile struct ehci_host_op  * op_regs;
+    /* Descriptor pool, see pool.c */
+    uint64_t dfree[EHCI_DPOOL_NCLASS];
+    struct ehci_dpage* dpages[EHCI_DPOOL_MAXPAGES];
+    uint32_t dnpages;
+    uint32_t dsegment;
+    int dsegment_valid;
     /* Support */
+    usb_host_t* hdev;
     ps_dma_man_t* dman;
     mutex_ops_t* mops;
     void* state;
 };
 
+/*
+ * Cache maintenance of transfer buffers, through the allocator of the
+ * buffers(hdev->dman), which knows whether the memory is cached at all. The
+ * descriptors themselves are always uncached.
+ */
+static inline void
+ehci_buf_to_dev(struct ehci_host *edev, void *vaddr, int len, int dir_in)
+{
+    if (!vaddr || len <= 0) {
+        return;
+    }
+    if (dir_in) {
+        /* Nothing dirty may be written back over the incoming data */
+        ps_dma_cache_clean_invalidate(edev->hdev->dman, vaddr, len);
+    } else {
+        ps_dma_cache_clean(edev->hdev->dman, vaddr, len);
+    }
+}
+
+static inline void
+ehci_buf_to_cpu(struct ehci_host *edev, void *vaddr, int len)
+{
+    if (!vaddr || len <= 0) {
+        return;
+    }
+    /* Drop anything speculatively loaded during the transfer */
+    ps_dma_cache_invalidate(edev->hdev->dman, vaddr, len);
+}
+
+/*
+ * Queue a completed transfer for ehci_process_completions. Any context may
+ * push, the consumer takes the whole list at once.
+ */
+static inline void
+ehci_done_push(struct ehci_host *edev, struct ehci_done *done,
+               enum usb_xact_status stat, int rbytes)
+{
+    struct ehci_done *head;
+
+    done->stat = stat;
+    done->rbytes = rbytes;
+    head = __atomic_load_n(&edev->done, __ATOMIC_RELAXED);
+    do {
+        done->next = head;
+    } while (!__atomic_compare_exchange_n(&edev->done, &head, done, 1,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/* Time stamp for statistics and traces */
+static inline uint32_t
+ehci_uframe(struct ehci_host *edev)
+{
+    return edev->op_regs->frindex & FRINDEX_MASK;
+}
+
+/*
+ * Micro frames since the host started, for transfer deadlines. FRINDEX only
+ * counts 2048 frames, anyone reading the clock brings the extended count up
+ * to date, and the frame list rollover interrupt makes sure that happens
+ * twice per FRINDEX period even when the bus is idle.
+ */
+static inline uint32_t
+ehci_clock(struct ehci_host *edev)
+{
+    uint32_t clk;
+
+    clk = __atomic_load_n(&edev->clk, __ATOMIC_RELAXED);
+    clk += (ehci_uframe(edev) - clk) & FRINDEX_MASK;
+    __atomic_store_n(&edev->clk, clk, __ATOMIC_RELAXED);
+
+    return clk;
+}
+
+/* The transfer ending with @tdn is past its deadline */
+static inline int
+qtd_expired(struct TDn *tdn, uint32_t now)
+{
+    return tdn->timed && (int32_t)(now - tdn->deadline) >= 0;
+}
+
+static inline void
+ehci_trace(struct ehci_host *edev, enum usb_trace_type type, struct QHn *qhn,
+           enum usb_xact_status stat, int len)
+{
+    if (edev->hdev->trace) {
+        usb_hcd_trace(edev->hdev, type, QHEPC0_GET_ADDR(qhn->qh->epc[0]),
+                      qhn->ep, stat, len, ehci_uframe(edev));
+    }
+}
+
+/* No transfer in flight on this queue head */
+static inline int
+qhn_is_idle(struct QHn *qhn)
+{
+    struct TDn *head = __atomic_load_n(&qhn->tdns, __ATOMIC_ACQUIRE);
+    return head == NULL || (head->retired &&
+            __atomic_load_n(&head->next, __ATOMIC_ACQUIRE) == NULL);
+}
+
 /**
  * Hub Emulation
  */
@@ -292,17 +655,15 @@ int _get_pstat(void* token, int port, struct port_status* _ps);
  * Async Scheduling
  */
 void ehci_handle_irq(usb_host_t* hdev);
+void ehci_process_completions(usb_host_t* hdev);
 int ehci_cancel_xact(usb_host_t* hdev, struct endpoint *ep);
 
-void qhn_destroy(ps_dma_man_t* dman, struct QHn* qhn);
-int clear_async_xact(struct ehci_host* edev, void* token);
-void _async_complete(struct ehci_host* edev);
-int ehci_wait_for_completion(struct TDn *tdn);
+void qhn_destroy(struct ehci_host *edev, struct QHn* qhn);
+int ehci_wait_for_completion(struct ehci_host *edev, struct TDn *tdn,
+		int timeout_ms);
 void ehci_schedule_async(struct ehci_host* edev, struct QHn* qh_new);
-void _async_doorbell(struct ehci_host* edev);
 enum usb_xact_status qtd_get_status(volatile struct TD* qtd);
 enum usb_xact_status qhn_get_status(struct QHn * qhn);
-int qhn_cb(struct QHn *qhn, enum usb_xact_status stat);
 void check_doorbell(struct ehci_host* edev);
 
 /* New APIs */
@@ -313,11 +674,27 @@ struct TDn* qtd_alloc(struct ehci_host *edev, enum usb_speed speed,
 		usb_cb_t cb, void *token);
 void qhn_update(struct QHn *qhn, uint8_t address, struct endpoint *ep);
 void qtd_enqueue(struct ehci_host *edev, struct QHn *qhn, struct TDn *tdn);
+void qtd_free(struct ehci_host *edev, struct TDn *tdn);
+void qtd_enqueue_batch(struct ehci_host *edev, struct QHn **qhns,
+		struct TDn **tdns, int n);
 void ehci_add_qhn_async(struct ehci_host *edev, struct QHn *qhn);
-void ehci_add_qhn_periodic(struct ehci_host *edev, struct QHn *qhn);
+int ehci_add_qhn_periodic(struct ehci_host *edev, struct QHn *qhn,
+		enum usb_speed speed, struct endpoint *ep);
 void ehci_del_qhn_async(struct ehci_host *edev, struct QHn *qhn);
 void ehci_del_qhn_periodic(struct ehci_host *edev, struct QHn *qhn);
 void ehci_async_complete(struct ehci_host *edev);
+void ehci_async_expire(struct ehci_host *edev, uint32_t now);
+void ehci_async_park(struct ehci_host *edev);
+void qhn_reap(struct ehci_host *edev, struct QHn *qhn);
+struct TDn* qhn_expired(struct QHn *qhn, uint32_t now);
+void qhn_timeout(struct ehci_host *edev, struct QHn *qhn, struct TDn *tdn);
+
+/**
+ * Descriptor pool
+ */
+int ehci_dpool_init(struct ehci_host *edev);
+void *ehci_desc_alloc(struct ehci_host *edev, size_t size, uintptr_t *paddr);
+void ehci_desc_free(struct ehci_host *edev, void *desc, size_t size);
 
 /**
  * Periodic Scheduling
@@ -326,11 +703,39 @@ int ehci_schedule_periodic_root(struct ehci_host* edev, struct xact *xact,
                             int nxact, usb_cb_t cb, void* t);
 int ehci_schedule_periodic(struct ehci_host* edev);
 void ehci_periodic_complete(struct ehci_host *edev);
-enum usb_xact_status qhn_wait(struct QHn* qhn, int to_ms);
-void _periodic_complete(struct ehci_host* edev);
-int clear_periodic_xact(struct ehci_host* edev, void* token);
-void _qhn_deschedule(struct ehci_host* dev, struct QHn* qhn);
-void _async_remove_next(struct ehci_host* edev, struct QHn* prev);
+void ehci_periodic_expire(struct ehci_host *edev, uint32_t now);
+int ehci_periodic_init(struct ehci_host *edev);
+int ehci_periodic_period(enum usb_speed speed, struct endpoint *ep,
+		int *uframes);
+int ehci_periodic_load(struct ehci_host *edev, int period, int phase,
+		uint8_t smask);
+void ehci_periodic_claim(struct ehci_host *edev, int period, int phase,
+		uint8_t smask, int usecs);
+int ehci_periodic_wait_frame(struct ehci_host *edev);
+struct ehci_tt* ehci_tt_get(struct ehci_host *edev, uint8_t hub_addr);
+void ehci_tt_put(struct ehci_host *edev, struct ehci_tt *tt);
+int ehci_tt_bytes(enum usb_speed speed, enum usb_endpoint_type type,
+		int maxpkt);
+int ehci_tt_fits(struct ehci_tt *tt, int period, int phase, int uframe,
+		int bytes);
+void ehci_tt_claim(struct ehci_tt *tt, int period, int phase, int uframe,
+		int bytes);
+
+/**
+ * Isochronous Scheduling
+ */
+struct ISOn* ehci_iso_alloc(struct ehci_host *edev, uint8_t address,
+		uint8_t hub_addr, uint8_t hub_port, enum usb_speed speed,
+		struct endpoint *ep);
+int ehci_iso_enqueue(struct ehci_host *edev, struct ISOn *ison,
+		struct iso_pkt *pkt, int npkt, int start_frame,
+		usb_cb_t cb, void *token);
+void ehci_iso_complete(struct ehci_host *edev);
+void ehci_del_iso(struct ehci_host *edev, struct ISOn *ison);
+void ehci_sched_enable_irq(struct ehci_host *edev);
+void ehci_sched_disable_irq(struct ehci_host *edev);
+void ehci_cmd_lock(struct ehci_host *edev);
+void ehci_cmd_unlock(struct ehci_host *edev);
 
 /**
  * Debugging
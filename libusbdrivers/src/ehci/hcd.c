@@ -83,22 +83,158 @@ static void print_list(struct QHn *qhn)
 	printf("\n");
 }
 
-void ehci_sched_enable_irq(struct ehci_host *edev)
+static void
+_trace_submit(struct ehci_host *edev, struct QHn *qhn, struct TDn *tdn)
+{
+	if (!edev->hdev->trace) {
+		return;
+	}
+	while (tdn->next) {
+		tdn = tdn->next;
+	}
+	ehci_trace(edev, USB_TRACE_SUBMIT, qhn, XACTSTAT_PENDING, tdn->xfer_len);
+}
+
+/* Transfers of a queue head that the host has not finished yet */
+static int
+_qhn_count_inflight(struct QHn *qhn)
+{
+	struct TDn *tdn;
+	int cnt = 0;
+
+	for (tdn = qhn->tdns; tdn; tdn = tdn->next) {
+		if ((tdn->td->token & (TDTOK_IOC | TDTOK_SACTIVE)) ==
+				(TDTOK_IOC | TDTOK_SACTIVE)) {
+			cnt++;
+		}
+	}
+
+	return cnt;
+}
+
+static void
+_sched_lock(struct ehci_host *edev)
 {
-	uint32_t irq;
+	while (__atomic_test_and_set(&edev->sched_lock, __ATOMIC_ACQUIRE));
+}
+
+static void
+_sched_unlock(struct ehci_host *edev)
+{
+	__atomic_clear(&edev->sched_lock, __ATOMIC_RELEASE);
+}
 
-	irq = edev->op_regs->usbintr;
-	irq |= EHCIINTR_USBINT;
-	edev->op_regs->usbintr = irq;
+void ehci_sched_enable_irq(struct ehci_host *edev)
+{
+	_sched_lock(edev);
+	if (--edev->sched_mask == 0) {
+		edev->op_regs->usbintr |= EHCI_SCHED_IRQS;
+	}
+	_sched_unlock(edev);
 }
 
+/*
+ * Keep the top half off the schedules. Masking nests, and returns only once
+ * a top half that raced with the mask has left, since it may be reaping the
+ * very transfers the caller is about to touch.
+ */
 void ehci_sched_disable_irq(struct ehci_host *edev)
 {
-	uint32_t irq;
+	_sched_lock(edev);
+	if (edev->sched_mask++ == 0) {
+		edev->op_regs->usbintr &= ~EHCI_SCHED_IRQS;
+	}
+	_sched_unlock(edev);
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	while (__atomic_load_n(&edev->in_irq, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Serialise the read-modify-writes of usbcmd. The only writer in the top
+ * half rings the doorbell on an IAA interrupt, which the schedule mask keeps
+ * off, and the lock orders the writers in thread context.
+ */
+void ehci_cmd_lock(struct ehci_host *edev)
+{
+	ehci_sched_disable_irq(edev);
+	while (__atomic_test_and_set(&edev->cmd_lock, __ATOMIC_ACQUIRE));
+}
+
+void ehci_cmd_unlock(struct ehci_host *edev)
+{
+	__atomic_clear(&edev->cmd_lock, __ATOMIC_RELEASE);
+	ehci_sched_enable_irq(edev);
+}
+
+/* Find the queue head of an endpoint, or create it on first use */
+static struct QHn*
+_qhn_get(struct ehci_host *edev, uint8_t addr, int8_t hub_addr,
+		uint8_t hub_port, enum usb_speed speed, struct endpoint *ep)
+{
+	struct QHn *qhn;
+
+	qhn = (struct QHn*)ep->hcpriv;
+	if (!qhn) {
+		qhn = qhn_alloc(edev, addr, hub_addr, hub_port, speed, ep);
+		qhn->mutex = usb_mutex_init(edev->mops);
+
+		if (ep->type == EP_CONTROL || ep->type == EP_BULK) {
+			ehci_add_qhn_async(edev, qhn);
+		} else if (ehci_add_qhn_periodic(edev, qhn, speed, ep)) {
+			/* Not enough periodic bandwidth left */
+			usb_mutex_destroy(edev->mops, qhn->mutex);
+			qhn_destroy(edev, qhn);
+			return NULL;
+		}
+		ep->hcpriv = qhn;
+	} else {
+		/*
+		 * The address and maximum packet size could change after
+		 * initial enumeration, update the queue head accordingly.
+		 */
+		qhn_update(qhn, addr, ep);
+	}
+
+	return qhn;
+}
+
+/* Synchronous transfers on endpoints without a timeout of their own */
+#define EHCI_SYNC_TIMEOUT_MS 3000
+
+/*
+ * Wait for the transfers already queued on @qhn ahead of a synchronous one.
+ * They are reaped here as well, since the caller may be the thread that
+ * would service the interrupt. Returns with the schedule interrupts masked,
+ * or -1 if the endpoint is still busy after @timeout_ms.
+ */
+static int
+_qhn_wait_idle(struct ehci_host *edev, struct QHn *qhn, int timeout_ms)
+{
+	uint32_t deadline;
+	uint64_t us, limit;
+
+	deadline = ehci_clock(edev) + timeout_ms * 8;
+	limit = timeout_ms * 1000ULL * EHCI_SYNC_MARGIN;
+	us = 0;
+	ehci_sched_disable_irq(edev);
+	while (!qhn_is_idle(qhn)) {
+		ehci_async_complete(edev);
+		if (qhn_is_idle(qhn)) {
+			break;
+		}
+		ehci_sched_enable_irq(edev);
+		if ((int32_t)(ehci_clock(edev) - deadline) >= 0 ||
+				us >= limit) {
+			EHCI_ERR(edev, "Endpoint %d busy\n", qhn->ep->num);
+			return -1;
+		}
+		udelay(EHCI_SYNC_POLL_US);
+		us += EHCI_SYNC_POLL_US;
+		ehci_sched_disable_irq(edev);
+	}
 
-	irq = edev->op_regs->usbintr;
-	irq &= ~EHCIINTR_USBINT;
-	edev->op_regs->usbintr = irq;
+	return 0;
 }
 
 int ehci_schedule_xact(usb_host_t* hdev, uint8_t addr, int8_t hub_addr, uint8_t hub_port,
@@ -108,6 +244,7 @@ int ehci_schedule_xact(usb_host_t* hdev, uint8_t addr, int8_t hub_addr, uint8_t
     struct QHn *qhn;
     struct TDn *tdn;
     struct ehci_host* edev;
+    int timeout_ms;
     int ret;
 
     usb_assert(hdev);
@@ -121,31 +258,23 @@ int ehci_schedule_xact(usb_host_t* hdev, uint8_t addr, int8_t hub_addr, uint8_t
         }
     }
 
-    qhn = (struct QHn*)ep->hcpriv;
-    if (!qhn) {
-	    qhn = qhn_alloc(edev, addr, hub_addr, hub_port, speed, ep);
-	    qhn->mutex = usb_mutex_init(edev->mops);
-	    ep->hcpriv = qhn;
-
-	    if (ep->type == EP_CONTROL || ep->type == EP_BULK) {
-		    ehci_add_qhn_async(edev, qhn);
-	    } else {
-		    ehci_add_qhn_periodic(edev, qhn);
-	    }
+    /* Isochronous endpoints go through ehci_schedule_iso */
+    if (ep->type == EP_ISOCHRONOUS) {
+        return -1;
+    }
 
-    } else {
-	    /*
-	     * The address and maximum packet size could change after initial
-	     * enumeration, update the queue head accordingly.
-	     */
-	    qhn_update(qhn, addr, ep);
+    qhn = _qhn_get(edev, addr, hub_addr, hub_port, speed, ep);
+    if (!qhn) {
+        return -1;
     }
 
     /* Allocate qTD */
     tdn = qtd_alloc(edev, speed, ep, xact, nxact, cb, t);
+    if (!tdn) {
+        return -1;
+    }
 
-    qhn->cb = cb;
-    qhn->token = t;
+    _trace_submit(edev, qhn, tdn);
     
     /* Add qTD to the queue head and send off over the bus */
     if (ep->type == EP_BULK || ep->type == EP_CONTROL) {
@@ -155,10 +284,17 @@ int ehci_schedule_xact(usb_host_t* hdev, uint8_t addr, int8_t hub_addr, uint8_t
 		return 0;
 	} else {
 		/* Wait for the existing TD to be processed */
-		while(qhn->tdns != NULL);
-		ehci_sched_disable_irq(edev);
+		timeout_ms = ep->timeout_ms ? ep->timeout_ms :
+			EHCI_SYNC_TIMEOUT_MS;
+		if (_qhn_wait_idle(edev, qhn, timeout_ms)) {
+			qtd_free(edev, tdn);
+			return -1;
+		}
 		qtd_enqueue(edev, qhn, tdn);
-		ret = ehci_wait_for_completion(tdn);
+		ret = ehci_wait_for_completion(edev, tdn, timeout_ms);
+		if (ret < 0) {
+			ehci_cancel_xact(hdev, ep);
+		}
 		ehci_async_complete(edev);
 		ehci_sched_enable_irq(edev);
 		return ret;
@@ -169,45 +305,172 @@ int ehci_schedule_xact(usb_host_t* hdev, uint8_t addr, int8_t hub_addr, uint8_t
     }
 }
 
+/*
+ * The TDs of up to EHCI_BATCH transfers are built first, then linked and
+ * activated together, and the schedules are enabled once per round.
+ */
+#define EHCI_BATCH 16
+
+int ehci_schedule_batch(usb_host_t* hdev, struct usb_hcd_req* reqs, int n)
+{
+	struct ehci_host *edev;
+	struct usb_hcd_req *r;
+	struct QHn *qhns[EHCI_BATCH];
+	struct TDn *tdns[EHCI_BATCH];
+	struct QHn *async;
+	int periodic, failed = 0;
+	int done, cnt;
+
+	usb_assert(hdev);
+	edev = _hcd_to_ehci(hdev);
+
+	for (done = 0; done < n && !failed; done += cnt) {
+		async = NULL;
+		periodic = 0;
+		for (cnt = 0; cnt < EHCI_BATCH && done + cnt < n; cnt++) {
+			r = &reqs[done + cnt];
+			if (!r->cb || r->ep->type == EP_ISOCHRONOUS) {
+				failed = 1;
+				break;
+			}
+			qhns[cnt] = NULL;
+			if (r->hub_addr == -1) {
+				/* The root hub is emulated, nothing to batch */
+				if (ehci_schedule_xact(hdev, r->addr, r->hub_addr,
+						r->hub_port, r->speed, r->ep,
+						r->xact, r->nxact, r->cb,
+						r->token) < 0) {
+					failed = 1;
+					break;
+				}
+				continue;
+			}
+			qhns[cnt] = _qhn_get(edev, r->addr, r->hub_addr,
+					r->hub_port, r->speed, r->ep);
+			if (!qhns[cnt]) {
+				failed = 1;
+				break;
+			}
+			tdns[cnt] = qtd_alloc(edev, r->speed, r->ep, r->xact,
+					r->nxact, r->cb, r->token);
+			if (!tdns[cnt]) {
+				failed = 1;
+				break;
+			}
+			_trace_submit(edev, qhns[cnt], tdns[cnt]);
+			if (r->ep->type == EP_BULK || r->ep->type == EP_CONTROL) {
+				async = async ? async : qhns[cnt];
+			} else {
+				periodic = 1;
+			}
+		}
+		if (async) {
+			ehci_schedule_async(edev, async);
+		}
+		qtd_enqueue_batch(edev, qhns, tdns, cnt);
+		if (periodic) {
+			ehci_schedule_periodic(edev);
+		}
+	}
+
+	return (done == 0 && n > 0) ? -1 : done;
+}
+
+int ehci_schedule_iso(usb_host_t* hdev, uint8_t addr, int8_t hub_addr,
+		uint8_t hub_port, enum usb_speed speed, struct endpoint *ep,
+		struct iso_pkt* pkt, int npkt, int start_frame,
+		usb_cb_t cb, void* t)
+{
+	struct ehci_host *edev;
+	struct ISOn *ison;
+
+	usb_assert(hdev);
+	usb_assert(ep);
+	edev = _hcd_to_ehci(hdev);
+
+	/* The root hub has no isochronous endpoint */
+	if (hub_addr == -1 || ep->type != EP_ISOCHRONOUS || !cb) {
+		return -1;
+	}
+
+	ison = (struct ISOn*)ep->hcpriv;
+	if (!ison) {
+		ison = ehci_iso_alloc(edev, addr, hub_addr, hub_port, speed, ep);
+		if (!ison) {
+			return -1;
+		}
+		ep->hcpriv = ison;
+	}
+
+	return ehci_iso_enqueue(edev, ison, pkt, npkt, start_frame, cb, t);
+}
+
+int ehci_set_async_park(usb_host_t* hdev, int count)
+{
+	struct ehci_host *edev = _hcd_to_ehci(hdev);
+
+	if (!(edev->cap_regs->hccparams & EHCI_HCC_PARK) ||
+			count < 0 || count > 3) {
+		return -1;
+	}
+
+	/* Takes effect on the next completion */
+	edev->park_count = count;
+
+	return 0;
+}
+
+int ehci_get_frame(usb_host_t* hdev)
+{
+	struct ehci_host *edev = _hcd_to_ehci(hdev);
+
+	return UFRAME2FRAME(edev->op_regs->frindex) & USB_FRAME_MASK;
+}
+
+/*
+ * Top half: acknowledge the interrupt and retire the finished transfers onto
+ * the done queue. Callbacks, and the root hub handler which may block, are
+ * left to ehci_process_completions.
+ */
 void
 ehci_handle_irq(usb_host_t* hdev)
 {
     struct ehci_host* edev = _hcd_to_ehci(hdev);
     uint32_t sts;
+    /* Seen by ehci_sched_disable_irq() before we read the mask */
+    __atomic_store_n(&edev->in_irq, 1, __ATOMIC_SEQ_CST);
     sts = edev->op_regs->usbsts;
     sts &= edev->op_regs->usbintr;
     if (sts & EHCISTS_HOST_ERR) {
+        /* The host halts, retire what it finished before that */
         EHCI_IRQDBG(edev, "INT - host error\n");
         edev->op_regs->usbsts = EHCISTS_HOST_ERR;
         sts &= ~EHCISTS_HOST_ERR;
-        _periodic_complete(edev);
-        _async_complete(edev);
+        sts |= EHCISTS_USBINT;
     }
-    if (sts & EHCISTS_USBINT) {
-        EHCI_IRQDBG(edev, "INT - USB\n");
-        edev->op_regs->usbsts = EHCISTS_USBINT;
-        sts &= ~EHCISTS_USBINT;
+    if (sts & (EHCISTS_USBINT | EHCISTS_USBERRINT)) {
+        /* Failed transfers are reaped like the others, with their status */
+        EHCI_IRQDBG(edev, "INT - USB%s\n",
+                    (sts & EHCISTS_USBERRINT) ? " error" : "");
+        edev->op_regs->usbsts = sts & (EHCISTS_USBINT | EHCISTS_USBERRINT);
+        sts &= ~(EHCISTS_USBINT | EHCISTS_USBERRINT);
 	ehci_periodic_complete(edev);
 	ehci_async_complete(edev);
     }
     if (sts & EHCISTS_FLIST_ROLL) {
+        /* Keeps the frame clock going, and times out hung transfers */
         EHCI_IRQDBG(edev, "INT - Frame list roll over\n");
         edev->op_regs->usbsts = EHCISTS_FLIST_ROLL;
         sts &= ~EHCISTS_FLIST_ROLL;
+        ehci_periodic_complete(edev);
+        ehci_async_complete(edev);
     }
 
-    if (sts & EHCISTS_USBERRINT) {
-        EHCI_IRQDBG(edev, "INT - USB error\n");
-        edev->op_regs->usbsts = EHCISTS_USBERRINT;
-        sts &= ~EHCISTS_USBERRINT;
-        _async_complete(edev);
-        _periodic_complete(edev);
-    }
     if (sts & EHCISTS_PORTC_DET) {
         EHCI_IRQDBG(edev, "INT - root hub port change\n");
         edev->op_regs->usbsts = EHCISTS_PORTC_DET;
         sts &= ~EHCISTS_PORTC_DET;
-        _root_irq(edev);
+        __atomic_or_fetch(&edev->work, EHCI_WORK_ROOT, __ATOMIC_RELEASE);
     }
     if (sts & EHCISTS_ASYNC_ADV) {
         EHCI_IRQDBG(edev, "INT - async list advance\n");
@@ -216,25 +479,82 @@ ehci_handle_irq(usb_host_t* hdev)
         check_doorbell(edev);
     }
     if (sts) {
-        printf("Unhandled USB irq. Status: 0x%x\n", sts);
+        EHCI_ERR(edev, "Unhandled USB irq. Status: 0x%x\n", sts);
         usb_assert(!"Unhandled irq");
     }
+    __atomic_store_n(&edev->in_irq, 0, __ATOMIC_RELEASE);
+}
+
+/* Bottom half, runs the callbacks in the order the transfers completed */
+void
+ehci_process_completions(usb_host_t* hdev)
+{
+	struct ehci_host *edev = _hcd_to_ehci(hdev);
+	struct ehci_done *done, *next, *list = NULL;
+	uint32_t work;
+
+	work = __atomic_exchange_n(&edev->work, 0, __ATOMIC_ACQUIRE);
+	if ((work & EHCI_WORK_ROOT) && edev->irq_cb) {
+		_root_irq(edev);
+	}
+	if (work & EHCI_WORK_EXPIRE) {
+		/* Keep the top half off the lists while they are edited */
+		ehci_sched_disable_irq(edev);
+		ehci_async_expire(edev, ehci_clock(edev));
+		ehci_periodic_expire(edev, ehci_clock(edev));
+		ehci_sched_enable_irq(edev);
+	}
+	if (work & EHCI_WORK_PARK) {
+		ehci_async_park(edev);
+	}
+
+	done = __atomic_exchange_n(&edev->done, NULL, __ATOMIC_ACQUIRE);
+	while (done) {
+		next = done->next;
+		done->next = list;
+		list = done;
+		done = next;
+	}
+
+	while (list) {
+		done = list;
+		list = list->next;
+		if (done->cb) {
+			/* The callback may queue the next transfer */
+			done->cb(done->token, done->stat, done->rbytes);
+		}
+		usb_free(done);
+	}
 }
 
 int ehci_cancel_xact(usb_host_t* hdev, struct endpoint *ep)
 {
 	int err = 0;
+	int cnt;
 	struct ehci_host* edev = _hcd_to_ehci(hdev);
 
 	usb_assert(ep);
 
+	/* The top half may be reaping the same queue head, or walking past it */
+	ehci_sched_disable_irq(edev);
+	if (ep->hcpriv && ep->type != EP_ISOCHRONOUS) {
+		cnt = _qhn_count_inflight(ep->hcpriv);
+		ep->stats.cancels += cnt;
+		ehci_trace(edev, USB_TRACE_CANCEL, ep->hcpriv, XACTSTAT_CANCELLED, cnt);
+	}
+
 	if (ep->hcpriv) {
 		if (ep->type == EP_BULK || ep->type == EP_CONTROL) {
 			ehci_del_qhn_async(edev, ep->hcpriv);
+		} else if (ep->type == EP_ISOCHRONOUS) {
+			ehci_del_iso(edev, ep->hcpriv);
 		} else {
 			ehci_del_qhn_periodic(edev, ep->hcpriv);
 		}
+		/* The endpoint may be used again, with a new queue head */
+		ep->hcpriv = NULL;
 	}
+	ehci_sched_enable_irq(edev);
 
 	return 0;
 }
@@ -261,8 +581,14 @@ ehci_host_init(usb_host_t* hdev, uintptr_t regs,
     edev->cap_regs = (volatile struct ehci_host_cap*)regs;
     edev->op_regs = (volatile struct ehci_host_op*)(regs + edev->cap_regs->caplength);
     hdev->schedule_xact = ehci_schedule_xact;
+    hdev->schedule_batch = ehci_schedule_batch;
+    hdev->schedule_iso = ehci_schedule_iso;
+    hdev->get_frame = ehci_get_frame;
+    hdev->set_async_park = ehci_set_async_park;
     hdev->cancel_xact = ehci_cancel_xact;
     hdev->handle_irq = ehci_handle_irq;
+    hdev->process_completions = ehci_process_completions;
+    hdev->trace = NULL;
     edev->board_pwren = board_pwren;
 
     /* Check some params */
@@ -270,6 +596,13 @@ ehci_host_init(usb_host_t* hdev, uintptr_t regs,
     assert(usb_hcd_count_ports(hdev) > 0);
     assert(usb_hcd_count_ports(hdev) < 32);
     edev->bmreset_c = 0;
+    edev->done = NULL;
+    edev->work = 0;
+    edev->sched_mask = 0;
+    edev->sched_lock = 0;
+    edev->cmd_lock = 0;
+    edev->in_irq = 0;
+    edev->clk = 0;
 
     /* If the host controller has 64-bit capability, it is compulsory to use
      * 64-bit data structure(Section 2.2.4). Clear the most significant address
@@ -295,15 +628,32 @@ ehci_host_init(usb_host_t* hdev, uintptr_t regs,
         return -1;
     }
     edev->hubem = hubem;
+    edev->hdev = hdev;
     edev->dman = hdev->dman;
     edev->mops = hdev->mops;
+    err = ehci_dpool_init(edev);
+    if (err) {
+        return -1;
+    }
 
     /* Terminate the periodic schedule head */
     edev->alist_tail = NULL;
     edev->db_pending = NULL;
     edev->db_active = NULL;
+    edev->db_retire = NULL;
+    edev->parked = 0;
+    edev->park_want = 0;
+    if (edev->cap_regs->hccparams & EHCI_HCC_PARK) {
+        edev->park_count = EHCI_PARK_DEFAULT;
+    } else {
+        edev->park_count = 0;
+    }
     edev->flist = NULL;
     edev->intn_list = NULL;
+    edev->iso_frame = NULL;
+    edev->iso_list = NULL;
+    edev->tt_list = NULL;
+    memset(edev->uframe_usecs, 0, sizeof(edev->uframe_usecs));
     /* Initialise IRQ */
     edev->irq_cb = NULL;
     edev->irq_token = NULL;
@@ -324,7 +674,7 @@ ehci_host_init(usb_host_t* hdev, uintptr_t regs,
     /* Enable Interrupts */
     v = edev->op_regs->usbintr;
     v |= EHCIINTR_HOST_ERR | EHCIINTR_USBERRINT
-         | EHCIINTR_USBINT | EHCIINTR_ASYNC_ADV;
+         | EHCIINTR_USBINT | EHCIINTR_ASYNC_ADV | EHCIINTR_FLIST_ROLL;
     edev->op_regs->usbintr = v;
 
     return 0;
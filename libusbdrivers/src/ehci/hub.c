@@ -66,7 +66,8 @@ _set_pf(void *token, int port, enum port_feature feature)
         v |= EHCI_PORT_SUSPEND;
         break;
     default:
-        printf("EHCI: Unknown feature %d for set feature request\n", feature);
+        EHCI_LOG(edev, USB_LOG_WARN,
+                 "Unknown feature %d for set feature request\n", feature);
         return -1;
     }
     *ps_reg = v;
@@ -115,7 +116,8 @@ _clr_pf(void *token, int port, enum port_feature feature)
         break;
 
     default:
-        printf("EHCI: Unknown feature %d for clear feature request\n", feature);
+        EHCI_LOG(edev, USB_LOG_WARN,
+                 "Unknown feature %d for clear feature request\n", feature);
         return -1;
     }
     udelay(10);
@@ -0,0 +1,702 @@
+/*
+ * Copyright 2016, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include "../services.h"
+#include "ehci.h"
+
+/*
+ * Isochronous streams
+ *
+ * Every isochronous endpoint owns a ring of pre-allocated descriptors, iTDs
+ * for high speed devices and siTDs for full speed devices behind a
+ * transaction translator. Each descriptor carries one frame worth of packets
+ * and is hooked in front of the interrupt tree on its frame list entry. The
+ * descriptors are recycled once their frame has passed.
+ *
+ * The ring has one owner at each end, as the async queues do. Submitters
+ * fill the slots from the tail and publish them with a release store, the
+ * completer retires them from the head. Only endpoints with more than one
+ * submitter need the stream mutex. The frame list entries are shared between
+ * streams, so the submitters edit them with the schedule interrupt masked,
+ * like the synchronous path keeps the completer away.
+ */
+
+/* Number of frames from @from to @to */
+static inline int
+_frame_diff(int to, int from)
+{
+	return (to - from) & USB_FRAME_MASK;
+}
+
+/* Slots in use, the indices run freely */
+static inline unsigned int
+_iso_used(struct ISOn *ison)
+{
+	return __atomic_load_n(&ison->tail, __ATOMIC_ACQUIRE) -
+	       __atomic_load_n(&ison->head, __ATOMIC_ACQUIRE);
+}
+
+static inline int
+_iso_is_shared(struct ISOn *ison)
+{
+	return ison->ep->nsubmitters > 1;
+}
+
+/* Has the host finished with the given frame? */
+static inline int
+_frame_passed(int frame, int now)
+{
+	int diff = _frame_diff(now, frame);
+	return diff != 0 && diff <= USB_FRAME_MASK / 2;
+}
+
+static inline int
+_current_frame(struct ehci_host *edev)
+{
+	return UFRAME2FRAME(edev->op_regs->frindex) & USB_FRAME_MASK;
+}
+
+/* The link pointer is the first word of both iTD and siTD */
+static inline volatile uint32_t*
+_iso_next(struct ISOslot *slot)
+{
+	return (volatile uint32_t*)slot->desc;
+}
+
+static inline int
+_iso_is_hs(struct ISOn *ison)
+{
+	return ison->speed == USBSPEED_HIGH;
+}
+
+/*
+ * Start and complete split masks of a full speed isochronous packet starting
+ * in micro frame @start, USB 2.0 spec 11.18.4. The full speed bus moves at
+ * most 188 bytes per micro frame. Returns -1 if the splits run past the end
+ * of the frame, which would need a frame span traversal node; such a start
+ * must not be used.
+ */
+static int
+_sitd_masks(int dir_in, int maxpkt, int start, uint8_t *smask, uint8_t *cmask)
+{
+	int n = MAX((maxpkt + 187) / 188, 1);
+	int end;
+
+	*smask = 0;
+	*cmask = 0;
+	if (dir_in) {
+		*smask = BIT(start);
+		end = start + n + 4;
+		for (int u = start + 2; u < MIN(end, 8); u++) {
+			*cmask |= BIT(u);
+		}
+	} else {
+		end = start + n;
+		for (int u = start; u < MIN(end, 8); u++) {
+			*smask |= BIT(u);
+		}
+	}
+
+	return end > 8 ? -1 : 0;
+}
+
+/* Admission control, the phase is dictated by the first frame queued */
+static int
+_iso_reserve(struct ehci_host *edev, struct ISOn *ison, int frame)
+{
+	int phase, load, best = -1;
+	uint8_t smask, cmask;
+
+	phase = frame % ison->rate;
+
+	if (_iso_is_hs(ison)) {
+		for (int u = 0; u < MIN(ison->uframes, 8); u++) {
+			smask = 0;
+			for (int i = u; i < 8; i += ison->uframes) {
+				smask |= BIT(i);
+			}
+			load = ehci_periodic_load(edev, ison->rate, phase, smask);
+			if (load + ison->usecs > EHCI_UFRAME_USECS_MAX) {
+				continue;
+			}
+			if (best < 0 || load < best) {
+				best = load;
+				ison->smask = smask;
+			}
+		}
+		ison->cmask = 0;
+	} else {
+		/* Pick a start split that the transaction translator can take */
+		ison->tt = ehci_tt_get(edev, ison->hub_addr);
+		if (!ison->tt) {
+			return -1;
+		}
+		ison->tt_bytes = ehci_tt_bytes(ison->speed, EP_ISOCHRONOUS,
+				ison->maxpkt);
+		for (int u = 0; u < 7; u++) {
+			if (_sitd_masks(ison->ep->dir == EP_DIR_IN,
+					ison->maxpkt, u, &smask, &cmask)) {
+				/* Ran out of micro frames for the splits */
+				break;
+			}
+			if (!ehci_tt_fits(ison->tt, ison->rate, phase, u,
+					ison->tt_bytes)) {
+				continue;
+			}
+			load = ehci_periodic_load(edev, ison->rate, phase,
+					smask | cmask);
+			if (load + ison->usecs > EHCI_UFRAME_USECS_MAX) {
+				continue;
+			}
+			if (best < 0 || load < best) {
+				best = load;
+				ison->smask = smask;
+				ison->cmask = cmask;
+			}
+		}
+	}
+
+	if (best < 0) {
+		if (ison->tt) {
+			ehci_tt_put(edev, ison->tt);
+			ison->tt = NULL;
+		}
+		return -1;
+	}
+
+	ison->phase = phase;
+	ehci_periodic_claim(edev, ison->rate, ison->phase,
+			ison->smask | ison->cmask, ison->usecs);
+	if (ison->tt) {
+		ehci_tt_claim(ison->tt, ison->rate, ison->phase,
+				CTZ(ison->smask), ison->tt_bytes);
+	}
+
+	return 0;
+}
+
+static void
+_iso_free(struct ehci_host *edev, struct ISOn *ison)
+{
+	size_t size;
+
+	size = _iso_is_hs(ison) ? sizeof(struct ITD) : sizeof(struct SITD);
+	if (ison->slots) {
+		for (int i = 0; i < ison->nslots; i++) {
+			if (ison->slots[i].desc) {
+				ehci_desc_free(edev,
+						(void*)ison->slots[i].desc, size);
+			}
+		}
+		usb_free(ison->slots);
+	}
+	if (ison->mutex) {
+		usb_mutex_destroy(edev->mops, ison->mutex);
+	}
+	usb_free(ison);
+}
+
+struct ISOn*
+ehci_iso_alloc(struct ehci_host *edev, uint8_t address, uint8_t hub_addr,
+		uint8_t hub_port, enum usb_speed speed, struct endpoint *ep)
+{
+	struct ISOn *ison;
+	struct ISOslot *slot;
+	size_t size;
+
+	ison = usb_malloc(sizeof(struct ISOn));
+	if (!ison) {
+		return NULL;
+	}
+
+	ison->ep = ep;
+	ison->speed = speed;
+	ison->addr = address;
+	ison->hub_addr = hub_addr;
+	ison->hub_port = hub_port;
+	ison->maxpkt = ep->max_pkt & 0x7ff;
+	ison->rate = ehci_periodic_period(speed, ep, &ison->uframes);
+	ison->phase = -1;
+	ison->next_frame = -1;
+
+	if (_iso_is_hs(ison)) {
+		ison->mult = ((ep->max_pkt >> 11) & 0x3) + 1;
+		ison->usecs = NS_TO_US(HS_NSECS_ISO(ison->maxpkt * ison->mult));
+		size = sizeof(struct ITD);
+	} else {
+		ison->mult = 1;
+		ison->usecs = NS_TO_US(HS_NSECS_ISO(MIN(ison->maxpkt, 188)));
+		size = sizeof(struct SITD);
+	}
+
+	/* Pre-allocate the descriptor ring */
+	ison->nslots = EHCI_ISO_RING;
+	ison->slots = usb_malloc(ison->nslots * sizeof(struct ISOslot));
+	if (!ison->slots) {
+		_iso_free(edev, ison);
+		return NULL;
+	}
+	for (int i = 0; i < ison->nslots; i++) {
+		slot = &ison->slots[i];
+		slot->desc = ehci_desc_alloc(edev, size, &slot->pdesc);
+		if (!slot->desc) {
+			_iso_free(edev, ison);
+			return NULL;
+		}
+	}
+	ison->mutex = usb_mutex_init(edev->mops);
+
+	/* The completer may be walking the list */
+	ison->next = edev->iso_list;
+	__atomic_store_n(&edev->iso_list, ison, __ATOMIC_RELEASE);
+
+	return ison;
+}
+
+/* Fill in an iTD, one packet for every micro frame in the S-mask */
+static void
+_itd_fill(struct ISOn *ison, struct ISOslot *slot, int ioc)
+{
+	volatile struct ITD *itd = slot->desc;
+	uintptr_t pages[7];
+	int npage = 0, last = -1, i = 0;
+	struct iso_pkt *p;
+	uintptr_t paddr;
+
+	for (int u = 0; u < 8; u++) {
+		itd->transaction[u] = 0;
+	}
+
+	for (int u = 0; u < 8 && i < slot->npkt; u++) {
+		if (!(ison->smask & BIT(u))) {
+			continue;
+		}
+		p = &slot->pkt[i++];
+		p->actual_len = 0;
+		paddr = p->xact.paddr;
+
+		/* Packets may share a page, and may run into the next one */
+		if (npage == 0 || pages[npage - 1] != (paddr & ITDBUF_PAGE_MASK)) {
+			if (npage == 7) {
+				p->status = XACTSTAT_ERROR;
+				continue;
+			}
+			pages[npage++] = paddr & ITDBUF_PAGE_MASK;
+		}
+		if ((paddr & 0xfff) + p->xact.len > 0x1000) {
+			if (npage == 7) {
+				p->status = XACTSTAT_ERROR;
+				continue;
+			}
+			pages[npage++] = (paddr & ITDBUF_PAGE_MASK) + 0x1000;
+			itd->transaction[u] = ITDTX_PG(npage - 2);
+		} else {
+			itd->transaction[u] = ITDTX_PG(npage - 1);
+		}
+
+		p->status = XACTSTAT_PENDING;
+		itd->transaction[u] |= ITDTX_ACTIVE | ITDTX_LEN(p->xact.len) |
+				       ITDTX_OFFSET(paddr);
+		last = u;
+	}
+
+	if (ioc && last >= 0) {
+		itd->transaction[last] |= ITDTX_IOC;
+	}
+
+	for (i = 0; i < 7; i++) {
+		itd->buf[i] = i < npage ? EHCI_ADDR_LO(pages[i]) : 0;
+		itd->buf_hi[i] = i < npage ? EHCI_ADDR_HI(pages[i]) : 0;
+	}
+	itd->buf[0] |= ITDBUF0_EP(ison->ep->num) | ITDBUF0_ADDR(ison->addr);
+	itd->buf[1] |= ITDBUF1_MAXPKT(ison->maxpkt);
+	if (ison->ep->dir == EP_DIR_IN) {
+		itd->buf[1] |= ITDBUF1_DIR_IN;
+	}
+	itd->buf[2] |= ITDBUF2_MULT(ison->mult);
+}
+
+/* Fill in a siTD, always a single packet */
+static void
+_sitd_fill(struct ISOn *ison, struct ISOslot *slot, int ioc)
+{
+	volatile struct SITD *sitd = slot->desc;
+	struct iso_pkt *p = slot->pkt;
+	uintptr_t paddr = p->xact.paddr;
+	int n;
+
+	p->status = XACTSTAT_PENDING;
+	p->actual_len = 0;
+
+	sitd->epc = SITDEPC_PORT(ison->hub_port) |
+		    SITDEPC_HUB_ADDR(ison->hub_addr) |
+		    SITDEPC_EP(ison->ep->num) | SITDEPC_ADDR(ison->addr);
+	if (ison->ep->dir == EP_DIR_IN) {
+		sitd->epc |= SITDEPC_DIR_IN;
+	}
+	sitd->uframe = SITDUF_SMASK(ison->smask) | SITDUF_CMASK(ison->cmask);
+
+	sitd->buf[0] = EHCI_ADDR_LO(paddr);
+	sitd->buf[1] = EHCI_ADDR_LO((paddr & ~(uintptr_t)0xfff) + 0x1000);
+	if (ison->ep->dir == EP_DIR_OUT) {
+		/* Number of start splits needed to send the data */
+		n = MAX((p->xact.len + 187) / 188, 1);
+		sitd->buf[1] |= SITDBUF1_TCOUNT(n);
+		sitd->buf[1] |= n == 1 ? SITDBUF1_TP_ALL : SITDBUF1_TP_BEGIN;
+	}
+	sitd->buf_hi[0] = EHCI_ADDR_HI(paddr);
+	sitd->buf_hi[1] = EHCI_ADDR_HI((paddr & ~(uintptr_t)0xfff) + 0x1000);
+	sitd->back = TDLP_INVALID;
+
+	sitd->state = SITDST_BYTES(p->xact.len) | SITDST_ACTIVE;
+	if (ioc) {
+		sitd->state |= SITDST_IOC;
+	}
+}
+
+/* Hook a filled descriptor in front of its frame list entry */
+static void
+_iso_link(struct ehci_host *edev, struct ISOn *ison, struct ISOslot *slot)
+{
+	int idx = slot->frame & (edev->flist_size - 1);
+	uint32_t type;
+
+	type = _iso_is_hs(ison) ? QHLP_TYPE_ITD : QHLP_TYPE_SITD;
+
+	*_iso_next(slot) = edev->flist[idx];
+	slot->fnext = edev->iso_frame[idx];
+	dsb();
+	edev->flist[idx] = slot->pdesc | type;
+	edev->iso_frame[idx] = slot;
+}
+
+static void
+_iso_unlink(struct ehci_host *edev, struct ISOslot *slot)
+{
+	int idx = slot->frame & (edev->flist_size - 1);
+	struct ISOslot *prev;
+
+	if (edev->iso_frame[idx] == slot) {
+		edev->flist[idx] = *_iso_next(slot);
+		edev->iso_frame[idx] = slot->fnext;
+	} else {
+		prev = edev->iso_frame[idx];
+		while (prev && prev->fnext != slot) {
+			prev = prev->fnext;
+		}
+		usb_assert(prev);
+		*_iso_next(prev) = *_iso_next(slot);
+		prev->fnext = slot->fnext;
+	}
+	slot->fnext = NULL;
+}
+
+static int
+_iso_enqueue(struct ehci_host *edev, struct ISOn *ison,
+		struct iso_pkt *pkt, int npkt, int start_frame,
+		usb_cb_t cb, void *token)
+{
+	struct ISOslot *slot;
+	struct ISOreq *req;
+	int ppf, nslots, frame, now;
+	unsigned int used;
+
+	usb_assert(pkt);
+	usb_assert(cb);
+	if (npkt <= 0) {
+		return -1;
+	}
+	for (int i = 0; i < npkt; i++) {
+		if (!EHCI_ADDR_OK(edev, pkt[i].xact.paddr, pkt[i].xact.len)) {
+			return -1;
+		}
+	}
+
+	if (!edev->flist && ehci_periodic_init(edev)) {
+		return -1;
+	}
+
+	/* Packets per descriptor */
+	ppf = _iso_is_hs(ison) ? 8 / MIN(ison->uframes, 8) : 1;
+	nslots = (npkt + ppf - 1) / ppf;
+	used = _iso_used(ison);
+	if (nslots > ison->nslots - (int)used) {
+		return -1;
+	}
+
+	/* Pick the first frame */
+	now = _current_frame(edev);
+	if (start_frame < 0) {
+		frame = ison->next_frame;
+		if (frame < 0 || _frame_passed(frame, now) ||
+				_frame_diff(frame, now) < EHCI_ISO_SLACK) {
+			frame = (now + EHCI_ISO_SLACK) & USB_FRAME_MASK;
+		}
+	} else {
+		frame = start_frame & USB_FRAME_MASK;
+		if (_frame_diff(frame, now) < EHCI_ISO_SLACK ||
+				_frame_passed(frame, now)) {
+			return -1;
+		}
+		if (used && _frame_passed(frame, ison->next_frame)) {
+			/* Overlaps the packets already queued */
+			return -1;
+		}
+	}
+
+	if (ison->phase < 0 && _iso_reserve(edev, ison, frame)) {
+		EHCI_DBG(edev, "Out of periodic bandwidth for ep %d\n",
+				ison->ep->num);
+		return -1;
+	}
+
+	/* Align to the reserved phase */
+	frame += (ison->phase - frame % ison->rate + ison->rate) % ison->rate;
+	frame &= USB_FRAME_MASK;
+
+	/* Must not wrap around the frame list */
+	if (_frame_diff(frame + (nslots - 1) * ison->rate, now) >=
+			edev->flist_size) {
+		return -1;
+	}
+
+	req = usb_malloc(sizeof(struct ISOreq));
+	if (!req) {
+		return -1;
+	}
+	req->pending = nslots;
+	req->stat = XACTSTAT_SUCCESS;
+	req->rbytes = 0;
+	req->done = usb_malloc(sizeof(struct ehci_done));
+	if (!req->done) {
+		usb_free(req);
+		return -1;
+	}
+	req->done->cb = cb;
+	req->done->token = token;
+
+	for (int i = 0; i < nslots; i++) {
+		slot = &ison->slots[(ison->tail + i) % ison->nslots];
+		slot->req = req;
+		slot->pkt = pkt + i * ppf;
+		slot->npkt = MIN(ppf, npkt - i * ppf);
+		slot->frame = frame;
+
+		for (int j = 0; j < slot->npkt; j++) {
+			ehci_buf_to_dev(edev, slot->pkt[j].xact.vaddr,
+					slot->pkt[j].xact.len,
+					ison->ep->dir == EP_DIR_IN);
+		}
+		if (_iso_is_hs(ison)) {
+			_itd_fill(ison, slot, i == nslots - 1);
+		} else {
+			_sitd_fill(ison, slot, i == nslots - 1);
+		}
+		frame = (frame + ison->rate) & USB_FRAME_MASK;
+	}
+	ison->next_frame = frame;
+
+	/* Hand the slots to the host, then to the completer */
+	ehci_sched_disable_irq(edev);
+	for (int i = 0; i < nslots; i++) {
+		slot = &ison->slots[(ison->tail + i) % ison->nslots];
+		_iso_link(edev, ison, slot);
+	}
+	ehci_sched_enable_irq(edev);
+	__atomic_store_n(&ison->tail, ison->tail + nslots, __ATOMIC_RELEASE);
+
+	return ehci_schedule_periodic(edev);
+}
+
+int
+ehci_iso_enqueue(struct ehci_host *edev, struct ISOn *ison,
+		struct iso_pkt *pkt, int npkt, int start_frame,
+		usb_cb_t cb, void *token)
+{
+	int shared, err;
+
+	shared = _iso_is_shared(ison);
+	if (shared) {
+		usb_mutex_lock(edev->mops, ison->mutex);
+	}
+	err = _iso_enqueue(edev, ison, pkt, npkt, start_frame, cb, token);
+	if (shared) {
+		usb_mutex_unlock(edev->mops, ison->mutex);
+	}
+
+	return err;
+}
+
+/* Collect the per packet results, returns 0 if the frame is still pending */
+static int
+_iso_slot_done(struct ISOn *ison, struct ISOslot *slot, int now)
+{
+	struct ISOreq *req = slot->req;
+	struct iso_pkt *p;
+	uint32_t st;
+	int i = 0;
+
+	if (_iso_is_hs(ison)) {
+		volatile struct ITD *itd = slot->desc;
+
+		if (!_frame_passed(slot->frame, now)) {
+			for (int u = 0; u < 8; u++) {
+				if (itd->transaction[u] & ITDTX_ACTIVE) {
+					return 0;
+				}
+			}
+		}
+
+		for (int u = 0; u < 8 && i < slot->npkt; u++) {
+			if (!(ison->smask & BIT(u))) {
+				continue;
+			}
+			p = &slot->pkt[i++];
+			if (p->status != XACTSTAT_PENDING) {
+				continue;
+			}
+			st = itd->transaction[u];
+			if (st & (ITDTX_ACTIVE | ITDTX_ERROR)) {
+				/* Missed or broken micro frame */
+				p->status = XACTSTAT_ERROR;
+			} else {
+				p->status = XACTSTAT_SUCCESS;
+				if (ison->ep->dir == EP_DIR_IN) {
+					p->actual_len = ITDTX_GET_LEN(st);
+				} else {
+					p->actual_len = p->xact.len;
+				}
+			}
+		}
+	} else {
+		volatile struct SITD *sitd = slot->desc;
+
+		st = sitd->state;
+		if ((st & SITDST_ACTIVE) && !_frame_passed(slot->frame, now)) {
+			return 0;
+		}
+
+		p = slot->pkt;
+		if (st & (SITDST_ACTIVE | SITDST_ERROR)) {
+			p->status = XACTSTAT_ERROR;
+		} else {
+			p->status = XACTSTAT_SUCCESS;
+			p->actual_len = p->xact.len - SITDST_GET_BYTES(st);
+		}
+	}
+
+	for (i = 0; i < slot->npkt; i++) {
+		p = &slot->pkt[i];
+		if (p->status != XACTSTAT_SUCCESS) {
+			req->stat = XACTSTAT_ERROR;
+		}
+		req->rbytes += p->xact.len - p->actual_len;
+	}
+
+	return 1;
+}
+
+static void
+_iso_retire(struct ehci_host *edev, struct ISOn *ison, struct ISOslot *slot)
+{
+	struct ISOreq *req = slot->req;
+
+	slot->req = NULL;
+	/* The slot may be filled again from here on */
+	__atomic_store_n(&ison->head, ison->head + 1, __ATOMIC_RELEASE);
+
+	if (--req->pending == 0) {
+		ehci_done_push(edev, req->done, req->stat, req->rbytes);
+		usb_free(req);
+	}
+}
+
+void
+ehci_iso_complete(struct ehci_host *edev)
+{
+	struct ISOn *ison;
+	struct ISOslot *slot;
+	int now;
+
+	if (!edev->iso_list) {
+		return;
+	}
+
+	now = _current_frame(edev);
+	for (ison = edev->iso_list; ison; ison = ison->next) {
+		while (ison->head != __atomic_load_n(&ison->tail,
+					__ATOMIC_ACQUIRE)) {
+			slot = &ison->slots[ison->head % ison->nslots];
+			if (!_iso_slot_done(ison, slot, now)) {
+				break;
+			}
+			if (ison->ep->dir == EP_DIR_IN) {
+				for (int i = 0; i < slot->npkt; i++) {
+					ehci_buf_to_cpu(edev,
+						slot->pkt[i].xact.vaddr,
+						slot->pkt[i].actual_len);
+				}
+			}
+			_iso_unlink(edev, slot);
+			_iso_retire(edev, ison, slot);
+		}
+	}
+}
+
+void
+ehci_del_iso(struct ehci_host *edev, struct ISOn *ison)
+{
+	struct ISOn **prev;
+	struct ISOslot *slot;
+
+	/* Keep the completer off the stream while it is taken apart */
+	ehci_sched_disable_irq(edev);
+
+	/* Remove from the software list */
+	prev = &edev->iso_list;
+	while (*prev && *prev != ison) {
+		prev = &(*prev)->next;
+	}
+	if (!*prev) {
+		ehci_sched_enable_irq(edev);
+		return;
+	}
+	*prev = ison->next;
+
+	/* Take all descriptors off the frame list */
+	for (unsigned int i = ison->head; i != ison->tail; i++) {
+		_iso_unlink(edev, &ison->slots[i % ison->nslots]);
+	}
+	ehci_sched_enable_irq(edev);
+	ehci_periodic_wait_frame(edev);
+
+	/* Report the remaining packets as cancelled */
+	while (ison->head != ison->tail) {
+		slot = &ison->slots[ison->head % ison->nslots];
+		for (int i = 0; i < slot->npkt; i++) {
+			if (slot->pkt[i].status == XACTSTAT_PENDING) {
+				slot->pkt[i].status = XACTSTAT_CANCELLED;
+			}
+		}
+		slot->req->stat = XACTSTAT_CANCELLED;
+		_iso_retire(edev, ison, slot);
+	}
+
+	if (ison->phase >= 0) {
+		ehci_periodic_claim(edev, ison->rate, ison->phase,
+				ison->smask | ison->cmask, -ison->usecs);
+		if (ison->tt) {
+			ehci_tt_claim(ison->tt, ison->rate, ison->phase,
+					CTZ(ison->smask), -ison->tt_bytes);
+			ehci_tt_put(edev, ison->tt);
+		}
+	}
+	_iso_free(edev, ison);
+}
@@ -11,116 +11,472 @@
 #include "../services.h"
 #include "ehci.h"
 
-/**************************
- **** Queue scheduling ****
- **************************/
+/****************************
+ **** Periodic bandwidth ****
+ ***************************/
+
+/*
+ * Translate the endpoint's bInterval into a polling period in frames, and the
+ * distance between two transactions in micro frames when the endpoint is
+ * polled more than once per frame.
+ */
+int
+ehci_periodic_period(enum usb_speed speed, struct endpoint *ep, int *uframes)
+{
+	int interval, period;
+
+	interval = ep->interval ? ep->interval : 1;
+
+	/*
+	 * bInterval is an exponent for high speed and isochronous endpoints,
+	 * USB 2.0 spec 9.6.6
+	 */
+	if (speed == USBSPEED_HIGH || ep->type == EP_ISOCHRONOUS) {
+		if (interval > 16) {
+			interval = 16;
+		}
+		interval = 1 << (interval - 1);
+		if (speed == USBSPEED_HIGH) {
+			/* Micro frames */
+			if (interval < 8) {
+				*uframes = interval;
+				return 1;
+			}
+			interval /= 8;
+		}
+	}
+
+	/* Round down to a power of two number of frames */
+	period = 1;
+	while (period * 2 <= interval) {
+		period *= 2;
+	}
+
+	*uframes = 8;
+	return MIN(period, EHCI_PERIODIC_MAX);
+}
+
+/* Busiest micro frame touched by the given placement */
+int
+ehci_periodic_load(struct ehci_host *edev, int period, int phase, uint8_t smask)
+{
+	int load = 0;
+
+	for (int f = phase; f < EHCI_PERIODIC_MAX; f += period) {
+		for (int u = 0; u < 8; u++) {
+			if ((smask & BIT(u)) && edev->uframe_usecs[f][u] > load) {
+				load = edev->uframe_usecs[f][u];
+			}
+		}
+	}
+
+	return load;
+}
 
 void
-_qhn_deschedule(struct ehci_host* dev, struct QHn* qhn)
+ehci_periodic_claim(struct ehci_host *edev, int period, int phase,
+		uint8_t smask, int usecs)
 {
-    int i;
-    /* TODO only supporting 1 int */
-    for (i = 0; i < dev->flist_size; i++) {
-        dev->flist[i] = QHLP_INVALID;
-    }
+	for (int f = phase; f < EHCI_PERIODIC_MAX; f += period) {
+		for (int u = 0; u < 8; u++) {
+			if (smask & BIT(u)) {
+				edev->uframe_usecs[f][u] += usecs;
+			}
+		}
+	}
 }
 
+/***************************************
+ **** Transaction translator budget ****
+ **************************************/
+
 /*
- * TODO: We only support interrupt endpoint at the moment, this function is
- * subject to change when we add isochronous endpoint support.
+ * XXX: We don't know whether a hub has one TT per port, so all ports of a hub
+ * share one budget. This is overly conservative for multi-TT hubs.
  */
-void ehci_add_qhn_periodic(struct ehci_host *edev, struct QHn *qhn)
+struct ehci_tt*
+ehci_tt_get(struct ehci_host *edev, uint8_t hub_addr)
 {
-	struct QHn *last_qhn;
+	struct ehci_tt *tt;
 
-	/* Allocate the frame list */
-	if (!edev->flist) {
-		/* XXX: The frame list size is default to 1024 */
-		edev->flist_size = 1024;
-		edev->flist = ps_dma_alloc_pinned(edev->dman,
-				edev->flist_size * sizeof(uint32_t*), 0x1000, 0,
-				PS_MEM_NORMAL, &edev->pflist);
-		usb_assert(edev->flist);
-
-		/* Mark all frames as disabled */
-		for (int i = 0; i < edev->flist_size; i++) {
-			edev->flist[i] = TDLP_INVALID;
+	for (tt = edev->tt_list; tt; tt = tt->next) {
+		if (tt->hub_addr == hub_addr) {
+			tt->users++;
+			return tt;
 		}
 	}
 
-	/* Find an empty slot and insert the queue head */
-	for (int i = 0; i < edev->flist_size; i++) {
-		/*
-		 * FIXME: We disable an interrupt ep by setting the TDLP_INVALID
-		 * of the frame list, there is a race here.
-		 */
-		if (edev->flist[i] & TDLP_INVALID) {
-			edev->flist[i] = qhn->pqh | QHLP_TYPE_QH;
-			break;
-		}
+	tt = usb_malloc(sizeof(struct ehci_tt));
+	if (!tt) {
+		return NULL;
 	}
+	tt->hub_addr = hub_addr;
+	tt->users = 1;
+	tt->next = edev->tt_list;
+	edev->tt_list = tt;
 
-	/* Add new queue head to the software queue */
-	if (edev->intn_list) {
-		/* Find the last queue head */
-		last_qhn = edev->intn_list;
-		while (last_qhn->next) {
-		    last_qhn = last_qhn->next;
-		}
+	return tt;
+}
+
+void
+ehci_tt_put(struct ehci_host *edev, struct ehci_tt *tt)
+{
+	struct ehci_tt **prev;
 
-		/* Add queue head to the list */
-		last_qhn->next = qhn;
-		/* TODO: Do we really need this line? */
-		last_qhn->qh->qhlptr = qhn->pqh | QHLP_TYPE_QH;
+	if (!tt || --tt->users) {
+		return;
+	}
+
+	prev = &edev->tt_list;
+	while (*prev != tt) {
+		prev = &(*prev)->next;
+	}
+	*prev = tt->next;
+	usb_free(tt);
+}
+
+/*
+ * Full/low speed bus time of one transaction in full speed byte times,
+ * including bit stuffing and the protocol overhead(USB 2.0 spec 5.11.3).
+ */
+int
+ehci_tt_bytes(enum usb_speed speed, enum usb_endpoint_type type, int maxpkt)
+{
+	int bytes = 7 * maxpkt / 6;
+
+	if (speed == USBSPEED_LOW) {
+		/* Low speed is 8 times slower, plus the preamble */
+		return bytes * 8 + 96;
+	} else if (type == EP_ISOCHRONOUS) {
+		return bytes + 11;
 	} else {
-		edev->intn_list = qhn;
+		return bytes + 14;
 	}
 }
 
-void ehci_del_qhn_periodic(struct ehci_host *edev, struct QHn *qhn)
+/*
+ * The full speed transaction starts one micro frame after the start split and
+ * fills the following micro frames at most 188 bytes at a time.
+ */
+int
+ehci_tt_fits(struct ehci_tt *tt, int period, int phase, int uframe,
+		int bytes)
 {
-	struct QHn *prev, *cur;
-	struct TDn *tdn, *tmp;
+	int total, left, u;
 
-	/* Remove from the frame list */
-	for (int i = 0; i < edev->flist_size; i++) {
-		if (edev->flist[i] == (qhn->pqh | QHLP_TYPE_QH)) {
-			edev->flist[i] = TDLP_INVALID;
-			break;
+	for (int f = phase; f < EHCI_PERIODIC_MAX; f += period) {
+		total = 0;
+		for (u = 0; u < 8; u++) {
+			total += tt->bytes[f][u];
+		}
+		if (total + bytes > EHCI_TT_FRAME_BYTES) {
+			return 0;
+		}
+
+		left = bytes;
+		for (u = uframe + 1; u < 8 && left > 0; u++) {
+			left -= EHCI_TT_UFRAME_BYTES - tt->bytes[f][u];
+		}
+		if (left > 0) {
+			return 0;
 		}
 	}
 
-	/* Remove from the software queue */
-	prev = edev->intn_list;
-	cur = prev;
-	while (cur != NULL) {
-		if (cur == qhn) {
-			if (qhn->next) {
-				prev->qh->qhlptr = qhn->qh->qhlptr;
-				prev->next = qhn->next;
+	return 1;
+}
+
+void
+ehci_tt_claim(struct ehci_tt *tt, int period, int phase, int uframe,
+		int bytes)
+{
+	int left, n, u;
+
+	for (int f = phase; f < EHCI_PERIODIC_MAX; f += period) {
+		left = bytes;
+		for (u = uframe + 1; u < 8 && left != 0; u++) {
+			if (left > 0) {
+				/* Fill the spare room of each micro frame */
+				n = MIN(left, EHCI_TT_UFRAME_BYTES -
+						tt->bytes[f][u]);
 			} else {
-				prev->qh->qhlptr = QHLP_INVALID;
-				prev->next = NULL;
+				/* Give back in the same order */
+				n = -MIN(-left, tt->bytes[f][u]);
 			}
-			tdn = qhn->tdns;
-			while (tdn) {
-				tmp = tdn;
-				tdn = tdn->next;
-				if (tmp->cb) {
-					tmp->cb(tmp->token, XACTSTAT_CANCELLED, 0);
+			tt->bytes[f][u] += n;
+			left -= n;
+		}
+	}
+}
+
+/*
+ * Find the least loaded phase and micro frame for a new periodic endpoint.
+ * Full and low speed endpoints additionally need room on the transaction
+ * translator of their hub, and get a start split in one of the first micro
+ * frames followed by three complete splits(USB 2.0 spec 11.18.4).
+ * Returns -1 if admitting the endpoint would exceed the periodic budget.
+ */
+static int
+_periodic_reserve(struct ehci_host *edev, struct QHn *qhn,
+		enum usb_speed speed, struct endpoint *ep)
+{
+	int period, uframes, mult, usecs, nstarts;
+	int best = -1, load, tt_bytes = 0, tt_uframe = 0;
+	uint8_t smask, cmask;
+	struct ehci_tt *tt = NULL;
+
+	period = ehci_periodic_period(speed, ep, &uframes);
+
+	if (speed == USBSPEED_HIGH) {
+		mult = ((ep->max_pkt >> 11) & 0x3) + 1;
+		usecs = NS_TO_US(HS_NSECS((ep->max_pkt & 0x7ff) * mult));
+		nstarts = MIN(uframes, 8);
+	} else {
+		/* The hub runs the full/low speed part, we only pay the split */
+		mult = 1;
+		usecs = NS_TO_US(HS_NSECS(ep->max_pkt & 0x7ff));
+		nstarts = EHCI_TT_SSPLIT_MAX + 1;
+
+		tt = ehci_tt_get(edev, (qhn->qh->epc[1] >> 16) & 0x7f);
+		if (!tt) {
+			return -1;
+		}
+		tt_bytes = ehci_tt_bytes(speed, ep->type, ep->max_pkt & 0x7ff);
+	}
+
+	for (int phase = 0; phase < period; phase++) {
+		for (int u = 0; u < nstarts; u++) {
+			if (speed == USBSPEED_HIGH) {
+				smask = 0;
+				for (int i = u; i < 8; i += uframes) {
+					smask |= BIT(i);
+				}
+				cmask = 0;
+			} else {
+				smask = BIT(u);
+				cmask = 0x1C << u;
+				if (!ehci_tt_fits(tt, period, phase, u, tt_bytes)) {
+					continue;
 				}
-				ps_dma_free_pinned(edev->dman, (void*)tmp->td,
-						sizeof(struct TD));
-				free(tmp);
 			}
 
-			ps_dma_free_pinned(edev->dman, (void*)qhn->qh, sizeof(struct QH));
-			free(qhn);
-			break;
+			load = ehci_periodic_load(edev, period, phase,
+					smask | cmask);
+			if (load + usecs > EHCI_UFRAME_USECS_MAX) {
+				continue;
+			}
+			if (best < 0 || load < best) {
+				best = load;
+				qhn->phase = phase;
+				qhn->smask = smask;
+				qhn->cmask = cmask;
+				tt_uframe = u;
+			}
+		}
+	}
+
+	if (best < 0) {
+		ehci_tt_put(edev, tt);
+		return -1;
+	}
+
+	qhn->rate = period;
+	qhn->usecs = usecs;
+	ehci_periodic_claim(edev, period, qhn->phase, qhn->smask | qhn->cmask,
+			usecs);
+	qhn->tt = tt;
+	qhn->tt_bytes = tt_bytes;
+	if (tt) {
+		ehci_tt_claim(tt, period, qhn->phase, tt_uframe, tt_bytes);
+	}
+
+	/* Program the micro frame masks */
+	qhn->qh->epc[1] &= ~(QHEPC1_UFRAME_MASK | QHEPC1_MULT(0x3));
+	qhn->qh->epc[1] |= QHEPC1_MULT(mult) |
+			   QHEPC1_UFRAME_SMASK(qhn->smask) |
+			   QHEPC1_UFRAME_CMASK(qhn->cmask);
+
+	return 0;
+}
+
+/**************************
+ **** Queue scheduling ****
+ **************************/
+
+/* Build the frame list and the static tree of the periodic schedule */
+int
+ehci_periodic_init(struct ehci_host *edev)
+{
+	struct QHn *skel;
+	int period, phase;
+
+	/* XXX: The frame list size is default to 1024 */
+	edev->flist_size = 1024;
+	edev->flist = ehci_desc_alloc(edev,
+			edev->flist_size * sizeof(uint32_t), &edev->pflist);
+	if (!edev->flist) {
+		return -1;
+	}
+
+	/* Software shadow of the isochronous descriptors on each frame */
+	edev->iso_frame = usb_malloc(edev->flist_size * sizeof(struct ISOslot*));
+	if (!edev->iso_frame) {
+		ehci_desc_free(edev, edev->flist,
+				edev->flist_size * sizeof(uint32_t));
+		edev->flist = NULL;
+		return -1;
+	}
+
+	/*
+	 * The tree nodes never carry any transfer. The overlay is halted so
+	 * the host simply moves on to the next queue head.
+	 */
+	for (int i = 0; i < EHCI_PERIODIC_NSKEL; i++) {
+		skel = &edev->skel[i];
+		skel->qh = ehci_desc_alloc(edev, sizeof(struct QH), &skel->pqh);
+		usb_assert(skel->qh);
+
+		skel->qh->epc[0] = QHEPC0_HSPEED;
+		skel->qh->epc[1] = QHEPC1_MULT(1) | QHEPC1_UFRAME_SMASK(0xff);
+		skel->qh->td_overlay.next = TDLP_INVALID;
+		skel->qh->td_overlay.alt = TDLP_INVALID;
+		skel->qh->td_overlay.token = TDTOK_SHALTED;
+		skel->pnext = NULL;
+	}
+
+	/* Link every node to its parent, the root terminates the schedule */
+	for (period = EHCI_PERIODIC_MAX; period > 1; period >>= 1) {
+		for (phase = 0; phase < period; phase++) {
+			skel = &edev->skel[EHCI_SKEL_IDX(period, phase)];
+			skel->qh->qhlptr = edev->skel[EHCI_SKEL_IDX(period / 2,
+					phase % (period / 2))].pqh | QHLP_TYPE_QH;
 		}
-		prev = cur;
-		cur = cur->next;
 	}
+	edev->skel[0].qh->qhlptr = QHLP_INVALID;
+
+	/* Each frame starts at the leaf of its phase */
+	for (int i = 0; i < edev->flist_size; i++) {
+		skel = &edev->skel[EHCI_SKEL_IDX(EHCI_PERIODIC_MAX,
+				i % EHCI_PERIODIC_MAX)];
+		edev->flist[i] = skel->pqh | QHLP_TYPE_QH;
+	}
+	dsb();
+
+	return 0;
+}
+
+/*
+ * A live host moves on every 1ms frame and a failed one sets HCHALTED. The
+ * time limit is only a backstop for a host that stopped answering, with a
+ * wide margin since udelay() is a rough busy loop on some platforms.
+ */
+#define EHCI_FRAME_WAIT_US 100000
+
+/*
+ * The host may still hold a reference to an unlinked queue head until the
+ * current frame is over. Returns -1 if the host has halted or the frame
+ * counter does not move, a host in that state no longer walks the schedule.
+ */
+int
+ehci_periodic_wait_frame(struct ehci_host *edev)
+{
+	uint32_t frame;
+	int us;
+
+	if (!(edev->op_regs->usbsts & EHCISTS_PERI_EN)) {
+		return 0;
+	}
+
+	frame = UFRAME2FRAME(edev->op_regs->frindex);
+	for (us = 0; UFRAME2FRAME(edev->op_regs->frindex) == frame; us += 10) {
+		if ((edev->op_regs->usbsts & EHCISTS_HCHALTED) ||
+				us >= EHCI_FRAME_WAIT_US) {
+			EHCI_ERR(edev, "Frame counter stopped\n");
+			return -1;
+		}
+		udelay(10);
+	}
+
+	return 0;
+}
+
+/* Unhook a queue head from the tree and give back its bandwidth */
+static void
+_periodic_unlink(struct ehci_host *edev, struct QHn *qhn)
+{
+	struct QHn *prev;
+
+	prev = &edev->skel[EHCI_SKEL_IDX(qhn->rate, qhn->phase)];
+	while (prev->pnext && prev->pnext != qhn) {
+		prev = prev->pnext;
+	}
+	if (!prev->pnext) {
+		return;
+	}
+
+	prev->qh->qhlptr = qhn->qh->qhlptr;
+	prev->pnext = qhn->pnext;
+	qhn->pnext = NULL;
+
+	ehci_periodic_claim(edev, qhn->rate, qhn->phase,
+			qhn->smask | qhn->cmask, -qhn->usecs);
+	if (qhn->tt) {
+		ehci_tt_claim(qhn->tt, qhn->rate, qhn->phase,
+				CTZ(qhn->smask), -qhn->tt_bytes);
+		ehci_tt_put(edev, qhn->tt);
+		qhn->tt = NULL;
+	}
+	ehci_periodic_wait_frame(edev);
+}
+
+/* Isochronous endpoints have their own streams, see isoc.c */
+int ehci_add_qhn_periodic(struct ehci_host *edev, struct QHn *qhn,
+		enum usb_speed speed, struct endpoint *ep)
+{
+	struct QHn *skel;
+
+	if (!edev->flist && ehci_periodic_init(edev)) {
+		return -1;
+	}
+
+	/* Admission control */
+	if (_periodic_reserve(edev, qhn, speed, ep)) {
+		EHCI_DBG(edev, "Out of periodic bandwidth for ep %d\n", ep->num);
+		return -1;
+	}
+
+	/* Hook the queue head onto the tree node of its period and phase */
+	skel = &edev->skel[EHCI_SKEL_IDX(qhn->rate, qhn->phase)];
+	qhn->qh->qhlptr = skel->qh->qhlptr;
+	qhn->pnext = skel->pnext;
+	dsb();
+	skel->qh->qhlptr = qhn->pqh | QHLP_TYPE_QH;
+	skel->pnext = qhn;
+
+	/* Add new queue head to the software queue */
+	qhn->next = edev->intn_list;
+	edev->intn_list = qhn;
+
+	return 0;
+}
+
+void ehci_del_qhn_periodic(struct ehci_host *edev, struct QHn *qhn)
+{
+	struct QHn **prev;
+
+	/* Remove from the software queue */
+	prev = &edev->intn_list;
+	while (*prev && *prev != qhn) {
+		prev = &(*prev)->next;
+	}
+	if (!*prev) {
+		return;
+	}
+	*prev = qhn->next;
+
+	/* Remove from the hardware schedule */
+	_periodic_unlink(edev, qhn);
+
+	qhn_destroy(edev, qhn);
 }
 
 int
@@ -148,6 +504,13 @@ ehci_schedule_periodic_root(struct ehci_host* edev, struct xact *xact,
 int
 ehci_schedule_periodic(struct ehci_host* edev)
 {
+	/* Already running, the common case */
+	if ((edev->op_regs->usbsts & EHCISTS_PERI_EN) &&
+			(edev->op_regs->usbcmd & EHCICMD_PERI_EN)) {
+		return 0;
+	}
+
+	ehci_cmd_lock(edev);
 	/* Make sure we are safe to write to the register */
 	while (((edev->op_regs->usbsts & EHCISTS_PERI_EN) >> 14)
 		^ ((edev->op_regs->usbcmd & EHCICMD_PERI_EN) >> 4));
@@ -158,134 +521,43 @@ ehci_schedule_periodic(struct ehci_host* edev)
 
 		/* TODO: Check FRINDEX, FLIST_SIZE, IRQTHRES_MASK */
 		edev->op_regs->usbcmd |= EHCICMD_PERI_EN;
-		while (edev->op_regs->usbsts & EHCISTS_PERI_EN) break;
 	}
+	ehci_cmd_unlock(edev);
 
 	return 0;
 }
 
-enum usb_xact_status
-qhn_wait(struct QHn* qhn, int to_ms)
-{
-    enum usb_xact_status stat;
-    do {
-        stat = qhn_get_status(qhn);
-        if (stat != XACTSTAT_PENDING) {
-            break;
-        } else if (to_ms-- == 0) {
-            break;
-        } else {
-            msdelay(1);
-        }
-    } while (1);
-
-    /* Check the result */
-    if (to_ms < 0) {
-        printf("USB timeout\n");
-    }
-    switch (stat) {
-    case XACTSTAT_SUCCESS:
-        break;
-    case XACTSTAT_ERROR:
-    case XACTSTAT_PENDING:
-    case XACTSTAT_HOSTERROR:
-    default:
-        printf("Bad status %d\n", stat);
-        dump_qhn(qhn);
-    }
-    return stat;
-}
-
 void ehci_periodic_complete(struct ehci_host *edev)
 {
 	struct QHn *qhn;
-	struct TDn *tdn;
-	int sum;
+	uint32_t now;
 
-	qhn = edev->intn_list;
+	ehci_iso_complete(edev);
 
-	while (qhn) {
-		tdn = qhn->tdns;
-		if (qtd_get_status(tdn->td) == XACTSTAT_SUCCESS) {
-			qhn->tdns = NULL;
-			sum = TDTOK_GET_BYTES(tdn->td->token);
-			if (tdn->cb) {
-				tdn->cb(tdn->token, XACTSTAT_SUCCESS, sum);
-			}
-			ps_dma_free_pinned(edev->dman, (void*)tdn->td, sizeof(struct TD));
-			free(tdn);
+	now = ehci_clock(edev);
+	for (qhn = edev->intn_list; qhn; qhn = qhn->next) {
+		qhn_reap(edev, qhn);
+		if (qhn_expired(qhn, now)) {
+			/* Unlinking is left to the bottom half */
+			__atomic_or_fetch(&edev->work, EHCI_WORK_EXPIRE,
+					__ATOMIC_RELEASE);
 		}
-		qhn = qhn->next;
 	}
 }
 
-void
-_periodic_complete(struct ehci_host* edev)
+/* Bottom half only, with the schedule interrupts masked */
+void ehci_periodic_expire(struct ehci_host *edev, uint32_t now)
 {
-    struct QHn* qhn;
-    struct QHn** qhn_ptr;
-    qhn_ptr = &edev->intn_list;
-    qhn = edev->intn_list;
-    EHCI_IRQDBG(edev, "Scanning periodic list....\n");
-    while (qhn != NULL) {
-        if (!qhn->irq_pending) {
-            /* Check the result */
-            enum usb_xact_status stat = qhn_get_status(qhn);
-            switch (stat) {
-            case XACTSTAT_PENDING:
-                break;
-            case XACTSTAT_ERROR:
-            case XACTSTAT_SUCCESS:
-                qhn->irq_pending = 1;
-#if defined(DEBUG_DES)
-                dump_qhn(qhn);
-#endif
-		qhn->qh->qhlptr = QHLP_INVALID;
-                if (!qhn_cb(qhn, stat)) {
-                    qhn->irq_pending = 0;
-                } else {
-                    struct QHn* cur;
-                    cur = qhn;
-                    qhn = cur->next;
-                    *qhn_ptr = cur->next;
-                    _qhn_deschedule(edev, cur);
-                    qhn_destroy(edev->dman, cur);
-                    continue;
-                }
-                break;
-            case XACTSTAT_HOSTERROR:
-            default:
-                printf("Bad status %d\n", qhn_get_status(qhn));
-                dump_qhn(qhn);
-            }
-        }
-        qhn_ptr = &qhn->next;
-        qhn = qhn->next;
-    }
-}
+	struct QHn *qhn, *next;
+	struct TDn *tdn;
 
-int
-clear_periodic_xact(struct ehci_host* edev, void* token)
-{
-    struct QHn** qhn_ptr;
-    struct QHn* qhn;
-    /* Clear from periodic list */
-    qhn_ptr = &edev->intn_list;
-    qhn = edev->intn_list;
-    while (qhn != NULL) {
-        if (qhn->token == token) {
-            _qhn_deschedule(edev, qhn);
-            /* Process and remove the QH node */
-            qhn_cb(qhn, XACTSTAT_CANCELLED);
-            *qhn_ptr = qhn->next;
-            qhn_destroy(edev->dman, qhn);
-            qhn = *qhn_ptr;
-            return 0;
-        } else {
-            qhn_ptr = &qhn->next;
-            qhn = qhn->next;
-        }
-    }
-    return -1;
+	qhn = edev->intn_list;
+	while (qhn) {
+		next = qhn->next;
+		tdn = qhn_expired(qhn, now);
+		if (tdn) {
+			qhn_timeout(edev, qhn, tdn);
+		}
+		qhn = next;
+	}
 }
-
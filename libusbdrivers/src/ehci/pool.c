@@ -0,0 +1,249 @@
+/*
+ * Copyright 2016, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include <string.h>
+
+#include "../services.h"
+#include "ehci.h"
+
+/*
+ * Descriptor pool
+ *
+ * qTDs, QHs, iTDs and siTDs are handed out in 64 byte blocks from pinned DMA
+ * pages. A block never crosses a page boundary, which the host requires, and
+ * every page is checked against the data structure segment. Pages are kept
+ * once allocated, so the pool only grows to the high water mark.
+ *
+ * Each page is carved into descriptors of one size and feeds the free list of
+ * that size. Submitters allocate and the completer frees from interrupt
+ * context, so the lists take no lock: a list head holds the index of the
+ * first free block and a tag that changes on every update, and is swapped
+ * with a single compare and exchange. Pages are aligned to their size and
+ * start with a header, which is how a descriptor finds its page.
+ */
+
+/* Block numbers, the page in the upper bits. 0 ends a list */
+static inline void *
+_dblock_addr(struct ehci_host *edev, uint32_t id)
+{
+	return (char*)edev->dpages[id / EHCI_DPOOL_NBLOCKS] +
+	       (id % EHCI_DPOOL_NBLOCKS) * EHCI_DPOOL_BLOCK;
+}
+
+static inline struct ehci_dpage *
+_dblock_page(void *desc)
+{
+	return (struct ehci_dpage*)((uintptr_t)desc &
+				    ~(uintptr_t)(EHCI_DPOOL_PAGE - 1));
+}
+
+static inline uint32_t
+_dblock_id(void *desc)
+{
+	return _dblock_page(desc)->index * EHCI_DPOOL_NBLOCKS +
+	       ((uintptr_t)desc & (EHCI_DPOOL_PAGE - 1)) / EHCI_DPOOL_BLOCK;
+}
+
+/* Put the chain of blocks from @first to @last on a free list */
+static void
+_dfree_push(struct ehci_host *edev, int cls, uint32_t first, uint32_t last)
+{
+	uint64_t old, new;
+
+	old = __atomic_load_n(&edev->dfree[cls], __ATOMIC_RELAXED);
+	do {
+		*(volatile uint32_t*)_dblock_addr(edev, last) = (uint32_t)old;
+		new = (((old >> 32) + 1) << 32) | (first + 1);
+	} while (!__atomic_compare_exchange_n(&edev->dfree[cls], &old, new, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+static void *
+_dfree_pop(struct ehci_host *edev, int cls)
+{
+	uint64_t old, new;
+	void *desc;
+
+	old = __atomic_load_n(&edev->dfree[cls], __ATOMIC_ACQUIRE);
+	do {
+		if (!(uint32_t)old) {
+			return NULL;
+		}
+		/* May be stale, the tag then fails the exchange */
+		desc = _dblock_addr(edev, (uint32_t)old - 1);
+		new = (((old >> 32) + 1) << 32) | *(volatile uint32_t*)desc;
+	} while (!__atomic_compare_exchange_n(&edev->dfree[cls], &old, new, 1,
+					      __ATOMIC_ACQUIRE,
+					      __ATOMIC_ACQUIRE));
+
+	return desc;
+}
+
+/*
+ * The first page fixes the segment. Hosts without the 64-bit capability can
+ * only address the first 4GB.
+ */
+static int
+_dpool_segment_ok(struct ehci_host *edev, uintptr_t paddr, size_t size)
+{
+	uint32_t seg = EHCI_ADDR_HI(paddr);
+
+	if (seg != EHCI_ADDR_HI(paddr + size - 1)) {
+		return 0;
+	}
+
+	if (!edev->dsegment_valid) {
+		if (edev->cap_regs->hccparams & EHCI_HCC_64BIT) {
+			edev->op_regs->ctrldssegment = seg;
+		} else if (seg) {
+			return 0;
+		}
+		edev->dsegment = seg;
+		edev->dsegment_valid = 1;
+	}
+
+	return seg == edev->dsegment;
+}
+
+/* Allocate pinned DMA memory within the data structure segment */
+static void *
+_dpool_dma_alloc(struct ehci_host *edev, size_t size, uintptr_t *paddr)
+{
+	void *rejected[EHCI_DPOOL_RETRY];
+	void *vaddr;
+	int nrejected = 0;
+
+	while (1) {
+		vaddr = ps_dma_alloc_pinned(edev->dman, size, EHCI_DPOOL_PAGE,
+				0, PS_MEM_NORMAL, paddr);
+		if (!vaddr || _dpool_segment_ok(edev, *paddr, size)) {
+			break;
+		}
+
+		/* Hold on to it, so the allocator won't return it again */
+		if (nrejected == EHCI_DPOOL_RETRY) {
+			ps_dma_free_pinned(edev->dman, vaddr, size);
+			vaddr = NULL;
+			break;
+		}
+		rejected[nrejected++] = vaddr;
+	}
+
+	while (nrejected) {
+		ps_dma_free_pinned(edev->dman, rejected[--nrejected], size);
+	}
+
+	return vaddr;
+}
+
+/* Add a page of descriptors of @n blocks to the pool */
+static int
+_dpage_add(struct ehci_host *edev, int n)
+{
+	struct ehci_dpage *page;
+	uintptr_t paddr;
+	uint32_t idx, first, last;
+
+	page = _dpool_dma_alloc(edev, EHCI_DPOOL_PAGE, &paddr);
+	if (!page) {
+		return -1;
+	}
+	usb_assert(!((uintptr_t)page & (EHCI_DPOOL_PAGE - 1)));
+
+	idx = __atomic_load_n(&edev->dnpages, __ATOMIC_RELAXED);
+	do {
+		if (idx == EHCI_DPOOL_MAXPAGES) {
+			ps_dma_free_pinned(edev->dman, page, EHCI_DPOOL_PAGE);
+			return -1;
+		}
+	} while (!__atomic_compare_exchange_n(&edev->dnpages, &idx, idx + 1,
+					      1, __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	page->paddr = paddr;
+	page->index = idx;
+	edev->dpages[idx] = page;
+
+	/* The header takes the first block */
+	first = idx * EHCI_DPOOL_NBLOCKS + 1;
+	last = first + ((EHCI_DPOOL_NBLOCKS - 1) / n - 1) * n;
+	for (uint32_t id = first; id < last; id += n) {
+		*(volatile uint32_t*)_dblock_addr(edev, id) = id + n + 1;
+	}
+	_dfree_push(edev, n - 1, first, last);
+
+	return 0;
+}
+
+/*
+ * The first page is added up front, so the segment is fixed before there is
+ * anyone to race with.
+ */
+int
+ehci_dpool_init(struct ehci_host *edev)
+{
+	memset(edev->dfree, 0, sizeof(edev->dfree));
+	edev->dnpages = 0;
+	edev->dsegment = 0;
+	edev->dsegment_valid = 0;
+
+	return _dpage_add(edev, 1);
+}
+
+/*
+ * Allocate a zeroed descriptor. Anything bigger than half a page, i.e. the
+ * frame list, gets pages of its own.
+ */
+void *
+ehci_desc_alloc(struct ehci_host *edev, size_t size, uintptr_t *paddr)
+{
+	void *desc;
+	int n;
+
+	assert(size);
+
+	n = (size + EHCI_DPOOL_BLOCK - 1) / EHCI_DPOOL_BLOCK;
+	if (n > EHCI_DPOOL_NCLASS) {
+		desc = _dpool_dma_alloc(edev, size, paddr);
+		if (desc) {
+			memset(desc, 0, size);
+		}
+		return desc;
+	}
+
+	while (!(desc = _dfree_pop(edev, n - 1))) {
+		if (_dpage_add(edev, n)) {
+			return NULL;
+		}
+	}
+
+	memset(desc, 0, n * EHCI_DPOOL_BLOCK);
+	*paddr = _dblock_page(desc)->paddr +
+		 ((uintptr_t)desc & (EHCI_DPOOL_PAGE - 1));
+
+	return desc;
+}
+
+void
+ehci_desc_free(struct ehci_host *edev, void *desc, size_t size)
+{
+	uint32_t id;
+	int n;
+
+	n = (size + EHCI_DPOOL_BLOCK - 1) / EHCI_DPOOL_BLOCK;
+	if (n > EHCI_DPOOL_NCLASS) {
+		ps_dma_free_pinned(edev->dman, desc, size);
+		return;
+	}
+
+	id = _dblock_id(desc);
+	_dfree_push(edev, n - 1, id, id);
+}
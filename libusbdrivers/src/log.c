@@ -0,0 +1,97 @@
+/*
+ * Copyright 2016, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include "log.h"
+
+#ifdef CONFIG_LIB_USB_LOG_DEFERRED
+
+#define USB_LOG_RING_SIZE CONFIG_LIB_USB_LOG_RING_SIZE
+
+struct usb_log_rec {
+    uint32_t seq;               // Index of the message plus 1, 0 while written
+    int nargs;
+    const char* fmt;
+    uintptr_t args[USB_LOG_NARGS];
+};
+
+/*
+ * Any thread may record, the flusher is the only consumer. Records are
+ * claimed with the head counter and committed with their sequence number,
+ * which the flusher checks again after copying, in case the writer of a
+ * later lap took the record over.
+ */
+static struct usb_log_rec usb_log_ring[USB_LOG_RING_SIZE];
+static uint32_t usb_log_head;
+static uint32_t usb_log_tail;
+
+void
+usb_log_record(const char* fmt, int nargs, const uintptr_t* args)
+{
+    struct usb_log_rec* rec;
+    uint32_t i;
+
+    i = __atomic_fetch_add(&usb_log_head, 1, __ATOMIC_RELAXED);
+    rec = &usb_log_ring[i & (USB_LOG_RING_SIZE - 1)];
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    rec->fmt = fmt;
+    rec->nargs = nargs;
+    for (int a = 0; a < nargs && a < USB_LOG_NARGS; a++) {
+        rec->args[a] = args[a];
+    }
+    __atomic_store_n(&rec->seq, i + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t
+usb_log_flush(void)
+{
+    struct usb_log_rec rec, *r;
+    uint32_t head, tail, lost = 0;
+
+    head = __atomic_load_n(&usb_log_head, __ATOMIC_ACQUIRE);
+    tail = usb_log_tail;
+    if (head - tail > USB_LOG_RING_SIZE) {
+        lost = head - tail - USB_LOG_RING_SIZE;
+        tail = head - USB_LOG_RING_SIZE;
+    }
+
+    for (; tail != head; tail++) {
+        r = &usb_log_ring[tail & (USB_LOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != tail + 1) {
+            /* Still being written, pick it up next time */
+            break;
+        }
+        rec = *r;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&r->seq, __ATOMIC_RELAXED) != tail + 1) {
+            /* Overwritten while we copied it */
+            lost++;
+            continue;
+        }
+        printf(rec.fmt, rec.args[0], rec.args[1], rec.args[2], rec.args[3],
+               rec.args[4], rec.args[5]);
+    }
+    usb_log_tail = tail;
+
+    if (lost) {
+        printf("USB log: %u messages lost\n", lost);
+    }
+    return lost;
+}
+
+#else
+
+uint32_t
+usb_log_flush(void)
+{
+    return 0;
+}
+
+#endif /* CONFIG_LIB_USB_LOG_DEFERRED */
@@ -0,0 +1,98 @@
+/*
+ * Copyright 2016, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <autoconf.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <usb/log.h>
+
+#ifdef CONFIG_LIB_USB_LOG_LEVEL
+#define USB_LOG_LEVEL CONFIG_LIB_USB_LOG_LEVEL
+#else
+#define USB_LOG_LEVEL USB_LOG_WARN
+#endif
+
+#ifdef CONFIG_LIB_USB_LOG_MODULES
+#define USB_LOG_MODULES CONFIG_LIB_USB_LOG_MODULES
+#else
+#define USB_LOG_MODULES USB_LOG_ALL
+#endif
+
+/* Usable in #if, for dumps that take more than one message */
+#define USB_LOG_ON(mod, lvl) \
+        ((lvl) <= USB_LOG_LEVEL && ((mod) & USB_LOG_MODULES))
+
+#ifdef CONFIG_LIB_USB_LOG_DEFERRED
+
+/*
+ * Deferred messages keep the address of the format string, so it has to be
+ * a literal, and at most USB_LOG_NARGS word sized arguments. Strings passed
+ * for %s must be static as well. An argument wider than a word, such as a
+ * uint64_t on a 32-bit target, can't be replayed and fails to compile; split
+ * it into two 32-bit halves instead.
+ */
+#define USB_LOG_NARGS 6
+
+void usb_log_record(const char* fmt, int nargs, const uintptr_t* args);
+
+#define _USB_LOG_N(...) _USB_LOG_N_(0, ##__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define _USB_LOG_N_(_0, _1, _2, _3, _4, _5, _6, n, ...) n
+#define _USB_LOG_CAT(a, b)  _USB_LOG_CAT_(a, b)
+#define _USB_LOG_CAT_(a, b) a##b
+/* The array size goes negative for an argument wider than a word */
+#define _USB_LOG_ARG(a) \
+        ((uintptr_t)(a) + \
+         0 * sizeof(char[sizeof((a) + 0) <= sizeof(uintptr_t) ? 1 : -1]))
+#define _USB_LOG_A0()
+#define _USB_LOG_A1(a)      _USB_LOG_ARG(a)
+#define _USB_LOG_A2(a, ...) _USB_LOG_ARG(a), _USB_LOG_A1(__VA_ARGS__)
+#define _USB_LOG_A3(a, ...) _USB_LOG_ARG(a), _USB_LOG_A2(__VA_ARGS__)
+#define _USB_LOG_A4(a, ...) _USB_LOG_ARG(a), _USB_LOG_A3(__VA_ARGS__)
+#define _USB_LOG_A5(a, ...) _USB_LOG_ARG(a), _USB_LOG_A4(__VA_ARGS__)
+#define _USB_LOG_A6(a, ...) _USB_LOG_ARG(a), _USB_LOG_A5(__VA_ARGS__)
+
+#define _usb_log_defer(fmt, ...)                                        \
+        do {                                                            \
+            uintptr_t _args[] = {0,                                     \
+                _USB_LOG_CAT(_USB_LOG_A, _USB_LOG_N(__VA_ARGS__))(__VA_ARGS__) \
+            };                                                          \
+            usb_log_record(fmt, _USB_LOG_N(__VA_ARGS__), _args + 1);    \
+        } while (0)
+
+#define _usb_log(lvl, fmt, ...)                                         \
+        do {                                                            \
+            if ((lvl) >= USB_LOG_INFO) {                                \
+                _usb_log_defer(fmt, ##__VA_ARGS__);                     \
+            } else {                                                    \
+                printf(fmt, ##__VA_ARGS__);                             \
+            }                                                           \
+        } while (0)
+
+#else
+
+#define _usb_log(lvl, fmt, ...) printf(fmt, ##__VA_ARGS__)
+
+#endif /* CONFIG_LIB_USB_LOG_DEFERRED */
+
+/*
+ * Log a message. Each module wraps this in its own macro, which adds the
+ * module and a prefix.
+ */
+#define usb_log(mod, lvl, fmt, ...)                                     \
+        do {                                                            \
+            if (USB_LOG_ON(mod, lvl)) {                                 \
+                _usb_log(lvl, fmt, ##__VA_ARGS__);                      \
+            }                                                           \
+        } while (0)
+
+#endif /* _LOG_H_ */
@@ -184,7 +184,7 @@ usb_host_init(enum usb_host_id id, ps_io_ops_t* io_ops, mutex_ops_t *mops,
 		usb_host_t* hdev)
 {
     int err;
-    if (id < 0 || id > USB_NHOSTS) {
+    if (id < 0 || id >= USB_NHOSTS) {
         return -1;
     }
     assert(io_ops);
@@ -221,7 +221,7 @@ usb_host_init(enum usb_host_id id, ps_io_ops_t* io_ops, mutex_ops_t *mops,
 const int*
 usb_host_irqs(usb_host_t* host, int* nirqs)
 {
-    if (host->id < 0 || host->id > USB_NHOSTS) {
+    if (host->id < 0 || host->id >= USB_NHOSTS) {
         return NULL;
     }
 
@@ -338,7 +338,7 @@ usb_host_init(enum usb_host_id id, ps_io_ops_t* ioops, mutex_ops_t *mops,
 {
     struct usb_host_regs * hc_regs = NULL;
     int err;
-    if (id < 0 || id > USB_NHOSTS) {
+    if (id < 0 || id >= USB_NHOSTS) {
         return -1;
     }
     assert(ioops);
@@ -365,7 +365,7 @@ usb_host_init(enum usb_host_id id, ps_io_ops_t* ioops, mutex_ops_t *mops,
 const int*
 usb_host_irqs(usb_host_t* host, int* nirqs)
 {
-    if (host->id < 0 || host->id > USB_NHOSTS) {
+    if (host->id < 0 || host->id >= USB_NHOSTS) {
         return NULL;
     }
 
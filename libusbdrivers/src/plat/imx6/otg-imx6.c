@@ -18,32 +18,15 @@
 #include "../usb_otg.h"
 #include <assert.h>
 
-//#define OTG_DEBUG_PAYLOAD
-#define OTG_DEBUG_IRQ
-#define OTG_DEBUG
-
-#ifdef OTG_DEBUG
-#define dprintf(...) printf(__VA_ARGS__)
-#else
-#define dprintf(...) do{}while(0)
-#endif
-
-#ifdef OTG_DEBUG_IRQ
-#define OTG_IRQDBG(...) OTG_DBG(__VA_ARGS__)
-#else
-#define OTG_IRQDBG(...) do{}while(0)
-#endif
+#define OTG_DBG(...)    _OTG_LOG(USB_LOG_DEBUG, __VA_ARGS__)
+#define OTG_IRQDBG(...) _OTG_LOG(USB_LOG_TRACE, __VA_ARGS__)
 
-#define OTG_DBG(host, ...)                      \
-        do {                                    \
-            struct ehci_otg* h = host;          \
-            if(h){                              \
-                dprintf("OTG  %1d: ", h->devid);\
-            }else{                              \
-                dprintf("OTG   ?: ");           \
-            }                                   \
-            dprintf(__VA_ARGS__);               \
-        }while(0)
+#define _OTG_LOG(lvl, host, fmt, ...)                                   \
+        do {                                                            \
+            struct ehci_otg* _h = host;                                 \
+            usb_log(USB_LOG_OTG, lvl, "OTG  %1d: " fmt,                 \
+                    _h ? _h->devid : -1, ##__VA_ARGS__);                \
+        } while (0)
 
 /*
  * The implementation here comes from the imx6 reference manual
@@ -336,7 +319,7 @@ dump_dtd(volatile struct dTD* dtd)
 static void
 dump_buf(void* buf, int len)
 {
-#ifdef OTG_DEBUG_PAYLOAD
+#if USB_LOG_ON(USB_LOG_OTG, USB_LOG_TRACE)
     uint8_t* d = buf;
     while (len--) {
         printf("%02x", *d++);
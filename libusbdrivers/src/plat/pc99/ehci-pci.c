@@ -55,9 +55,10 @@
 #define USB_HOST1_IRQ    23
 #define USB_HOST2_IRQ    16
 
-static int _irq_line;
+/* Interrupt line of each host, hosts may be driven by different threads */
+static int _irq_lines[USB_NHOSTS];
 
-static uintptr_t ehci_pci_init(uint16_t vid, uint16_t did,
+static uintptr_t ehci_pci_init(enum usb_host_id id, uint16_t vid, uint16_t did,
 		ps_io_ops_t *io_ops)
 {
 	int err;
@@ -76,7 +77,7 @@ static uintptr_t ehci_pci_init(uint16_t vid, uint16_t did,
 				dev->cfg.base_addr[0],
 				dev->cfg.base_addr_size[0]);
 		assert(cap_regs);
-		_irq_line = dev->interrupt_line;
+		_irq_lines[id] = dev->interrupt_line;
 	} else {
 		printf("EHCI: Host device not found!\n");
 		assert(0);
@@ -111,7 +112,7 @@ usb_host_init(enum usb_host_id id, ps_io_ops_t* io_ops, mutex_ops_t *mops,
 	uint16_t vid, did;
 	uintptr_t usb_regs;
 
-	if (id < 0 || id > USB_NHOSTS) {
+	if (id < 0 || id >= USB_NHOSTS) {
 		return -1;
 	}
 	assert(io_ops);
@@ -136,7 +137,7 @@ usb_host_init(enum usb_host_id id, ps_io_ops_t* io_ops, mutex_ops_t *mops,
 	}
 
 	/* Check device mappings */
-	usb_regs = ehci_pci_init(vid, did, io_ops);
+	usb_regs = ehci_pci_init(id, vid, did, io_ops);
 	if (!usb_regs) {
 		return -1;
 	}
@@ -149,7 +150,7 @@ usb_host_init(enum usb_host_id id, ps_io_ops_t* io_ops, mutex_ops_t *mops,
 const int*
 usb_host_irqs(usb_host_t* host, int* nirqs)
 {
-	if (host->id < 0 || host->id > USB_NHOSTS) {
+	if (host->id < 0 || host->id >= USB_NHOSTS) {
 		return NULL;
 	}
 
@@ -160,10 +161,10 @@ usb_host_irqs(usb_host_t* host, int* nirqs)
 #ifdef CONFIG_IRQ_IOAPIC
 	switch (host->id) {
 		case USB_HOST1:
-			_irq_line = USB_HOST1_IRQ;
+			_irq_lines[host->id] = USB_HOST1_IRQ;
 			break;
 		case USB_HOST2:
-			_irq_line = USB_HOST2_IRQ;
+			_irq_lines[host->id] = USB_HOST2_IRQ;
 			break;
 		default:
 			assert(0);
@@ -171,7 +172,7 @@ usb_host_irqs(usb_host_t* host, int* nirqs)
 	}
 #endif
 
-	host->irqs = &_irq_line;
+	host->irqs = &_irq_lines[host->id];
 	return host->irqs;
 }
 
@@ -0,0 +1,661 @@
+/*
+ * Copyright 2016, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include <string.h>
+
+#include "../../services.h"
+#include "sim.h"
+
+/*
+ * Virtual devices
+ *
+ * The model owns the default control pipe, answers the standard device
+ * requests from the descriptors and passes everything else to the device.
+ */
+
+#define SIM_VID          0x1d6b
+#define SIM_PID_HUB      0x5309
+#define SIM_PID_BULK     0x5301
+#define SIM_PID_INTR     0x5302
+
+#define SIM_CLASS_HUB    0x09
+#define SIM_CLASS_VENDOR 0xff
+
+#define SIM_TYPE_MASK    (0x3 * BIT(5))
+#define SIM_RCPT_MASK    0x1f
+
+struct sim_desc {
+	struct device_desc dev;
+	struct {
+		struct config_desc cfg;
+		struct iface_desc iface;
+		struct endpoint_desc ep[2];
+	} __attribute__ ((packed)) conf;
+};
+
+struct sim_dev_store {
+	sim_dev_t dev;
+	struct sim_desc desc;
+};
+
+struct sim_intr {
+	uint8_t report[1024];
+	int len;
+	int pending;
+	int max_pkt;
+};
+
+static const struct sim_dev_ops _hub_ops;
+
+/*********************
+ **** Enumeration ****
+ *********************/
+
+static int
+_sim_get_desc(sim_dev_t *dev, uint16_t value, uint8_t *data)
+{
+	const struct config_desc *cfg;
+	const char *s;
+	int i, len;
+
+	switch (value >> 8) {
+	case DEVICE:
+		memcpy(data, dev->ddesc, sizeof(*dev->ddesc));
+		return sizeof(*dev->ddesc);
+	case CONFIGURATION:
+		cfg = dev->cdesc;
+		memcpy(data, cfg, cfg->wTotalLength);
+		return cfg->wTotalLength;
+	case STRING:
+		if ((value & 0xff) == 0) {
+			/* English(US) only */
+			data[2] = 0x09;
+			data[3] = 0x04;
+			len = 4;
+		} else {
+			s = dev->name ? dev->name : "";
+			for (i = 0; s[i] && i < 126; i++) {
+				data[2 + i * 2] = s[i];
+				data[3 + i * 2] = 0;
+			}
+			len = 2 + i * 2;
+		}
+		data[0] = len;
+		data[1] = STRING;
+		return len;
+	default:
+		return SIM_STALL;
+	}
+}
+
+static int
+_sim_request(sim_dev_t *dev, const struct usbreq *req, uint8_t *data)
+{
+	if ((req->bmRequestType & SIM_TYPE_MASK) != USB_TYPE_STD) {
+		if (dev->ops->control) {
+			return dev->ops->control(dev, req, data);
+		}
+		return SIM_STALL;
+	}
+
+	switch (req->bRequest) {
+	case SET_ADDRESS:
+		/* Takes effect after the status stage */
+		dev->new_addr = req->wValue & 0x7f;
+		return 0;
+	case SET_CONFIGURATION:
+		dev->config = req->wValue;
+		return 0;
+	case GET_CONFIGURATION:
+		data[0] = dev->config;
+		return 1;
+	case GET_INTERFACE:
+		data[0] = 0;
+		return 1;
+	case GET_STATUS:
+		data[0] = 0;
+		data[1] = 0;
+		return 2;
+	case GET_DESCRIPTOR:
+		return _sim_get_desc(dev, req->wValue, data);
+	case SYNCH_FRAME:
+	case SET_DESCRIPTOR:
+		return SIM_STALL;
+	default:
+		/* Features and interface settings */
+		return 0;
+	}
+}
+
+void
+sim_dev_reset(sim_dev_t *dev)
+{
+	dev->addr = 0;
+	dev->config = 0;
+	dev->ctl_len = 0;
+	dev->ctl_pos = 0;
+	dev->ctl_stall = 0;
+	dev->new_addr = -1;
+	if (dev->ops->reset) {
+		dev->ops->reset(dev);
+	}
+}
+
+/* SETUP is always acknowledged, failures stall the following stages */
+int
+sim_dev_setup(sim_dev_t *dev, const struct usbreq *req)
+{
+	int r;
+
+	dev->req = *req;
+	dev->ctl_len = 0;
+	dev->ctl_pos = 0;
+	dev->ctl_stall = 0;
+	dev->new_addr = -1;
+
+	if (!(req->bmRequestType & USB_DIR_IN) && req->wLength) {
+		/* Run it once the data stage is in */
+		return sizeof(*req);
+	}
+
+	r = _sim_request(dev, req, dev->ctl_buf);
+	if (r < 0) {
+		dev->ctl_stall = 1;
+	} else {
+		dev->ctl_len = MIN(r, req->wLength);
+	}
+
+	return sizeof(*req);
+}
+
+int
+sim_dev_ctl_in(sim_dev_t *dev, void *buf, int len)
+{
+	int n;
+
+	if (dev->ctl_stall) {
+		dev->stalls++;
+		return SIM_STALL;
+	}
+
+	if (!(dev->req.bmRequestType & USB_DIR_IN)) {
+		/* Status stage */
+		if (dev->new_addr >= 0) {
+			dev->addr = dev->new_addr;
+			dev->new_addr = -1;
+		}
+		return 0;
+	}
+
+	n = MIN(len, dev->ctl_len - dev->ctl_pos);
+	memcpy(buf, dev->ctl_buf + dev->ctl_pos, n);
+	dev->ctl_pos += n;
+	return n;
+}
+
+int
+sim_dev_ctl_out(sim_dev_t *dev, const void *buf, int len)
+{
+	int n, r;
+
+	if (dev->ctl_stall) {
+		dev->stalls++;
+		return SIM_STALL;
+	}
+
+	if (dev->req.bmRequestType & USB_DIR_IN) {
+		/* Status stage */
+		return 0;
+	}
+
+	n = MIN(len, dev->req.wLength - dev->ctl_pos);
+	memcpy(dev->ctl_buf + dev->ctl_pos, buf, n);
+	dev->ctl_pos += n;
+	if (dev->ctl_pos == dev->req.wLength) {
+		r = _sim_request(dev, &dev->req, dev->ctl_buf);
+		if (r < 0) {
+			dev->ctl_stall = 1;
+		}
+	}
+	return len;
+}
+
+static sim_dev_t *
+_sim_find(sim_dev_t *dev, int addr)
+{
+	struct sim_hub *hub;
+	sim_dev_t *d;
+	int i;
+
+	if (dev->addr == addr) {
+		return dev;
+	}
+	if (dev->ops != &_hub_ops) {
+		return NULL;
+	}
+
+	hub = dev->priv;
+	for (i = 1; i <= hub->nports; i++) {
+		if (hub->child[i] && (hub->status[i] & BIT(PORT_ENABLE))) {
+			d = _sim_find(hub->child[i], addr);
+			if (d) {
+				return d;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Find a device on an enabled port */
+sim_dev_t *
+sim_find_dev(ehci_sim_t *sim, int addr)
+{
+	sim_dev_t *d;
+	int i;
+
+	for (i = 0; i < SIM_NPORTS; i++) {
+		if (sim->port[i] && (sim_op(sim)->portsc[i] & EHCI_PORT_ENABLE)) {
+			d = _sim_find(sim->port[i], addr);
+			if (d) {
+				return d;
+			}
+		}
+	}
+	return NULL;
+}
+
+/***************
+ **** Stock ****
+ ***************/
+
+static sim_dev_t *
+_sim_dev_new(const struct sim_dev_ops *ops, const char *name, uint16_t pid,
+		uint8_t class, const struct endpoint_desc *ep, int nep,
+		size_t priv)
+{
+	struct sim_dev_store *s;
+	struct sim_desc *d;
+
+	s = usb_malloc(sizeof(*s));
+	if (!s) {
+		return NULL;
+	}
+	if (priv) {
+		s->dev.priv = usb_malloc(priv);
+		if (!s->dev.priv) {
+			usb_free(s);
+			return NULL;
+		}
+	}
+
+	d = &s->desc;
+	d->dev.bLength = sizeof(d->dev);
+	d->dev.bDescriptorType = DEVICE;
+	d->dev.bcdUSB = 0x0200;
+	d->dev.bDeviceClass = (class == SIM_CLASS_VENDOR) ? 0 : class;
+	d->dev.bMaxPacketSize0 = 64;
+	d->dev.idVendor = SIM_VID;
+	d->dev.idProduct = pid;
+	d->dev.iProduct = 1;
+	d->dev.bNumConfigurations = 1;
+
+	d->conf.cfg.bLength = sizeof(d->conf.cfg);
+	d->conf.cfg.bDescriptorType = CONFIGURATION;
+	d->conf.cfg.wTotalLength = sizeof(d->conf.cfg) + sizeof(d->conf.iface)
+		+ nep * sizeof(*ep);
+	d->conf.cfg.bNumInterfaces = 1;
+	d->conf.cfg.bConfigurationValue = 1;
+	d->conf.cfg.bmAttributes = BIT(7);
+	d->conf.cfg.bMaxPower = 50;
+
+	d->conf.iface.bLength = sizeof(d->conf.iface);
+	d->conf.iface.bDescriptorType = INTERFACE;
+	d->conf.iface.bNumEndpoints = nep;
+	d->conf.iface.bInterfaceClass = class;
+	memcpy(d->conf.ep, ep, nep * sizeof(*ep));
+
+	s->dev.ops = ops;
+	s->dev.ddesc = &d->dev;
+	s->dev.cdesc = &d->conf;
+	s->dev.name = name;
+	s->dev.new_addr = -1;
+
+	return &s->dev;
+}
+
+void
+sim_dev_free(sim_dev_t *dev)
+{
+	if (dev) {
+		usb_free(dev->priv);
+		usb_free(dev);
+	}
+}
+
+/* Hub */
+
+static int
+_sim_hub_control(sim_dev_t *dev, const struct usbreq *req, void *data)
+{
+	struct sim_hub *hub = dev->priv;
+	uint8_t *d = data;
+	int port = req->wIndex;
+	int bytes = (hub->nports + 1 + 7) / 8;
+	int rcpt = req->bmRequestType & SIM_RCPT_MASK;
+
+	if ((req->bmRequestType & SIM_TYPE_MASK) != USB_TYPE_CLS) {
+		return SIM_STALL;
+	}
+
+	if (rcpt == USB_RCPT_DEVICE) {
+		switch (req->bRequest) {
+		case GET_DESCRIPTOR:
+			if ((req->wValue >> 8) != HUB) {
+				return SIM_STALL;
+			}
+			memset(d, 0, 7 + 2 * bytes);
+			d[0] = 7 + 2 * bytes;
+			d[1] = HUB;
+			d[2] = hub->nports;
+			d[3] = 0x01;        /* Per port power switching */
+			d[5] = 10;          /* 20ms power on to power good */
+			memset(d + 7 + bytes, 0xff, bytes);
+			return d[0];
+		case GET_STATUS:
+			memset(d, 0, 4);
+			return 4;
+		case SET_FEATURE:
+		case CLR_FEATURE:
+			return 0;
+		default:
+			return SIM_STALL;
+		}
+	}
+
+	if (rcpt != USB_RCPT_OTHER || port < 1 || port > hub->nports) {
+		return SIM_STALL;
+	}
+
+	switch (req->bRequest) {
+	case GET_STATUS:
+		d[0] = hub->status[port] & 0xff;
+		d[1] = hub->status[port] >> 8;
+		d[2] = hub->change[port] & 0xff;
+		d[3] = hub->change[port] >> 8;
+		return 4;
+	case SET_FEATURE:
+		switch (req->wValue) {
+		case PORT_POWER:
+			hub->status[port] |= BIT(PORT_POWER);
+			if (hub->child[port]) {
+				hub->status[port] |= BIT(PORT_CONNECTION) |
+					BIT(PORT_HIGH_SPEED);
+				hub->change[port] |= BIT(PORT_CONNECTION);
+			}
+			return 0;
+		case PORT_RESET:
+			if (hub->child[port]) {
+				sim_dev_reset(hub->child[port]);
+				hub->status[port] |= BIT(PORT_ENABLE);
+				hub->change[port] |= BIT(PORT_RESET);
+			}
+			return 0;
+		case PORT_SUSPEND:
+			hub->status[port] |= BIT(PORT_SUSPEND);
+			return 0;
+		default:
+			return SIM_STALL;
+		}
+	case CLR_FEATURE:
+		if (req->wValue >= C_PORT_CONNECTION) {
+			hub->change[port] &= ~BIT(req->wValue - C_PORT_CONNECTION);
+			return 0;
+		}
+		switch (req->wValue) {
+		case PORT_ENABLE:
+		case PORT_SUSPEND:
+			hub->status[port] &= ~BIT(req->wValue);
+			return 0;
+		case PORT_POWER:
+			hub->status[port] = 0;
+			return 0;
+		default:
+			return SIM_STALL;
+		}
+	default:
+		return SIM_STALL;
+	}
+}
+
+/* Status change endpoint, one bit per port */
+static int
+_sim_hub_in(sim_dev_t *dev, int ep, void *buf, int len)
+{
+	struct sim_hub *hub = dev->priv;
+	uint8_t *bm = buf;
+	int bytes = (hub->nports + 1 + 7) / 8;
+	int i, change = 0;
+
+	if (ep != 1) {
+		return SIM_STALL;
+	}
+
+	memset(bm, 0, MIN(len, bytes));
+	for (i = 1; i <= hub->nports; i++) {
+		if (hub->change[i] && i / 8 < len) {
+			bm[i / 8] |= BIT(i % 8);
+			change = 1;
+		}
+	}
+
+	return change ? MIN(len, bytes) : SIM_NAK;
+}
+
+static void
+_sim_hub_reset(sim_dev_t *dev)
+{
+	struct sim_hub *hub = dev->priv;
+	int i;
+
+	for (i = 1; i <= hub->nports; i++) {
+		hub->status[i] = 0;
+		hub->change[i] = 0;
+	}
+}
+
+static const struct sim_dev_ops _hub_ops = {
+	.control = _sim_hub_control,
+	.in = _sim_hub_in,
+	.reset = _sim_hub_reset,
+};
+
+sim_dev_t *
+sim_hub_new(int nports)
+{
+	struct endpoint_desc ep = {
+		.bLength = sizeof(ep),
+		.bDescriptorType = ENDPOINT,
+		.bEndpointAddress = 0x81,
+		.bmAttributes = 0x3,
+		.wMaxPacketSize = (nports + 1 + 7) / 8,
+		.bInterval = 12
+	};
+	sim_dev_t *dev;
+
+	if (nports < 1 || nports > SIM_HUB_NPORTS) {
+		return NULL;
+	}
+
+	dev = _sim_dev_new(&_hub_ops, "sim hub", SIM_PID_HUB, SIM_CLASS_HUB,
+			&ep, 1, sizeof(struct sim_hub));
+	if (dev) {
+		((struct sim_hub*)dev->priv)->nports = nports;
+	}
+	return dev;
+}
+
+int
+sim_hub_attach(sim_dev_t *dev, int port, sim_dev_t *child)
+{
+	struct sim_hub *hub = dev->priv;
+
+	if (dev->ops != &_hub_ops || port < 1 || port > hub->nports ||
+	    hub->child[port]) {
+		return -1;
+	}
+
+	hub->child[port] = child;
+	child->addr = 0;
+	if (hub->status[port] & BIT(PORT_POWER)) {
+		hub->status[port] |= BIT(PORT_CONNECTION) | BIT(PORT_HIGH_SPEED);
+		hub->change[port] |= BIT(PORT_CONNECTION);
+	}
+	return 0;
+}
+
+sim_dev_t *
+sim_hub_detach(sim_dev_t *dev, int port)
+{
+	struct sim_hub *hub = dev->priv;
+	sim_dev_t *child;
+
+	if (dev->ops != &_hub_ops || port < 1 || port > hub->nports) {
+		return NULL;
+	}
+
+	child = hub->child[port];
+	if (child) {
+		hub->child[port] = NULL;
+		if (hub->status[port] & BIT(PORT_ENABLE)) {
+			hub->change[port] |= BIT(PORT_ENABLE);
+		}
+		hub->status[port] &= ~(BIT(PORT_CONNECTION) |
+				BIT(PORT_ENABLE) | BIT(PORT_HIGH_SPEED));
+		hub->change[port] |= BIT(PORT_CONNECTION);
+	}
+	return child;
+}
+
+/* Bulk sink and source */
+
+static int
+_sim_bulk_in(sim_dev_t *dev, int ep, void *buf, int len)
+{
+	uint8_t *seq = dev->priv;
+	uint8_t *p = buf;
+	int i;
+
+	if (ep != 2) {
+		return SIM_STALL;
+	}
+	for (i = 0; i < len; i++) {
+		p[i] = (*seq)++;
+	}
+	return len;
+}
+
+static int
+_sim_bulk_out(sim_dev_t *dev, int ep, const void *buf, int len)
+{
+	return (ep == 1) ? len : SIM_STALL;
+}
+
+static const struct sim_dev_ops _bulk_ops = {
+	.in = _sim_bulk_in,
+	.out = _sim_bulk_out,
+};
+
+sim_dev_t *
+sim_bulk_new(int max_pkt)
+{
+	struct endpoint_desc ep[2] = {
+		{
+			.bLength = sizeof(ep[0]),
+			.bDescriptorType = ENDPOINT,
+			.bEndpointAddress = 0x01,
+			.bmAttributes = 0x2,
+			.wMaxPacketSize = max_pkt,
+		}, {
+			.bLength = sizeof(ep[1]),
+			.bDescriptorType = ENDPOINT,
+			.bEndpointAddress = 0x82,
+			.bmAttributes = 0x2,
+			.wMaxPacketSize = max_pkt,
+		}
+	};
+
+	return _sim_dev_new(&_bulk_ops, "sim bulk", SIM_PID_BULK,
+			SIM_CLASS_VENDOR, ep, 2, sizeof(uint8_t));
+}
+
+/* Interrupt source */
+
+static int
+_sim_intr_in(sim_dev_t *dev, int ep, void *buf, int len)
+{
+	struct sim_intr *intr = dev->priv;
+	int n;
+
+	if (ep != 1) {
+		return SIM_STALL;
+	}
+	if (!intr->pending) {
+		return SIM_NAK;
+	}
+	n = MIN(len, intr->len);
+	memcpy(buf, intr->report, n);
+	intr->pending = 0;
+	return n;
+}
+
+static const struct sim_dev_ops _intr_ops = {
+	.in = _sim_intr_in,
+};
+
+sim_dev_t *
+sim_intr_new(int max_pkt, int interval)
+{
+	struct endpoint_desc ep = {
+		.bLength = sizeof(ep),
+		.bDescriptorType = ENDPOINT,
+		.bEndpointAddress = 0x81,
+		.bmAttributes = 0x3,
+		.wMaxPacketSize = max_pkt,
+		.bInterval = interval
+	};
+	sim_dev_t *dev;
+
+	dev = _sim_dev_new(&_intr_ops, "sim interrupt", SIM_PID_INTR,
+			SIM_CLASS_VENDOR,
+			&ep, 1, sizeof(struct sim_intr));
+	if (dev) {
+		((struct sim_intr*)dev->priv)->max_pkt = max_pkt;
+	}
+	return dev;
+}
+
+int
+sim_intr_post(ehci_sim_t *sim, sim_dev_t *dev, const void *data, int len)
+{
+	struct sim_intr *intr = dev->priv;
+
+	if (dev->ops != &_intr_ops || len > intr->max_pkt ||
+	    len > (int)sizeof(intr->report)) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&sim->lock);
+	memcpy(intr->report, data, len);
+	intr->len = len;
+	intr->pending = 1;
+	pthread_mutex_unlock(&sim->lock);
+
+	return 0;
+}
@@ -0,0 +1,679 @@
+/*
+ * Copyright 2016, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+
+#include <usb/usb_host.h>
+#include "../../services.h"
+#include "sim.h"
+
+#define SIM_PAGE        0x1000
+#define SIM_ALIGN(x, a) (((x) + (a) - 1) & ~((uintptr_t)(a) - 1))
+#define SIM_X86_TF      0x100           /* EFLAGS trap flag */
+#define SIM_DEFAULT_NS  1000000         /* One frame per millisecond */
+
+/* Op register offsets */
+#define SIM_USBCMD      0x00
+#define SIM_USBSTS      0x04
+#define SIM_USBINTR     0x08
+#define SIM_FRINDEX     0x0C
+#define SIM_CTRLDSSEG   0x10
+#define SIM_PERIODIC    0x14
+#define SIM_ASYNC       0x18
+#define SIM_CONFIGFLAG  0x40
+#define SIM_PORTSC      0x44
+
+#define SIM_STS_W1C     0x3f
+#define SIM_PORT_RW     (EHCI_PORT_POWER | EHCI_PORT_OWNER |           \
+			 EHCI_PORT_SUSPEND | EHCI_PORT_FORCE_RESUME |  \
+			 EHCI_PORT_WO_OCURRENT | EHCI_PORT_WO_DCONNECT | \
+			 EHCI_PORT_WO_CONNECT)
+
+static ehci_sim_t *_sims[USB_NHOSTS];
+static int _irq_lines[USB_NHOSTS];
+static pthread_mutex_t _sims_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t _trap_once = PTHREAD_ONCE_INIT;
+static struct sigaction _old_segv, _old_trap;
+
+/* The store being replayed by this thread */
+struct sim_trap {
+	ehci_sim_t *sim;
+	uint32_t off;
+	uint32_t old;
+};
+static __thread struct sim_trap _trap;
+
+/*******************************
+ **** DMA, identity mapped ****
+ *******************************/
+
+static void *
+_sim_dma_alloc(void *cookie, size_t size, int align, int cache,
+		ps_mem_flags_t flags)
+{
+	size_t len = SIM_ALIGN(size, SIM_PAGE);
+	size_t extra = (align > SIM_PAGE) ? align : 0;
+	uintptr_t p, a;
+
+	/* MAP_32BIT keeps everything reachable by 32-bit link pointers */
+	p = (uintptr_t)mmap(NULL, len + extra, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+	if ((void*)p == MAP_FAILED) {
+		return NULL;
+	}
+
+	a = extra ? SIM_ALIGN(p, align) : p;
+	if (a != p) {
+		munmap((void*)p, a - p);
+	}
+	if (p + len + extra != a + len) {
+		munmap((void*)(a + len), p + extra - a);
+	}
+
+	return (void*)a;
+}
+
+static void
+_sim_dma_free(void *cookie, void *addr, size_t size)
+{
+	munmap(addr, SIM_ALIGN(size, SIM_PAGE));
+}
+
+static uintptr_t
+_sim_dma_pin(void *cookie, void *addr, size_t size)
+{
+	return (uintptr_t)addr;
+}
+
+static void
+_sim_dma_unpin(void *cookie, void *addr, size_t size)
+{
+}
+
+/* The model is cache coherent */
+static void
+_sim_dma_cache_op(void *cookie, void *addr, size_t size, dma_cache_op_t op)
+{
+}
+
+int
+ehci_sim_dma_init(ps_dma_man_t *dman)
+{
+	dman->cookie = NULL;
+	dman->dma_alloc_fn = _sim_dma_alloc;
+	dman->dma_free_fn = _sim_dma_free;
+	dman->dma_pin_fn = _sim_dma_pin;
+	dman->dma_unpin_fn = _sim_dma_unpin;
+	dman->dma_cache_op_fn = _sim_dma_cache_op;
+
+	return 0;
+}
+
+/*******************
+ **** Registers ****
+ *******************/
+
+void
+sim_update_irq(ehci_sim_t *sim)
+{
+	volatile struct ehci_host_op *op = sim_op(sim);
+	int line;
+
+	line = !!(op->usbsts & op->usbintr & SIM_STS_W1C);
+	if (line && !sim->irq_line) {
+		sim->stats.irqs++;
+		pthread_cond_broadcast(&sim->irq_cond);
+	}
+	sim->irq_line = line;
+}
+
+static uint32_t
+_sim_port_reset_value(ehci_sim_t *sim, int i)
+{
+	uint32_t v = EHCI_PORT_POWER;
+
+	if (sim->port[i]) {
+		v |= EHCI_PORT_CONNECT | EHCI_PORT_CONNECT_C;
+	}
+	return v;
+}
+
+/* HCRESET, the capability registers are left alone */
+static void
+_sim_reset(ehci_sim_t *sim)
+{
+	volatile struct ehci_host_op *op = sim_op(sim);
+	int i;
+
+	for (i = SIM_CAPLENGTH / 4; i < SIM_REGS_SIZE / 4; i++) {
+		sim->regs[i] = 0;
+	}
+	op->usbcmd = EHCICMD_IRQTHRES(8) | EHCICMD_LIST_S1024;
+	op->usbsts = EHCISTS_HCHALTED;
+	for (i = 0; i < SIM_NPORTS; i++) {
+		op->portsc[i] = _sim_port_reset_value(sim, i);
+	}
+}
+
+static uint32_t
+_sim_write_cmd(ehci_sim_t *sim, uint32_t old, uint32_t v)
+{
+	volatile struct ehci_host_op *op = sim_op(sim);
+	uint32_t sts = op->usbsts;
+
+	if (v & EHCICMD_HCRESET) {
+		_sim_reset(sim);
+		return op->usbcmd;
+	}
+
+	if (v & EHCICMD_RUNSTOP) {
+		sts &= ~EHCISTS_HCHALTED;
+	} else {
+		sts |= EHCISTS_HCHALTED;
+		/* Nothing walks the schedule, so answer the doorbell now */
+		if (v & EHCICMD_ASYNC_DB) {
+			v &= ~EHCICMD_ASYNC_DB;
+			sts |= EHCISTS_ASYNC_ADV;
+		}
+	}
+
+	/* Schedules start and stop instantly */
+	sts &= ~(EHCISTS_ASYNC_EN | EHCISTS_PERI_EN);
+	sts |= (v & EHCICMD_ASYNC_EN) ? EHCISTS_ASYNC_EN : 0;
+	sts |= (v & EHCICMD_PERI_EN) ? EHCISTS_PERI_EN : 0;
+	op->usbsts = sts;
+
+	return v & ~EHCICMD_LIGHT_RST;
+}
+
+static uint32_t
+_sim_write_port(ehci_sim_t *sim, int i, uint32_t old, uint32_t v)
+{
+	sim_dev_t *dev = sim->port[i];
+	uint32_t new;
+
+	new = old & ~(v & EHCI_PORT_CHANGE);
+	new = (new & ~SIM_PORT_RW) | (v & SIM_PORT_RW);
+	/* Software can disable a port, but only a reset enables it */
+	if (!(v & EHCI_PORT_ENABLE)) {
+		new &= ~EHCI_PORT_ENABLE;
+	}
+
+	if ((v & EHCI_PORT_RESET) && !(old & EHCI_PORT_RESET)) {
+		new |= EHCI_PORT_RESET;
+		new &= ~EHCI_PORT_ENABLE;
+	} else if (!(v & EHCI_PORT_RESET) && (old & EHCI_PORT_RESET)) {
+		new &= ~EHCI_PORT_RESET;
+		if (dev && !(new & EHCI_PORT_OWNER)) {
+			new |= EHCI_PORT_ENABLE;
+			sim_dev_reset(dev);
+		}
+	}
+
+	/* Resume completes when software clears FORCE_RESUME */
+	if ((old & EHCI_PORT_FORCE_RESUME) && !(v & EHCI_PORT_FORCE_RESUME)) {
+		new &= ~EHCI_PORT_SUSPEND;
+	}
+
+	return new;
+}
+
+static void
+_sim_port_detect(ehci_sim_t *sim)
+{
+	volatile struct ehci_host_op *op = sim_op(sim);
+	int i;
+
+	for (i = 0; i < SIM_NPORTS; i++) {
+		if (op->portsc[i] & EHCI_PORT_CHANGE) {
+			sim_raise(sim, EHCISTS_PORTC_DET);
+		}
+	}
+}
+
+/* Replay a store, @v is what the driver wrote over @old */
+static void
+_sim_write(ehci_sim_t *sim, uint32_t off, uint32_t old, uint32_t v)
+{
+	volatile uint32_t *reg = &sim->regs[off / 4];
+	uint32_t o;
+
+	sim->stats.traps++;
+	if (off < SIM_CAPLENGTH) {
+		*reg = old;
+		return;
+	}
+
+	o = off - SIM_CAPLENGTH;
+	switch (o) {
+	case SIM_USBCMD:
+		*reg = _sim_write_cmd(sim, old, v);
+		break;
+	case SIM_USBSTS:
+		*reg = old & ~(v & SIM_STS_W1C);
+		break;
+	case SIM_FRINDEX:
+		if (!(sim_op(sim)->usbsts & EHCISTS_HCHALTED)) {
+			*reg = old;
+		}
+		break;
+	case SIM_PERIODIC:
+		*reg = v & ~0xfff;
+		break;
+	case SIM_ASYNC:
+		*reg = v & ~0x1f;
+		break;
+	case SIM_CONFIGFLAG:
+		/* Ports are routed to us, report what is plugged in */
+		if ((v & EHCICFLAG_CFLAG) && !(old & EHCICFLAG_CFLAG)) {
+			_sim_port_detect(sim);
+		}
+		break;
+	case SIM_USBINTR:
+	case SIM_CTRLDSSEG:
+		break;
+	default:
+		if (o >= SIM_PORTSC && o < SIM_PORTSC + SIM_NPORTS * 4) {
+			*reg = _sim_write_port(sim, (o - SIM_PORTSC) / 4, old, v);
+		} else {
+			*reg = old;
+		}
+		break;
+	}
+
+	sim_update_irq(sim);
+}
+
+/*
+ * Signal side of the handshake with the model thread. Only read() and
+ * write() are used, both are async-signal-safe.
+ */
+static void
+_sim_trap_wait(ehci_sim_t *sim)
+{
+	char c = 0;
+	int err = errno;
+
+	while (write(sim->trap_req[1], &c, 1) < 0 && errno == EINTR);
+	while (read(sim->trap_ack[0], &c, 1) < 0 && errno == EINTR);
+	errno = err;
+}
+
+/*
+ * A store to the driver view faults. Open the page, single step the store
+ * and replay it through the model once it has landed. The handlers take no
+ * lock: the trap is handed over in a per-thread slot and the model thread
+ * holds the model lock on our behalf from the fault until the replay, so
+ * the model never sees a half done write.
+ */
+static void
+_sim_segv(int sig, siginfo_t *si, void *ctx)
+{
+	ucontext_t *uc = ctx;
+	uintptr_t addr = (uintptr_t)si->si_addr;
+	ehci_sim_t *sim = NULL;
+	struct sim_trap *none;
+	int i;
+
+	for (i = 0; i < USB_NHOSTS; i++) {
+		if (_sims[i] && addr >= (uintptr_t)_sims[i]->drv &&
+		    addr < (uintptr_t)_sims[i]->drv + SIM_REGS_SIZE) {
+			sim = _sims[i];
+			break;
+		}
+	}
+	if (!sim || _trap.sim) {
+		/* Not ours, the store faults again with the old handler */
+		sigaction(SIGSEGV, &_old_segv, NULL);
+		return;
+	}
+
+	/* One store at a time per host */
+	_trap.sim = sim;
+	do {
+		none = NULL;
+	} while (!__atomic_compare_exchange_n(&sim->trap, &none, &_trap, 0,
+					      __ATOMIC_ACQUIRE,
+					      __ATOMIC_RELAXED));
+
+	/* Returns with the model parked */
+	_sim_trap_wait(sim);
+	_trap.off = (addr - (uintptr_t)sim->drv) & ~3;
+	_trap.old = sim->regs[_trap.off / 4];
+	mprotect(sim->drv, SIM_REGS_SIZE, PROT_READ | PROT_WRITE);
+	uc->uc_mcontext.gregs[REG_EFL] |= SIM_X86_TF;
+}
+
+static void
+_sim_step(int sig, siginfo_t *si, void *ctx)
+{
+	ucontext_t *uc = ctx;
+	ehci_sim_t *sim = _trap.sim;
+
+	if (!sim) {
+		sigaction(SIGTRAP, &_old_trap, NULL);
+		raise(SIGTRAP);
+		return;
+	}
+
+	uc->uc_mcontext.gregs[REG_EFL] &= ~SIM_X86_TF;
+	mprotect(sim->drv, SIM_REGS_SIZE, PROT_READ);
+	/* Returns once the model has replayed the store */
+	_sim_trap_wait(sim);
+	_trap.sim = NULL;
+}
+
+/* Model side of the handshake, called with the model lock held */
+static void
+_sim_serve_trap(ehci_sim_t *sim)
+{
+	struct sim_trap *t;
+	char c = 0;
+
+	t = __atomic_load_n(&sim->trap, __ATOMIC_ACQUIRE);
+	assert(t);
+
+	/* Parked, then wait for the store to land */
+	while (write(sim->trap_ack[1], &c, 1) < 0 && errno == EINTR);
+	while (read(sim->trap_req[0], &c, 1) < 0 && errno == EINTR);
+
+	_sim_write(sim, t->off, t->old, sim->regs[t->off / 4]);
+	__atomic_store_n(&sim->trap, NULL, __ATOMIC_RELEASE);
+	while (write(sim->trap_ack[1], &c, 1) < 0 && errno == EINTR);
+}
+
+static void
+_sim_install_traps(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_flags = SA_SIGINFO;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_sigaction = _sim_segv;
+	sigaction(SIGSEGV, &sa, &_old_segv);
+	sa.sa_sigaction = _sim_step;
+	sigaction(SIGTRAP, &sa, &_old_trap);
+}
+
+/***************
+ **** Model ****
+ ***************/
+
+static void *
+_sim_thread(void *arg)
+{
+	ehci_sim_t *sim = arg;
+	struct pollfd pfd = { .fd = sim->trap_req[0], .events = POLLIN };
+	struct timespec next, now, wait;
+	uint32_t ns;
+	char c;
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	while (1) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		wait.tv_sec = next.tv_sec - now.tv_sec;
+		wait.tv_nsec = next.tv_nsec - now.tv_nsec;
+		if (wait.tv_nsec < 0) {
+			wait.tv_nsec += 1000000000;
+			wait.tv_sec--;
+		}
+		if (wait.tv_sec < 0) {
+			wait.tv_sec = wait.tv_nsec = 0;
+		}
+
+		/* Trapped stores are served between frames */
+		if (ppoll(&pfd, 1, &wait, NULL) > 0 &&
+				read(sim->trap_req[0], &c, 1) == 1) {
+			pthread_mutex_lock(&sim->lock);
+			_sim_serve_trap(sim);
+			pthread_mutex_unlock(&sim->lock);
+			continue;
+		}
+
+		pthread_mutex_lock(&sim->lock);
+		sim_run_frame(sim);
+		sim_update_irq(sim);
+		ns = sim->frame_ns;
+		pthread_mutex_unlock(&sim->lock);
+
+		if (!ns) {
+			sched_yield();
+			clock_gettime(CLOCK_MONOTONIC, &next);
+			continue;
+		}
+		next.tv_nsec += ns;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			next.tv_sec++;
+		}
+	}
+
+	return NULL;
+}
+
+static ehci_sim_t *
+_sim_new(enum usb_host_id id)
+{
+	volatile struct ehci_host_cap *cap;
+	ehci_sim_t *sim;
+	int fd;
+
+	sim = usb_malloc(sizeof(*sim));
+	if (!sim) {
+		return NULL;
+	}
+	sim->id = id;
+	sim->frame_ns = SIM_DEFAULT_NS;
+
+	/* Two views of one page, the model writes through its own */
+	fd = memfd_create("ehci-sim", 0);
+	if (fd < 0 || ftruncate(fd, SIM_REGS_SIZE)) {
+		goto fail;
+	}
+	sim->regs = mmap(NULL, SIM_REGS_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	sim->drv = mmap(NULL, SIM_REGS_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (sim->regs == MAP_FAILED || sim->drv == MAP_FAILED) {
+		goto fail;
+	}
+
+	cap = (volatile struct ehci_host_cap*)sim->regs;
+	cap->caplength = SIM_CAPLENGTH;
+	cap->hciversion = 0x0100;
+	cap->hcsparams = SIM_NPORTS;
+	cap->hccparams = EHCI_HCC_PARK | EHCI_HCC_PFRAMELIST;
+	_sim_reset(sim);
+
+	pthread_mutex_init(&sim->lock, NULL);
+	pthread_cond_init(&sim->irq_cond, NULL);
+	if (pipe(sim->trap_req) || pipe(sim->trap_ack)) {
+		goto fail;
+	}
+	if (pthread_create(&sim->thread, NULL, _sim_thread, sim)) {
+		goto fail;
+	}
+
+	return sim;
+fail:
+	printf("EHCI sim: Failed to create host %d\n", id);
+	usb_free(sim);
+	return NULL;
+}
+
+/****************************
+ **** Exported functions ****
+ ****************************/
+
+ehci_sim_t *
+ehci_sim_get(enum usb_host_id id)
+{
+	ehci_sim_t *sim;
+
+	if (id < 0 || id >= USB_NHOSTS) {
+		return NULL;
+	}
+
+	pthread_once(&_trap_once, _sim_install_traps);
+	pthread_mutex_lock(&_sims_lock);
+	if (!_sims[id]) {
+		_sims[id] = _sim_new(id);
+	}
+	sim = _sims[id];
+	pthread_mutex_unlock(&_sims_lock);
+
+	return sim;
+}
+
+void
+ehci_sim_set_frame_ns(ehci_sim_t *sim, uint32_t ns)
+{
+	pthread_mutex_lock(&sim->lock);
+	sim->frame_ns = ns;
+	pthread_mutex_unlock(&sim->lock);
+}
+
+int
+ehci_sim_wait_irq(ehci_sim_t *sim, int timeout_ms)
+{
+	struct timespec end;
+	int line;
+
+	clock_gettime(CLOCK_REALTIME, &end);
+	if (timeout_ms > 0) {
+		end.tv_sec += timeout_ms / 1000;
+		end.tv_nsec += (timeout_ms % 1000) * 1000000;
+		if (end.tv_nsec >= 1000000000) {
+			end.tv_nsec -= 1000000000;
+			end.tv_sec++;
+		}
+	}
+
+	pthread_mutex_lock(&sim->lock);
+	while (!sim->irq_line && timeout_ms) {
+		if (timeout_ms < 0) {
+			pthread_cond_wait(&sim->irq_cond, &sim->lock);
+		} else if (pthread_cond_timedwait(&sim->irq_cond, &sim->lock,
+					&end) == ETIMEDOUT) {
+			break;
+		}
+	}
+	line = sim->irq_line;
+	pthread_mutex_unlock(&sim->lock);
+
+	return line;
+}
+
+void
+ehci_sim_get_stats(ehci_sim_t *sim, struct ehci_sim_stats *stats)
+{
+	pthread_mutex_lock(&sim->lock);
+	*stats = sim->stats;
+	pthread_mutex_unlock(&sim->lock);
+}
+
+int
+ehci_sim_attach(ehci_sim_t *sim, sim_dev_t *hub, int port, sim_dev_t *dev)
+{
+	volatile struct ehci_host_op *op = sim_op(sim);
+	int err = 0;
+
+	pthread_mutex_lock(&sim->lock);
+	if (hub) {
+		err = sim_hub_attach(hub, port, dev);
+	} else if (port < 1 || port > SIM_NPORTS || sim->port[port - 1]) {
+		err = -1;
+	} else {
+		sim->port[port - 1] = dev;
+		dev->addr = 0;
+		op->portsc[port - 1] |= EHCI_PORT_CONNECT | EHCI_PORT_CONNECT_C;
+		sim_raise(sim, EHCISTS_PORTC_DET);
+		sim_update_irq(sim);
+	}
+	pthread_mutex_unlock(&sim->lock);
+
+	return err;
+}
+
+sim_dev_t *
+ehci_sim_detach(ehci_sim_t *sim, sim_dev_t *hub, int port)
+{
+	volatile struct ehci_host_op *op = sim_op(sim);
+	sim_dev_t *dev = NULL;
+	uint32_t v;
+
+	pthread_mutex_lock(&sim->lock);
+	if (hub) {
+		dev = sim_hub_detach(hub, port);
+	} else if (port >= 1 && port <= SIM_NPORTS && sim->port[port - 1]) {
+		dev = sim->port[port - 1];
+		sim->port[port - 1] = NULL;
+		v = op->portsc[port - 1];
+		if (v & EHCI_PORT_ENABLE) {
+			v |= EHCI_PORT_ENABLE_C;
+		}
+		v &= ~(EHCI_PORT_CONNECT | EHCI_PORT_ENABLE);
+		op->portsc[port - 1] = v | EHCI_PORT_CONNECT_C;
+		sim_raise(sim, EHCISTS_PORTC_DET);
+		sim_update_irq(sim);
+	}
+	pthread_mutex_unlock(&sim->lock);
+
+	return dev;
+}
+
+int
+usb_host_init(enum usb_host_id id, ps_io_ops_t* io_ops, mutex_ops_t *mops,
+		usb_host_t* hdev)
+{
+	ehci_sim_t *sim;
+
+	if (id < 0 || id >= USB_NHOSTS) {
+		return -1;
+	}
+	assert(io_ops);
+	assert(hdev);
+
+	hdev->id = id;
+	hdev->dman = &io_ops->dma_manager;
+	hdev->mops = mops;
+
+	sim = ehci_sim_get(id);
+	if (!sim) {
+		return -1;
+	}
+
+	return ehci_host_init(hdev, (uintptr_t)sim->drv, NULL);
+}
+
+/* There is no interrupt controller, see ehci_sim_wait_irq() */
+const int*
+usb_host_irqs(usb_host_t* host, int* nirqs)
+{
+	if (host->id < 0 || host->id >= USB_NHOSTS) {
+		return NULL;
+	}
+
+	if (nirqs) {
+		*nirqs = 1;
+	}
+
+	_irq_lines[host->id] = host->id;
+	host->irqs = &_irq_lines[host->id];
+	return host->irqs;
+}
@@ -0,0 +1,414 @@
+/*
+ * Copyright 2016, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include <string.h>
+
+#include "../../services.h"
+#include "sim.h"
+
+/*
+ * Schedule walker
+ *
+ * Runs once per frame with the model lock held. The periodic schedule is
+ * walked once for the frame, the asynchronous schedule once around the ring.
+ * Bandwidth is not modelled, a qTD moves all of its data in one go unless the
+ * device NAKs, and data toggles are not checked. The NAK counter of a queue
+ * head counts down, but never stops the queue head from being executed.
+ */
+
+/* Bail out of corrupt or looping schedules */
+#define SIM_WALK_LIMIT    1024
+/* qTDs retired per asynchronous QH per frame */
+#define SIM_QH_BUDGET     64
+
+#define SIM_LP_ADDR(x)    ((x) & ~0x1fU)
+#define SIM_LP_TYPE(x)    ((x) & (0x3 * BIT(1)))
+#define SIM_TD_PID(x)     ((x) & (0x3 * BIT(8)))
+
+enum sim_td_result {
+	SIM_TD_DONE,
+	SIM_TD_SHORT,
+	SIM_TD_NAK,
+	SIM_TD_HALT
+};
+
+/*
+ * Copy between a flat buffer and a transfer described by page pointers,
+ * starting @start bytes into the first page.
+ */
+static void
+_sim_pages_copy(volatile uint32_t *pages, int npages, uint32_t start,
+		void *buf, int len, int to_mem)
+{
+	char *p = buf;
+	char *mem;
+	int pg, n;
+
+	while (len > 0) {
+		pg = start >> 12;
+		if (pg >= npages) {
+			break;
+		}
+		n = MIN(len, 0x1000 - (int)(start & 0xfff));
+		mem = (char*)(uintptr_t)((pages[pg] & ~0xfff) + (start & 0xfff));
+		if (to_mem) {
+			memcpy(mem, p, n);
+		} else {
+			memcpy(p, mem, n);
+		}
+		p += n;
+		start += n;
+		len -= n;
+	}
+}
+
+/* Run one transaction of an endpoint against a device */
+static int
+_sim_xfer(ehci_sim_t *sim, sim_dev_t *dev, int ep, int in, void *buf, int len)
+{
+	int r;
+
+	if (in) {
+		r = dev->ops->in ? dev->ops->in(dev, ep, buf, len) : SIM_STALL;
+	} else {
+		r = dev->ops->out ? dev->ops->out(dev, ep, buf, len) : SIM_STALL;
+	}
+
+	if (r == SIM_NAK) {
+		dev->naks++;
+		sim->stats.naks++;
+	} else if (r == SIM_STALL) {
+		dev->stalls++;
+	} else if (r > 0) {
+		if (in) {
+			dev->bytes_in += r;
+		} else {
+			dev->bytes_out += r;
+		}
+		sim->stats.bytes += r;
+	}
+
+	return r;
+}
+
+/* Execute the qTD in the overlay area */
+static int
+_sim_exec_td(ehci_sim_t *sim, sim_dev_t *dev, int ep, volatile struct TD *td)
+{
+	uint8_t buf[5 * 0x1000];
+	uint32_t tok = td->token;
+	uint32_t start = td->buf[0] & 0xfff;
+	int len = TDTOK_GET_BYTES(tok);
+	int pid = SIM_TD_PID(tok);
+	int r;
+
+	if (!dev) {
+		td->token = (tok & ~TDTOK_SACTIVE) | TDTOK_SHALTED | TDTOK_SXACTERR;
+		return SIM_TD_HALT;
+	}
+
+	if (pid == TDTOK_PID_IN) {
+		if (ep) {
+			r = _sim_xfer(sim, dev, ep, 1, buf, len);
+		} else {
+			r = sim_dev_ctl_in(dev, buf, len);
+		}
+		if (r > len) {
+			tok &= ~(TDTOK_SACTIVE | TDTOK_BYTES_MASK);
+			td->token = tok | TDTOK_SHALTED | TDTOK_SBABDET;
+			return SIM_TD_HALT;
+		}
+		if (r > 0) {
+			_sim_pages_copy(td->buf, 5, start, buf, r, 1);
+		}
+	} else {
+		_sim_pages_copy(td->buf, 5, start, buf, len, 0);
+		if (pid == TDTOK_PID_SETUP) {
+			if (len != sizeof(struct usbreq)) {
+				r = SIM_STALL;
+			} else {
+				r = sim_dev_setup(dev, (struct usbreq*)buf);
+			}
+		} else if (ep) {
+			r = _sim_xfer(sim, dev, ep, 0, buf, len);
+		} else {
+			r = sim_dev_ctl_out(dev, buf, len);
+		}
+	}
+
+	if (r == SIM_NAK) {
+		return SIM_TD_NAK;
+	}
+
+	tok &= ~(TDTOK_SACTIVE | TDTOK_BYTES_MASK);
+	if (r == SIM_STALL) {
+		td->token = tok | TDTOK_SHALTED | TDTOK_BYTES(len);
+		return SIM_TD_HALT;
+	}
+
+	r = MIN(r, len);
+	td->token = tok | TDTOK_BYTES(len - r);
+	if (pid == TDTOK_PID_IN && r < len) {
+		return SIM_TD_SHORT;
+	}
+	return SIM_TD_DONE;
+}
+
+/*
+ * Advance a queue head through its qTDs, following the overlay rules of
+ * Section 4.10. Interrupt queue heads get one qTD per visit.
+ */
+static void
+_sim_run_qh(ehci_sim_t *sim, volatile struct QH *qh, int periodic)
+{
+	volatile struct TD *ov = &qh->td_overlay;
+	volatile struct TD *td;
+	sim_dev_t *dev;
+	uint32_t next, nakcnt;
+	int ep, n, r;
+
+	dev = sim_find_dev(sim, QHEPC0_GET_ADDR(qh->epc[0]));
+	ep = (qh->epc[0] >> 8) & 0xf;
+
+	for (n = 0; n < SIM_QH_BUDGET; n++) {
+		if (ov->token & TDTOK_SHALTED) {
+			return;
+		}
+
+		if (!(ov->token & TDTOK_SACTIVE)) {
+			next = ov->next;
+			if (next & TDLP_INVALID) {
+				return;
+			}
+			td = SIM_PTR(struct TD, SIM_LP_ADDR(next));
+			if (!(td->token & TDTOK_SACTIVE)) {
+				return;
+			}
+			qh->td_cur = SIM_LP_ADDR(next);
+			ov->next = td->next;
+			/* The NAK counter is reloaded with every new qTD */
+			ov->alt = (td->alt & ~0x1eU) |
+				(QHEPC0_GET_NAKCNT_RL(qh->epc[0]) << 1);
+			memcpy((void*)ov->buf, (void*)td->buf, sizeof(td->buf));
+			memcpy((void*)ov->buf_hi, (void*)td->buf_hi,
+					sizeof(td->buf_hi));
+			ov->token = td->token;
+		}
+
+		r = _sim_exec_td(sim, dev, ep, ov);
+		if (r == SIM_TD_NAK) {
+			nakcnt = TDALTTDPTR_NAKCNT(ov->alt);
+			if (nakcnt) {
+				ov->alt = (ov->alt & ~0x1eU) | ((nakcnt - 1) << 1);
+			}
+			return;
+		}
+
+		/* Write back */
+		td = SIM_PTR(struct TD, qh->td_cur);
+		td->token = ov->token;
+		sim->stats.qtds++;
+		if (ov->token & TDTOK_IOC) {
+			sim_raise(sim, EHCISTS_USBINT);
+		}
+		if (r == SIM_TD_HALT) {
+			sim_raise(sim, EHCISTS_USBERRINT);
+			return;
+		}
+		if (r == SIM_TD_SHORT && !(ov->alt & TDLP_INVALID)) {
+			ov->next = SIM_LP_ADDR(ov->alt);
+		}
+		if (periodic) {
+			return;
+		}
+	}
+}
+
+static void
+_sim_run_itd(ehci_sim_t *sim, volatile struct ITD *itd)
+{
+	uint8_t buf[ITDTX_GET_LEN(~0U)];
+	sim_dev_t *dev;
+	uint32_t tx, start;
+	int uf, ep, in, len, r;
+
+	dev = sim_find_dev(sim, itd->buf[0] & 0x7f);
+	ep = (itd->buf[0] >> 8) & 0xf;
+	in = !!(itd->buf[1] & ITDBUF1_DIR_IN);
+
+	for (uf = 0; uf < 8; uf++) {
+		tx = itd->transaction[uf];
+		if (!(tx & ITDTX_ACTIVE)) {
+			continue;
+		}
+		len = ITDTX_GET_LEN(tx);
+		start = ((tx >> 12) & 0x7) * 0x1000 + (tx & 0xfff);
+
+		if (!dev) {
+			r = SIM_STALL;
+		} else if (in) {
+			r = _sim_xfer(sim, dev, ep, 1, buf, len);
+			if (r > 0) {
+				_sim_pages_copy(itd->buf, 7, start, buf, r, 1);
+			}
+		} else {
+			_sim_pages_copy(itd->buf, 7, start, buf, len, 0);
+			r = _sim_xfer(sim, dev, ep, 0, buf, len);
+		}
+
+		/* Isochronous endpoints don't handshake, a NAK is no data */
+		tx &= ~ITDTX_ACTIVE;
+		if (r == SIM_STALL) {
+			tx |= ITDTX_XACTERR;
+			sim_raise(sim, EHCISTS_USBERRINT);
+		} else if (in) {
+			tx &= ~ITDTX_LEN(0xfff);
+			tx |= ITDTX_LEN(MAX(r, 0));
+		}
+		itd->transaction[uf] = tx;
+		sim->stats.isoc++;
+		if (tx & ITDTX_IOC) {
+			sim_raise(sim, EHCISTS_USBINT);
+		}
+	}
+}
+
+static void
+_sim_run_sitd(ehci_sim_t *sim, volatile struct SITD *sitd)
+{
+	uint8_t buf[SITDST_GET_BYTES(~0U)];
+	sim_dev_t *dev;
+	uint32_t st = sitd->state;
+	int ep, in, len, r;
+
+	if (!(st & SITDST_ACTIVE)) {
+		return;
+	}
+
+	dev = sim_find_dev(sim, sitd->epc & 0x7f);
+	ep = (sitd->epc >> 8) & 0xf;
+	in = !!(sitd->epc & SITDEPC_DIR_IN);
+	len = SITDST_GET_BYTES(st);
+
+	if (!dev) {
+		r = SIM_STALL;
+	} else if (in) {
+		r = _sim_xfer(sim, dev, ep, 1, buf, len);
+		if (r > 0) {
+			_sim_pages_copy(sitd->buf, 2, sitd->buf[0] & 0xfff,
+					buf, MIN(r, len), 1);
+		}
+	} else {
+		_sim_pages_copy(sitd->buf, 2, sitd->buf[0] & 0xfff, buf, len, 0);
+		r = _sim_xfer(sim, dev, ep, 0, buf, len);
+	}
+
+	st &= ~(SITDST_ACTIVE | SITDST_BYTES(0x3ff));
+	if (r == SIM_STALL) {
+		st |= SITDST_XACTERR;
+		sim_raise(sim, EHCISTS_USBERRINT);
+	} else {
+		st |= SITDST_BYTES(len - MIN(MAX(r, 0), len));
+	}
+	sitd->state = st;
+	sim->stats.isoc++;
+	if (st & SITDST_IOC) {
+		sim_raise(sim, EHCISTS_USBINT);
+	}
+}
+
+static void
+_sim_periodic(ehci_sim_t *sim, uint32_t frame)
+{
+	volatile struct ehci_host_op *op = sim_op(sim);
+	volatile uint32_t *flist;
+	volatile struct QH *qh;
+	uint32_t link;
+	int size, n;
+
+	size = 1024 >> ((op->usbcmd & EHCICMD_LIST_SMASK) >> 2);
+	flist = SIM_PTR(uint32_t, op->periodiclistbase);
+	link = flist[frame & (size - 1)];
+
+	for (n = 0; !(link & QHLP_INVALID) && n < SIM_WALK_LIMIT; n++) {
+		switch (SIM_LP_TYPE(link)) {
+		case QHLP_TYPE_ITD:
+			_sim_run_itd(sim, SIM_PTR(struct ITD, SIM_LP_ADDR(link)));
+			break;
+		case QHLP_TYPE_SITD:
+			_sim_run_sitd(sim, SIM_PTR(struct SITD, SIM_LP_ADDR(link)));
+			break;
+		case QHLP_TYPE_QH:
+			qh = SIM_PTR(struct QH, SIM_LP_ADDR(link));
+			if (qh->epc[1] & QHEPC1_UFRAME_SMASK(0xff)) {
+				_sim_run_qh(sim, qh, 1);
+			}
+			break;
+		default:
+			break;
+		}
+		/* All periodic descriptors start with their link pointer */
+		link = *SIM_PTR(uint32_t, SIM_LP_ADDR(link));
+	}
+}
+
+static void
+_sim_async(ehci_sim_t *sim)
+{
+	volatile struct QH *qh;
+	uint32_t head, addr;
+	int n;
+
+	head = SIM_LP_ADDR(sim_op(sim)->asynclistaddr);
+	addr = head;
+	for (n = 0; n < SIM_WALK_LIMIT; n++) {
+		qh = SIM_PTR(struct QH, addr);
+		_sim_run_qh(sim, qh, 0);
+		if (qh->qhlptr & QHLP_INVALID) {
+			break;
+		}
+		addr = SIM_LP_ADDR(qh->qhlptr);
+		if (addr == head) {
+			break;
+		}
+	}
+}
+
+void
+sim_run_frame(ehci_sim_t *sim)
+{
+	volatile struct ehci_host_op *op = sim_op(sim);
+	uint32_t cmd = op->usbcmd;
+	int size;
+
+	if (!(cmd & EHCICMD_RUNSTOP)) {
+		return;
+	}
+
+	if ((cmd & EHCICMD_PERI_EN) && op->periodiclistbase) {
+		_sim_periodic(sim, UFRAME2FRAME(op->frindex));
+	}
+	if ((cmd & EHCICMD_ASYNC_EN) && op->asynclistaddr) {
+		_sim_async(sim);
+	}
+
+	/* The walk above is the advance the doorbell waits for */
+	if (cmd & EHCICMD_ASYNC_DB) {
+		op->usbcmd = op->usbcmd & ~EHCICMD_ASYNC_DB;
+		sim_raise(sim, EHCISTS_ASYNC_ADV);
+	}
+
+	op->frindex = (op->frindex + FRAME2UFRAME(1)) & 0x3fff;
+	size = 1024 >> ((cmd & EHCICMD_LIST_SMASK) >> 2);
+	if ((UFRAME2FRAME(op->frindex) & (size - 1)) == 0) {
+		sim_raise(sim, EHCISTS_FLIST_ROLL);
+	}
+	sim->stats.frames++;
+}
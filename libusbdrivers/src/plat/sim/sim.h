@@ -0,0 +1,79 @@
+/*
+ * Copyright 2016, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#ifndef _PLAT_SIM_SIM_H_
+#define _PLAT_SIM_SIM_H_
+
+#include <pthread.h>
+#include <usb/plat/sim.h>
+
+#include "../../ehci/ehci.h"
+
+#define SIM_NPORTS       4
+#define SIM_HUB_NPORTS   15
+#define SIM_CAPLENGTH    0x20
+#define SIM_REGS_SIZE    0x1000
+
+/* Physical addresses are virtual addresses */
+#define SIM_PTR(type, paddr)  ((volatile type*)(uintptr_t)(paddr))
+
+struct ehci_sim {
+	enum usb_host_id id;
+	volatile uint32_t *regs;        /* Model view, read-write */
+	void *drv;                      /* Driver view, stores trap */
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t irq_cond;
+	struct sim_trap *trap;          /* Store being replayed, see ehci-sim.c */
+	int trap_req[2];                /* Pipes to and from the model thread */
+	int trap_ack[2];
+	int irq_line;
+	uint32_t frame_ns;
+	sim_dev_t *port[SIM_NPORTS];
+	struct ehci_sim_stats stats;
+};
+
+/* Private data of a virtual hub */
+struct sim_hub {
+	int nports;
+	uint16_t status[SIM_HUB_NPORTS + 1];
+	uint16_t change[SIM_HUB_NPORTS + 1];
+	sim_dev_t *child[SIM_HUB_NPORTS + 1];
+};
+
+static inline volatile struct ehci_host_op *
+sim_op(ehci_sim_t *sim)
+{
+	return (volatile struct ehci_host_op*)((uintptr_t)sim->regs +
+			SIM_CAPLENGTH);
+}
+
+static inline void
+sim_raise(ehci_sim_t *sim, uint32_t sts)
+{
+	sim_op(sim)->usbsts |= sts;
+}
+
+/* ehci-sim.c */
+void sim_update_irq(ehci_sim_t *sim);
+
+/* sched.c */
+void sim_run_frame(ehci_sim_t *sim);
+
+/* devices.c, called with the model lock held */
+sim_dev_t *sim_find_dev(ehci_sim_t *sim, int addr);
+void sim_dev_reset(sim_dev_t *dev);
+int sim_dev_setup(sim_dev_t *dev, const struct usbreq *req);
+int sim_dev_ctl_in(sim_dev_t *dev, void *buf, int len);
+int sim_dev_ctl_out(sim_dev_t *dev, const void *buf, int len);
+int sim_hub_attach(sim_dev_t *hub, int port, sim_dev_t *dev);
+sim_dev_t *sim_hub_detach(sim_dev_t *hub, int port);
+
+#endif /* _PLAT_SIM_SIM_H_ */
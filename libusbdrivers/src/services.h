@@ -12,6 +12,7 @@
 #include <platsupport/io.h>
 #include <platsupport/delay.h>
 #include "debug.h"
+#include "log.h"
 #include <assert.h>
 #include <utils/util.h>
 #include <usb/usb_host.h>
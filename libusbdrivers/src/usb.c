@@ -20,28 +20,13 @@
 #include <string.h>
 #include <utils/util.h>
 
-#define USB_DEBUG
+#define USB_DBG(d, fmt, ...)                                            \
+        do {                                                            \
+            usb_dev_t _dev = d;                                         \
+            usb_log(USB_LOG_CORE, USB_LOG_DEBUG, "USB %2d: " fmt,       \
+                    _dev ? _dev->addr : 0, ##__VA_ARGS__);              \
+        } while (0)
 
-#ifdef USB_DEBUG
-#define dprintf(...) printf(__VA_ARGS__)
-#else
-#define dprintf(...) do{}while(0)
-#endif
-
-
-#define USB_DBG(d, ...)                                 \
-        do {                                            \
-            usb_dev_t dev = d;                          \
-            if(dev && dev->addr){                       \
-                dprintf("USB %2d: ", dev->addr);        \
-            }else{                                      \
-                dprintf("USB   : ");                    \
-            }                                           \
-            dprintf(__VA_ARGS__);                       \
-        }while(0)
-
-
-#define NUM_DEVICES 32
 
 #define CLASS_RESERVED_STR "<Reserved>"
 
@@ -122,41 +107,53 @@ __new_address_req(int addr) {
 static void
 devlist_init(usb_t* host)
 {
-    host->devlist = NULL;
-    host->addrbm = 1;
+    memset(host->devices, 0, sizeof(host->devices));
+    memset(host->addrbm, 0, sizeof(host->addrbm));
+    /* Remember address 0 is a special case */
+    host->addrbm[0] = 1;
     host->next_addr = 1;
 }
 
-/* Insert a device into the list, return the index at which it was inserted */
+/* Find the first free address at or above @from, -1 if there is none */
+static int
+devlist_find_free(usb_t* host, int from)
+{
+    uint32_t free;
+    int w;
+
+    for (w = from / 32; w < (int)ARRAY_SIZE(host->addrbm); w++) {
+        free = ~host->addrbm[w];
+        if (w == from / 32) {
+            free &= ~0U << (from % 32);
+        }
+        if (free) {
+            return w * 32 + CTZ(free);
+        }
+    }
+    return -1;
+}
+
+/* Insert a device into the list, return the address at which it was inserted */
 static int
 devlist_insert(usb_dev_t d)
 {
     usb_t* host = d->host;
-    int i = host->next_addr;
-    /* Early exit */
-    if (host->addrbm == (1ULL << NUM_DEVICES) - 1) {
-        return -1;
-    }
-    /* cycle the list searching for a free address */
-    while (host->addrbm & (1 << i)) {
-        if (i == NUM_DEVICES) {
-            /* Remember address 0 is a special case */
-            i = 1;
-        } else {
-            i++;
+    int i;
+
+    /* Search up from the last address first, then wrap around */
+    i = devlist_find_free(host, host->next_addr);
+    if (i < 0) {
+        i = devlist_find_free(host, 1);
+        if (i < 0) {
+            return -1;
         }
     }
     /* Add the device to the list */
-    d->next = host->devlist;
-    host->devlist = d;
-    host->addrbm |= (1 << i);
+    host->devices[i] = d;
+    host->addrbm[i / 32] |= BIT(i % 32);
 
     /* Update the next address for next insertion */
-    if ((i + 1) == NUM_DEVICES) {
-        host->next_addr = 1;
-    } else {
-        host->next_addr = i + 1;
-    }
+    host->next_addr = (i == USB_NDEVICES) ? 1 : i + 1;
 
     /* return address */
     return i;
@@ -167,14 +164,11 @@ static void
 devlist_remove(usb_dev_t d)
 {
     usb_t* host = d->host;
-    usb_dev_t* dptr = &host->devlist;
-    while (*dptr != d) {
-        assert(*dptr != NULL || !"Device not in list");
-        dptr = &(*dptr)->next;
-    }
-    *dptr = d->next;
-    d->next = NULL;
-    host->addrbm &= ~(1 << d->addr);
+    int i = d->addr;
+
+    assert(i > 0 && i <= USB_NDEVICES && host->devices[i] == d);
+    host->devices[i] = NULL;
+    host->addrbm[i / 32] &= ~BIT(i % 32);
     d->addr = -1;
 }
 
@@ -182,14 +176,8 @@ devlist_remove(usb_dev_t d)
 static usb_dev_t
 devlist_at(usb_t* host, int addr)
 {
-    usb_dev_t d;
-    assert(addr >= 0 && addr < NUM_DEVICES);
-    for (d = host->devlist; d != NULL; d = d->next) {
-        if (d->addr == addr) {
-            return d;
-        }
-    }
-    return 0;
+    assert(addr >= 0 && addr <= USB_NDEVICES);
+    return host->devices[addr];
 }
 
 /************************
@@ -372,73 +360,60 @@ usb_print_descriptor(struct anon_desc * desc, int index)
     }
 }
 
-static void
-print_string_desc(struct string_desc *desc)
-{
-	assert(desc);
+/* A cached string, see usbdev_get_string() */
+struct usb_string {
+    struct usb_string* next;
+    uint8_t index;
+    char str[];
+};
 
-	for (int i = 0; i < desc->bLength - 2; i++) {
-		printf("%c", desc->bString[i]);
-	}
-	printf("\n");
-}
-
-static void
-usb_get_string_desc(usb_dev_t udev, int index, struct string_desc *desc)
+/* Read string descriptor @index, returns the number of bytes read */
+static int
+usb_read_string_desc(usb_dev_t udev, int index, int lang,
+                     struct string_desc *desc)
 {
-    int err;
-    int lang;
     struct xact xact[2];
     struct usbreq *req;
     struct string_desc *sdesc;
+    int len;
+    int err;
 
-    if (index == 0) {
-	    return;
-    }
-
-    /* XXX: xact allocation relies on the xact.len */
+    xact[0].type = PID_SETUP;
     xact[0].len = sizeof(struct usbreq);
+    xact[1].type = PID_IN;
     xact[1].len = sizeof(struct string_desc);
-
-    /* Get memory for the request */
-    err = usb_alloc_xact(udev->dman, xact, sizeof(xact) / sizeof(struct xact));
+    err = usb_alloc_xact(udev->dman, xact, 2);
     if (err) {
         USB_DBG(udev, "Not enough DMA memory!\n");
-        return;
+        return -1;
     }
-
-    /* Fill in the SETUP packet */
-    xact[0].type = PID_SETUP;
-    xact[1].type = PID_IN;
     req = xact_get_vaddr(&xact[0]);
-    sdesc = (struct string_desc*)xact[1].vaddr;
+    sdesc = xact_get_vaddr(&xact[1]);
 
-    /* Get language ID */
-    *req = __get_descriptor_req(STRING, 0, 0, sizeof(struct string_desc));
+    *req = __get_descriptor_req(STRING, index, lang, xact[1].len);
     err = usbdev_schedule_xact(udev, udev->ep_ctrl, xact, 2, NULL, NULL);
-
     if (err < 0) {
-       USB_DBG(udev, "USB request failed.\n");
-       usb_destroy_xact(udev->dman, xact, 2);
-       return;
+        USB_DBG(udev, "USB request failed.\n");
+        usb_destroy_xact(udev->dman, xact, 2);
+        return -1;
     }
+    len = MIN(xact[1].len - err, sdesc->bLength);
+    memcpy(desc, sdesc, len);
+    usb_destroy_xact(udev->dman, xact, 2);
 
-    lang = sdesc->bString[1] << 8 | sdesc->bString[0];
-
-    /* Get the string descriptor */
-    *req = __get_descriptor_req(STRING, index, lang, sizeof(struct string_desc));
-    err = usbdev_schedule_xact(udev, udev->ep_ctrl, xact, 2, NULL, NULL);
+    return len;
+}
 
-    if (err < 0) {
-       USB_DBG(udev, "USB request failed.\n");
-       usb_destroy_xact(udev->dman, xact, 2);
-       return;
-    }
+static void
+usbdev_free_strings(usb_dev_t udev)
+{
+    struct usb_string *s;
 
-    if (desc) {
-        memcpy(desc, sdesc, sdesc->bLength);
+    while (udev->strings) {
+        s = udev->strings;
+        udev->strings = s->next;
+        usb_free(s);
     }
-    usb_destroy_xact(udev->dman, xact, 2);
 }
 
 static void
@@ -489,31 +464,10 @@ usb_config_print_cb(void* token, int cfg, int iface,
 static void
 usbdev_config_print(usb_dev_t udev)
 {
-    struct anon_desc* desc;
-    struct usbreq *req;
-    struct xact xact[2];
-    int ret;
     uint32_t cnt[3] = {0, 0, 0};
 
     /* Device descriptor */
-    xact[0].type = PID_SETUP;
-    xact[0].len = sizeof(*req);
-    xact[1].type = PID_IN;
-    xact[1].len = sizeof(struct device_desc);
-    ret = usb_alloc_xact(udev->dman, xact, 2);
-    if (ret) {
-        assert(0);
-    }
-    req = xact_get_vaddr(&xact[0]);
-    *req = __get_descriptor_req(DEVICE, 0, 0, xact[1].len);
-    ret = usbdev_schedule_xact(udev, udev->ep_ctrl, xact, 2, NULL, NULL);
-    if (ret < 0) {
-        assert(ret >= 0);
-        return;
-    }
-    desc = (struct anon_desc*)xact_get_vaddr(&xact[1]);
-    usb_print_descriptor(desc, -1);
-    usb_destroy_xact(udev->dman, xact, sizeof(xact) / sizeof(*xact));
+    usb_print_descriptor((struct anon_desc*)udev->ddesc, -1);
     /* Print config descriptors */
     usbdev_parse_config(udev, usb_config_print_cb, cnt);
 }
@@ -528,29 +482,34 @@ print_dev_graph(usb_t* host, usb_dev_t d, int depth)
         }
         print_dev(d);
     }
-    /* Search for connected devices */
-    for (i = 1; i < NUM_DEVICES; i++) {
-        usb_dev_t d2;
-        d2 = devlist_at(host, i);
-        if (d2 && d2->hub == d) {
-            print_dev_graph(host, d2, depth + 1);
+    if (d == NULL) {
+        /* Root hubs */
+        for (i = 1; i <= USB_NDEVICES; i++) {
+            usb_dev_t d2 = devlist_at(host, i);
+            if (d2 && d2->hub == NULL) {
+                print_dev_graph(host, d2, depth + 1);
+            }
+        }
+    } else if (d->class == USB_CLASS_HUB && d->dev_data) {
+        /* Walk the ports of the hub */
+        usb_hub_t hub = (usb_hub_t)d->dev_data;
+        for (i = 0; i < hub->nports; i++) {
+            if (hub->port[i].udev) {
+                print_dev_graph(host, hub->port[i].udev, depth + 1);
+            }
         }
     }
 }
 
 static int
-parse_config(usb_dev_t udev, struct anon_desc *d, int tot_len,
-             usb_config_cb cb, void* t)
+parse_config(struct anon_desc *d, int tot_len, usb_config_cb cb, void* t)
 {
     int cfg = -1;
     int iface = -1;
     struct anon_desc *usrd = NULL;
-    struct endpoint_desc *edsc;
-    struct endpoint *ep;
     int buf_len = 0;
     int cur_len = 0;
     int err = 0;
-    int cnt = 0;
 
     /*
      * FIXME: Not all devices report the total length of its descriptors
@@ -583,19 +542,6 @@ parse_config(usb_dev_t udev, struct anon_desc *d, int tot_len,
         case INTERFACE:
             iface = ((struct iface_desc*)usrd)->bInterfaceNumber;
             break;
-	case ENDPOINT:
-	    edsc = (struct endpoint_desc*)usrd;
-	    ep = usb_malloc(sizeof(struct endpoint));
-
-	    /* Fill in the endpoint structure, USB standard(9.6.6) */
-	    ep->type = edsc->bmAttributes & 0x3;
-	    ep->dir = edsc->bEndpointAddress >> 0x7;
-	    ep->num = edsc->bEndpointAddress & 0xF;
-	    ep->max_pkt = edsc->wMaxPacketSize;
-	    ep->interval = edsc->bInterval;
-
-	    udev->ep[cnt++] = ep;
-	    break;
         default:
             break;
         }
@@ -613,19 +559,141 @@ parse_config(usb_dev_t udev, struct anon_desc *d, int tot_len,
         cb(t, cfg, iface, NULL);
     }
     /* Clean up */
-    if (usrd == NULL) {
+    if (usrd != NULL) {
         usb_free(usrd);
     }
     return err;
 }
 
+/* Create the endpoints of the cached configuration, USB standard(9.6.6) */
+static int
+init_endpoints(usb_dev_t udev)
+{
+    struct endpoint_desc edsc;
+    struct endpoint *ep;
+    struct anon_desc *d;
+    int cur_len = 0;
+    int cnt = 0;
+
+    d = (struct anon_desc*)udev->cdesc;
+    while (cur_len + (int)sizeof(*d) <= udev->cdesc_len && d->bLength) {
+        if (cur_len + d->bLength > udev->cdesc_len) {
+            break;
+        }
+        if (d->bDescriptorType == ENDPOINT && d->bLength >= sizeof(edsc)) {
+            if (cnt == USB_MAX_EPS) {
+                USB_DBG(udev, "Too many endpoints\n");
+                break;
+            }
+            /* Copy out for the sake of alignment */
+            memcpy(&edsc, d, sizeof(edsc));
+            ep = usb_malloc(sizeof(struct endpoint));
+            if (ep == NULL) {
+                return -1;
+            }
+            ep->type = edsc.bmAttributes & 0x3;
+            ep->dir = edsc.bEndpointAddress >> 0x7;
+            ep->num = edsc.bEndpointAddress & 0xF;
+            ep->max_pkt = edsc.wMaxPacketSize;
+            ep->interval = edsc.bInterval;
+            udev->ep[cnt++] = ep;
+        }
+        cur_len += d->bLength;
+        d = (struct anon_desc*)((uintptr_t)d + d->bLength);
+    }
+
+    return 0;
+}
+
+/*
+ * Read the device descriptor and the first configuration into the device,
+ * drivers parse the cached copies. We don't support multiple configurations.
+ */
+static int
+read_descriptors(usb_dev_t udev, struct device_desc *d_desc)
+{
+    struct usbreq *req;
+    struct config_desc *cd;
+    struct xact xact[2];
+    int tot_len;
+    int err;
+
+    udev->ddesc = usb_malloc(sizeof(*udev->ddesc));
+    if (udev->ddesc == NULL) {
+        return -1;
+    }
+    memcpy(udev->ddesc, d_desc, sizeof(*udev->ddesc));
+
+    /* First read to find the size of the descriptor table */
+    xact[0].len = sizeof(*req);
+    xact[0].type = PID_SETUP;
+    xact[1].len = sizeof(*cd);
+    xact[1].type = PID_IN;
+    err = usb_alloc_xact(udev->dman, xact, 2);
+    if (err) {
+        return -1;
+    }
+    req = xact_get_vaddr(&xact[0]);
+    cd = xact_get_vaddr(&xact[1]);
+    *req = __get_descriptor_req(CONFIGURATION, 0, 0, xact[1].len);
+    err = usbdev_schedule_xact(udev, udev->ep_ctrl, xact, 2, NULL, NULL);
+    tot_len = cd->wTotalLength;
+    usb_destroy_xact(udev->dman, xact, 2);
+    if (err < 0 || tot_len < (int)sizeof(*cd)) {
+        return -1;
+    }
+
+    /* Next read for the entire descriptor table */
+    xact[1].len = tot_len;
+    err = usb_alloc_xact(udev->dman, xact, 2);
+    if (err) {
+        return -1;
+    }
+    req = xact_get_vaddr(&xact[0]);
+    *req = __get_descriptor_req(CONFIGURATION, 0, 0, tot_len);
+    err = usbdev_schedule_xact(udev, udev->ep_ctrl, xact, 2, NULL, NULL);
+    if (err >= 0) {
+        /* Keep what the device actually sent */
+        udev->cdesc_len = tot_len - err;
+        udev->cdesc = usb_malloc(tot_len);
+        if (udev->cdesc != NULL) {
+            memcpy(udev->cdesc, xact_get_vaddr(&xact[1]), udev->cdesc_len);
+        }
+    }
+    usb_destroy_xact(udev->dman, xact, 2);
+    if (udev->cdesc == NULL) {
+        return -1;
+    }
+
+    return init_endpoints(udev);
+}
+
+static void
+usbdev_free(usb_dev_t udev)
+{
+    usb_free(udev->ep_ctrl);
+    for (int i = 0; i < USB_MAX_EPS; i++) {
+        if (udev->ep[i]) {
+            usb_free(udev->ep[i]);
+        }
+    }
+    usb_free(udev->ddesc);
+    usb_free(udev->cdesc);
+    usbdev_free_strings(udev);
+    usb_free(udev);
+}
+
+/*
+ * First half of enumeration: talk to the device on the default address and
+ * move it to its own one. Only one device on the bus may be at address 0, so
+ * the caller must not reset another port until this returns.
+ */
 static int
 usb_new_device_with_host(usb_dev_t hub, usb_t* host, int port, enum usb_speed speed, usb_dev_t* d)
 {
     usb_dev_t udev = NULL;
     struct usbreq *req;
     struct device_desc* d_desc;
-    struct string_desc s_desc;
     struct xact xact[2];
     int addr = 0;
     int err;
@@ -672,19 +740,12 @@ usb_new_device_with_host(usb_dev_t hub, usb_t* host, int port, enum usb_speed sp
     if (err) {
         USB_DBG(udev, "No DMA memory for new USB device\n");
         assert(0);
-        free(udev);
+        usbdev_free(udev);
         return -1;
     }
     req = xact_get_vaddr(&xact[0]);
     d_desc = xact_get_vaddr(&xact[1]);
 
-
-    /* USB transactions are O(n) when trying to bind a driver.
-     * This is a good time to at least cache
-     * a) Max packet size for EP 0
-     * b) product and vendor ID
-     * c) device class
-     */
     USB_DBG(udev, "Determining maximum packet size on the control endpoint\n");
     /*
      * We need the value of bMaxPacketSize in order to request
@@ -701,20 +762,19 @@ usb_new_device_with_host(usb_dev_t hub, usb_t* host, int port, enum usb_speed sp
     err = usbdev_schedule_xact(udev, udev->ep_ctrl, xact, 2, NULL, NULL);
     if (err < 0) {
         usb_destroy_xact(udev->dman, xact, 2);
-        free(udev);
+        usbdev_free(udev);
         return -1;
     }
 
-    assert(err >= 0);
     udev->ep_ctrl->max_pkt = d_desc->bMaxPacketSize0;
-    
+
     /* Find the next available address */
     addr = devlist_insert(udev);
     if (addr < 0) {
-        USB_DBG(dev, "Too many devices\n");
+        USB_DBG(udev, "Too many devices\n");
         assert(0);
         usb_destroy_xact(udev->dman, xact, sizeof(xact) / sizeof(*xact));
-        usb_free(udev);
+        usbdev_free(udev);
         return -1;
     }
 
@@ -722,36 +782,81 @@ usb_new_device_with_host(usb_dev_t hub, usb_t* host, int port, enum usb_speed sp
     *req = __new_address_req(addr);
     USB_DBG(udev, "Setting address to %d\n", addr);
     err = usbdev_schedule_xact(udev, udev->ep_ctrl, xact, 1, NULL, NULL);
-    assert(err >= 0);
-    /* Device has 2ms to start responding to new address */
-    msdelay(2);
+    usb_destroy_xact(udev->dman, xact, sizeof(xact) / sizeof(*xact));
+    if (err < 0) {
+        USB_DBG(udev, "Failed to set address %d\n", addr);
+        udev->addr = addr;
+        devlist_remove(udev);
+        usbdev_free(udev);
+        return -1;
+    }
     udev->addr = addr;
 
-    /* All settled, start processing standard USB descriptors */
-    USB_DBG(udev, "Retrieving device descriptor\n");
+    *d = udev;
+    return 0;
+}
+
+/*
+ * Second half of enumeration, the device must have had its 2ms to settle
+ * on the new address (USB 2.0 9.2.6.3).
+ */
+static int
+usb_setup_device(usb_dev_t udev)
+{
+    struct usbreq *req;
+    struct device_desc* d_desc;
+    struct xact xact[2];
+    UNUSED const char* str;
+    int err;
+
+    xact[0].type = PID_SETUP;
+    xact[0].len = sizeof(*req);
+    xact[1].type = PID_IN;
     xact[1].len = sizeof(*d_desc);
+    err = usb_alloc_xact(udev->dman, xact, 2);
+    if (err) {
+        USB_DBG(udev, "No DMA memory for new USB device\n");
+        assert(0);
+        devlist_remove(udev);
+        usbdev_free(udev);
+        return -1;
+    }
+    req = xact_get_vaddr(&xact[0]);
+    d_desc = xact_get_vaddr(&xact[1]);
+
+    /* USB transactions are O(n) when trying to bind a driver.
+     * This is a good time to at least cache
+     * a) Max packet size for EP 0
+     * b) product and vendor ID
+     * c) device class
+     */
+    USB_DBG(udev, "Retrieving device descriptor\n");
     *req = __new_desc_req(DEVICE, sizeof(*d_desc));
     err = usbdev_schedule_xact(udev, udev->ep_ctrl, xact, 2, NULL, NULL);
-    assert(err >= 0);
-    udev->prod_id = d_desc->idProduct;
-    udev->vend_id = d_desc->idVendor;
-    udev->class   = d_desc->bDeviceClass;
-    USB_DBG(udev, "idVendor  0x%04x | ", udev->vend_id);
-    if (d_desc->iManufacturer) {
-        usb_get_string_desc(udev, d_desc->iManufacturer, &s_desc);
-        print_string_desc(&s_desc);
-    } else {
-        printf("\n");
+    if (err >= 0) {
+        udev->prod_id = d_desc->idProduct;
+        udev->vend_id = d_desc->idVendor;
+        udev->class   = d_desc->bDeviceClass;
+        err = read_descriptors(udev, d_desc);
     }
-    USB_DBG(udev, "idProduct 0x%04x | ", udev->prod_id);
-    if (d_desc->iProduct) {
-        usb_get_string_desc(udev, d_desc->iProduct, &s_desc);
-        print_string_desc(&s_desc);
-    } else {
-        printf("\n");
+    if (err) {
+        USB_DBG(udev, "Failed to read the descriptors\n");
+        usb_destroy_xact(udev->dman, xact, sizeof(xact) / sizeof(*xact));
+        devlist_remove(udev);
+        usbdev_free(udev);
+        return -1;
     }
+#if USB_LOG_ON(USB_LOG_CORE, USB_LOG_DEBUG) && defined(CONFIG_LIB_USB_ENUM_STRINGS)
+    /* Each string costs two transfers, only read them to print them */
+    str = usbdev_get_string(udev, d_desc->iManufacturer);
+    USB_DBG(udev, "idVendor  0x%04x | %s\n", udev->vend_id, str ? str : "");
+    str = usbdev_get_string(udev, d_desc->iProduct);
+    USB_DBG(udev, "idProduct 0x%04x | %s\n", udev->prod_id, str ? str : "");
+#else
+    USB_DBG(udev, "idVendor  0x%04x\n", udev->vend_id);
+    USB_DBG(udev, "idProduct 0x%04x\n", udev->prod_id);
+#endif
 
-    *d = udev;
     usb_destroy_xact(udev->dman, xact, sizeof(xact) / sizeof(*xact));
 
     return 0;
@@ -770,39 +875,127 @@ usb_init(enum usb_host_id id, ps_io_ops_t* ioops, mutex_ops_t *mops, usb_t* host
 
     /* Pre-fill the host structure */
     devlist_init(host);
+    host->enumerating = 0;
+    host->hub_enum = NULL;
+    host->defer_completions = 0;
 
     err = usb_host_init(id, ioops, mops, &host->hdev);
     if (err) {
         assert(!err);
         return -1;
     }
-    err = usb_new_device_with_host(NULL, host, 1, 0, &udev);
 
+    /* Transfer buffers come from the pool from now on */
+    err = usb_dma_pool_init(&host->dma_pool, host->hdev.dman, mops);
+    if (err) {
+        assert(!err);
+        return -1;
+    }
+    host->hdev.dman = &host->dma_pool.dman;
+    err = usb_new_device_with_host(NULL, host, 1, 0, &udev);
+    assert(!err);
+    err = usb_setup_device(udev);
     assert(!err);
 
     err = usb_hub_driver_bind(udev, &hub);
     assert(!err);
+
+    /* Bring up what is plugged in at boot before returning */
+    while (usb_hub_poll(host)) {
+        msdelay(1);
+    }
     return 0;
 }
 
 int
 usb_new_device(usb_dev_t hub, int port, enum usb_speed speed,
                usb_dev_t* d)
+{
+    int err;
+
+    err = usb_new_device_with_host(hub, hub->host, port, speed, d);
+    if (err) {
+        return err;
+    }
+    /* Device has 2ms to start responding to new address */
+    msdelay(2);
+    return usb_setup_device(*d);
+}
+
+int
+usb_new_device_address(usb_dev_t hub, int port, enum usb_speed speed,
+                       usb_dev_t* d)
 {
     return usb_new_device_with_host(hub, hub->host, port, speed, d);
 }
 
+int
+usb_new_device_setup(usb_dev_t udev)
+{
+    assert(udev);
+    return usb_setup_device(udev);
+}
+
 
 usb_dev_t
 usb_get_device(usb_t* host, int addr)
 {
-    if (addr <= 0 || addr >= NUM_DEVICES) {
+    if (addr <= 0 || addr > USB_NDEVICES) {
         return NULL;
     } else {
         return devlist_at(host, addr);
     }
 }
 
+const char*
+usbdev_get_string(usb_dev_t udev, int index)
+{
+    struct string_desc desc;
+    struct usb_string *s;
+    int len;
+    int i;
+
+    assert(udev);
+    if (index == 0) {
+        return NULL;
+    }
+    for (s = udev->strings; s != NULL; s = s->next) {
+        if (s->index == index) {
+            return s->str;
+        }
+    }
+
+    /* String 0 lists the supported languages, USB 2.0 9.6.7 */
+    if (udev->langid == 0) {
+        len = usb_read_string_desc(udev, 0, 0, &desc);
+        if (len < 4) {
+            return NULL;
+        }
+        udev->langid = desc.bString[1] << 8 | desc.bString[0];
+    }
+    len = usb_read_string_desc(udev, index, udev->langid, &desc);
+    if (len < 2) {
+        return NULL;
+    }
+
+    /* UTF-16LE to ASCII */
+    len = (len - 2) / 2;
+    s = usb_malloc(sizeof(*s) + len + 1);
+    if (s == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < len; i++) {
+        uint16_t c = desc.bString[i * 2 + 1] << 8 | desc.bString[i * 2];
+        s->str[i] = (c >= 0x20 && c < 0x7f) ? c : '?';
+    }
+    s->str[len] = '\0';
+    s->index = index;
+    s->next = udev->strings;
+    udev->strings = s;
+
+    return s->str;
+}
+
 /*
  * Parsing standard USB descriptors.
  * We don't support multiple configurations, if the device has more than one
@@ -811,55 +1004,12 @@ usb_get_device(usb_t* host, int addr)
 int
 usbdev_parse_config(usb_dev_t udev, usb_config_cb cb, void* t)
 {
-    struct xact xact[2];
-    struct usbreq* req;
-    struct config_desc *cd;
-    struct anon_desc *d;
-    int tot_len;
-    int err;
-
-    /* First read to find the size of the descriptor table */
-    xact[0].len = sizeof(*req);
-    xact[0].type = PID_SETUP;
-    xact[1].len = sizeof(*cd);
-    xact[1].type = PID_IN;
-    err = usb_alloc_xact(udev->dman, xact, 2);
-    if (err) {
-        assert(0);
-        return -1;
-    }
-    req = xact_get_vaddr(&xact[0]);
-    cd = xact_get_vaddr(&xact[1]);
-    *req = __get_descriptor_req(CONFIGURATION, 0, 0, xact[1].len);
-    err = usbdev_schedule_xact(udev, udev->ep_ctrl, xact, 2, NULL, NULL);
-    if (err < 0) {
-        usb_destroy_xact(udev->dman, xact, 2);
-        assert(0);
-        return -1;
-    }
-    tot_len = cd->wTotalLength;
-    /* Next read for the entire descriptor table */
-    xact[0].len = sizeof(*req);
-    xact[0].type = PID_SETUP;
-    xact[1].len = tot_len;
-    xact[1].type = PID_IN;
-    err = usb_alloc_xact(udev->dman, xact, 2);
-    if (err) {
-        assert(0);
-        return -1;
-    }
-    req = xact_get_vaddr(&xact[0]);
-    d = xact_get_vaddr(&xact[1]);
-    *req = __get_descriptor_req(CONFIGURATION, 0, 0, tot_len);
-    err = usbdev_schedule_xact(udev, udev->ep_ctrl, xact, 2, NULL, NULL);
-    if (err < 0) {
-        usb_destroy_xact(udev->dman, xact, sizeof(xact) / sizeof(*xact));
+    assert(udev);
+    if (udev->cdesc == NULL) {
         return -1;
     }
-    /* Now loop through descriptors */
-    err = parse_config(udev, d, tot_len, cb, t);
-    usb_destroy_xact(udev->dman, xact, sizeof(xact) / sizeof(*xact));
-    return err;
+    return parse_config((struct anon_desc*)udev->cdesc, udev->cdesc_len,
+                        cb, t);
 }
 
 void
@@ -883,11 +1033,12 @@ usbdev_disconnect(usb_dev_t udev)
      * Check if we are disconnecting a Hub, in which case we also need to
      * disconnect all devices that connect to it.
      */
-    if (udev->class == USB_CLASS_HUB) {
+    if (udev->class == USB_CLASS_HUB && udev->dev_data) {
 	    hub = (usb_hub_t)udev->dev_data;
 	    for (int i = 0; i < hub->nports; i++) {
 		    if (hub->port[i].udev) {
 			    usbdev_disconnect(hub->port[i].udev);
+			    hub->port[i].udev = NULL;
 		    }
 	    }
     }
@@ -901,17 +1052,13 @@ usbdev_disconnect(usb_dev_t udev)
 	    cnt++;
     }
 
+    /* Report the cancelled transfers before the endpoints go away */
+    usb_hcd_process_completions(hdev);
+
     assert(!err);
     (void)hdev;
     devlist_remove(udev);
-    /* destroy it */
-    usb_free(udev->ep_ctrl);
-    for (int i = 0; i < USB_MAX_EPS; i++) {
-        if (udev->ep[i]) {
-            usb_free(udev->ep[i]);
-        }
-    }
-    usb_free(udev);
+    usbdev_free(udev);
 }
 
 void
@@ -921,6 +1068,25 @@ usb_handle_irq(usb_t* host)
     assert(host);
     hdev = &host->hdev;
     hdev->handle_irq(hdev);
+    if (!host->defer_completions) {
+        usb_hcd_process_completions(hdev);
+        usb_hub_poll(host);
+    }
+}
+
+void
+usb_process_completions(usb_t* host)
+{
+    assert(host);
+    usb_hcd_process_completions(&host->hdev);
+    usb_hub_poll(host);
+}
+
+void
+usb_defer_completions(usb_t* host, int defer)
+{
+    assert(host);
+    host->defer_completions = defer;
 }
 
 int
@@ -944,6 +1110,51 @@ usbdev_schedule_xact(usb_dev_t udev, struct endpoint *ep, struct xact* xact,
     return err;
 }
 
+int
+usbdev_schedule_batch(usb_dev_t udev, struct usb_hcd_req* reqs, int n)
+{
+    int8_t hub_addr;
+    int i;
+
+    assert(udev);
+    assert(udev->host);
+    hub_addr = udev->hub ? udev->hub->addr : -1;
+    for (i = 0; i < n; i++) {
+        reqs[i].addr = udev->addr;
+        reqs[i].hub_addr = hub_addr;
+        reqs[i].hub_port = udev->port;
+        reqs[i].speed = udev->speed;
+    }
+    return usb_hcd_schedule_batch(&udev->host->hdev, reqs, n);
+}
+
+int
+usbdev_schedule_iso(usb_dev_t udev, struct endpoint *ep, struct iso_pkt* pkt,
+                    int npkt, int start_frame, usb_cb_t cb, void* token)
+{
+    usb_host_t* hdev;
+    uint8_t hub_addr;
+    assert(udev);
+    assert(udev->host);
+    hdev = &udev->host->hdev;
+    if (udev->hub) {
+        hub_addr = udev->hub->addr;
+    } else {
+        hub_addr = -1;
+    }
+    return usb_hcd_schedule_iso(hdev, udev->addr, hub_addr, udev->port,
+                                udev->speed, ep, pkt, npkt, start_frame,
+                                cb, token);
+}
+
+int
+usbdev_get_frame_number(usb_dev_t udev)
+{
+    assert(udev);
+    assert(udev->host);
+    return usb_hcd_get_frame_number(&udev->host->hdev);
+}
+
 void
 usb_lsusb(usb_t* host, int v)
 {
@@ -951,7 +1162,7 @@ usb_lsusb(usb_t* host, int v)
     printf("\n");
     if (v == 0) {
         /* Print a simple list */
-        for (i = 1; i < NUM_DEVICES; i++) {
+        for (i = 1; i <= USB_NDEVICES; i++) {
             usb_dev_t d = devlist_at(host, i);
             print_dev(d);
         }
@@ -962,7 +1173,7 @@ usb_lsusb(usb_t* host, int v)
     /* Print out all the configs */
     if (v > 1) {
         printf("\n");
-        for (i = 1; i < NUM_DEVICES; i++) {
+        for (i = 1; i <= USB_NDEVICES; i++) {
             usb_dev_t d = devlist_at(host, i);
             if (d) {
                 print_dev(d);
@@ -979,13 +1190,184 @@ usb_probe_device(usb_dev_t dev)
     usbdev_config_print(dev);
 }
 
+void
+usb_get_ep_stats(struct endpoint* ep, struct usb_ep_stats* stats, int reset)
+{
+    assert(ep);
+    assert(stats);
+    *stats = ep->stats;
+    if (reset) {
+        memset(&ep->stats, 0, sizeof(ep->stats));
+    }
+}
+
+static const char*
+ep_type_str(struct endpoint* ep)
+{
+    switch (ep->type) {
+    case EP_CONTROL:
+        return "ctrl";
+    case EP_ISOCHRONOUS:
+        return "isoc";
+    case EP_BULK:
+        return "bulk";
+    case EP_INTERRUPT:
+    default:
+        return "intr";
+    }
+}
+
+static void
+print_ep_stats(usb_dev_t d, struct endpoint* ep)
+{
+    struct usb_ep_stats s;
+    int i, last;
+
+    usb_get_ep_stats(ep, &s, 0);
+    printf("USB@%02d EP%-2d %-3s %s: %u xfers %llu bytes, %u short, "
+           "%u halts, %u cancels, %u timeouts, %u retries, %u naks\n",
+           d->addr, ep->num, ep->dir == EP_DIR_IN ? "in" : "out",
+           ep_type_str(ep), s.xfers, (unsigned long long)s.bytes,
+           s.short_xfers, s.halts, s.cancels, s.timeouts, s.retries,
+           s.naks);
+    /* Latency histogram in micro frames, up to the last used bucket */
+    for (last = USB_EP_LAT_BUCKETS - 1; last > 0 && !s.lat[last]; last--);
+    if (s.xfers) {
+        printf("              latency(uframes):");
+        for (i = 0; i <= last; i++) {
+            printf(" <%d:%u", 1 << i, s.lat[i]);
+        }
+        printf("\n");
+    }
+}
+
+void
+usb_dump_ep_stats(usb_t* host)
+{
+    int i, j;
+
+    assert(host);
+    for (i = 1; i <= USB_NDEVICES; i++) {
+        usb_dev_t d = devlist_at(host, i);
+        if (d == NULL) {
+            continue;
+        }
+        print_ep_stats(d, d->ep_ctrl);
+        for (j = 0; j < USB_MAX_EPS && d->ep[j]; j++) {
+            print_ep_stats(d, d->ep[j]);
+        }
+    }
+}
+
 int
-usb_alloc_xact(ps_dma_man_t* dman, struct xact* xact, int nxact)
+usb_trace_enable(usb_t* host, int nevents)
+{
+    struct usb_trace* trace;
+    uint32_t size = 1;
+
+    assert(host);
+    if (host->hdev.trace || nevents <= 0) {
+        return -1;
+    }
+    while (size < (uint32_t)nevents) {
+        size <<= 1;
+    }
+
+    trace = usb_malloc(sizeof(*trace));
+    if (trace == NULL) {
+        return -1;
+    }
+    trace->ev = usb_malloc(sizeof(*trace->ev) * size);
+    if (trace->ev == NULL) {
+        usb_free(trace);
+        return -1;
+    }
+    trace->size = size;
+    trace->head = 0;
+
+    __atomic_store_n(&host->hdev.trace, trace, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void
+usb_trace_disable(usb_t* host)
+{
+    struct usb_trace* trace;
+
+    assert(host);
+    trace = __atomic_exchange_n(&host->hdev.trace, NULL, __ATOMIC_ACQ_REL);
+    if (trace) {
+        usb_free(trace->ev);
+        usb_free(trace);
+    }
+}
+
+int
+usb_trace_read(usb_t* host, struct usb_trace_ev* ev, int n)
+{
+    struct usb_trace* trace;
+    uint32_t head, first, cnt;
+
+    assert(host);
+    trace = __atomic_load_n(&host->hdev.trace, __ATOMIC_ACQUIRE);
+    if (trace == NULL || n <= 0) {
+        return 0;
+    }
+
+    /* Events still being written may be copied torn */
+    head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+    cnt = MIN(head, trace->size);
+    cnt = MIN(cnt, (uint32_t)n);
+    first = head - cnt;
+    for (uint32_t i = 0; i < cnt; i++) {
+        ev[i] = trace->ev[(first + i) & (trace->size - 1)];
+    }
+
+    return cnt;
+}
+
+void
+usb_trace_dump(usb_t* host)
+{
+    static const char* type_str[] = {"submit", "complete", "cancel"};
+    struct usb_trace_ev ev[64];
+    struct usb_trace* trace;
+    uint32_t head, seq;
+    int i, n;
+
+    assert(host);
+    trace = host->hdev.trace;
+    if (trace == NULL) {
+        printf("USB trace disabled\n");
+        return;
+    }
+
+    /* Print the ring a chunk at a time, oldest first */
+    head = trace->head;
+    seq = head - MIN(head, trace->size);
+    while (seq != head) {
+        n = MIN(head - seq, sizeof(ev) / sizeof(*ev));
+        for (i = 0; i < n; i++) {
+            ev[i] = trace->ev[(seq + i) & (trace->size - 1)];
+        }
+        for (i = 0; i < n; i++) {
+            printf("%8u @%05u %-8s USB@%02d EP%-2d %-3s stat %d len %d\n",
+                   seq + i, ev[i].time,
+                   ev[i].type <= USB_TRACE_CANCEL ? type_str[ev[i].type] : "?",
+                   ev[i].addr, ev[i].ep & 0xf,
+                   ev[i].ep & USB_DIR_IN ? "in" : "out", ev[i].stat, ev[i].len);
+        }
+        seq += n;
+    }
+}
+
+static int
+_alloc_xact(ps_dma_man_t* dman, struct xact* xact, int nxact, int cache)
 {
     int i;
     for (i = 0; i < nxact; i++) {
         if (xact[i].len) {
-            xact[i].vaddr = ps_dma_alloc_pinned(dman, xact[i].len, 32, 0, PS_MEM_NORMAL, &xact[i].paddr);
+            xact[i].vaddr = ps_dma_alloc_pinned(dman, xact[i].len, 32, cache, PS_MEM_NORMAL, &xact[i].paddr);
             if (xact[i].vaddr == NULL) {
                 usb_destroy_xact(dman, xact, i);
                 return -1;
@@ -997,6 +1379,18 @@ usb_alloc_xact(ps_dma_man_t* dman, struct xact* xact, int nxact)
     return 0;
 }
 
+int
+usb_alloc_xact(ps_dma_man_t* dman, struct xact* xact, int nxact)
+{
+    return _alloc_xact(dman, xact, nxact, 0);
+}
+
+int
+usb_alloc_xact_cached(ps_dma_man_t* dman, struct xact* xact, int nxact)
+{
+    return _alloc_xact(dman, xact, nxact, 1);
+}
+
 void
 usb_destroy_xact(ps_dma_man_t* dman, struct xact* xact, int nxact)
 {
@@ -0,0 +1,382 @@
+/*
+ * Copyright 2016, NICTA
+ *
+ * This software may be distributed and modified according to the terms of
+ * the BSD 2-Clause license. Note that NO WARRANTY is provided.
+ * See "LICENSE_BSD2.txt" for details.
+ *
+ * @TAG(NICTA_BSD)
+ */
+
+#include <string.h>
+
+#include <usb/usb.h>
+#include <usb/usb_dma.h>
+#include "services.h"
+#include "log.h"
+
+#define USB_DMA_PAGE      0x1000
+#define _DMA_PAGE_EMPTY   0
+#define _DMA_PAGE_REMOVED 1
+
+/* Buffer size and slab size of each class, at most 64 buffers per slab */
+static const struct {
+    size_t size;
+    size_t slab;
+} _dma_class[USB_DMA_NCLASSES] = {
+    {   64,  0x1000 },
+    {  512,  0x1000 },
+    { 4096,  0x4000 },
+    {16384,  0x4000 },
+};
+
+static int
+_dma_class_of(size_t size, size_t align)
+{
+    int i;
+    for (i = 0; i < USB_DMA_NCLASSES; i++) {
+        if (size <= _dma_class[i].size && align <= _dma_class[i].size) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static inline uint64_t
+_dma_slab_full(int c)
+{
+    int n = _dma_class[c].slab / _dma_class[c].size;
+    return (n == 64) ? ~0ULL : (1ULL << n) - 1;
+}
+
+/* Account for memory pinned from the platform, honouring the cap */
+static int
+_dma_reserve(struct usb_dma_pool* pool, size_t size)
+{
+    struct usb_dma_stats* s = &pool->stats;
+
+    if (s->cap && s->reserved + size > s->cap) {
+        s->nfail++;
+        return -1;
+    }
+    s->reserved += size;
+    s->peak = MAX(s->peak, s->reserved);
+    return 0;
+}
+
+static inline int
+_dma_hash(uintptr_t page)
+{
+    return (page / USB_DMA_PAGE) % USB_DMA_NPAGES;
+}
+
+/*
+ * Find the page table entry of @addr. Safe without the lock, as an entry only
+ * changes while none of the page's buffers is handed out.
+ */
+static struct usb_dma_page*
+_dma_lookup(struct usb_dma_pool* pool, void* addr)
+{
+    uintptr_t page = (uintptr_t)addr & ~(uintptr_t)(USB_DMA_PAGE - 1);
+    struct usb_dma_page* p;
+    uintptr_t v;
+    int i, h;
+
+    h = _dma_hash(page);
+    for (i = 0; i < USB_DMA_NPAGES; i++) {
+        p = &pool->pages[(h + i) % USB_DMA_NPAGES];
+        v = __atomic_load_n(&p->vaddr, __ATOMIC_ACQUIRE);
+        if (v == page) {
+            return p;
+        }
+        if (v == _DMA_PAGE_EMPTY) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Remove the pages of [@vaddr, @vaddr + @size) from the table, lock held */
+static void
+_dma_unmap(struct usb_dma_pool* pool, void* vaddr, size_t size)
+{
+    struct usb_dma_page* p;
+    size_t off;
+
+    for (off = 0; off < size; off += USB_DMA_PAGE) {
+        p = _dma_lookup(pool, (char*)vaddr + off);
+        usb_assert(p);
+        __atomic_store_n(&p->vaddr, _DMA_PAGE_REMOVED, __ATOMIC_RELEASE);
+        pool->npages--;
+    }
+}
+
+/* Enter the pages of [@vaddr, @vaddr + @size) in the table, lock held */
+static int
+_dma_map(struct usb_dma_pool* pool, void* vaddr, size_t size,
+         struct usb_dma_slab* slab)
+{
+    struct usb_dma_page* p;
+    uintptr_t page;
+    size_t off;
+    int h;
+
+    for (off = 0; off < size; off += USB_DMA_PAGE) {
+        if (pool->npages >= USB_DMA_NPAGES / 4 * 3) {
+            _dma_unmap(pool, vaddr, off);
+            return -1;
+        }
+        page = ((uintptr_t)vaddr + off) & ~(uintptr_t)(USB_DMA_PAGE - 1);
+        h = _dma_hash(page);
+        while (pool->pages[h].vaddr > _DMA_PAGE_REMOVED) {
+            h = (h + 1) % USB_DMA_NPAGES;
+        }
+        p = &pool->pages[h];
+        p->slab = slab;
+        __atomic_store_n(&p->vaddr, page, __ATOMIC_RELEASE);
+        pool->npages++;
+    }
+    return 0;
+}
+
+/* Foreign buffers are legal for pinning, storage pins the caller's buffer */
+static void
+_dma_unknown(void* addr)
+{
+    usb_log(USB_LOG_CORE, USB_LOG_DEBUG,
+            "DMA pool: %p is not ours, passed on\n", addr);
+}
+
+static void*
+_dma_alloc(void* cookie, size_t size, int align, int cache, ps_mem_flags_t flags)
+{
+    struct usb_dma_pool* pool = cookie;
+    struct usb_dma_slab* slab;
+    void* vaddr = NULL;
+    int c, i, k;
+
+    usb_mutex_lock(pool->mops, pool->lock);
+
+    k = !!cache;
+    c = _dma_class_of(size, align);
+    if (c < 0) {
+        if (_dma_reserve(pool, size) == 0) {
+            vaddr = ps_dma_alloc(pool->parent, size, align, cache, flags);
+            if (vaddr && _dma_map(pool, vaddr, size, NULL)) {
+                ps_dma_free(pool->parent, vaddr, size);
+                vaddr = NULL;
+            }
+            if (vaddr) {
+                pool->stats.nfallback++;
+                pool->stats.in_use += size;
+            } else {
+                pool->stats.reserved -= size;
+                pool->stats.nfail++;
+            }
+        }
+        goto out;
+    }
+
+    for (slab = pool->slabs[k][c]; slab; slab = slab->next) {
+        if (slab->used != _dma_slab_full(c)) {
+            break;
+        }
+    }
+
+    if (!slab) {
+        if (_dma_reserve(pool, _dma_class[c].slab)) {
+            goto out;
+        }
+        slab = usb_malloc(sizeof(*slab));
+        if (slab) {
+            slab->vaddr = ps_dma_alloc_pinned(pool->parent, _dma_class[c].slab,
+                                              0x1000, k, PS_MEM_NORMAL,
+                                              &slab->paddr);
+        }
+        if (slab && slab->vaddr &&
+                _dma_map(pool, slab->vaddr, _dma_class[c].slab, slab)) {
+            ps_dma_free_pinned(pool->parent, slab->vaddr, _dma_class[c].slab);
+            slab->vaddr = NULL;
+        }
+        if (!slab || !slab->vaddr) {
+            usb_free(slab);
+            pool->stats.reserved -= _dma_class[c].slab;
+            pool->stats.nfail++;
+            goto out;
+        }
+        slab->used = 0;
+        slab->class = c;
+        slab->cached = k;
+        slab->next = pool->slabs[k][c];
+        pool->slabs[k][c] = slab;
+        pool->stats.nslabs++;
+    }
+
+    i = __builtin_ctzll(~slab->used);
+    slab->used |= 1ULL << i;
+    vaddr = (char*)slab->vaddr + i * _dma_class[c].size;
+    pool->stats.nalloc++;
+    pool->stats.in_use += _dma_class[c].size;
+
+out:
+    usb_mutex_unlock(pool->mops, pool->lock);
+    return vaddr;
+}
+
+static void
+_dma_free(void* cookie, void* addr, size_t size)
+{
+    struct usb_dma_pool* pool = cookie;
+    struct usb_dma_slab* slab;
+    struct usb_dma_page* p;
+    int c, i;
+
+    usb_mutex_lock(pool->mops, pool->lock);
+
+    p = _dma_lookup(pool, addr);
+    if (p && p->slab) {
+        slab = p->slab;
+        c = slab->class;
+        i = ((char*)addr - (char*)slab->vaddr) / _dma_class[c].size;
+        assert(slab->used & (1ULL << i));
+        slab->used &= ~(1ULL << i);
+        pool->stats.nfree++;
+        pool->stats.in_use -= _dma_class[c].size;
+    } else if (p) {
+        _dma_unmap(pool, addr, size);
+        ps_dma_free(pool->parent, addr, size);
+        pool->stats.reserved -= size;
+        pool->stats.in_use -= size;
+    } else {
+        usb_log(USB_LOG_CORE, USB_LOG_WARN,
+                "DMA pool: freeing %p, which was not allocated here\n", addr);
+        ps_dma_free(pool->parent, addr, size);
+    }
+
+    usb_mutex_unlock(pool->mops, pool->lock);
+}
+
+/* Slabs are pinned for their lifetime, so only fallbacks need the platform */
+static uintptr_t
+_dma_pin(void* cookie, void* addr, size_t size)
+{
+    struct usb_dma_pool* pool = cookie;
+    struct usb_dma_page* p;
+
+    p = _dma_lookup(pool, addr);
+    if (p && p->slab) {
+        return p->slab->paddr + ((char*)addr - (char*)p->slab->vaddr);
+    }
+    if (!p) {
+        _dma_unknown(addr);
+    }
+    return ps_dma_pin(pool->parent, addr, size);
+}
+
+static void
+_dma_unpin(void* cookie, void* addr, size_t size)
+{
+    struct usb_dma_pool* pool = cookie;
+    struct usb_dma_page* p;
+
+    p = _dma_lookup(pool, addr);
+    if (p && p->slab) {
+        return;
+    }
+    if (!p) {
+        _dma_unknown(addr);
+    }
+    ps_dma_unpin(pool->parent, addr, size);
+}
+
+/* Uncached slabs need no maintenance, anything else is passed on */
+static void
+_dma_cache_op(void* cookie, void* addr, size_t size, dma_cache_op_t op)
+{
+    struct usb_dma_pool* pool = cookie;
+    struct usb_dma_page* p;
+
+    p = _dma_lookup(pool, addr);
+    if ((p && p->slab && !p->slab->cached) || !pool->parent->dma_cache_op_fn) {
+        return;
+    }
+    if (!p) {
+        _dma_unknown(addr);
+    }
+    pool->parent->dma_cache_op_fn(pool->parent->cookie, addr, size, op);
+}
+
+int
+usb_dma_pool_init(struct usb_dma_pool* pool, ps_dma_man_t* parent,
+                  mutex_ops_t* mops)
+{
+    assert(pool);
+    assert(parent);
+
+    memset(pool, 0, sizeof(*pool));
+    pool->parent = parent;
+    pool->mops = mops;
+    pool->lock = usb_mutex_init(mops);
+    if (!pool->lock) {
+        return -1;
+    }
+
+    pool->dman.cookie = pool;
+    pool->dman.dma_alloc_fn = _dma_alloc;
+    pool->dman.dma_free_fn = _dma_free;
+    pool->dman.dma_pin_fn = _dma_pin;
+    pool->dman.dma_unpin_fn = _dma_unpin;
+    pool->dman.dma_cache_op_fn = _dma_cache_op;
+
+    return 0;
+}
+
+void
+usb_dma_get_stats(usb_t* host, struct usb_dma_stats* stats)
+{
+    struct usb_dma_pool* pool = &host->dma_pool;
+
+    usb_mutex_lock(pool->mops, pool->lock);
+    *stats = pool->stats;
+    usb_mutex_unlock(pool->mops, pool->lock);
+}
+
+void
+usb_dma_set_cap(usb_t* host, size_t cap)
+{
+    struct usb_dma_pool* pool = &host->dma_pool;
+
+    usb_mutex_lock(pool->mops, pool->lock);
+    pool->stats.cap = cap;
+    usb_mutex_unlock(pool->mops, pool->lock);
+}
+
+void
+usb_dma_trim(usb_t* host)
+{
+    struct usb_dma_pool* pool = &host->dma_pool;
+    struct usb_dma_slab** prev;
+    struct usb_dma_slab* slab;
+    int c, k;
+
+    usb_mutex_lock(pool->mops, pool->lock);
+    for (k = 0; k < 2; k++) {
+        for (c = 0; c < USB_DMA_NCLASSES; c++) {
+            prev = &pool->slabs[k][c];
+            while ((slab = *prev)) {
+                if (slab->used) {
+                    prev = &slab->next;
+                    continue;
+                }
+                *prev = slab->next;
+                _dma_unmap(pool, slab->vaddr, _dma_class[c].slab);
+                ps_dma_free_pinned(pool->parent, slab->vaddr,
+                                   _dma_class[c].slab);
+                usb_free(slab);
+                pool->stats.reserved -= _dma_class[c].slab;
+                pool->stats.nslabs--;
+            }
+        }
+    }
+    usb_mutex_unlock(pool->mops, pool->lock);
+}